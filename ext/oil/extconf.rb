@@ -18,4 +18,30 @@ unless have_library('png')
   abort "libpng was not found."
 end
 
+# Optional: mozjpeg's extended parameters, for trellis quantization.
+have_func('jpeg_c_set_bool_param', ['stdio.h', 'jpeglib.h'])
+
+# Optional: libdeflate, for the deflate: :libdeflate PNG encoder.
+if have_header('libdeflate.h')
+  if have_library('deflate', 'libdeflate_alloc_compressor', 'libdeflate.h')
+    $defs << '-DHAVE_LIBDEFLATE'
+  end
+end
+
+# Optional: libwebp, for format: :webp output.
+if have_header('webp/encode.h')
+  if have_library('webp', 'WebPEncode', 'webp/encode.h')
+    $defs << '-DHAVE_LIBWEBP'
+  end
+end
+
+# Optional: reads from IO::Buffer and memory-mapped files.
+have_header('ruby/io/buffer.h')
+have_func('mmap', 'sys/mman.h')
+have_func('madvise', 'sys/mman.h')
+
+# Native worker pool.
+have_library('pthread')
+have_func('pthread_setaffinity_np', 'pthread.h')
+
 create_makefile('oil/oil')
@@ -1,7 +1,11 @@
 #include <ruby.h>
 #include <ruby/st.h>
 #include <jpeglib.h>
+#include <jerror.h>
 #include "oil_libjpeg.h"
+#include "oil_libwebp.h"
+#include "oil_mem.h"
+#include "oil_resize.h"
 
 #define READ_SIZE 1024
 #define WRITE_SIZE 1024
@@ -12,7 +16,21 @@ static ID id_APP0, id_APP1, id_APP2, id_APP3, id_APP4, id_APP5, id_APP6,
 	id_APP14, id_APP15, id_COM;
 static ID id_read;
 
-static VALUE sym_quality, sym_markers;
+static VALUE cJob;
+static VALUE sym_quality, sym_markers, sym_ycbcr, sym_planar, sym_linear;
+static VALUE sym_max_bytes;
+
+VALUE oil_mem_from_value(VALUE src, struct oil_mem *mem);
+void oil_mem_map_value(VALUE file, struct oil_mem *mem);
+void oil_step_limit(VALUE limit, long *max_rows, double *deadline);
+int oil_step_expired(double deadline);
+int oil_speed_opt(VALUE opts);
+int oil_threads_opt(VALUE opts);
+void oil_encode_opts(VALUE opts, struct oil_libjpeg_encode *enc);
+enum oil_format oil_format_opt(VALUE opts, enum oil_format own);
+#ifdef HAVE_LIBWEBP
+void oil_webp_encode_opts(VALUE opts, struct oil_libwebp_encode *enc);
+#endif
 
 /* Color Space Conversion Helpers. */
 
@@ -154,6 +172,14 @@ void output_message(j_common_ptr cinfo)
 	rb_warning("jpeglib: %s", buffer);
 }
 
+/* Warn with the last message of the worker threads, once they are joined. */
+static void workers_output_message(const char *warning)
+{
+	if (warning[0]) {
+		rb_warning("jpeglib: %s", warning);
+	}
+}
+
 static void error_exit(j_common_ptr dinfo)
 {
 	char buffer[JMSG_LENGTH_MAX];
@@ -170,6 +196,11 @@ struct readerdata {
 	int locked;
 	VALUE source_io;
 	VALUE buffer;
+	struct oil_mem mem;
+	struct oil_push push; // data given with <<, by readers made with push.
+	int pushed; // 1 if the reader was made with push.
+	int header_read; // 1 once the header has been read.
+	size_t mem_size;
 	int scale_width;
 	int scale_height;
 };
@@ -218,16 +249,115 @@ static void skip_input_data(j_decompress_ptr dinfo, long num_bytes)
 	}
 }
 
+/* Source for Strings, IO::Buffers and mapped files, which are read in one go.
+ * Running past the end warns and inserts an EOI marker, as jpeg_mem_src() does.
+ */
+static boolean mem_fill_input_buffer(j_decompress_ptr dinfo)
+{
+	static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+	struct readerdata *reader;
+
+	reader = (struct readerdata *)dinfo;
+	WARNMS(dinfo, JWRN_JPEG_EOF);
+	reader->mgr.next_input_byte = eoi;
+	reader->mgr.bytes_in_buffer = 2;
+	return TRUE;
+}
+
+static void mem_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+	struct readerdata *reader;
+
+	reader = (struct readerdata *)dinfo;
+	if (num_bytes <= 0) {
+		return;
+	}
+	if ((size_t)num_bytes > reader->mgr.bytes_in_buffer) {
+		mem_fill_input_buffer(dinfo);
+		return;
+	}
+	reader->mgr.next_input_byte += num_bytes;
+	reader->mgr.bytes_in_buffer -= num_bytes;
+}
+
+/* Suspending source for data given with <<. Running out of input suspends the
+ * decompressor until more is pushed, and once the reader is closed we insert
+ * an EOI marker the way the IO source does.
+ */
+static boolean push_fill_input_buffer(j_decompress_ptr dinfo)
+{
+	static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+	struct readerdata *reader;
+
+	reader = (struct readerdata *)dinfo;
+	if (!reader->push.closed) {
+		return FALSE;
+	}
+	reader->mgr.next_input_byte = eoi;
+	reader->mgr.bytes_in_buffer = 2;
+	return TRUE;
+}
+
+/* Skips past the end of the pushed data are taken from the chunks to come. */
+static void push_skip_input_data(j_decompress_ptr dinfo, long num_bytes)
+{
+	struct readerdata *reader;
+	size_t left;
+
+	reader = (struct readerdata *)dinfo;
+	if (num_bytes <= 0) {
+		return;
+	}
+	left = reader->mgr.bytes_in_buffer;
+	if ((size_t)num_bytes > left) {
+		reader->push.skip += num_bytes - left;
+		num_bytes = left;
+	}
+	reader->mgr.next_input_byte += num_bytes;
+	reader->mgr.bytes_in_buffer -= num_bytes;
+}
+
 /* Ruby GC */
 
-static void deallocate(struct readerdata *reader)
+/* Tell the GC about native memory held by the reader, so that readers holding
+ * large buffers are collected as promptly as equally large strings would be.
+ */
+static void set_mem_size(struct readerdata *reader, size_t mem_size)
+{
+	rb_gc_adjust_memory_usage((ssize_t)mem_size - (ssize_t)reader->mem_size);
+	reader->mem_size = mem_size;
+}
+
+static size_t saved_markers_size(struct jpeg_decompress_struct *dinfo)
+{
+	jpeg_saved_marker_ptr marker;
+	size_t size;
+
+	size = 0;
+	for (marker=dinfo->marker_list; marker; marker=marker->next) {
+		size += sizeof(*marker) + marker->data_length;
+	}
+	return size;
+}
+
+static void deallocate(void *ptr)
 {
+	struct readerdata *reader = ptr;
+
 	jpeg_destroy_decompress(&reader->dinfo);
-	free(reader);
+	oil_mem_free(&reader->mem);
+	set_mem_size(reader, 0);
+	rb_gc_adjust_memory_usage(-(ssize_t)reader->push.cap);
+	oil_push_free(&reader->push);
+	xfree(reader);
 }
 
-static void mark(struct readerdata *reader)
+/* Marked objects must not move: the decompressor may point into their memory.
+ */
+static void mark(void *ptr)
 {
+	struct readerdata *reader = ptr;
+
 	if (!NIL_P(reader->source_io)) {
 		rb_gc_mark(reader->source_io);
 	}
@@ -237,11 +367,24 @@ static void mark(struct readerdata *reader)
 	}
 }
 
+static size_t memsize(const void *ptr)
+{
+	const struct readerdata *reader = ptr;
+	return sizeof(struct readerdata) + reader->mem_size + reader->push.cap;
+}
+
+static const rb_data_type_t jpeg_reader_type = {
+	"Oil::JPEGReader",
+	{ mark, deallocate, memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
 static VALUE allocate(VALUE klass)
 {
 	struct readerdata *reader;
 	VALUE self;
-	self = Data_Make_Struct(klass, struct readerdata, mark, deallocate, reader);
+	self = TypedData_Make_Struct(klass, struct readerdata, &jpeg_reader_type,
+		reader);
 
 	jpeg_std_error(&reader->jerr);
 	reader->jerr.error_exit = error_exit;
@@ -264,12 +407,98 @@ static void raise_if_locked(struct readerdata *reader)
 	}
 }
 
+/* Helpers shared by Reader.new and Reader.open. */
+
+static void reset_decompress(struct readerdata *reader)
+{
+	/* If source_io has already been set, then this is a re-used jpeg reader
+	 * object. This means we need to abort the previous decompress to
+	 * prevent memory leaks.
+	 */
+	if (reader->source_io) {
+		jpeg_abort_decompress(&reader->dinfo);
+	} else {
+		jpeg_create_decompress(&reader->dinfo);
+	}
+	oil_mem_free(&reader->mem);
+	set_mem_size(reader, 0);
+	rb_gc_adjust_memory_usage(-(ssize_t)reader->push.cap);
+	oil_push_free(&reader->push);
+	reader->pushed = 0;
+	reader->header_read = 0;
+}
+
+static void set_mem_src(struct readerdata *reader)
+{
+	reader->mgr.fill_input_buffer = mem_fill_input_buffer;
+	reader->mgr.skip_input_data = mem_skip_input_data;
+	reader->mgr.next_input_byte = reader->mem.data;
+	reader->mgr.bytes_in_buffer = reader->mem.len;
+	reader->dinfo.src = &reader->mgr;
+}
+
+static void save_markers(struct readerdata *reader, VALUE markers)
+{
+	struct jpeg_decompress_struct *dinfo;
+	int i, marker_code;
+
+	dinfo = &reader->dinfo;
+
+	if(!NIL_P(markers)) {
+		Check_Type(markers, T_ARRAY);
+		for (i=0; i<RARRAY_LEN(markers); i++) {
+			if (!SYMBOL_P(RARRAY_PTR(markers)[i])) {
+				rb_raise(rb_eTypeError, "Marker code is not a symbol.");
+			}
+			marker_code = sym_to_marker_code(RARRAY_PTR(markers)[i]);
+			jpeg_save_markers(dinfo, marker_code, 0xFFFF);
+		}
+	}
+}
+
+/* Returns 0 if the reader was made with push and the header isn't all there
+ * yet.
+ */
+static int read_header(struct readerdata *reader)
+{
+	struct jpeg_decompress_struct *dinfo;
+
+	dinfo = &reader->dinfo;
+
+	/* Be warned that this can raise a ruby exception and longjmp away. */
+	if (jpeg_read_header(dinfo, TRUE) == JPEG_SUSPENDED) {
+		return 0;
+	}
+
+	jpeg_calc_output_dimensions(dinfo);
+	set_mem_size(reader, saved_markers_size(dinfo));
+	reader->header_read = 1;
+	return 1;
+}
+
+/* Helper that raises an exception if the header hasn't been read yet, or if
+ * the reader was made with push and the caller can't wait for data.
+ */
+static void raise_if_not_ready(struct readerdata *reader, int wait)
+{
+	if (!reader->header_read) {
+		rb_raise(rb_eRuntimeError, "Header not read yet.");
+	}
+	if (reader->pushed && !wait) {
+		rb_raise(rb_eRuntimeError, "Pushed data can only be decoded with start.");
+	}
+}
+
 /*
  *  call-seq:
  *     Reader.new(io_in [, markers]) -> reader
  *
  *  Creates a new JPEG Reader. +io_in+ must be an IO-like object that responds
- *  to read(size).
+ *  to read(size), a String or an IO::Buffer.
+ *
+ *  Strings are decoded in place, without copying them or calling back into
+ *  Ruby. IO::Buffers are copied once, so they may be freed or resized while
+ *  the reader is in use.
  *
  *  +markers+ should be an array of valid JPEG header marker symbols. Valid
  *  symbols are :APP0 through :APP15 and :COM.
@@ -284,53 +513,206 @@ static void raise_if_locked(struct readerdata *reader)
  *
  *     io = File.open("image.jpg", "r")
  *     reader = Oil::JPEGReader.new(io, [:APP1, :APP2])
+ *
+ *     reader = Oil::JPEGReader.new(upload_string)
  */
 
 static VALUE initialize(int argc, VALUE *argv, VALUE self)
 {
 	struct readerdata *reader;
-	VALUE io, markers;
-	struct jpeg_decompress_struct *dinfo;
-	int i, marker_code;
+	VALUE io, markers, mem_src;
 
-	Data_Get_Struct(self, struct readerdata, reader);
-	dinfo = &reader->dinfo;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 
-	/* If source_io has already been set, then this is a re-used jpeg reader
-	 * object. This means we need to abort the previous decompress to
-	 * prevent memory leaks.
-	 */
-	if (reader->source_io) {
-		jpeg_abort_decompress(dinfo);
+	rb_scan_args(argc, argv, "11", &io, &markers);
+	reset_decompress(reader);
+
+	mem_src = oil_mem_from_value(io, &reader->mem);
+	if (NIL_P(mem_src)) {
+		reader->dinfo.src = &reader->mgr;
+		reader->source_io = io;
+		reader->mgr.fill_input_buffer = fill_input_buffer;
+		reader->mgr.skip_input_data = skip_input_data;
+		reader->mgr.bytes_in_buffer = 0;
 	} else {
-		jpeg_create_decompress(dinfo);
+		reader->source_io = mem_src;
+		set_mem_src(reader);
 	}
 
-	dinfo->src = &reader->mgr;
+	save_markers(reader, markers);
+	read_header(reader);
+	return self;
+}
 
-	rb_scan_args(argc, argv, "11", &io, &markers);
-	reader->source_io = io;
+/*
+ *  call-seq:
+ *     Reader.open(path [, markers]) -> reader
+ *     Reader.open(file [, markers]) -> reader
+ *
+ *  Creates a new JPEG Reader that decodes a memory-mapped file. When given an
+ *  open File, the image is read from the file's current position.
+ *
+ *  The mapping is read sequentially without calling back into Ruby, which
+ *  avoids the copies made when reading through an IO object.
+ *
+ *  +markers+ has the same meaning as in Reader.new.
+ *
+ *     reader = Oil::JPEGReader.open("image.jpg")
+ */
+
+static VALUE open_file(int argc, VALUE *argv, VALUE klass)
+{
+	struct readerdata *reader;
+	VALUE self, file, markers;
+
+	rb_scan_args(argc, argv, "11", &file, &markers);
+
+	self = rb_obj_alloc(klass);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	reset_decompress(reader);
+	reader->source_io = file;
+
+	oil_mem_map_value(file, &reader->mem);
+	set_mem_src(reader);
+
+	save_markers(reader, markers);
+	read_header(reader);
+	return self;
+}
+
+/*
+ *  call-seq:
+ *     Reader.push([markers]) -> reader
+ *
+ *  Creates a new JPEG Reader that is given the image a chunk at a time with
+ *  <<, as it arrives from a socket or an upload. The header is read as soon
+ *  as enough of it has been pushed, and ready? tells when it has been.
+ *
+ *  Pushed images are decoded with start. Each step of the job decodes and
+ *  scales as many rows as the data pushed so far allows, and returns an empty
+ *  string when it needs more. Once the last chunk has been pushed, close the
+ *  reader so that the job can finish. :ycbcr is ignored, and the image is
+ *  decoded on a single thread.
+ *
+ *  +markers+ has the same meaning as in Reader.new.
+ *
+ *     reader = Oil::JPEGReader.push
+ *     reader << socket.readpartial(16384) until reader.ready?
+ *     reader.scale_width = 100
+ *     reader.scale_height = 100
+ *     job = reader.start
+ *     loop do
+ *       out << job.step
+ *       break if job.done?
+ *       chunk = socket.read(16384)
+ *       chunk ? reader << chunk : reader.close
+ *     end
+ */
+
+static VALUE push_reader(int argc, VALUE *argv, VALUE klass)
+{
+	struct readerdata *reader;
+	VALUE self, markers;
+
+	rb_scan_args(argc, argv, "01", &markers);
+
+	self = rb_obj_alloc(klass);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	reset_decompress(reader);
+	reader->source_io = Qnil;
+	reader->pushed = 1;
+
+	reader->mgr.fill_input_buffer = push_fill_input_buffer;
+	reader->mgr.skip_input_data = push_skip_input_data;
 	reader->mgr.bytes_in_buffer = 0;
+	reader->dinfo.src = &reader->mgr;
 
-	if(!NIL_P(markers)) {
-		Check_Type(markers, T_ARRAY);
-		for (i=0; i<RARRAY_LEN(markers); i++) {
-			if (!SYMBOL_P(RARRAY_PTR(markers)[i])) {
-				rb_raise(rb_eTypeError, "Marker code is not a symbol.");
-			}
-			marker_code = sym_to_marker_code(RARRAY_PTR(markers)[i]);
-			jpeg_save_markers(dinfo, marker_code, 0xFFFF);
-		}
+	save_markers(reader, markers);
+	return self;
+}
+
+/*
+ *  call-seq:
+ *     reader << string -> reader
+ *
+ *  Append a chunk of the image to a reader made with Reader.push, and read the
+ *  header if it hasn't been read yet and the chunk completes it.
+ */
+
+static VALUE push_data(VALUE self, VALUE string)
+{
+	struct readerdata *reader;
+	struct oil_push *push;
+	size_t cap;
+
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	StringValue(string);
+	push = &reader->push;
+	if (!reader->pushed) {
+		rb_raise(rb_eRuntimeError, "Reader was not made with push.");
+	}
+	if (push->closed) {
+		rb_raise(rb_eRuntimeError, "Reader is closed.");
 	}
 
-	/* Be warned that this can raise a ruby exception and longjmp away. */
-	jpeg_read_header(dinfo, TRUE);
+	/* Keep the bytes the decompressor hasn't read, which it may back up to
+	 * after suspending.
+	 */
+	push->pos = push->len - reader->mgr.bytes_in_buffer;
+	cap = push->cap;
+	if (oil_push_append(push, (unsigned char *)RSTRING_PTR(string),
+		RSTRING_LEN(string))) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	rb_gc_adjust_memory_usage((ssize_t)push->cap - (ssize_t)cap);
+	reader->mgr.next_input_byte = push->data;
+	reader->mgr.bytes_in_buffer = push->len;
 
-	jpeg_calc_output_dimensions(dinfo);
+	if (!reader->header_read) {
+		read_header(reader);
+	}
+	return self;
+}
+
+/*
+ *  call-seq:
+ *     reader.close -> reader
+ *
+ *  Tell a reader made with Reader.push that the whole image has been pushed.
+ *  Raises RuntimeError if the header is incomplete. A job that runs out of
+ *  data after this finishes the image the way a truncated file would.
+ */
 
+static VALUE push_close(VALUE self)
+{
+	struct readerdata *reader;
+
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	if (!reader->pushed) {
+		rb_raise(rb_eRuntimeError, "Reader was not made with push.");
+	}
+	reader->push.closed = 1;
+	if (!reader->header_read) {
+		read_header(reader);
+	}
 	return self;
 }
 
+/*
+ *  call-seq:
+ *     reader.ready? -> true or false
+ *
+ *  Returns true once the header has been read. Readers not made with
+ *  Reader.push are always ready.
+ */
+
+static VALUE ready_p(VALUE self)
+{
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return reader->header_read ? Qtrue : Qfalse;
+}
+
 /*
  *  call-seq:
  *     reader.num_components -> number
@@ -344,9 +726,9 @@ static VALUE initialize(int argc, VALUE *argv, VALUE self)
 
 static VALUE num_components(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->num_components);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.num_components);
 }
 
 /*
@@ -361,9 +743,9 @@ static VALUE num_components(VALUE self)
 
 static VALUE output_components(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->output_components);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.output_components);
 }
 
 /*
@@ -378,9 +760,9 @@ static VALUE output_components(VALUE self)
 
 static VALUE out_color_components(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->out_color_components);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.out_color_components);
 }
 
 /*
@@ -399,11 +781,11 @@ static VALUE out_color_components(VALUE self)
 
 static VALUE jpeg_color_space(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
+	struct readerdata *reader;
 	ID id;
 
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	id = j_color_space_to_id(dinfo->jpeg_color_space);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	id = j_color_space_to_id(reader->dinfo.jpeg_color_space);
 
 	return ID2SYM(id);
 }
@@ -418,11 +800,11 @@ static VALUE jpeg_color_space(VALUE self)
 
 static VALUE out_color_space(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
+	struct readerdata *reader;
 	ID id;
 
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	id = j_color_space_to_id(dinfo->out_color_space);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	id = j_color_space_to_id(reader->dinfo.out_color_space);
 
 	return ID2SYM(id);
 }
@@ -438,7 +820,7 @@ static VALUE set_out_color_space(VALUE self, VALUE cs)
 {
 	struct readerdata *reader;
 
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	raise_if_locked(reader);
 
 	reader->dinfo.out_color_space = sym_to_j_color_space(cs);
@@ -458,9 +840,9 @@ static VALUE set_out_color_space(VALUE self, VALUE cs)
 
 static VALUE image_width(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->image_width);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.image_width);
 }
 
 /*
@@ -475,9 +857,9 @@ static VALUE image_width(VALUE self)
 
 static VALUE image_height(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->image_height);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.image_height);
 }
 
 /*
@@ -489,9 +871,9 @@ static VALUE image_height(VALUE self)
 
 static VALUE output_width(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->output_width);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.output_width);
 }
 
 /*
@@ -503,9 +885,9 @@ static VALUE output_width(VALUE self)
 
 static VALUE output_height(VALUE self)
 {
-	struct jpeg_decompress_struct * dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->output_height);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.output_height);
 }
 
 /*
@@ -522,15 +904,15 @@ static VALUE output_height(VALUE self)
 
 static VALUE markers(VALUE self)
 {
-	struct jpeg_decompress_struct *dinfo;
+	struct readerdata *reader;
 	jpeg_saved_marker_ptr marker;
 	VALUE hash, ary, key, val;
 
 	hash = rb_hash_new();
 
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 
-	for (marker=dinfo->marker_list; marker; marker=marker->next) {
+	for (marker=reader->dinfo.marker_list; marker; marker=marker->next) {
 		key = marker_code_to_sym(marker->marker);
 		ary = rb_hash_aref(hash, key);
 		if (NIL_P(ary)) {
@@ -555,9 +937,9 @@ static VALUE markers(VALUE self)
 
 static VALUE scale_num(VALUE self)
 {
-	struct jpeg_decompress_struct *dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->scale_num);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.scale_num);
 }
 
 /*
@@ -573,7 +955,7 @@ static VALUE set_scale_num(VALUE self, VALUE scale_num)
 {
 	struct readerdata *reader;
 
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	raise_if_locked(reader);
 
 	reader->dinfo.scale_num = NUM2INT(scale_num);
@@ -592,9 +974,9 @@ static VALUE set_scale_num(VALUE self, VALUE scale_num)
 
 static VALUE scale_denom(VALUE self)
 {
-	struct jpeg_decompress_struct *dinfo;
-	Data_Get_Struct(self, struct jpeg_decompress_struct, dinfo);
-	return INT2FIX(dinfo->scale_denom);
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	return INT2FIX(reader->dinfo.scale_denom);
 }
 
 /*
@@ -613,7 +995,7 @@ static VALUE set_scale_denom(VALUE self, VALUE scale_denom)
 {
 	struct readerdata *reader;
 
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	raise_if_locked(reader);
 
 	reader->dinfo.scale_denom = NUM2INT(scale_denom);
@@ -621,6 +1003,37 @@ static VALUE set_scale_denom(VALUE self, VALUE scale_denom)
 	return scale_denom;
 }
 
+/*
+ *  call-seq:
+ *     reader.prescale(width, height [, min_ratio]) -> nil
+ *
+ *  Sets scale_num and scale_denom so that the decompressor produces the
+ *  smallest image that is still at least +min_ratio+ times the given size. The
+ *  reduced-size IDCT is far cheaper than decoding at full size, and the rest of
+ *  the reduction is done by the resampler.
+ *
+ *  +min_ratio+ defaults to 2. Larger values trade speed for quality. The
+ *  decompressor never scales images up.
+ *
+ *     reader.prescale(400, 300)
+ *     reader.output_width # => 1512 for a 6048 pixel wide image
+ */
+
+static VALUE prescale(int argc, VALUE *argv, VALUE self)
+{
+	struct readerdata *reader;
+	VALUE width, height, min_ratio;
+
+	rb_scan_args(argc, argv, "21", &width, &height, &min_ratio);
+
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	raise_if_locked(reader);
+
+	oil_libjpeg_prescale(&reader->dinfo, NUM2INT(width), NUM2INT(height),
+		NIL_P(min_ratio) ? 2 : NUM2DBL(min_ratio));
+	return Qnil;
+}
+
 /*
  *  call-seq:
  *     reader.scale_width -> number
@@ -632,7 +1045,7 @@ static VALUE set_scale_denom(VALUE self, VALUE scale_denom)
 static VALUE scale_width(VALUE self)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	return INT2FIX(reader->scale_width);
 }
 
@@ -647,7 +1060,7 @@ static VALUE scale_width(VALUE self)
 static VALUE set_scale_width(VALUE self, VALUE scale_width)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	raise_if_locked(reader);
 	reader->scale_width = NUM2INT(scale_width);
 	return scale_width;
@@ -664,7 +1077,7 @@ static VALUE set_scale_width(VALUE self, VALUE scale_width)
 static VALUE scale_height(VALUE self)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	return INT2FIX(reader->scale_height);
 }
 
@@ -679,7 +1092,7 @@ static VALUE scale_height(VALUE self)
 static VALUE set_scale_height(VALUE self, VALUE scale_height)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
 	raise_if_locked(reader);
 	reader->scale_height = NUM2INT(scale_height);
 	return scale_height;
@@ -691,6 +1104,9 @@ struct writerdata {
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_destination_mgr mgr;
 	VALUE buffer;
+	unsigned char *trial; // receives trial encodings for max_bytes.
+	size_t max_bytes; // largest output accepted. trial holds one byte more.
+	int overflow; // 1 if the current trial did not fit in trial.
 };
 
 static void init_destination(j_compress_ptr cinfo)
@@ -727,6 +1143,30 @@ static void term_destination(j_compress_ptr cinfo)
 	}
 }
 
+/* Trial encodings for max_bytes go to a fixed buffer. Once it is full, the rest
+ * of the output is dropped and the trial is marked as too big. libjpeg empties
+ * the buffer as soon as it fills up, so it has room for one byte more than
+ * max_bytes.
+ */
+static void trial_init_destination(j_compress_ptr cinfo)
+{
+	struct writerdata *writer;
+
+	writer = (struct writerdata *)cinfo;
+	writer->mgr.next_output_byte = writer->trial;
+	writer->mgr.free_in_buffer = writer->max_bytes + 1;
+	writer->overflow = 0;
+}
+
+static boolean trial_empty_output_buffer(j_compress_ptr cinfo)
+{
+	trial_init_destination(cinfo);
+	((struct writerdata *)cinfo)->overflow = 1;
+	return TRUE;
+}
+
+static void trial_term_destination(j_compress_ptr cinfo) {}
+
 static int markerhash_each(VALUE marker_code_v, VALUE marker_ary, VALUE cinfo_v)
 {
 	struct jpeg_compress_struct *cinfo;
@@ -748,72 +1188,424 @@ static int markerhash_each(VALUE marker_code_v, VALUE marker_ary, VALUE cinfo_v)
 	return ST_CONTINUE;
 }
 
-struct write_jpeg_args {
-	VALUE opts;
-	struct readerdata *reader;
-	struct writerdata *writer;
-	unsigned char *inwidthbuf;
-	unsigned char *outwidthbuf;
-	struct oil_libjpeg ol;
-};
-
-static VALUE each2(struct write_jpeg_args *args)
+/* Returns 1 if the options ask for YCbCr planes to be scaled directly, and the
+ * image allows it.
+ */
+static enum oil_ycbcr ycbcr_mode(struct readerdata *reader, VALUE opts)
 {
-	struct writerdata *writer;
-	struct jpeg_decompress_struct *dinfo;
-	struct jpeg_compress_struct *cinfo;
+	enum oil_ycbcr ycbcr;
+	VALUE mode;
+
+	if (NIL_P(opts) || reader->pushed) {
+		return OIL_YCBCR_RGB;
+	}
+	Check_Type(opts, T_HASH);
+	mode = rb_hash_aref(opts, sym_ycbcr);
+	if (NIL_P(mode)) {
+		return OIL_YCBCR_RGB;
+	}
+	if (mode == sym_planar) {
+		ycbcr = OIL_YCBCR_PLANAR;
+	} else if (mode == sym_linear) {
+		ycbcr = OIL_YCBCR_LINEAR;
+	} else {
+		rb_raise(rb_eArgError, "Unknown ycbcr mode.");
+	}
+	if (!oil_libjpeg_planar_supported(&reader->dinfo,
+		ycbcr == OIL_YCBCR_LINEAR)) {
+		return OIL_YCBCR_RGB;
+	}
+	return ycbcr;
+}
+
+/* Set the compressor's parameters to match the reader's output. */
+static void set_compress(struct jpeg_compress_struct *cinfo,
+	struct readerdata *reader, VALUE opts)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct oil_libjpeg_encode enc;
+	VALUE quality;
+
+	dinfo = &reader->dinfo;
+	oil_encode_opts(opts, &enc);
+
+	cinfo->image_width = reader->scale_width;
+	cinfo->image_height = reader->scale_height;
+	cinfo->in_color_space = dinfo->out_color_space;
+	cinfo->input_components = dinfo->output_components;
+
+	jpeg_set_defaults(cinfo);
+
+	if (!NIL_P(opts)) {
+		quality = rb_hash_aref(opts, sym_quality);
+		if (!NIL_P(quality)) {
+			jpeg_set_quality(cinfo, FIX2INT(quality), FALSE);
+		}
+	}
+	oil_libjpeg_compress_speed(cinfo, oil_speed_opt(opts));
+	oil_libjpeg_compress_encode(cinfo, &enc);
+}
+
+/* Write the custom markers given in the options. */
+static void write_markers(struct jpeg_compress_struct *cinfo, VALUE opts)
+{
+	VALUE markers;
+
+	if (!NIL_P(opts)) {
+		markers = rb_hash_aref(opts, sym_markers);
+		if (!NIL_P(markers)) {
+			Check_Type(markers, T_HASH);
+			rb_hash_foreach(markers, markerhash_each, (VALUE)cinfo);
+		}
+	}
+}
+
+/* Start the decompressor. It runs on several threads when the options ask for
+ * them, ol is given and the whole image is in memory. Returns 0 if the reader
+ * was made with push and needs more data first, in which case we are called
+ * again once it has some.
+ */
+static int start_decompress(struct readerdata *reader, struct oil_libjpeg *ol,
+	VALUE opts)
+{
+	int threads, ret;
+
+	threads = oil_threads_opt(opts);
+	if (ol && threads > 1 && reader->mem.data) {
+		ret = oil_libjpeg_start_parallel(ol, reader->mem.data,
+			reader->mem.len, threads);
+		if (!ret) {
+			return 1;
+		} else if (ret == -2) {
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+	}
+	return oil_libjpeg_start_decompress(&reader->dinfo);
+}
+
+/* Set up the parallel writer when the options ask for threads. Returns 1 if
+ * rows are to be given to the writer instead of the compressor.
+ */
+static int start_writer(struct oil_libjpeg_writer *jw,
+	struct jpeg_compress_struct *cinfo, VALUE opts)
+{
+	int threads, ret;
+
+	threads = oil_threads_opt(opts);
+	if (threads < 2) {
+		return 0;
+	}
+	ret = oil_libjpeg_writer_init(jw, cinfo, threads);
+	if (ret == -2) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	return !ret;
+}
+
+/* Write a row with the parallel writer or the compressor. */
+static void write_row(struct jpeg_compress_struct *cinfo,
+	struct oil_libjpeg_writer *jw, int parallel, unsigned char *row)
+{
+	if (parallel) {
+		oil_libjpeg_writer_write_row(jw, row);
+	} else {
+		jpeg_write_scanlines(cinfo, &row, 1);
+	}
+}
+
+static void finish_compress(struct jpeg_compress_struct *cinfo,
+	struct oil_libjpeg_writer *jw, int parallel)
+{
+	if (parallel) {
+		oil_libjpeg_writer_finish(jw);
+	} else {
+		jpeg_finish_compress(cinfo);
+	}
+}
+
+/* Set up the compressor to match the reader and start it. When op is given, it
+ * is initialized to scale the image plane by plane. Otherwise ol is the scaler
+ * the rows will be read through, and jw is set up to encode them when the
+ * options ask for threads. Returns 1 if jw is in use. The decompressor is
+ * started afterwards with start_decompress().
+ */
+static int start_compress(struct jpeg_compress_struct *cinfo,
+	struct readerdata *reader, VALUE opts, enum oil_ycbcr ycbcr,
+	struct oil_libjpeg_planar *op, struct oil_libjpeg *ol,
+	struct oil_libjpeg_writer *jw)
+{
+	struct jpeg_decompress_struct *dinfo;
+	int ret, parallel;
+
+	dinfo = &reader->dinfo;
+	oil_libjpeg_decompress_speed(dinfo, oil_speed_opt(opts));
+	if (ycbcr) {
+		dinfo->out_color_space = JCS_YCbCr;
+		jpeg_calc_output_dimensions(dinfo);
+	}
+
+	set_compress(cinfo, reader, opts);
+
+	if (ycbcr) {
+		ret = oil_libjpeg_planar_init(op, dinfo, cinfo,
+			reader->scale_width, reader->scale_height,
+			ycbcr == OIL_YCBCR_LINEAR);
+		if (ret!=0) {
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+		set_mem_size(reader, saved_markers_size(dinfo) +
+			oil_libjpeg_planar_mem_size(op));
+	}
+
+	parallel = ycbcr ? 0 : start_writer(jw, cinfo, opts);
+	jpeg_start_compress(cinfo, TRUE);
+	write_markers(cinfo, opts);
+	return parallel;
+}
+
+/* Write the whole image plane by plane. */
+static void write_planar(struct oil_libjpeg_planar *op, int height)
+{
+	int i;
+
+	for (i=0; i<height; i+=op->out_lines) {
+		if (oil_libjpeg_planar_write(op)) {
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+	}
+}
+
+struct write_jpeg_args {
+	VALUE opts;
+	struct readerdata *reader;
+	struct writerdata *writer;
+	unsigned char *inwidthbuf;
+	unsigned char *outwidthbuf;
+	struct oil_libjpeg ol;
+	struct oil_libjpeg_planar op;
+	struct oil_libjpeg_writer jw;
+	enum oil_ycbcr ycbcr;
+	unsigned char *image; // the whole scaled image, for max_bytes.
+	unsigned char *best; // the best trial encoding so far.
+};
+
+/* Encode the scaled image held in args->image at the given quality. Returns
+ * the size of the output, or 0 if it does not fit in max_bytes.
+ */
+static size_t encode_trial(struct write_jpeg_args *args, int quality)
+{
+	struct writerdata *writer;
+	struct jpeg_compress_struct *cinfo;
+	JSAMPROW row;
+	size_t stride;
+	int i;
+
+	writer = args->writer;
+	cinfo = &writer->cinfo;
+	stride = (size_t)args->reader->scale_width * OIL_CMP(args->ol.os.cs);
+
+	set_compress(cinfo, args->reader, args->opts);
+	jpeg_set_quality(cinfo, quality, FALSE);
+	jpeg_start_compress(cinfo, TRUE);
+	write_markers(cinfo, args->opts);
+
+	for (i=0; i<args->reader->scale_height && !writer->overflow; i++) {
+		row = args->image + i * stride;
+		jpeg_write_scanlines(cinfo, &row, 1);
+	}
+	if (writer->overflow) {
+		jpeg_abort_compress(cinfo);
+		return 0;
+	}
+	jpeg_finish_compress(cinfo);
+	if (writer->overflow) {
+		return 0;
+	}
+	return writer->max_bytes + 1 - writer->mgr.free_in_buffer;
+}
+
+/* Scale the image once, then binary search for the highest quality whose
+ * output fits in max_bytes. Only the encoder runs more than once.
+ */
+static void each_max_bytes(struct write_jpeg_args *args)
+{
+	struct writerdata *writer;
+	struct jpeg_decompress_struct *dinfo;
+	unsigned char *tmp;
+	size_t stride, size, best_size;
+	int i, lo, hi, q;
+	VALUE quality;
+
+	writer = args->writer;
+	dinfo = &args->reader->dinfo;
+	stride = (size_t)args->reader->scale_width * OIL_CMP(args->ol.os.cs);
+
+	oil_libjpeg_decompress_speed(dinfo, oil_speed_opt(args->opts));
+	start_decompress(args->reader, &args->ol, args->opts);
+	for (i=0; i<args->reader->scale_height; i++) {
+		oil_libjpeg_read_scanline(&args->ol, args->image + i * stride);
+	}
+
+	writer->mgr.init_destination = trial_init_destination;
+	writer->mgr.empty_output_buffer = trial_empty_output_buffer;
+	writer->mgr.term_destination = trial_term_destination;
+
+	quality = rb_hash_aref(args->opts, sym_quality);
+	hi = NIL_P(quality) ? 100 : FIX2INT(quality);
+	lo = 1;
+	best_size = 0;
+
+	/* Try the highest quality first, since many images already fit. */
+	q = hi;
+	while (lo <= hi) {
+		size = encode_trial(args, q);
+		if (size) {
+			tmp = args->best;
+			args->best = writer->trial;
+			writer->trial = tmp;
+			best_size = size;
+			lo = q + 1;
+		} else {
+			hi = q - 1;
+		}
+		q = (lo + hi + 1) / 2;
+	}
+
+	if (!best_size) {
+		rb_raise(rb_eRuntimeError, "Unable to fit the image in max_bytes.");
+	}
+	rb_yield(rb_str_new((char *)args->best, best_size));
+}
+
+static VALUE each2(struct write_jpeg_args *args)
+{
+	struct writerdata *writer;
+	struct jpeg_compress_struct *cinfo;
 	unsigned char *outwidthbuf;
-	int i, scalex, scaley;
-	VALUE quality, markers;
+	int i, scaley;
 	struct oil_libjpeg *ol;
+	int parallel;
 
 	writer = args->writer;
 	ol = &args->ol;
 	outwidthbuf = args->outwidthbuf;
-	dinfo = &args->reader->dinfo;
 	cinfo = &writer->cinfo;
-	scalex = args->reader->scale_width;
 	scaley = args->reader->scale_height;
 
 	writer->mgr.init_destination = init_destination;
 	writer->mgr.empty_output_buffer = empty_output_buffer;
 	writer->mgr.term_destination = term_destination;
 	writer->cinfo.dest = &writer->mgr;
-	writer->cinfo.image_width = scalex;
-	writer->cinfo.image_height = scaley;
-	writer->cinfo.in_color_space = dinfo->out_color_space;
-	writer->cinfo.input_components = dinfo->output_components;
-
-	jpeg_set_defaults(cinfo);
 
-	if (!NIL_P(args->opts)) {
-		quality = rb_hash_aref(args->opts, sym_quality);
-		if (!NIL_P(quality)) {
-			jpeg_set_quality(cinfo, FIX2INT(quality), FALSE);
-		}
+	if (args->image) {
+		each_max_bytes(args);
+		return Qnil;
 	}
 
-	jpeg_start_compress(cinfo, TRUE);
-	jpeg_start_decompress(dinfo);
-
-	if (!NIL_P(args->opts)) {
-		markers = rb_hash_aref(args->opts, sym_markers);
-		if (!NIL_P(markers)) {
-			Check_Type(markers, T_HASH);
-			rb_hash_foreach(markers, markerhash_each, (VALUE)cinfo);
-		}
+	if (args->ycbcr) {
+		start_compress(cinfo, args->reader, args->opts, args->ycbcr,
+			&args->op, NULL, NULL);
+		start_decompress(args->reader, NULL, args->opts);
+		write_planar(&args->op, scaley);
+		jpeg_finish_compress(cinfo);
+		return Qnil;
 	}
 
+	parallel = start_compress(cinfo, args->reader, args->opts,
+		OIL_YCBCR_RGB, NULL, ol, &args->jw);
+	start_decompress(args->reader, ol, args->opts);
+
 	for(i=scaley; i>0; i--) {
 		oil_libjpeg_read_scanline(ol, outwidthbuf);
-		jpeg_write_scanlines(cinfo, (JSAMPARRAY)&outwidthbuf, 1);
+		write_row(cinfo, &args->jw, parallel, outwidthbuf);
 	}
 
-	jpeg_finish_compress(cinfo);
+	finish_compress(cinfo, &args->jw, parallel);
 
 	return Qnil;
 }
 
+#ifdef HAVE_LIBWEBP
+struct webp_args {
+	struct readerdata *reader;
+	VALUE opts;
+	struct oil_libjpeg ol;
+	struct oil_libwebp ow;
+	unsigned char *outwidthbuf;
+};
+
+static VALUE each_webp2(struct webp_args *args)
+{
+	int i, ret;
+
+	oil_libjpeg_decompress_speed(&args->reader->dinfo,
+		oil_speed_opt(args->opts));
+	start_decompress(args->reader, &args->ol, args->opts);
+	for (i=0; i<args->reader->scale_height; i++) {
+		oil_libjpeg_read_scanline(&args->ol, args->outwidthbuf);
+		oil_libwebp_write_row(&args->ow, args->outwidthbuf,
+			args->ol.os.cs);
+	}
+	ret = oil_libwebp_finish(&args->ow);
+	if (ret == -1) {
+		rb_raise(rb_eRuntimeError, "Unable to encode the WebP image.");
+	} else if (ret) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	rb_yield(rb_str_new((char *)args->ow.wr.mem, args->ow.wr.size));
+	return Qnil;
+}
+
+/* Scale the image into a WebP picture and yield the output in one string. */
+static void each_webp(struct readerdata *reader, VALUE opts)
+{
+	struct webp_args args;
+	struct oil_libwebp_encode enc;
+	size_t markers_size, rowbytes;
+	int ret, state;
+
+	oil_webp_encode_opts(opts, &enc);
+	markers_size = saved_markers_size(&reader->dinfo);
+
+	ret = oil_libjpeg_init(&args.ol, &reader->dinfo, reader->scale_width,
+		reader->scale_height);
+	if (ret!=0) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	rowbytes = (size_t)reader->scale_width * OIL_CMP(args.ol.os.cs);
+	args.reader = reader;
+	args.opts = opts;
+	args.outwidthbuf = malloc(rowbytes);
+	ret = oil_libwebp_init(&args.ow, reader->scale_width,
+		reader->scale_height, &enc);
+	if (ret!=0 || !args.outwidthbuf) {
+		oil_libwebp_free(&args.ow);
+		oil_libjpeg_free(&args.ol);
+		free(args.outwidthbuf);
+		if (ret == -1) {
+			rb_raise(rb_eArgError, "Invalid dimensions for WebP.");
+		}
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	set_mem_size(reader, markers_size + oil_libjpeg_mem_size(&args.ol) +
+		rowbytes + oil_libwebp_mem_size(&args.ow));
+
+	reader->locked = 1;
+	rb_protect((VALUE(*)(VALUE))each_webp2, (VALUE)&args, &state);
+
+	oil_libwebp_free(&args.ow);
+	oil_libjpeg_free(&args.ol);
+	free(args.outwidthbuf);
+	set_mem_size(reader, markers_size +
+		oil_libjpeg_decoder_mem_size(&reader->dinfo));
+	workers_output_message(args.ol.warning);
+
+	if (state) {
+		rb_jump_tag(state);
+	}
+}
+#endif
+
 /*
  * call-seq:
  *    reader.each(opts, &block) -> self
@@ -826,6 +1618,49 @@ static VALUE each2(struct write_jpeg_args *args)
  * :markers - Custom markers to include in the output JPEG. Must be a hash where
  *   the keys are :APP[0-15] or :COM and the values are arrays of strings that
  *   will be inserted into the markers.
+ * :ycbcr - Pass :planar to scale the Y, Cb and Cr planes directly, each at its
+ *   own resolution, skipping color conversion and chroma upsampling. This is
+ *   faster, but samples are averaged as stored rather than in linear light.
+ *   Pass :linear to convert the planes to linear RGB inside the scaler and
+ *   back to YCbCr on the way out, which avoids rounding to 8-bit RGB in
+ *   between. Images that are not YCbCr are scaled as usual.
+ * :speed - :fast uses libjpeg's fast integer DCT and turns off fancy
+ *   upsampling and block smoothing, for previews that favor throughput.
+ *   :balanced, the default, keeps libjpeg's defaults. :quality also optimizes
+ *   the Huffman tables of the output, which makes it smaller.
+ * :progressive - true to write a progressive JPEG. Usually smaller than
+ *   baseline, and slower to encode.
+ * :optimize - true to build optimal Huffman tables for the output.
+ * :subsampling - Chroma subsampling of color output: "4:4:4", "4:2:2" or
+ *   "4:2:0". Defaults to "4:2:0".
+ * :arithmetic - true to use arithmetic coding, which is smaller still but not
+ *   supported by many decoders. Raises ArgumentError if libjpeg was built
+ *   without it.
+ * :trellis - true to use trellis quantization. Needs libjpeg to be mozjpeg,
+ *   and raises ArgumentError otherwise.
+ * :restart_rows - Write a restart marker every this many MCU rows. This makes
+ *   the output a little larger, and lets it be decoded on several threads.
+ * :threads - Number of threads to decode and encode the image with, in bands
+ *   of MCU rows. Images are decoded on several threads when they are baseline
+ *   images with restart markers at the start of MCU rows, read from a String,
+ *   an IO::Buffer or a file opened with Reader.open. The output is encoded on
+ *   several threads unless :optimize, :progressive, :arithmetic, :trellis or
+ *   :speed => :quality is given, and then gets a restart marker every MCU row
+ *   unless :restart_rows says otherwise. Defaults to 1.
+ * :max_bytes - Largest allowed size of the output, in bytes. The image is
+ *   decoded and scaled once, then encoded at the highest quality, up to
+ *   :quality or 100, that fits. The output is yielded as a single string.
+ *   Raises RuntimeError if it doesn't fit even at quality 1. Can't be
+ *   combined with :ycbcr.
+ * :format - :jpeg, the default, or :webp to write a WebP image instead,
+ *   lossy unless :lossless is given. The output is yielded as a single string
+ *   once the whole image is encoded. WebP output takes :quality, which
+ *   defaults to 75, :speed and :threads, and ignores the other options above.
+ *   Raises ArgumentError if oil was built without libwebp.
+ * :method - WebP compression method, from 0, the fastest, to 6, the
+ *   smallest. Defaults to 4. speed: :fast picks 0 and speed: :quality picks 6.
+ * :lossless - true to write a lossless WebP image. :quality then sets the
+ *   effort spent compressing it.
  */
 
 static VALUE each(int argc, VALUE *argv, VALUE self)
@@ -833,13 +1668,16 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 	struct readerdata *reader;
 	struct writerdata writer;
 	int state, width_out, ret;
+	size_t markers_size, image_size;
 	struct write_jpeg_args args;
 	unsigned char *outwidthbuf;
-	VALUE opts;
+	enum oil_format format;
+	VALUE opts, max_bytes;
 
 	rb_scan_args(argc, argv, "01", &opts);
 
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	raise_if_not_ready(reader, 0);
 
 	if (!reader->scale_width) {
 		reader->scale_width = reader->dinfo.output_width;
@@ -848,21 +1686,79 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 		reader->scale_height = reader->dinfo.output_height;
 	}
 
+	format = oil_format_opt(opts, OIL_FMT_JPEG);
+#ifdef HAVE_LIBWEBP
+	if (format == OIL_FMT_WEBP) {
+		each_webp(reader, opts);
+		return self;
+	}
+#endif
+	if (format != OIL_FMT_JPEG) {
+		rb_raise(rb_eArgError,
+			"JPEG images can't be written in that format.");
+	}
+
+	memset(&args.op, 0, sizeof(args.op));
+	memset(&args.jw, 0, sizeof(args.jw));
+	args.ycbcr = ycbcr_mode(reader, opts);
+	args.image = args.best = NULL;
+	writer.trial = NULL;
+	writer.max_bytes = 0;
+	outwidthbuf = NULL;
+	markers_size = saved_markers_size(&reader->dinfo);
+
+	max_bytes = NIL_P(opts) ? Qnil : rb_hash_aref(opts, sym_max_bytes);
+	if (!NIL_P(max_bytes)) {
+		if (!NIL_P(rb_hash_aref(opts, sym_ycbcr))) {
+			rb_raise(rb_eArgError, "max_bytes can't be used with ycbcr.");
+		}
+		writer.max_bytes = NUM2SIZET(max_bytes);
+		if (!writer.max_bytes) {
+			rb_raise(rb_eArgError, "max_bytes must be positive.");
+		}
+	}
+
 	writer.cinfo.err = &reader->jerr;
 	jpeg_create_compress(&writer.cinfo);
 
 	width_out = reader->scale_width;
-	ret = oil_libjpeg_init(&args.ol, &reader->dinfo, width_out,
-		reader->scale_height);
-	if (ret!=0) {
-		jpeg_destroy_compress(&writer.cinfo);
-		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
-	}
-	outwidthbuf = malloc(width_out * OIL_CMP(args.ol.os.cs));
-	if (!outwidthbuf) {
-		oil_libjpeg_free(&args.ol);
-		jpeg_destroy_compress(&writer.cinfo);
-		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	if (!args.ycbcr) {
+		ret = oil_libjpeg_init(&args.ol, &reader->dinfo, width_out,
+			reader->scale_height);
+		if (ret!=0) {
+			jpeg_destroy_compress(&writer.cinfo);
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+		outwidthbuf = malloc(width_out * OIL_CMP(args.ol.os.cs));
+		if (!outwidthbuf) {
+			oil_libjpeg_free(&args.ol);
+			jpeg_destroy_compress(&writer.cinfo);
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+
+		image_size = 0;
+		if (writer.max_bytes) {
+			image_size = (size_t)width_out * reader->scale_height *
+				OIL_CMP(args.ol.os.cs);
+			args.image = malloc(image_size);
+			args.best = malloc(writer.max_bytes + 1);
+			writer.trial = malloc(writer.max_bytes + 1);
+			if (!args.image || !args.best || !writer.trial) {
+				free(args.image);
+				free(args.best);
+				free(writer.trial);
+				free(outwidthbuf);
+				oil_libjpeg_free(&args.ol);
+				jpeg_destroy_compress(&writer.cinfo);
+				rb_raise(rb_eRuntimeError,
+					"Unable to allocate memory.");
+			}
+			image_size += writer.max_bytes * 2;
+		}
+
+		set_mem_size(reader, markers_size +
+			oil_libjpeg_mem_size(&args.ol) +
+			width_out * OIL_CMP(args.ol.os.cs) + image_size);
 	}
 
 	args.reader = reader;
@@ -872,10 +1768,27 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 	reader->locked = 1;
 	rb_protect((VALUE(*)(VALUE))each2, (VALUE)&args, &state);
 
-	oil_libjpeg_free(&args.ol);
-	free(outwidthbuf);
+	oil_libjpeg_writer_free(&args.jw);
+	if (args.ycbcr) {
+		oil_libjpeg_planar_free(&args.op);
+	} else {
+		oil_libjpeg_free(&args.ol);
+		free(outwidthbuf);
+		free(args.image);
+		free(args.best);
+		free(writer.trial);
+	}
 	jpeg_destroy_compress(&writer.cinfo);
 
+	/* libjpeg keeps its buffers until the decompressor is reset. */
+	set_mem_size(reader, markers_size +
+		oil_libjpeg_decoder_mem_size(&reader->dinfo));
+
+	workers_output_message(args.jw.warning);
+	if (!args.ycbcr) {
+		workers_output_message(args.ol.warning);
+	}
+
 	if (state) {
 		rb_jump_tag(state);
 	}
@@ -883,6 +1796,323 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 	return self;
 }
 
+/* Time-sliced Jobs */
+
+struct jobdata {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_destination_mgr mgr;
+	struct jpeg_error_mgr jerr;
+	JOCTET buf[WRITE_SIZE];
+	VALUE reader;
+	VALUE opts;
+	VALUE out;
+	struct oil_libjpeg ol;
+	struct oil_libjpeg_planar op;
+	struct oil_libjpeg_writer jw;
+	unsigned char *outwidthbuf;
+	enum oil_ycbcr ycbcr;
+	int rows_left;
+	int started;
+	int decompressing; // 1 once the decompressor has started.
+	int parallel;
+	int done;
+	size_t mem_size;
+};
+
+static void job_init_destination(j_compress_ptr cinfo)
+{
+	struct jobdata *job;
+
+	job = (struct jobdata *)cinfo;
+	job->mgr.next_output_byte = job->buf;
+	job->mgr.free_in_buffer = WRITE_SIZE;
+}
+
+static boolean job_empty_output_buffer(j_compress_ptr cinfo)
+{
+	struct jobdata *job;
+
+	job = (struct jobdata *)cinfo;
+	rb_str_cat(job->out, (char *)job->buf, WRITE_SIZE);
+	job_init_destination(cinfo);
+	return TRUE;
+}
+
+static void job_term_destination(j_compress_ptr cinfo)
+{
+	struct jobdata *job;
+
+	job = (struct jobdata *)cinfo;
+	rb_str_cat(job->out, (char *)job->buf,
+		WRITE_SIZE - job->mgr.free_in_buffer);
+}
+
+/* Free the scaler and compressor once the job has finished or failed. The
+ * reader may already be gone when this is called from the GC, so leave it be.
+ */
+static void job_release(struct jobdata *job)
+{
+	oil_libjpeg_writer_free(&job->jw);
+	if (job->outwidthbuf) {
+		oil_libjpeg_free(&job->ol);
+		free(job->outwidthbuf);
+		job->outwidthbuf = NULL;
+	}
+	oil_libjpeg_planar_free(&job->op);
+	jpeg_destroy_compress(&job->cinfo);
+	rb_gc_adjust_memory_usage(-(ssize_t)job->mem_size);
+	job->mem_size = 0;
+	job->done = 1;
+}
+
+static void job_free(void *ptr)
+{
+	job_release(ptr);
+	xfree(ptr);
+}
+
+static void job_mark(void *ptr)
+{
+	struct jobdata *job = ptr;
+
+	rb_gc_mark(job->reader);
+	rb_gc_mark(job->opts);
+	rb_gc_mark(job->out);
+}
+
+static size_t job_memsize(const void *ptr)
+{
+	const struct jobdata *job = ptr;
+	return sizeof(struct jobdata) + job->mem_size;
+}
+
+static const rb_data_type_t job_type = {
+	"Oil::JPEGReader::Job",
+	{ job_mark, job_free, job_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+
+/*
+ * call-seq:
+ *    reader.start(opts) -> job
+ *
+ * Returns a Job that produces the same output as reader.each(opts), a few rows
+ * at a time. See Job#step.
+ *
+ * Takes the same options as reader.each. The reader can't be modified once a
+ * job has been started.
+ *
+ *    job = reader.start(quality: 90)
+ *    while chunk = job.step(0.005)
+ *      out << chunk
+ *    end
+ */
+
+static VALUE start(int argc, VALUE *argv, VALUE self)
+{
+	struct readerdata *reader;
+	struct jobdata *job;
+	int width_out, ret;
+	VALUE opts, job_obj;
+
+	rb_scan_args(argc, argv, "01", &opts);
+
+	TypedData_Get_Struct(self, struct readerdata, &jpeg_reader_type, reader);
+	raise_if_locked(reader);
+	raise_if_not_ready(reader, 1);
+	if (oil_format_opt(opts, OIL_FMT_JPEG) != OIL_FMT_JPEG) {
+		rb_raise(rb_eArgError, "Jobs can only write JPEG images.");
+	}
+
+	if (!reader->scale_width) {
+		reader->scale_width = reader->dinfo.output_width;
+	}
+	if (!reader->scale_height) {
+		reader->scale_height = reader->dinfo.output_height;
+	}
+
+	job_obj = TypedData_Make_Struct(cJob, struct jobdata, &job_type, job);
+	job->reader = self;
+	job->opts = opts;
+	job->out = Qnil;
+
+	jpeg_std_error(&job->jerr);
+	job->jerr.error_exit = error_exit;
+	job->jerr.output_message = output_message;
+	job->cinfo.err = &job->jerr;
+	jpeg_create_compress(&job->cinfo);
+	job->mgr.init_destination = job_init_destination;
+	job->mgr.empty_output_buffer = job_empty_output_buffer;
+	job->mgr.term_destination = job_term_destination;
+	job->cinfo.dest = &job->mgr;
+
+	job->rows_left = reader->scale_height;
+	job->ycbcr = ycbcr_mode(reader, opts);
+	reader->locked = 1;
+	if (job->ycbcr) {
+		return job_obj;
+	}
+
+	width_out = reader->scale_width;
+	ret = oil_libjpeg_init(&job->ol, &reader->dinfo, width_out,
+		reader->scale_height);
+	if (ret!=0) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	job->outwidthbuf = malloc(width_out * OIL_CMP(job->ol.os.cs));
+	if (!job->outwidthbuf) {
+		oil_libjpeg_free(&job->ol);
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+
+	job->mem_size = oil_libjpeg_mem_size(&job->ol) +
+		width_out * OIL_CMP(job->ol.os.cs);
+	rb_gc_adjust_memory_usage(job->mem_size);
+	set_mem_size(reader, saved_markers_size(&reader->dinfo));
+	return job_obj;
+}
+
+struct job_step_args {
+	struct jobdata *job;
+	struct readerdata *reader;
+	long max_rows;
+	double deadline;
+};
+
+static VALUE job_step2(struct job_step_args *args)
+{
+	struct jobdata *job;
+	long i, n;
+
+	job = args->job;
+	i = 0;
+
+	if (!job->started) {
+		job->parallel = start_compress(&job->cinfo, args->reader,
+			job->opts, job->ycbcr, &job->op, &job->ol, &job->jw);
+		job->started = 1;
+	}
+
+	/* Pushed data may run out at any point until the reader is closed. The
+	 * step then returns what it has, and resumes from there next time.
+	 */
+	if (!job->decompressing) {
+		job->decompressing = start_decompress(args->reader,
+			job->ycbcr ? NULL : &job->ol, job->opts);
+		if (!job->decompressing) {
+			return Qnil;
+		}
+	}
+
+	/* Planar jobs advance a whole iMCU row at a time. */
+	while (job->ycbcr && i<args->max_rows && job->rows_left) {
+		if (oil_libjpeg_planar_write(&job->op)) {
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+		n = job->op.out_lines;
+		job->rows_left -= n < job->rows_left ? n : job->rows_left;
+		i += n;
+		if (oil_step_expired(args->deadline)) {
+			break;
+		}
+	}
+
+	for (; !job->ycbcr && i<args->max_rows && job->rows_left; i++) {
+		if (!oil_libjpeg_read_scanline(&job->ol, job->outwidthbuf)) {
+			break;
+		}
+		write_row(&job->cinfo, &job->jw, job->parallel,
+			job->outwidthbuf);
+		job->rows_left--;
+		if (oil_step_expired(args->deadline)) {
+			break;
+		}
+	}
+
+	if (!job->rows_left) {
+		finish_compress(&job->cinfo, &job->jw, job->parallel);
+	}
+
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    job.step(max_rows) -> string or nil
+ *    job.step(seconds) -> string or nil
+ *    job.step -> string or nil
+ *
+ * Scales and compresses up to +max_rows+ rows of output, or as many rows as
+ * fit in a time budget of +seconds+ given as a Float. Without an argument the
+ * job runs to completion.
+ *
+ * Returns the output bytes produced by this step, which may be empty since the
+ * compressor buffers its output. Returns nil once the job is done.
+ *
+ * For a reader made with Reader.push, the step also ends when the data pushed
+ * so far runs out, and the next step picks up from there.
+ *
+ * If the image is corrupt, the error is raised from step and the job is done.
+ */
+
+static VALUE job_step(int argc, VALUE *argv, VALUE self)
+{
+	struct jobdata *job;
+	struct job_step_args args;
+	int state;
+	VALUE limit, out;
+
+	rb_scan_args(argc, argv, "01", &limit);
+
+	TypedData_Get_Struct(self, struct jobdata, &job_type, job);
+	if (job->done) {
+		return Qnil;
+	}
+	if (!NIL_P(job->out)) {
+		rb_raise(rb_eRuntimeError, "Job is already running.");
+	}
+
+	oil_step_limit(limit, &args.max_rows, &args.deadline);
+	TypedData_Get_Struct(job->reader, struct readerdata, &jpeg_reader_type,
+		args.reader);
+	args.job = job;
+
+	job->out = rb_str_buf_new(WRITE_SIZE);
+	rb_protect((VALUE(*)(VALUE))job_step2, (VALUE)&args, &state);
+	out = job->out;
+	job->out = Qnil;
+
+	if (state) {
+		job_release(job);
+		rb_jump_tag(state);
+	}
+
+	if (!job->rows_left) {
+		job_release(job);
+		set_mem_size(args.reader, saved_markers_size(&args.reader->dinfo) +
+			oil_libjpeg_decoder_mem_size(&args.reader->dinfo));
+		workers_output_message(job->jw.warning);
+		workers_output_message(job->ol.warning);
+	}
+
+	return out;
+}
+
+/*
+ * call-seq:
+ *    job.done? -> true or false
+ *
+ * Returns true once all output has been returned by step, or step has raised.
+ */
+
+static VALUE job_done_p(VALUE self)
+{
+	struct jobdata *job;
+	TypedData_Get_Struct(self, struct jobdata, &job_type, job);
+	return job->done ? Qtrue : Qfalse;
+}
+
 /*
  * Document-class: Oil::JPEGReader
  *
@@ -897,7 +2127,12 @@ void Init_jpeg()
 
 	cJPEGReader = rb_define_class_under(mOil, "JPEGReader", rb_cObject);
 	rb_define_alloc_func(cJPEGReader, allocate);
+	rb_define_singleton_method(cJPEGReader, "open", open_file, -1);
+	rb_define_singleton_method(cJPEGReader, "push", push_reader, -1);
 	rb_define_method(cJPEGReader, "initialize", initialize, -1);
+	rb_define_method(cJPEGReader, "<<", push_data, 1);
+	rb_define_method(cJPEGReader, "close", push_close, 0);
+	rb_define_method(cJPEGReader, "ready?", ready_p, 0);
 	rb_define_method(cJPEGReader, "markers", markers, 0);
 	rb_define_method(cJPEGReader, "jpeg_color_space", jpeg_color_space, 0);
 	rb_define_method(cJPEGReader, "out_color_space", out_color_space, 0);
@@ -910,15 +2145,22 @@ void Init_jpeg()
 	rb_define_method(cJPEGReader, "output_width", output_width, 0);
 	rb_define_method(cJPEGReader, "output_height", output_height, 0);
 	rb_define_method(cJPEGReader, "each", each, -1);
+	rb_define_method(cJPEGReader, "start", start, -1);
 	rb_define_method(cJPEGReader, "scale_num", scale_num, 0);
 	rb_define_method(cJPEGReader, "scale_num=", set_scale_num, 1);
 	rb_define_method(cJPEGReader, "scale_denom", scale_denom, 0);
 	rb_define_method(cJPEGReader, "scale_denom=", set_scale_denom, 1);
+	rb_define_method(cJPEGReader, "prescale", prescale, -1);
 	rb_define_method(cJPEGReader, "scale_width", scale_width, 0);
 	rb_define_method(cJPEGReader, "scale_width=", set_scale_width, 1);
 	rb_define_method(cJPEGReader, "scale_height", scale_height, 0);
 	rb_define_method(cJPEGReader, "scale_height=", set_scale_height, 1);
 
+	cJob = rb_define_class_under(cJPEGReader, "Job", rb_cObject);
+	rb_undef_alloc_func(cJob);
+	rb_define_method(cJob, "step", job_step, -1);
+	rb_define_method(cJob, "done?", job_done_p, 0);
+
 	id_GRAYSCALE = rb_intern("GRAYSCALE");
 	id_RGB = rb_intern("RGB");
 	id_YCbCr = rb_intern("YCbCr");
@@ -947,4 +2189,8 @@ void Init_jpeg()
 
 	sym_quality = ID2SYM(rb_intern("quality"));
 	sym_markers = ID2SYM(rb_intern("markers"));
+	sym_ycbcr = ID2SYM(rb_intern("ycbcr"));
+	sym_planar = ID2SYM(rb_intern("planar"));
+	sym_linear = ID2SYM(rb_intern("linear"));
+	sym_max_bytes = ID2SYM(rb_intern("max_bytes"));
 }
@@ -1,5 +1,30 @@
 #include <ruby.h>
+#include <ruby/io.h>
+#include <ruby/thread.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#ifdef HAVE_RUBY_IO_BUFFER_H
+#include <ruby/io/buffer.h>
+#endif
 #include "oil_resample.h"
+#include "oil_libjpeg.h"
+#include "oil_libpng.h"
+#include "oil_libwebp.h"
+#include "oil_mem.h"
+#include "oil_resize.h"
+
+static ID id_fileno, id_pos;
+static VALUE sym_quality, sym_prescale, sym_ycbcr, sym_planar, sym_linear;
+static VALUE sym_speed, sym_fast, sym_balanced;
+static VALUE sym_progressive, sym_optimize, sym_subsampling, sym_arithmetic;
+static VALUE sym_trellis, sym_compression_level, sym_filter, sym_strategy;
+static VALUE sym_threads, sym_deflate, sym_zlib, sym_libdeflate;
+static VALUE sym_restart_rows, sym_bit_depth, sym_reduce, sym_colors;
+static VALUE sym_dither, sym_format, sym_jpeg, sym_png, sym_webp, sym_method;
+static VALUE sym_lossless, sym_background;
+static VALUE sym_none, sym_sub, sym_up, sym_average, sym_paeth, sym_all;
+static VALUE sym_default, sym_filtered, sym_huffman_only, sym_rle, sym_fixed;
 
 static VALUE rb_fix_ratio(VALUE self, VALUE src_w, VALUE src_h, VALUE out_w, VALUE out_h)
 {
@@ -15,14 +40,617 @@ static VALUE rb_fix_ratio(VALUE self, VALUE src_w, VALUE src_h, VALUE out_w, VAL
 	return ret;
 }
 
+/* Native path-to-path resizing. */
+
+struct resize_file_args {
+	const char *in_path;
+	const char *out_path;
+	int box_width;
+	int box_height;
+	struct oil_resize_opts opts;
+	int ret;
+	char err[OIL_ERR_LEN];
+};
+
+static void *resize_file_nogvl(void *data)
+{
+	struct resize_file_args *args;
+
+	args = (struct resize_file_args *)data;
+	args->ret = oil_resize_file(args->in_path, args->out_path,
+		args->box_width, args->box_height, &args->opts, args->err);
+	return NULL;
+}
+
+/**
+ * Read the :speed option, shared by JPEGReader and the native entry points.
+ */
+int oil_speed_opt(VALUE opts)
+{
+	VALUE speed;
+
+	if (NIL_P(opts)) {
+		return OIL_SPEED_BALANCED;
+	}
+	Check_Type(opts, T_HASH);
+	speed = rb_hash_aref(opts, sym_speed);
+	if (NIL_P(speed) || speed == sym_balanced) {
+		return OIL_SPEED_BALANCED;
+	} else if (speed == sym_fast) {
+		return OIL_SPEED_FAST;
+	} else if (speed == sym_quality) {
+		return OIL_SPEED_QUALITY;
+	}
+	rb_raise(rb_eArgError, "Unknown speed.");
+}
+
+/**
+ * Read the :threads option, shared by the readers and the native entry points.
+ * Returns 1 when it is not given.
+ */
+int oil_threads_opt(VALUE opts)
+{
+	VALUE threads;
+	int n;
+
+	if (NIL_P(opts)) {
+		return 1;
+	}
+	Check_Type(opts, T_HASH);
+	threads = rb_hash_aref(opts, sym_threads);
+	if (NIL_P(threads)) {
+		return 1;
+	}
+	n = NUM2INT(threads);
+	if (n < 1) {
+		rb_raise(rb_eArgError, "threads must be at least 1.");
+	}
+	return n;
+}
+
+/**
+ * Read the JPEG encoder options, shared by JPEGReader and the native entry
+ * points.
+ */
+void oil_encode_opts(VALUE opts, struct oil_libjpeg_encode *enc)
+{
+	VALUE subsampling, restart_rows;
+	const char *s;
+
+	memset(enc, 0, sizeof(*enc));
+	if (NIL_P(opts)) {
+		return;
+	}
+	Check_Type(opts, T_HASH);
+
+	enc->progressive = RTEST(rb_hash_aref(opts, sym_progressive));
+	enc->optimize = RTEST(rb_hash_aref(opts, sym_optimize));
+	enc->arithmetic = RTEST(rb_hash_aref(opts, sym_arithmetic));
+	enc->trellis = RTEST(rb_hash_aref(opts, sym_trellis));
+
+	restart_rows = rb_hash_aref(opts, sym_restart_rows);
+	if (!NIL_P(restart_rows)) {
+		enc->restart_rows = NUM2INT(restart_rows);
+		if (enc->restart_rows < 0 || enc->restart_rows > 65535) {
+			rb_raise(rb_eArgError,
+				"restart_rows must be between 0 and 65535.");
+		}
+	}
+
+	subsampling = rb_hash_aref(opts, sym_subsampling);
+	if (!NIL_P(subsampling)) {
+		s = StringValueCStr(subsampling);
+		if (!strcmp(s, "4:4:4")) {
+			enc->subsampling = OIL_SUBSAMPLE_444;
+		} else if (!strcmp(s, "4:2:2")) {
+			enc->subsampling = OIL_SUBSAMPLE_422;
+		} else if (!strcmp(s, "4:2:0")) {
+			enc->subsampling = OIL_SUBSAMPLE_420;
+		} else {
+			rb_raise(rb_eArgError, "Unknown subsampling.");
+		}
+	}
+
+	switch (oil_libjpeg_encode_check(enc)) {
+	case -1:
+		rb_raise(rb_eArgError, "libjpeg was built without arithmetic coding.");
+	case -2:
+		rb_raise(rb_eArgError, "Trellis quantization needs mozjpeg.");
+	}
+}
+
+static int png_filter_from_sym(VALUE sym)
+{
+	if (sym == sym_none) {
+		return PNG_FILTER_NONE;
+	} else if (sym == sym_sub) {
+		return PNG_FILTER_SUB;
+	} else if (sym == sym_up) {
+		return PNG_FILTER_UP;
+	} else if (sym == sym_average) {
+		return PNG_FILTER_AVG;
+	} else if (sym == sym_paeth) {
+		return PNG_FILTER_PAETH;
+	} else if (sym == sym_all) {
+		return PNG_ALL_FILTERS;
+	}
+	rb_raise(rb_eArgError, "Unknown filter.");
+}
+
+static int png_strategy_from_sym(VALUE sym)
+{
+	if (sym == sym_default) {
+		return Z_DEFAULT_STRATEGY;
+	} else if (sym == sym_filtered) {
+		return Z_FILTERED;
+	} else if (sym == sym_huffman_only) {
+		return Z_HUFFMAN_ONLY;
+	} else if (sym == sym_rle) {
+		return Z_RLE;
+	} else if (sym == sym_fixed) {
+		return Z_FIXED;
+	}
+	rb_raise(rb_eArgError, "Unknown strategy.");
+}
+
+/**
+ * Read the PNG encoder options, shared by PNGReader and the native entry
+ * points. speed: :fast picks oil_libpng_encode_fast(), and the other options
+ * override it.
+ */
+void oil_png_encode_opts(VALUE opts, struct oil_libpng_encode *enc)
+{
+	VALUE level, filter, strategy, deflate, depth, colors;
+	long i;
+
+	oil_libpng_encode_defaults(enc);
+	if (oil_speed_opt(opts) == OIL_SPEED_FAST) {
+		oil_libpng_encode_fast(enc);
+	}
+	if (NIL_P(opts)) {
+		return;
+	}
+
+	filter = rb_hash_aref(opts, sym_filter);
+	if (RB_TYPE_P(filter, T_ARRAY)) {
+		enc->filters = 0;
+		for (i=0; i<RARRAY_LEN(filter); i++) {
+			enc->filters |= png_filter_from_sym(rb_ary_entry(filter, i));
+		}
+		if (!enc->filters) {
+			rb_raise(rb_eArgError, "filter must not be empty.");
+		}
+	} else if (!NIL_P(filter)) {
+		enc->filters = png_filter_from_sym(filter);
+	}
+
+	strategy = rb_hash_aref(opts, sym_strategy);
+	if (!NIL_P(strategy)) {
+		enc->strategy = png_strategy_from_sym(strategy);
+	}
+
+	enc->threads = oil_threads_opt(opts);
+
+	deflate = rb_hash_aref(opts, sym_deflate);
+	if (deflate == sym_libdeflate) {
+#ifdef HAVE_LIBDEFLATE
+		enc->libdeflate = 1;
+#else
+		rb_raise(rb_eArgError, "Oil was built without libdeflate.");
+#endif
+	} else if (!NIL_P(deflate) && deflate != sym_zlib) {
+		rb_raise(rb_eArgError, "Unknown deflate.");
+	}
+	if (enc->libdeflate && enc->threads > 1) {
+		rb_raise(rb_eArgError, "libdeflate can't be used with threads.");
+	}
+
+	/* libdeflate has levels up to 12, above zlib's 9. */
+	level = rb_hash_aref(opts, sym_compression_level);
+	if (!NIL_P(level)) {
+		enc->level = NUM2INT(level);
+		if (enc->libdeflate && (enc->level < 0 || enc->level > 12)) {
+			rb_raise(rb_eArgError,
+				"compression_level must be between 0 and 12.");
+		} else if (!enc->libdeflate && (enc->level < 0 || enc->level > 9)) {
+			rb_raise(rb_eArgError,
+				"compression_level must be between 0 and 9.");
+		}
+	}
+
+	depth = rb_hash_aref(opts, sym_bit_depth);
+	if (!NIL_P(depth)) {
+		enc->depth = NUM2INT(depth);
+		if (enc->depth != 8 && enc->depth != 16) {
+			rb_raise(rb_eArgError, "bit_depth must be 8 or 16.");
+		}
+	}
+
+	enc->reduce = RTEST(rb_hash_aref(opts, sym_reduce));
+	colors = rb_hash_aref(opts, sym_colors);
+	if (!NIL_P(colors)) {
+		enc->colors = NUM2INT(colors);
+		if (enc->colors < 2 || enc->colors > 256) {
+			rb_raise(rb_eArgError, "colors must be between 2 and 256.");
+		}
+		enc->reduce = 1;
+	}
+	enc->dither = RTEST(rb_hash_aref(opts, sym_dither));
+	if (enc->reduce && enc->depth != 8) {
+		rb_raise(rb_eArgError, "reduce and colors need a bit_depth of 8.");
+	}
+}
+
+/**
+ * Read the :format option, shared by the readers. Readers write their own
+ * format when it is not given.
+ */
+enum oil_format oil_format_opt(VALUE opts, enum oil_format own)
+{
+	VALUE format;
+
+	if (NIL_P(opts)) {
+		return own;
+	}
+	Check_Type(opts, T_HASH);
+	format = rb_hash_aref(opts, sym_format);
+	if (NIL_P(format)) {
+		return own;
+	} else if (format == sym_jpeg) {
+		return OIL_FMT_JPEG;
+	} else if (format == sym_png) {
+		return OIL_FMT_PNG;
+	} else if (format == sym_webp) {
+#ifdef HAVE_LIBWEBP
+		return OIL_FMT_WEBP;
+#else
+		rb_raise(rb_eArgError, "Oil was built without libwebp.");
+#endif
+	}
+	rb_raise(rb_eArgError, "Unknown format.");
+}
+
+/**
+ * Read the :background option, the color that alpha is flattened against when
+ * the output has no alpha channel. It is given as [red, green, blue] and is
+ * white by default.
+ */
+void oil_background_opt(VALUE opts, unsigned char *bg)
+{
+	VALUE background;
+	int i, v;
+
+	bg[0] = bg[1] = bg[2] = 255;
+	if (NIL_P(opts)) {
+		return;
+	}
+	Check_Type(opts, T_HASH);
+	background = rb_hash_aref(opts, sym_background);
+	if (NIL_P(background)) {
+		return;
+	}
+	Check_Type(background, T_ARRAY);
+	if (RARRAY_LEN(background) != 3) {
+		rb_raise(rb_eArgError, "background must be [red, green, blue].");
+	}
+	for (i=0; i<3; i++) {
+		v = NUM2INT(rb_ary_entry(background, i));
+		if (v < 0 || v > 255) {
+			rb_raise(rb_eArgError,
+				"background samples must be between 0 and 255.");
+		}
+		bg[i] = v;
+	}
+}
+
+#ifdef HAVE_LIBWEBP
+/**
+ * Read the WebP encoder options, shared by the readers. speed: :fast and
+ * :quality pick the fastest and the smallest method, and :method overrides
+ * them.
+ */
+void oil_webp_encode_opts(VALUE opts, struct oil_libwebp_encode *enc)
+{
+	VALUE quality, method;
+	int speed;
+
+	oil_libwebp_encode_defaults(enc);
+	speed = oil_speed_opt(opts);
+	if (speed == OIL_SPEED_FAST) {
+		oil_libwebp_encode_fast(enc);
+	} else if (speed == OIL_SPEED_QUALITY) {
+		oil_libwebp_encode_best(enc);
+	}
+	if (NIL_P(opts)) {
+		return;
+	}
+
+	quality = rb_hash_aref(opts, sym_quality);
+	if (!NIL_P(quality)) {
+		enc->quality = NUM2DBL(quality);
+		if (enc->quality < 0 || enc->quality > 100) {
+			rb_raise(rb_eArgError, "quality must be between 0 and 100.");
+		}
+	}
+
+	method = rb_hash_aref(opts, sym_method);
+	if (!NIL_P(method)) {
+		enc->method = NUM2INT(method);
+		if (enc->method < 0 || enc->method > 6) {
+			rb_raise(rb_eArgError, "method must be between 0 and 6.");
+		}
+	}
+
+	enc->lossless = RTEST(rb_hash_aref(opts, sym_lossless));
+	enc->threads = oil_threads_opt(opts);
+}
+#endif
+
+/**
+ * Read options shared by the native entry points.
+ */
+void oil_resize_opts_from_hash(VALUE opts, struct oil_resize_opts *ropts)
+{
+	VALUE quality, prescale, ycbcr;
+
+	ropts->quality = 95;
+	ropts->prescale = 2;
+	ropts->ycbcr = OIL_YCBCR_RGB;
+	ropts->speed = oil_speed_opt(opts);
+	ropts->threads = oil_threads_opt(opts);
+	oil_encode_opts(opts, &ropts->encode);
+	oil_png_encode_opts(opts, &ropts->png);
+
+	if (NIL_P(opts)) {
+		return;
+	}
+	Check_Type(opts, T_HASH);
+
+	quality = rb_hash_aref(opts, sym_quality);
+	if (!NIL_P(quality)) {
+		ropts->quality = NUM2INT(quality);
+	}
+
+	prescale = rb_hash_aref(opts, sym_prescale);
+	if (prescale == Qfalse) {
+		ropts->prescale = 0;
+	} else if (!NIL_P(prescale)) {
+		ropts->prescale = NUM2DBL(prescale);
+	}
+
+	ycbcr = rb_hash_aref(opts, sym_ycbcr);
+	if (ycbcr == sym_planar) {
+		ropts->ycbcr = OIL_YCBCR_PLANAR;
+	} else if (ycbcr == sym_linear) {
+		ropts->ycbcr = OIL_YCBCR_LINEAR;
+	} else if (!NIL_P(ycbcr)) {
+		rb_raise(rb_eArgError, "Unknown ycbcr mode.");
+	}
+}
+
+/*
+ *  call-seq:
+ *     Oil.resize_file(in_path, out_path, box_width, box_height [, opts]) -> nil
+ *
+ *  Resize the JPEG or PNG image at +in_path+ to fit in the given box and
+ *  write it to +out_path+ in the same format.
+ *
+ *  The whole resize happens in C, without the GVL, so other threads keep
+ *  running. The input file is memory-mapped and the output is written with
+ *  stdio. JPEG COM, APP1 and APP2 markers are preserved, as with Oil.new.
+ *
+ *  Options is a hash which may have the following symbols:
+ *
+ *  :quality - JPEG quality setting, between 1 and 100. Defaults to 95.
+ *  :prescale - Let libjpeg decode JPEGs at a reduced size that is at least this
+ *    many times the output size. Defaults to 2. Pass false to disable it. See
+ *    JPEGReader#prescale.
+ *  :ycbcr - Pass :planar or :linear to read and write YCbCr JPEGs as raw
+ *    planes. See JPEGReader#each.
+ *  :speed - JPEG speed profile, :fast, :balanced or :quality. See
+ *    JPEGReader#each.
+ *  :progressive, :optimize, :subsampling, :arithmetic, :trellis,
+ *    :restart_rows - JPEG encoder settings. See JPEGReader#each.
+ *  :threads - Number of threads to decode JPEGs with restart markers, to
+ *    encode baseline JPEGs and to deflate PNGs with. See JPEGReader#each and
+ *    PNGReader#each.
+ *  :compression_level, :filter, :strategy, :deflate - PNG encoder settings.
+ *    See PNGReader#each. speed: :fast also applies to PNGs.
+ */
+
+static VALUE rb_resize_file(int argc, VALUE *argv, VALUE self)
+{
+	struct resize_file_args args;
+	VALUE in_path, out_path, box_width, box_height, opts;
+
+	rb_scan_args(argc, argv, "41", &in_path, &out_path, &box_width,
+		&box_height, &opts);
+
+	FilePathValue(in_path);
+	FilePathValue(out_path);
+	args.in_path = StringValueCStr(in_path);
+	args.out_path = StringValueCStr(out_path);
+	args.box_width = NUM2INT(box_width);
+	args.box_height = NUM2INT(box_height);
+	oil_resize_opts_from_hash(opts, &args.opts);
+
+	rb_thread_call_without_gvl(resize_file_nogvl, &args, NULL, NULL);
+
+	RB_GC_GUARD(in_path);
+	RB_GC_GUARD(out_path);
+
+	if (args.ret) {
+		rb_raise(rb_eRuntimeError, "%s", args.err);
+	}
+	return Qnil;
+}
+
+/* Memory sources shared by the readers. */
+
+/**
+ * If src is a String or an IO::Buffer, point mem at its bytes and return the
+ * object that must be kept alive while they are read. Returns nil for any
+ * other object.
+ *
+ * Strings are referenced through a frozen shared string, so the caller may
+ * keep modifying the original. IO::Buffers can be freed or resized at any time,
+ * and a lock on one could not be released safely from the GC, so their bytes
+ * are copied into a frozen string.
+ */
+VALUE oil_mem_from_value(VALUE src, struct oil_mem *mem)
+{
+#ifdef HAVE_RUBY_IO_BUFFER_H
+	const void *base;
+	size_t size;
+#endif
+
+	if (RB_TYPE_P(src, T_STRING)) {
+		src = rb_str_new_frozen(src);
+		oil_mem_init(mem, (unsigned char *)RSTRING_PTR(src),
+			RSTRING_LEN(src));
+		return src;
+	}
+
+#ifdef HAVE_RUBY_IO_BUFFER_H
+	if (rb_obj_is_kind_of(src, rb_cIOBuffer)) {
+		rb_io_buffer_get_bytes_for_reading(src, &base, &size);
+		src = rb_obj_freeze(rb_str_new(base, size));
+		oil_mem_init(mem, (unsigned char *)RSTRING_PTR(src),
+			RSTRING_LEN(src));
+		return src;
+	}
+#endif
+
+	return Qnil;
+}
+
+/**
+ * Map a file into mem. file is either a path or an open File, in which case
+ * the image is read from the File's current position.
+ */
+void oil_mem_map_value(VALUE file, struct oil_mem *mem)
+{
+	int fd;
+	long offset;
+	VALUE io;
+
+	io = rb_io_check_io(file);
+	if (!NIL_P(io)) {
+		fd = NUM2INT(rb_funcall(io, id_fileno, 0));
+		offset = NUM2LONG(rb_funcall(io, id_pos, 0));
+		if (oil_mem_map(mem, fd, offset)) {
+			rb_sys_fail("mmap");
+		}
+		return;
+	}
+
+	FilePathValue(file);
+	if (oil_mem_map_path(mem, StringValueCStr(file))) {
+		rb_sys_fail_str(file);
+	}
+}
+
+/* Time-sliced jobs. */
+
+static double monotonic_now()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Parse the argument to Job#step. An Integer limits the number of output rows,
+ * a Float is a time budget in seconds and nil means no limit. Sets deadline to
+ * 0 when there is no time budget.
+ */
+void oil_step_limit(VALUE limit, long *max_rows, double *deadline)
+{
+	*max_rows = LONG_MAX;
+	*deadline = 0;
+
+	if (NIL_P(limit)) {
+		return;
+	}
+	if (RB_FLOAT_TYPE_P(limit)) {
+		*deadline = monotonic_now() + NUM2DBL(limit);
+		return;
+	}
+	*max_rows = NUM2LONG(limit);
+	if (*max_rows < 0) {
+		rb_raise(rb_eArgError, "Row count must not be negative.");
+	}
+}
+
+/**
+ * Returns 1 if the time budget given to oil_step_limit() has run out.
+ */
+int oil_step_expired(double deadline)
+{
+	return deadline && monotonic_now() >= deadline;
+}
+
 void Init_jpeg();
 void Init_png();
+void Init_pool();
 
 void Init_oil()
 {
 	VALUE mOil;
 	mOil = rb_const_get(rb_cObject, rb_intern("Oil"));
 	rb_define_singleton_method(mOil, "fix_ratio", rb_fix_ratio, 4);
+	rb_define_singleton_method(mOil, "resize_file", rb_resize_file, -1);
+	id_fileno = rb_intern("fileno");
+	id_pos = rb_intern("pos");
+	sym_quality = ID2SYM(rb_intern("quality"));
+	sym_prescale = ID2SYM(rb_intern("prescale"));
+	sym_ycbcr = ID2SYM(rb_intern("ycbcr"));
+	sym_planar = ID2SYM(rb_intern("planar"));
+	sym_linear = ID2SYM(rb_intern("linear"));
+	sym_speed = ID2SYM(rb_intern("speed"));
+	sym_fast = ID2SYM(rb_intern("fast"));
+	sym_balanced = ID2SYM(rb_intern("balanced"));
+	sym_progressive = ID2SYM(rb_intern("progressive"));
+	sym_optimize = ID2SYM(rb_intern("optimize"));
+	sym_subsampling = ID2SYM(rb_intern("subsampling"));
+	sym_arithmetic = ID2SYM(rb_intern("arithmetic"));
+	sym_trellis = ID2SYM(rb_intern("trellis"));
+	sym_compression_level = ID2SYM(rb_intern("compression_level"));
+	sym_filter = ID2SYM(rb_intern("filter"));
+	sym_strategy = ID2SYM(rb_intern("strategy"));
+	sym_threads = ID2SYM(rb_intern("threads"));
+	sym_restart_rows = ID2SYM(rb_intern("restart_rows"));
+	sym_bit_depth = ID2SYM(rb_intern("bit_depth"));
+	sym_reduce = ID2SYM(rb_intern("reduce"));
+	sym_colors = ID2SYM(rb_intern("colors"));
+	sym_dither = ID2SYM(rb_intern("dither"));
+	sym_format = ID2SYM(rb_intern("format"));
+	sym_jpeg = ID2SYM(rb_intern("jpeg"));
+	sym_png = ID2SYM(rb_intern("png"));
+	sym_webp = ID2SYM(rb_intern("webp"));
+	sym_method = ID2SYM(rb_intern("method"));
+	sym_lossless = ID2SYM(rb_intern("lossless"));
+	sym_background = ID2SYM(rb_intern("background"));
+	sym_deflate = ID2SYM(rb_intern("deflate"));
+	sym_zlib = ID2SYM(rb_intern("zlib"));
+	sym_libdeflate = ID2SYM(rb_intern("libdeflate"));
+	sym_none = ID2SYM(rb_intern("none"));
+	sym_sub = ID2SYM(rb_intern("sub"));
+	sym_up = ID2SYM(rb_intern("up"));
+	sym_average = ID2SYM(rb_intern("average"));
+	sym_paeth = ID2SYM(rb_intern("paeth"));
+	sym_all = ID2SYM(rb_intern("all"));
+	sym_default = ID2SYM(rb_intern("default"));
+	sym_filtered = ID2SYM(rb_intern("filtered"));
+	sym_huffman_only = ID2SYM(rb_intern("huffman_only"));
+	sym_rle = ID2SYM(rb_intern("rle"));
+	sym_fixed = ID2SYM(rb_intern("fixed"));
+	/* Build the color tables now, pool workers and resize_file scale
+	 * without the GVL.
+	 */
+	oil_global_init();
 	Init_jpeg();
 	Init_png();
+	Init_pool();
 }
@@ -20,7 +20,21 @@
  */
 
 #include "oil_libjpeg.h"
+#include <jerror.h>
+#include <setjmp.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+
+#if JPEG_LIB_VERSION >= 70
+#define DCT_SCALED_SIZE(comp) ((comp)->DCT_h_scaled_size)
+#define DCT_V_SCALED_SIZE(comp) ((comp)->DCT_v_scaled_size)
+#define MIN_DCT_V_SCALED_SIZE(dinfo) ((dinfo)->min_DCT_v_scaled_size)
+#else
+#define DCT_SCALED_SIZE(comp) ((comp)->DCT_scaled_size)
+#define DCT_V_SCALED_SIZE(comp) ((comp)->DCT_scaled_size)
+#define MIN_DCT_V_SCALED_SIZE(dinfo) ((dinfo)->min_DCT_scaled_size)
+#endif
 
 int oil_libjpeg_init(struct oil_libjpeg *ol,
 	struct jpeg_decompress_struct *dinfo, int out_width, int out_height)
@@ -29,6 +43,8 @@ int oil_libjpeg_init(struct oil_libjpeg *ol,
 	enum oil_colorspace cs;
 
 	ol->dinfo = dinfo;
+	ol->par = NULL;
+	ol->warning[0] = 0;
 
 	cs = jpeg_cs_to_oil(dinfo->out_color_space);
 	if (cs == OIL_CS_UNKNOWN) {
@@ -50,23 +66,1253 @@ int oil_libjpeg_init(struct oil_libjpeg *ol,
 	return 0;
 }
 
+static void parallel_free(struct oil_libjpeg_parallel *pd, char *warning);
+
 void oil_libjpeg_free(struct oil_libjpeg *ol)
 {
+	if (ol->par) {
+		parallel_free(ol->par, ol->warning);
+		ol->par = NULL;
+	}
 	if (ol->inbuf) {
 		free(ol->inbuf);
 	}
 	oil_scale_free(&ol->os);
 }
 
-void oil_libjpeg_read_scanline(struct oil_libjpeg *ol, unsigned char *outbuf)
+void oil_libjpeg_prescale(struct jpeg_decompress_struct *dinfo, int out_width,
+	int out_height, double min_ratio)
+{
+	int num;
+
+	if (min_ratio < 1) {
+		min_ratio = 1;
+	}
+
+	/* libjpeg 6b rounds unsupported factors up to the next of 1/8, 1/4 and
+	 * 1/2, so check the resulting dimensions rather than assuming them.
+	 *
+	 * At 1/8 the IDCT reduces each block to its DC coefficient, so small
+	 * thumbnails get a DC-only decode. A custom DC path through
+	 * jpeg_read_coefficients() would be no faster: it has to Huffman decode
+	 * every block all the same, and buffers the coefficients of the whole
+	 * image on top of that.
+	 */
+	for (num=1; num<8; num++) {
+		dinfo->scale_num = num;
+		dinfo->scale_denom = 8;
+		jpeg_calc_output_dimensions(dinfo);
+		if (dinfo->output_width >= min_ratio * out_width &&
+			dinfo->output_height >= min_ratio * out_height) {
+			return;
+		}
+	}
+
+	dinfo->scale_num = 1;
+	dinfo->scale_denom = 1;
+	jpeg_calc_output_dimensions(dinfo);
+}
+
+/* libjpeg-turbo documents JDCT_FLOAT as no more accurate than JDCT_ISLOW and
+ * slower on most machines, so the quality profile keeps the integer DCT.
+ */
+void oil_libjpeg_decompress_speed(struct jpeg_decompress_struct *dinfo,
+	enum oil_libjpeg_speed speed)
+{
+	int fast;
+
+	fast = speed == OIL_SPEED_FAST;
+	dinfo->dct_method = fast ? JDCT_IFAST : JDCT_ISLOW;
+	dinfo->do_fancy_upsampling = !fast;
+	dinfo->do_block_smoothing = !fast;
+}
+
+void oil_libjpeg_compress_speed(struct jpeg_compress_struct *cinfo,
+	enum oil_libjpeg_speed speed)
+{
+	cinfo->dct_method = speed == OIL_SPEED_FAST ? JDCT_IFAST : JDCT_ISLOW;
+	cinfo->optimize_coding = speed == OIL_SPEED_QUALITY;
+}
+
+int oil_libjpeg_encode_check(struct oil_libjpeg_encode *enc)
+{
+#ifndef C_ARITH_CODING_SUPPORTED
+	if (enc->arithmetic) {
+		return -1;
+	}
+#endif
+#ifndef HAVE_JPEG_C_SET_BOOL_PARAM
+	if (enc->trellis) {
+		return -2;
+	}
+#endif
+	return 0;
+}
+
+void oil_libjpeg_compress_encode(struct jpeg_compress_struct *cinfo,
+	struct oil_libjpeg_encode *enc)
+{
+	jpeg_component_info *comp;
+
+	if (enc->subsampling && cinfo->jpeg_color_space == JCS_YCbCr) {
+		comp = cinfo->comp_info;
+		comp[0].h_samp_factor = enc->subsampling == OIL_SUBSAMPLE_444 ? 1 : 2;
+		comp[0].v_samp_factor = enc->subsampling == OIL_SUBSAMPLE_420 ? 2 : 1;
+		comp[1].h_samp_factor = comp[1].v_samp_factor = 1;
+		comp[2].h_samp_factor = comp[2].v_samp_factor = 1;
+	}
+	if (enc->optimize) {
+		cinfo->optimize_coding = TRUE;
+	}
+	if (enc->restart_rows) {
+		cinfo->restart_in_rows = enc->restart_rows;
+	}
+#ifdef C_ARITH_CODING_SUPPORTED
+	if (enc->arithmetic) {
+		cinfo->arith_code = TRUE;
+	}
+#endif
+#ifdef HAVE_JPEG_C_SET_BOOL_PARAM
+	if (enc->trellis) {
+		jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT, TRUE);
+		jpeg_c_set_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT_DC, TRUE);
+	}
+#endif
+	/* Progression depends on the number of components and must come last. */
+	if (enc->progressive) {
+		jpeg_simple_progression(cinfo);
+	}
+}
+
+/* Zigzag position of each coefficient, in natural order. */
+static const int zigzag[DCTSIZE2] = {
+	0,  1,  5,  6, 14, 15, 27, 28,
+	2,  4,  7, 13, 16, 26, 29, 42,
+	3,  8, 12, 17, 25, 30, 41, 43,
+	9, 11, 18, 24, 31, 40, 44, 53,
+	10, 19, 23, 32, 39, 45, 52, 54,
+	20, 22, 33, 38, 46, 51, 55, 60,
+	21, 34, 37, 47, 50, 56, 59, 61,
+	35, 36, 48, 49, 57, 58, 62, 63,
+};
+
+/* Returns 1 if the reduced-size IDCT producing size x size blocks reads
+ * coefficients from this row or column of the 8x8 block. The reduced IDCTs
+ * skip some high frequencies, but not all of them.
+ */
+static int idct_uses(int size, int i)
+{
+	switch (size) {
+	case 1:
+		return i == 0;
+	case 2:
+		return i == 0 || i == 1 || i == 3 || i == 5 || i == 7;
+	case 4:
+		return i != 4;
+	default:
+		return 1;
+	}
+}
+
+/* Returns 1 once the scans read so far have fully refined every coefficient
+ * that the IDCT will use at the current output scale.
+ */
+static int scans_sufficient(struct jpeg_decompress_struct *dinfo)
+{
+	jpeg_component_info *comp;
+	int c, row, col, size;
+
+	for (c=0; c<dinfo->num_components; c++) {
+		comp = dinfo->comp_info + c;
+		size = DCT_SCALED_SIZE(comp);
+		for (row=0; row<DCTSIZE; row++) {
+			for (col=0; col<DCTSIZE; col++) {
+				if (!idct_uses(size, row) || !idct_uses(size, col)) {
+					continue;
+				}
+				if (dinfo->coef_bits[c][zigzag[row * DCTSIZE + col]]) {
+					return 0;
+				}
+			}
+		}
+	}
+	return 1;
+}
+
+int oil_libjpeg_start_decompress(struct jpeg_decompress_struct *dinfo)
+{
+	int ret;
+
+	if (!jpeg_has_multiple_scans(dinfo)) {
+		return jpeg_start_decompress(dinfo);
+	}
+
+	/* Buffered-image mode costs nothing extra here, since libjpeg buffers
+	 * the coefficients of multi-scan images either way. It is already set
+	 * if we are called again after the source suspended.
+	 */
+	if (!dinfo->buffered_image) {
+		dinfo->buffered_image = TRUE;
+		jpeg_start_decompress(dinfo);
+	}
+	do {
+		ret = jpeg_consume_input(dinfo);
+	} while (ret != JPEG_REACHED_EOI && ret != JPEG_SUSPENDED &&
+		!(ret == JPEG_SCAN_COMPLETED && scans_sufficient(dinfo)));
+	if (ret == JPEG_SUSPENDED) {
+		return 0;
+	}
+
+	/* Block smoothing only guesses at coefficients that are not fully
+	 * refined, which the IDCT won't read if we stopped early.
+	 */
+	if (ret != JPEG_REACHED_EOI) {
+		dinfo->do_block_smoothing = FALSE;
+	}
+	jpeg_start_output(dinfo, dinfo->input_scan_number);
+	return 1;
+}
+
+size_t oil_libjpeg_decoder_mem_size(struct jpeg_decompress_struct *dinfo)
+{
+	jpeg_component_info *comp;
+	size_t size, blocks;
+	int i;
+
+	/* One iMCU row of samples per component, plus the coefficients of the
+	 * whole image when they have to be buffered between scans.
+	 */
+	size = 0;
+	for (i=0; i<dinfo->num_components; i++) {
+		comp = dinfo->comp_info + i;
+		size += (size_t)comp->width_in_blocks * DCTSIZE *
+			comp->v_samp_factor * DCTSIZE;
+		if (jpeg_has_multiple_scans(dinfo)) {
+			blocks = (size_t)comp->width_in_blocks *
+				comp->height_in_blocks;
+			size += blocks * sizeof(JBLOCK);
+		}
+	}
+	return size;
+}
+
+static size_t parallel_mem_size(struct oil_libjpeg_parallel *pd);
+static unsigned char *parallel_read_row(struct oil_libjpeg_parallel *pd);
+
+size_t oil_libjpeg_mem_size(struct oil_libjpeg *ol)
+{
+	struct jpeg_decompress_struct *dinfo;
+	size_t size;
+
+	dinfo = ol->dinfo;
+	size = oil_scale_mem_size(&ol->os);
+	size += (size_t)dinfo->output_width * dinfo->output_components;
+	if (ol->par) {
+		size += parallel_mem_size(ol->par);
+	}
+	return size + oil_libjpeg_decoder_mem_size(dinfo);
+}
+
+int oil_libjpeg_read_scanline(struct oil_libjpeg *ol, unsigned char *outbuf)
 {
 	int i;
 
 	for (i=oil_scale_slots(&ol->os); i>0; i--) {
-		jpeg_read_scanlines(ol->dinfo, &ol->inbuf, 1);
+		if (ol->par) {
+			oil_scale_in(&ol->os, parallel_read_row(ol->par));
+			continue;
+		}
+		if (!jpeg_read_scanlines(ol->dinfo, &ol->inbuf, 1)) {
+			return 0;
+		}
 		oil_scale_in(&ol->os, ol->inbuf);
 	}
 	oil_scale_out(&ol->os, outbuf);
+	return 1;
+}
+
+/* Parallel decoding */
+
+/* Target size of the decoded rows of a band. */
+#define BAND_BYTES (4*1024*1024)
+
+struct oil_libjpeg_worker {
+	struct jpeg_error_mgr jerr; // must come first, see worker_error_exit().
+	jmp_buf jmp;
+	struct jpeg_decompress_struct dinfo; // used by decoding workers.
+	struct oil_libjpeg_parallel *pd;
+	struct jpeg_compress_struct cinfo; // used by encoding workers.
+	struct jpeg_destination_mgr dest; // writes into the band's data.
+	struct oil_libjpeg_band *band; // band being encoded.
+	struct oil_libjpeg_writer *jw;
+	pthread_t thread;
+	char warning[JMSG_LENGTH_MAX]; // last message from libjpeg, or empty.
+};
+
+static void worker_error_exit(j_common_ptr cinfo)
+{
+	struct oil_libjpeg_worker *w;
+
+	w = (struct oil_libjpeg_worker *)cinfo->err;
+	longjmp(w->jmp, 1);
+}
+
+/* Keep the message, the thread that owns the image reports it once the worker
+ * has been joined.
+ */
+static void worker_output_message(j_common_ptr cinfo)
+{
+	struct oil_libjpeg_worker *w;
+
+	w = (struct oil_libjpeg_worker *)cinfo->err;
+	(*cinfo->err->format_message)(cinfo, w->warning);
+}
+
+/* Copy the last warning of joined workers into warning, if they had one. */
+static void workers_warning(struct oil_libjpeg_worker *workers, int num,
+	char *warning)
+{
+	int i;
+
+	for (i=0; i<num; i++) {
+		if (workers[i].warning[0]) {
+			memcpy(warning, workers[i].warning, JMSG_LENGTH_MAX);
+		}
+	}
+}
+
+static int gcd(int a, int b)
+{
+	int t;
+
+	while (b) {
+		t = a % b;
+		a = b;
+		b = t;
+	}
+	return a;
+}
+
+/* Walk the markers up to the end of the SOS marker, and find the offset of the
+ * image height in the SOF marker. Returns 0 if the image is a Huffman-coded
+ * sequential JPEG, -1 otherwise.
+ */
+static int parse_header(const unsigned char *data, size_t len,
+	size_t *sof_height, size_t *header_len)
+{
+	size_t pos, seg;
+	int marker;
+
+	*sof_height = 0;
+	if (len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+		return -1;
+	}
+	pos = 2;
+	for (;;) {
+		if (pos >= len || data[pos] != 0xFF) {
+			return -1;
+		}
+		while (pos < len && data[pos] == 0xFF) {
+			pos++;
+		}
+		if (pos + 2 >= len) {
+			return -1;
+		}
+		marker = data[pos++];
+		seg = data[pos] << 8 | data[pos + 1];
+		if (seg < 2 || pos + seg > len) {
+			return -1;
+		}
+		if (marker == 0xC0 || marker == 0xC1) {
+			if (seg < 5) {
+				return -1;
+			}
+			*sof_height = pos + 3;
+		} else if ((marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 &&
+			marker != 0xC8 && marker != 0xCC) ||
+			(marker >= 0xD0 && marker <= 0xD9)) {
+			return -1;
+		} else if (marker == 0xDA) {
+			*header_len = pos + seg;
+			return *sof_height ? 0 : -1;
+		}
+		pos += seg;
+	}
+}
+
+/* Find where each restart interval of the scan starts and ends. Returns -1 if
+ * the markers are not all there and in sequence, which is left to libjpeg to
+ * sort out.
+ */
+static int find_intervals(struct oil_libjpeg_parallel *pd, size_t len)
+{
+	const unsigned char *data, *p;
+	size_t pos;
+	int n, marker;
+
+	data = pd->data;
+	n = 0;
+	pd->starts[0] = pd->header_len;
+	pos = pd->header_len;
+	for (;;) {
+		p = memchr(data + pos, 0xFF, len - pos);
+		if (!p || p + 1 >= data + len) {
+			return -1;
+		}
+		pos = p - data;
+		marker = data[pos + 1];
+		if (marker == 0x00 || marker == 0xFF) {
+			pos += marker ? 1 : 2;
+			continue;
+		}
+		pd->ends[n++] = pos;
+		if (marker < 0xD0 || marker > 0xD7) {
+			break;
+		}
+		if (n == pd->num_intervals || (marker & 7) != ((n - 1) & 7)) {
+			return -1;
+		}
+		pos += 2;
+		pd->starts[n] = pos;
+	}
+	return n == pd->num_intervals ? 0 : -1;
+}
+
+/* Work out the MCU geometry and the band size. Returns -1 if the image can't
+ * be split at MCU rows.
+ */
+static int plan_bands(struct oil_libjpeg_parallel *pd, int threads)
+{
+	struct jpeg_decompress_struct *dinfo;
+	jpeg_component_info *comp;
+	int i, ri, step, max_h, max_v, ctx, band, max_band;
+
+	dinfo = pd->dinfo;
+	ri = dinfo->restart_interval;
+	if (!ri || jpeg_has_multiple_scans(dinfo) || dinfo->arith_code ||
+		dinfo->progressive_mode ||
+		dinfo->comps_in_scan != dinfo->num_components) {
+		return -1;
+	}
+
+	max_h = dinfo->max_h_samp_factor;
+	max_v = dinfo->max_v_samp_factor;
+	if (dinfo->num_components == 1 && (max_h != 1 || max_v != 1)) {
+		/* A single component scan has MCUs of one block. */
+		return -1;
+	}
+	pd->mcu_height = max_v * DCTSIZE;
+	pd->mcus_per_row = (dinfo->image_width + max_h * DCTSIZE - 1) /
+		(max_h * DCTSIZE);
+	pd->mcu_rows = (dinfo->image_height + pd->mcu_height - 1) /
+		pd->mcu_height;
+
+	/* Each MCU row gives the same number of output rows, and the last one
+	 * as many as are left.
+	 */
+	pd->out_rows = max_v * MIN_DCT_V_SCALED_SIZE(dinfo);
+	if ((long)pd->out_rows * pd->mcu_rows < (long)dinfo->output_height ||
+		(long)pd->out_rows * (pd->mcu_rows - 1) >=
+		(long)dinfo->output_height) {
+		return -1;
+	}
+
+	pd->num_intervals = ((long)pd->mcus_per_row * pd->mcu_rows + ri - 1) /
+		ri;
+	if (pd->num_intervals < 2) {
+		return -1;
+	}
+
+	/* Bands start every step MCU rows at the least. */
+	step = ri / gcd(pd->mcus_per_row, ri);
+	ctx = 0;
+	for (i=0; i<dinfo->num_components; i++) {
+		comp = dinfo->comp_info + i;
+		if (comp->v_samp_factor < max_v) {
+			ctx = dinfo->do_fancy_upsampling;
+		}
+	}
+	pd->overlap = ctx ? step : 0;
+
+	/* Aim for a few bands per thread, with no more than BAND_BYTES of
+	 * decoded rows each, and enough rows to make the overlap worth it.
+	 */
+	band = (pd->mcu_rows + threads * 4 - 1) / (threads * 4);
+	max_band = BAND_BYTES / (pd->stride * pd->out_rows);
+	if (band > max_band) {
+		band = max_band;
+	}
+	if (band < pd->overlap * 4) {
+		band = pd->overlap * 4;
+	}
+	band = (band + step - 1) / step * step;
+	if (band < step) {
+		band = step;
+	}
+	if (band >= pd->mcu_rows) {
+		return -1;
+	}
+	pd->band_mcu_rows = band;
+	pd->num_bands = (pd->mcu_rows + band - 1) / band;
+	return 0;
+}
+
+/* Build the JPEG for a band in b->data and decode it into b->rows. Runs on a
+ * worker thread.
+ */
+static void decode_band(struct oil_libjpeg_worker *w,
+	struct oil_libjpeg_band *b)
+{
+	struct oil_libjpeg_parallel *pd;
+	struct jpeg_decompress_struct *dinfo;
+	unsigned char *src, *dst;
+	size_t size, cap;
+	int i, first, last, start, end, dec_start, dec_end, height, skip;
+	JSAMPROW row;
+
+	pd = w->pd;
+	dinfo = &w->dinfo;
+
+	if (setjmp(w->jmp)) {
+		b->ret = -1;
+		b->err = w->jerr;
+		jpeg_abort_decompress(dinfo);
+		return;
+	}
+
+	start = b->band * pd->band_mcu_rows;
+	end = start + pd->band_mcu_rows;
+	if (end > pd->mcu_rows) {
+		end = pd->mcu_rows;
+	}
+	dec_start = start > pd->overlap ? start - pd->overlap : 0;
+	dec_end = end + pd->overlap < pd->mcu_rows ? end + pd->overlap :
+		pd->mcu_rows;
+	first = (long)dec_start * pd->mcus_per_row / pd->dinfo->restart_interval;
+	last = ((long)dec_end * pd->mcus_per_row + pd->dinfo->restart_interval -
+		1) / pd->dinfo->restart_interval;
+
+	/* Header, restart intervals with a marker between each, and EOI. */
+	size = pd->header_len + pd->ends[last - 1] - pd->starts[first] +
+		(last - first) * 2 + 2;
+	if (size > b->data_cap) {
+		cap = size + size / 4;
+		src = realloc(b->data, cap);
+		if (!src) {
+			ERREXIT1(dinfo, JERR_OUT_OF_MEMORY, 0);
+		}
+		b->data = src;
+		b->data_cap = cap;
+	}
+	dst = b->data;
+	memcpy(dst, pd->data, pd->header_len);
+	height = dec_end == pd->mcu_rows ? (int)pd->dinfo->image_height -
+		dec_start * pd->mcu_height : (dec_end - dec_start) * pd->mcu_height;
+	dst[pd->sof_height] = height >> 8;
+	dst[pd->sof_height + 1] = height;
+	dst += pd->header_len;
+	for (i=first; i<last; i++) {
+		if (i > first) {
+			*dst++ = 0xFF;
+			*dst++ = JPEG_RST0 + ((i - first - 1) & 7);
+		}
+		memcpy(dst, pd->data + pd->starts[i],
+			pd->ends[i] - pd->starts[i]);
+		dst += pd->ends[i] - pd->starts[i];
+	}
+	*dst++ = 0xFF;
+	*dst++ = JPEG_EOI;
+
+	jpeg_mem_src(dinfo, b->data, dst - b->data);
+	jpeg_read_header(dinfo, TRUE);
+	dinfo->out_color_space = pd->dinfo->out_color_space;
+	dinfo->scale_num = pd->dinfo->scale_num;
+	dinfo->scale_denom = pd->dinfo->scale_denom;
+	dinfo->dct_method = pd->dinfo->dct_method;
+	dinfo->do_fancy_upsampling = pd->dinfo->do_fancy_upsampling;
+	dinfo->do_block_smoothing = pd->dinfo->do_block_smoothing;
+	jpeg_start_decompress(dinfo);
+
+	/* Rows of the overlap above the band are read into the first row, which
+	 * the band's own rows then overwrite.
+	 */
+	skip = (start - dec_start) * pd->out_rows;
+	row = b->rows;
+	for (i=0; i<skip; i++) {
+		jpeg_read_scanlines(dinfo, &row, 1);
+	}
+	for (i=0; i<b->num_rows; i++) {
+		row = b->rows + i * pd->stride;
+		jpeg_read_scanlines(dinfo, &row, 1);
+	}
+	jpeg_abort_decompress(dinfo);
+	b->ret = 0;
+}
+
+static void *parallel_worker(void *data)
+{
+	struct oil_libjpeg_worker *w;
+	struct oil_libjpeg_parallel *pd;
+	struct oil_libjpeg_band *b;
+
+	w = (struct oil_libjpeg_worker *)data;
+	pd = w->pd;
+
+	pthread_mutex_lock(&pd->lock);
+	for (;;) {
+		b = pd->slots + pd->next;
+		if (pd->closed) {
+			break;
+		} else if (b->state == OIL_BAND_QUEUED) {
+			b->state = OIL_BAND_RUNNING;
+			pd->next = (pd->next + 1) % pd->num_slots;
+			pthread_mutex_unlock(&pd->lock);
+
+			decode_band(w, b);
+
+			pthread_mutex_lock(&pd->lock);
+			b->state = OIL_BAND_DONE;
+			pthread_cond_broadcast(&pd->done);
+		} else {
+			pthread_cond_wait(&pd->queued, &pd->lock);
+		}
+	}
+	pthread_mutex_unlock(&pd->lock);
+	return NULL;
+}
+
+/* Queue band number band in slot b, if the image has that many bands. */
+static void queue_band(struct oil_libjpeg_parallel *pd,
+	struct oil_libjpeg_band *b, int band)
+{
+	int last_row;
+
+	pthread_mutex_lock(&pd->lock);
+	b->band = band;
+	b->pos = 0;
+	b->state = OIL_BAND_FREE;
+	if (band < pd->num_bands) {
+		last_row = (band + 1) * pd->band_mcu_rows * pd->out_rows;
+		if (last_row > (int)pd->dinfo->output_height) {
+			last_row = pd->dinfo->output_height;
+		}
+		b->num_rows = last_row - band * pd->band_mcu_rows * pd->out_rows;
+		b->state = OIL_BAND_QUEUED;
+		pthread_cond_signal(&pd->queued);
+	}
+	pthread_mutex_unlock(&pd->lock);
+}
+
+/* Wait for the next row to be decoded and return it. Raises errors from the
+ * workers through the decompressor of the image.
+ */
+static unsigned char *parallel_read_row(struct oil_libjpeg_parallel *pd)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct oil_libjpeg_band *b;
+	unsigned char *row;
+
+	/* The last row of a band is in use by the caller until the next call,
+	 * so only then is its slot given the next band.
+	 */
+	b = pd->slots + pd->take;
+	if (b->pos == b->num_rows) {
+		queue_band(pd, b, b->band + pd->num_slots);
+		pd->take = (pd->take + 1) % pd->num_slots;
+		b = pd->slots + pd->take;
+	}
+
+	pthread_mutex_lock(&pd->lock);
+	while (b->state != OIL_BAND_DONE) {
+		pthread_cond_wait(&pd->done, &pd->lock);
+	}
+	pthread_mutex_unlock(&pd->lock);
+
+	if (b->ret) {
+		dinfo = pd->dinfo;
+		dinfo->err->msg_code = b->err.msg_code;
+		memcpy(&dinfo->err->msg_parm, &b->err.msg_parm,
+			sizeof(b->err.msg_parm));
+		(*dinfo->err->error_exit)((j_common_ptr)dinfo);
+	}
+
+	row = b->rows + b->pos * pd->stride;
+	b->pos++;
+	return row;
+}
+
+int oil_libjpeg_start_parallel(struct oil_libjpeg *ol,
+	const unsigned char *data, size_t len, int threads)
+{
+	struct oil_libjpeg_parallel *pd;
+	struct oil_libjpeg_worker *w;
+	size_t rows_len;
+	sigset_t all, old;
+	int i;
+
+	if (threads < 2) {
+		return -1;
+	}
+	pd = calloc(1, sizeof(struct oil_libjpeg_parallel));
+	if (!pd) {
+		return -2;
+	}
+	pthread_mutex_init(&pd->lock, NULL);
+	pthread_cond_init(&pd->queued, NULL);
+	pthread_cond_init(&pd->done, NULL);
+	pd->dinfo = ol->dinfo;
+	pd->data = data;
+	pd->stride = (size_t)ol->dinfo->output_width *
+		ol->dinfo->output_components;
+
+	if (parse_header(data, len, &pd->sof_height, &pd->header_len) ||
+		plan_bands(pd, threads)) {
+		parallel_free(pd, NULL);
+		return -1;
+	}
+	pd->starts = malloc(pd->num_intervals * sizeof(size_t));
+	pd->ends = malloc(pd->num_intervals * sizeof(size_t));
+	if (!pd->starts || !pd->ends) {
+		parallel_free(pd, NULL);
+		return -2;
+	}
+	if (find_intervals(pd, len)) {
+		parallel_free(pd, NULL);
+		return -1;
+	}
+
+	pd->num_slots = threads * 2;
+	if (pd->num_slots > pd->num_bands) {
+		pd->num_slots = pd->num_bands;
+	}
+	pd->slots = calloc(pd->num_slots, sizeof(struct oil_libjpeg_band));
+	pd->workers = calloc(threads, sizeof(struct oil_libjpeg_worker));
+	if (!pd->slots || !pd->workers) {
+		parallel_free(pd, NULL);
+		return -2;
+	}
+	rows_len = pd->stride * pd->band_mcu_rows * pd->out_rows;
+	for (i=0; i<pd->num_slots; i++) {
+		pd->slots[i].rows = malloc(rows_len);
+		if (!pd->slots[i].rows) {
+			parallel_free(pd, NULL);
+			return -2;
+		}
+	}
+
+	/* Let signals go to the threads that called us. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i=0; i<threads; i++) {
+		w = pd->workers + i;
+		w->pd = pd;
+		w->dinfo.err = jpeg_std_error(&w->jerr);
+		w->jerr.error_exit = worker_error_exit;
+		w->jerr.output_message = worker_output_message;
+		jpeg_create_decompress(&w->dinfo);
+		if (pthread_create(&w->thread, NULL, parallel_worker, w)) {
+			jpeg_destroy_decompress(&w->dinfo);
+			break;
+		}
+		pd->num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (pd->num_threads != threads) {
+		parallel_free(pd, NULL);
+		return -2;
+	}
+
+	for (i=0; i<pd->num_slots; i++) {
+		queue_band(pd, pd->slots + i, i);
+	}
+	ol->par = pd;
+	return 0;
+}
+
+static size_t parallel_mem_size(struct oil_libjpeg_parallel *pd)
+{
+	size_t size;
+	int i;
+
+	size = sizeof(struct oil_libjpeg_parallel);
+	size += pd->num_intervals * 2 * sizeof(size_t);
+	for (i=0; i<pd->num_slots; i++) {
+		size += pd->slots[i].data_cap;
+		size += pd->stride * pd->band_mcu_rows * pd->out_rows;
+	}
+	return size + pd->num_threads * oil_libjpeg_decoder_mem_size(pd->dinfo);
+}
+
+static void parallel_free(struct oil_libjpeg_parallel *pd, char *warning)
+{
+	int i;
+
+	pthread_mutex_lock(&pd->lock);
+	pd->closed = 1;
+	pthread_cond_broadcast(&pd->queued);
+	pthread_mutex_unlock(&pd->lock);
+	for (i=0; i<pd->num_threads; i++) {
+		pthread_join(pd->workers[i].thread, NULL);
+		jpeg_destroy_decompress(&pd->workers[i].dinfo);
+	}
+	if (warning) {
+		workers_warning(pd->workers, pd->num_threads, warning);
+	}
+
+	for (i=0; pd->slots && i<pd->num_slots; i++) {
+		free(pd->slots[i].data);
+		free(pd->slots[i].rows);
+	}
+	free(pd->slots);
+	free(pd->workers);
+	free(pd->starts);
+	free(pd->ends);
+	pthread_mutex_destroy(&pd->lock);
+	pthread_cond_destroy(&pd->queued);
+	pthread_cond_destroy(&pd->done);
+	free(pd);
+}
+
+/* Parallel encoding */
+
+/* Destination that grows the data of the band being encoded. */
+static void band_init_destination(j_compress_ptr cinfo)
+{
+	struct oil_libjpeg_worker *w;
+
+	w = (struct oil_libjpeg_worker *)cinfo->err;
+	w->dest.next_output_byte = w->band->data;
+	w->dest.free_in_buffer = w->band->data_cap;
+}
+
+static boolean band_empty_output_buffer(j_compress_ptr cinfo)
+{
+	struct oil_libjpeg_worker *w;
+	struct oil_libjpeg_band *b;
+	unsigned char *data;
+	size_t cap;
+
+	w = (struct oil_libjpeg_worker *)cinfo->err;
+	b = w->band;
+	cap = b->data_cap * 2;
+	data = realloc(b->data, cap);
+	if (!data) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+	w->dest.next_output_byte = data + b->data_cap;
+	w->dest.free_in_buffer = cap - b->data_cap;
+	b->data = data;
+	b->data_cap = cap;
+	return TRUE;
+}
+
+static void band_term_destination(j_compress_ptr cinfo) {}
+
+/* Give a worker's compressor the settings of the image's compressor, for a
+ * band of the given height.
+ */
+static void copy_compress(struct jpeg_compress_struct *from,
+	struct jpeg_compress_struct *to, int height)
+{
+	jpeg_component_info *fc, *tc;
+	int i;
+
+	to->image_width = from->image_width;
+	to->image_height = height;
+	to->input_components = from->input_components;
+	to->in_color_space = from->in_color_space;
+	jpeg_set_defaults(to);
+	jpeg_set_colorspace(to, from->jpeg_color_space);
+	to->write_JFIF_header = FALSE;
+	to->write_Adobe_marker = FALSE;
+	to->dct_method = from->dct_method;
+	to->restart_in_rows = from->restart_in_rows;
+
+	for (i=0; i<from->num_components; i++) {
+		fc = from->comp_info + i;
+		tc = to->comp_info + i;
+		tc->component_id = fc->component_id;
+		tc->h_samp_factor = fc->h_samp_factor;
+		tc->v_samp_factor = fc->v_samp_factor;
+		tc->quant_tbl_no = fc->quant_tbl_no;
+		tc->dc_tbl_no = fc->dc_tbl_no;
+		tc->ac_tbl_no = fc->ac_tbl_no;
+	}
+	for (i=0; i<NUM_QUANT_TBLS; i++) {
+		if (!from->quant_tbl_ptrs[i]) {
+			continue;
+		}
+		if (!to->quant_tbl_ptrs[i]) {
+			to->quant_tbl_ptrs[i] =
+				jpeg_alloc_quant_table((j_common_ptr)to);
+		}
+		memcpy(to->quant_tbl_ptrs[i]->quantval,
+			from->quant_tbl_ptrs[i]->quantval,
+			sizeof(from->quant_tbl_ptrs[i]->quantval));
+	}
+	for (i=0; i<NUM_HUFF_TBLS; i++) {
+		if (from->dc_huff_tbl_ptrs[i]) {
+			if (!to->dc_huff_tbl_ptrs[i]) {
+				to->dc_huff_tbl_ptrs[i] =
+					jpeg_alloc_huff_table((j_common_ptr)to);
+			}
+			*to->dc_huff_tbl_ptrs[i] = *from->dc_huff_tbl_ptrs[i];
+		}
+		if (from->ac_huff_tbl_ptrs[i]) {
+			if (!to->ac_huff_tbl_ptrs[i]) {
+				to->ac_huff_tbl_ptrs[i] =
+					jpeg_alloc_huff_table((j_common_ptr)to);
+			}
+			*to->ac_huff_tbl_ptrs[i] = *from->ac_huff_tbl_ptrs[i];
+		}
+	}
+}
+
+/* Encode a band into b->data and find its entropy-coded data, numbering its
+ * restart markers as they are numbered in the image. Runs on a worker thread.
+ */
+static void encode_band(struct oil_libjpeg_worker *w,
+	struct oil_libjpeg_band *b)
+{
+	struct oil_libjpeg_writer *jw;
+	struct jpeg_compress_struct *cinfo;
+	unsigned char *data, *p, *end;
+	size_t len, sof_height;
+	int i, num;
+	JSAMPROW row;
+
+	jw = w->jw;
+	cinfo = &w->cinfo;
+	w->band = b;
+
+	if (setjmp(w->jmp)) {
+		b->ret = -1;
+		b->err = w->jerr;
+		jpeg_abort_compress(cinfo);
+		return;
+	}
+
+	copy_compress(jw->cinfo, cinfo, b->num_rows);
+	cinfo->dest = &w->dest;
+	jpeg_start_compress(cinfo, TRUE);
+	for (i=0; i<b->num_rows; i++) {
+		row = b->rows + i * jw->stride;
+		jpeg_write_scanlines(cinfo, &row, 1);
+	}
+	jpeg_finish_compress(cinfo);
+
+	data = b->data;
+	len = w->dest.next_output_byte - data;
+	if (parse_header(data, len, &sof_height, &b->data_start) ||
+		len < b->data_start + 2) {
+		ERREXIT(cinfo, JERR_BAD_LENGTH);
+	}
+	b->data_len = len - 2 - b->data_start;
+
+	/* libjpeg numbers the markers of each band from 0. */
+	num = b->band * jw->band_intervals;
+	p = data + b->data_start;
+	end = p + b->data_len;
+	while ((p = memchr(p, 0xFF, end - p)) && p + 1 < end) {
+		if (p[1] >= JPEG_RST0 && p[1] <= JPEG_RST0 + 7) {
+			p[1] = JPEG_RST0 + (num++ & 7);
+		}
+		p += 2;
+	}
+	b->ret = 0;
+}
+
+static void *writer_worker(void *data)
+{
+	struct oil_libjpeg_worker *w;
+	struct oil_libjpeg_writer *jw;
+	struct oil_libjpeg_band *b;
+
+	w = (struct oil_libjpeg_worker *)data;
+	jw = w->jw;
+
+	pthread_mutex_lock(&jw->lock);
+	for (;;) {
+		b = jw->slots + jw->next;
+		if (jw->closed) {
+			break;
+		} else if (b->state == OIL_BAND_QUEUED) {
+			b->state = OIL_BAND_RUNNING;
+			jw->next = (jw->next + 1) % jw->num_slots;
+			pthread_mutex_unlock(&jw->lock);
+
+			encode_band(w, b);
+
+			pthread_mutex_lock(&jw->lock);
+			b->state = OIL_BAND_DONE;
+			pthread_cond_broadcast(&jw->done);
+		} else {
+			pthread_cond_wait(&jw->queued, &jw->lock);
+		}
+	}
+	pthread_mutex_unlock(&jw->lock);
+	return NULL;
+}
+
+/* Write bytes through the compressor's destination manager, as libjpeg
+ * does.
+ */
+static void dest_write(j_compress_ptr cinfo, const unsigned char *data,
+	size_t len)
+{
+	struct jpeg_destination_mgr *dest;
+	size_t n;
+
+	dest = cinfo->dest;
+	while (len) {
+		if (!dest->free_in_buffer &&
+			!(*dest->empty_output_buffer)(cinfo)) {
+			ERREXIT(cinfo, JERR_CANT_SUSPEND);
+		}
+		n = len < dest->free_in_buffer ? len : dest->free_in_buffer;
+		memcpy(dest->next_output_byte, data, n);
+		dest->next_output_byte += n;
+		dest->free_in_buffer -= n;
+		data += n;
+		len -= n;
+	}
+}
+
+/* Wait for the oldest band to be encoded and write it out, after the restart
+ * marker that separates it from the band before. Errors from the workers are
+ * raised through the image's compressor.
+ */
+static void flush_band(struct oil_libjpeg_writer *jw)
+{
+	struct jpeg_compress_struct *cinfo;
+	struct oil_libjpeg_band *b;
+	unsigned char rst[2];
+
+	cinfo = jw->cinfo;
+	b = jw->slots + jw->flush;
+	pthread_mutex_lock(&jw->lock);
+	while (b->state != OIL_BAND_DONE) {
+		pthread_cond_wait(&jw->done, &jw->lock);
+	}
+	pthread_mutex_unlock(&jw->lock);
+
+	if (b->ret) {
+		cinfo->err->msg_code = b->err.msg_code;
+		memcpy(&cinfo->err->msg_parm, &b->err.msg_parm,
+			sizeof(b->err.msg_parm));
+		(*cinfo->err->error_exit)((j_common_ptr)cinfo);
+	}
+
+	if (b->band) {
+		rst[0] = 0xFF;
+		rst[1] = JPEG_RST0 + ((b->band * jw->band_intervals - 1) & 7);
+		dest_write(cinfo, rst, 2);
+	}
+	dest_write(cinfo, b->data + b->data_start, b->data_len);
+
+	pthread_mutex_lock(&jw->lock);
+	b->state = OIL_BAND_FREE;
+	pthread_mutex_unlock(&jw->lock);
+	jw->flush = (jw->flush + 1) % jw->num_slots;
+}
+
+int oil_libjpeg_writer_init(struct oil_libjpeg_writer *jw,
+	struct jpeg_compress_struct *cinfo, int threads)
+{
+	struct oil_libjpeg_worker *w;
+	jpeg_component_info *comp;
+	sigset_t all, old;
+	int i, max_h, max_v, mcus_per_row, mcu_rows, band, max_band, restart;
+
+	memset(jw, 0, sizeof(struct oil_libjpeg_writer));
+	if (threads < 2 || cinfo->optimize_coding || cinfo->arith_code ||
+		cinfo->scan_info || cinfo->raw_data_in ||
+		cinfo->smoothing_factor || cinfo->restart_interval ||
+		cinfo->data_precision != 8) {
+		return -1;
+	}
+#ifdef HAVE_JPEG_C_SET_BOOL_PARAM
+	if (jpeg_c_get_bool_param(cinfo, JBOOLEAN_TRELLIS_QUANT)) {
+		return -1;
+	}
+#endif
+
+	max_h = max_v = 1;
+	for (i=0; i<cinfo->num_components; i++) {
+		comp = cinfo->comp_info + i;
+		if (comp->h_samp_factor > max_h) {
+			max_h = comp->h_samp_factor;
+		}
+		if (comp->v_samp_factor > max_v) {
+			max_v = comp->v_samp_factor;
+		}
+	}
+	if (cinfo->num_components == 1 && (max_h != 1 || max_v != 1)) {
+		/* A single component scan has MCUs of one block. */
+		return -1;
+	}
+	mcus_per_row = (cinfo->image_width + max_h * DCTSIZE - 1) /
+		(max_h * DCTSIZE);
+	jw->mcu_height = max_v * DCTSIZE;
+	mcu_rows = (cinfo->image_height + jw->mcu_height - 1) / jw->mcu_height;
+	restart = cinfo->restart_in_rows ? cinfo->restart_in_rows : 1;
+	if ((long)restart * mcus_per_row > 65535) {
+		return -1;
+	}
+	jw->stride = (size_t)cinfo->image_width * cinfo->input_components;
+
+	/* A few bands per thread, with no more than BAND_BYTES of rows each,
+	 * starting at a restart marker.
+	 */
+	band = (mcu_rows + threads * 4 - 1) / (threads * 4);
+	max_band = BAND_BYTES / (jw->stride * jw->mcu_height);
+	if (band > max_band) {
+		band = max_band;
+	}
+	band = (band + restart - 1) / restart * restart;
+	if (band < restart) {
+		band = restart;
+	}
+	if (band >= mcu_rows) {
+		return -1;
+	}
+
+	pthread_mutex_init(&jw->lock, NULL);
+	pthread_cond_init(&jw->queued, NULL);
+	pthread_cond_init(&jw->done, NULL);
+	jw->cinfo = cinfo;
+	cinfo->restart_in_rows = restart;
+	jw->band_rows = band * jw->mcu_height;
+	jw->band_intervals = band / restart;
+	jw->num_bands = (mcu_rows + band - 1) / band;
+
+	jw->num_slots = threads * 2;
+	if (jw->num_slots > jw->num_bands) {
+		jw->num_slots = jw->num_bands;
+	}
+	jw->slots = calloc(jw->num_slots, sizeof(struct oil_libjpeg_band));
+	jw->workers = calloc(threads, sizeof(struct oil_libjpeg_worker));
+	if (!jw->slots || !jw->workers) {
+		return -2;
+	}
+	for (i=0; i<jw->num_slots; i++) {
+		jw->slots[i].rows = malloc(jw->stride * jw->band_rows);
+		jw->slots[i].data_cap = 65536;
+		jw->slots[i].data = malloc(jw->slots[i].data_cap);
+		if (!jw->slots[i].rows || !jw->slots[i].data) {
+			return -2;
+		}
+	}
+
+	/* Let signals go to the threads that called us. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i=0; i<threads; i++) {
+		w = jw->workers + i;
+		w->jw = jw;
+		w->cinfo.err = jpeg_std_error(&w->jerr);
+		w->jerr.error_exit = worker_error_exit;
+		w->jerr.output_message = worker_output_message;
+		w->dest.init_destination = band_init_destination;
+		w->dest.empty_output_buffer = band_empty_output_buffer;
+		w->dest.term_destination = band_term_destination;
+		jpeg_create_compress(&w->cinfo);
+		if (pthread_create(&w->thread, NULL, writer_worker, w)) {
+			jpeg_destroy_compress(&w->cinfo);
+			break;
+		}
+		jw->num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return jw->num_threads == threads ? 0 : -2;
+}
+
+void oil_libjpeg_writer_write_row(struct oil_libjpeg_writer *jw,
+	unsigned char *row)
+{
+	struct oil_libjpeg_band *b;
+	int rows_left;
+
+	/* Have the compressor write the tables, frame and scan headers. */
+	if (!jw->started) {
+		jpeg_write_scanlines(jw->cinfo, NULL, 0);
+		jw->started = 1;
+	}
+
+	b = jw->slots + jw->fill;
+	if (!jw->filling) {
+		while (b->state != OIL_BAND_FREE) {
+			flush_band(jw);
+		}
+		rows_left = jw->cinfo->image_height -
+			jw->queued_bands * jw->band_rows;
+		b->band = jw->queued_bands;
+		b->num_rows = rows_left < jw->band_rows ? rows_left :
+			jw->band_rows;
+		b->pos = 0;
+		jw->filling = 1;
+	}
+
+	memcpy(b->rows + b->pos * jw->stride, row, jw->stride);
+	if (++b->pos < b->num_rows) {
+		return;
+	}
+
+	pthread_mutex_lock(&jw->lock);
+	b->state = OIL_BAND_QUEUED;
+	pthread_cond_signal(&jw->queued);
+	pthread_mutex_unlock(&jw->lock);
+	jw->queued_bands++;
+	jw->fill = (jw->fill + 1) % jw->num_slots;
+	jw->filling = 0;
+}
+
+void oil_libjpeg_writer_finish(struct oil_libjpeg_writer *jw)
+{
+	static const unsigned char eoi[2] = { 0xFF, JPEG_EOI };
+	struct jpeg_compress_struct *cinfo;
+
+	cinfo = jw->cinfo;
+	while (jw->flush != jw->fill ||
+		jw->slots[jw->flush].state != OIL_BAND_FREE) {
+		flush_band(jw);
+	}
+	dest_write(cinfo, eoi, 2);
+	(*cinfo->dest->term_destination)(cinfo);
+	jpeg_abort_compress(cinfo);
+}
+
+void oil_libjpeg_writer_free(struct oil_libjpeg_writer *jw)
+{
+	char warning[JMSG_LENGTH_MAX];
+	int i;
+
+	if (!jw->cinfo) {
+		return;
+	}
+	pthread_mutex_lock(&jw->lock);
+	jw->closed = 1;
+	pthread_cond_broadcast(&jw->queued);
+	pthread_mutex_unlock(&jw->lock);
+	for (i=0; i<jw->num_threads; i++) {
+		pthread_join(jw->workers[i].thread, NULL);
+		jpeg_destroy_compress(&jw->workers[i].cinfo);
+	}
+	warning[0] = 0;
+	workers_warning(jw->workers, jw->num_threads, warning);
+
+	for (i=0; jw->slots && i<jw->num_slots; i++) {
+		free(jw->slots[i].data);
+		free(jw->slots[i].rows);
+	}
+	free(jw->slots);
+	free(jw->workers);
+	pthread_mutex_destroy(&jw->lock);
+	pthread_cond_destroy(&jw->queued);
+	pthread_cond_destroy(&jw->done);
+	memset(jw, 0, sizeof(struct oil_libjpeg_writer));
+	memcpy(jw->warning, warning, JMSG_LENGTH_MAX);
 }
 
 enum oil_colorspace jpeg_cs_to_oil(J_COLOR_SPACE cs)
@@ -102,3 +1348,468 @@ J_COLOR_SPACE oil_cs_to_jpeg(enum oil_colorspace cs)
 	}
 }
 
+/* Planar YCbCr */
+
+/* Returns 1 if the sampling factors of the components allow linear mode: luma
+ * at full resolution and both chroma components subsampled alike, by at most
+ * two in each direction.
+ */
+static int linear_supported(jpeg_component_info *comp)
+{
+	int h, v;
+
+	if (comp[1].h_samp_factor != comp[2].h_samp_factor ||
+		comp[1].v_samp_factor != comp[2].v_samp_factor) {
+		return 0;
+	}
+	h = comp[0].h_samp_factor;
+	v = comp[0].v_samp_factor;
+	return (h == comp[1].h_samp_factor || h == 2 * comp[1].h_samp_factor) &&
+		(v == comp[1].v_samp_factor || v == 2 * comp[1].v_samp_factor);
+}
+
+/* Set up the scaler and buffers that let oil_libjpeg_planar_write() convert
+ * the planes to linear RGB, scale them together, and convert them back.
+ */
+static int linear_init(struct oil_libjpeg_planar *op, int out_width,
+	int out_height)
+{
+	struct oil_libjpeg_plane *luma, *chroma;
+	jpeg_component_info *comp;
+	int i;
+
+	if (!linear_supported(op->cinfo->comp_info)) {
+		return -1;
+	}
+
+	luma = op->planes;
+	chroma = op->planes + 1;
+	/* DCT scaling may decode chroma at a larger scale than luma, undoing
+	 * the subsampling, so the planes as decoded are compared rather than the
+	 * sampling factors.
+	 */
+	op->in_h_shift = luma->in_width > chroma->in_width;
+	op->in_v_ratio = luma->in_height > chroma->in_height ? 2 : 1;
+	comp = op->cinfo->comp_info;
+	op->out_h_ratio = comp[0].h_samp_factor / comp[1].h_samp_factor;
+	op->out_v_ratio = comp[0].v_samp_factor / comp[1].v_samp_factor;
+
+	for (i=0; i<2; i++) {
+		op->chroma_in[i] = malloc(chroma->in_width * sizeof(float));
+		op->chroma_out[i] = malloc(out_width);
+		op->chroma_sum[i] = calloc(chroma->out_width, sizeof(int));
+		if (!op->chroma_in[i] || !op->chroma_out[i] ||
+			!op->chroma_sum[i]) {
+			return -2;
+		}
+	}
+
+	return oil_scale_init(&op->os, luma->in_height, out_height,
+		luma->in_width, out_width, OIL_CS_RGB);
+}
+
+int oil_libjpeg_planar_init(struct oil_libjpeg_planar *op,
+	struct jpeg_decompress_struct *dinfo, struct jpeg_compress_struct *cinfo,
+	int out_width, int out_height, int linear)
+{
+	struct oil_libjpeg_plane *pl;
+	jpeg_component_info *in_comp, *out_comp;
+	int i, j, ret, max_h, max_v, scratch_len, in_rows_total;
+
+	memset(op, 0, sizeof(*op));
+	op->dinfo = dinfo;
+	op->cinfo = cinfo;
+	op->linear = linear;
+
+	if (!oil_libjpeg_planar_supported(dinfo, linear) ||
+		cinfo->num_components != 3) {
+		return -1;
+	}
+
+	max_h = max_v = 1;
+	for (i=0; i<3; i++) {
+		out_comp = cinfo->comp_info + i;
+		if (out_comp->h_samp_factor > max_h) {
+			max_h = out_comp->h_samp_factor;
+		}
+		if (out_comp->v_samp_factor > max_v) {
+			max_v = out_comp->v_samp_factor;
+		}
+	}
+
+	dinfo->raw_data_out = TRUE;
+	cinfo->raw_data_in = TRUE;
+	op->out_lines = max_v * DCTSIZE;
+	op->in_lines = dinfo->max_v_samp_factor * MIN_DCT_V_SCALED_SIZE(dinfo);
+
+	scratch_len = 0;
+	in_rows_total = 0;
+	for (i=0; i<3; i++) {
+		pl = op->planes + i;
+		in_comp = dinfo->comp_info + i;
+		out_comp = cinfo->comp_info + i;
+
+		pl->in_stride = in_comp->width_in_blocks * DCT_SCALED_SIZE(in_comp);
+		pl->in_rows = in_comp->v_samp_factor * DCT_V_SCALED_SIZE(in_comp);
+		pl->in_left = in_comp->downsampled_height;
+		pl->in_width = in_comp->downsampled_width;
+		pl->in_height = in_comp->downsampled_height;
+		if (pl->in_stride > scratch_len) {
+			scratch_len = pl->in_stride;
+		}
+		in_rows_total += pl->in_rows;
+
+		pl->out_width = (out_width * out_comp->h_samp_factor + max_h - 1) /
+			max_h;
+		pl->out_height = (out_height * out_comp->v_samp_factor + max_v -
+			1) / max_v;
+		pl->out_stride = (pl->out_width + DCTSIZE - 1) / DCTSIZE * DCTSIZE;
+		pl->out_rows_imcu = out_comp->v_samp_factor * DCTSIZE;
+
+		pl->out = malloc((size_t)pl->out_stride * pl->out_rows_imcu);
+		pl->out_rows = malloc(pl->out_rows_imcu * sizeof(JSAMPROW));
+		if (!pl->out || !pl->out_rows) {
+			return -2;
+		}
+		for (j=0; j<pl->out_rows_imcu; j++) {
+			pl->out_rows[j] = pl->out + (size_t)j * pl->out_stride;
+		}
+		op->out_ptrs[i] = pl->out_rows;
+
+		if (linear) {
+			continue;
+		}
+		ret = oil_scale_init(&pl->os, in_comp->downsampled_height,
+			pl->out_height, in_comp->downsampled_width,
+			pl->out_width, OIL_CS_G);
+		if (ret!=0) {
+			return ret;
+		}
+		op->num_ready++;
+	}
+
+	op->scratch = malloc(scratch_len);
+	op->in_row_ptrs = malloc(in_rows_total * sizeof(JSAMPROW));
+	if (!op->scratch || !op->in_row_ptrs) {
+		return -2;
+	}
+	for (i=0, j=0; i<3; i++) {
+		op->in_ptrs[i] = op->in_row_ptrs + j;
+		j += op->planes[i].in_rows;
+	}
+
+	if (linear) {
+		return linear_init(op, out_width, out_height);
+	}
+	return 0;
+}
+
+/* Make room in a plane's FIFO for one more iMCU row of decoded samples. */
+static int fifo_reserve(struct oil_libjpeg_plane *pl)
+{
+	unsigned char *fifo;
+	int cap;
+
+	if (pl->fifo_start + pl->fifo_len + pl->in_rows <= pl->fifo_cap) {
+		return 0;
+	}
+
+	memmove(pl->fifo, pl->fifo + (size_t)pl->fifo_start * pl->in_stride,
+		(size_t)pl->fifo_len * pl->in_stride);
+	pl->fifo_start = 0;
+	if (pl->fifo_len + pl->in_rows <= pl->fifo_cap) {
+		return 0;
+	}
+
+	cap = (pl->fifo_len + pl->in_rows) * 2;
+	fifo = realloc(pl->fifo, (size_t)cap * pl->in_stride);
+	if (!fifo) {
+		return -2;
+	}
+	pl->fifo = fifo;
+	pl->fifo_cap = cap;
+	return 0;
+}
+
+/* Decode one iMCU row, appending the rows of each plane to its FIFO. Rows
+ * below the bottom of the image are discarded.
+ */
+static int read_imcu(struct oil_libjpeg_planar *op)
+{
+	struct oil_libjpeg_plane *pl;
+	int i, j, n;
+
+	for (i=0; i<3; i++) {
+		pl = op->planes + i;
+		if (fifo_reserve(pl)) {
+			return -2;
+		}
+		for (j=0; j<pl->in_rows; j++) {
+			op->in_ptrs[i][j] = j < pl->in_left ?
+				pl->fifo + (size_t)(pl->fifo_start + pl->fifo_len + j) *
+				pl->in_stride : op->scratch;
+		}
+	}
+
+	jpeg_read_raw_data(op->dinfo, op->in_ptrs, op->in_lines);
+
+	for (i=0; i<3; i++) {
+		pl = op->planes + i;
+		n = pl->in_rows < pl->in_left ? pl->in_rows : pl->in_left;
+		pl->fifo_len += n;
+		pl->in_left -= n;
+	}
+	return 0;
+}
+
+/* Returns row k of a plane, clamped to the image, decoding as needed. Decoding
+ * may move rows that were returned earlier.
+ */
+static unsigned char *plane_row(struct oil_libjpeg_planar *op, int i, int k)
+{
+	struct oil_libjpeg_plane *pl;
+
+	pl = op->planes + i;
+	k = k < 0 ? 0 : (k >= pl->in_height ? pl->in_height - 1 : k);
+	while (pl->fifo_pos + pl->fifo_len <= k) {
+		if (read_imcu(op)) {
+			return NULL;
+		}
+	}
+	return pl->fifo + (size_t)(pl->fifo_start + k - pl->fifo_pos) *
+		pl->in_stride;
+}
+
+/* Drop the rows of a plane that come before row k. */
+static void plane_release(struct oil_libjpeg_plane *pl, int k)
+{
+	while (pl->fifo_pos < k && pl->fifo_len) {
+		pl->fifo_start++;
+		pl->fifo_len--;
+		pl->fifo_pos++;
+	}
+}
+
+/* Feed the next luma row and its chroma to the linear scaler. Chroma rows are
+ * upsampled vertically here with the same triangle filter that the scaler
+ * applies horizontally.
+ */
+static int feed_linear(struct oil_libjpeg_planar *op)
+{
+	struct oil_libjpeg_plane *pl;
+	unsigned char *near, *far, *y;
+	float *out;
+	int i, j, r, k, nb;
+
+	r = op->os.in_pos;
+	k = r / op->in_v_ratio;
+	nb = k;
+	if (op->in_v_ratio == 2) {
+		nb = r & 1 ? k + 1 : k - 1;
+	}
+
+	for (i=0; i<2; i++) {
+		pl = op->planes + 1 + i;
+		plane_release(pl, k < nb ? k : nb);
+		/* Decode through the later row first so the earlier stays put. */
+		if (!plane_row(op, i + 1, k > nb ? k : nb)) {
+			return -2;
+		}
+		near = plane_row(op, i + 1, k);
+		far = plane_row(op, i + 1, nb);
+		out = op->chroma_in[i];
+		for (j=0; j<pl->in_width; j++) {
+			out[j] = 0.75f * near[j] + 0.25f * far[j] - 128.0f;
+		}
+	}
+
+	plane_release(op->planes, r);
+	y = plane_row(op, 0, r);
+	if (!y) {
+		return -2;
+	}
+	oil_scale_in_ycbcr(&op->os, y, op->chroma_in[0], op->chroma_in[1],
+		op->in_h_shift);
+	return 0;
+}
+
+/* Average the accumulated chroma into the next row of each chroma plane. */
+static void emit_chroma(struct oil_libjpeg_planar *op, int row)
+{
+	struct oil_libjpeg_plane *pl;
+	unsigned char *out;
+	int i, j, cols, n;
+
+	for (i=0; i<2; i++) {
+		pl = op->planes + 1 + i;
+		out = pl->out_rows[row];
+		for (j=0; j<pl->out_width; j++) {
+			cols = op->os.out_width - j * op->out_h_ratio;
+			cols = cols < op->out_h_ratio ? cols : op->out_h_ratio;
+			n = cols * op->sum_rows;
+			out[j] = (op->chroma_sum[i][j] + n / 2) / n;
+			op->chroma_sum[i][j] = 0;
+		}
+		memset(out + pl->out_width, out[pl->out_width - 1],
+			pl->out_stride - pl->out_width);
+		pl->out_pos++;
+	}
+	op->sum_rows = 0;
+}
+
+static int write_linear(struct oil_libjpeg_planar *op)
+{
+	struct oil_libjpeg_plane *luma, *pl;
+	unsigned char *row, *c;
+	int i, j, k, ret, chroma_rows;
+
+	luma = op->planes;
+	chroma_rows = 0;
+	for (j=0; j<op->out_lines; j++) {
+		row = luma->out_rows[j];
+
+		/* Pad the bottom of the image by repeating the last row. */
+		if (op->os.out_pos == op->os.out_height) {
+			memcpy(row, luma->out_rows[j - 1], luma->out_stride);
+			continue;
+		}
+
+		for (k=oil_scale_slots(&op->os); k>0; k--) {
+			if ((ret = feed_linear(op))) {
+				return ret;
+			}
+		}
+		oil_scale_out_ycbcr(&op->os, row, op->chroma_out[0],
+			op->chroma_out[1]);
+		memset(row + luma->out_width, row[luma->out_width - 1],
+			luma->out_stride - luma->out_width);
+
+		for (i=0; i<2; i++) {
+			c = op->chroma_out[i];
+			for (k=0; k<op->os.out_width; k++) {
+				op->chroma_sum[i][k / op->out_h_ratio] += c[k];
+			}
+		}
+		op->sum_rows++;
+		if (op->sum_rows == op->out_v_ratio ||
+			op->os.out_pos == op->os.out_height) {
+			emit_chroma(op, chroma_rows++);
+		}
+	}
+
+	for (i=1; i<3; i++) {
+		pl = op->planes + i;
+		for (j=chroma_rows; j<pl->out_rows_imcu; j++) {
+			memcpy(pl->out_rows[j], pl->out_rows[j - 1], pl->out_stride);
+		}
+	}
+
+	jpeg_write_raw_data(op->cinfo, op->out_ptrs, op->out_lines);
+	return 0;
+}
+
+int oil_libjpeg_planar_write(struct oil_libjpeg_planar *op)
+{
+	struct oil_libjpeg_plane *pl;
+	unsigned char *row;
+	int i, j, k, ret;
+
+	if (op->linear) {
+		return write_linear(op);
+	}
+
+	for (i=0; i<3; i++) {
+		pl = op->planes + i;
+		for (j=0; j<pl->out_rows_imcu; j++) {
+			row = pl->out_rows[j];
+
+			/* Pad the bottom of the image by repeating the last row. */
+			if (pl->out_pos == pl->out_height) {
+				memcpy(row, pl->out_rows[j - 1], pl->out_stride);
+				continue;
+			}
+
+			for (k=oil_scale_slots(&pl->os); k>0; k--) {
+				if (!pl->fifo_len && (ret = read_imcu(op))) {
+					return ret;
+				}
+				oil_scale_in(&pl->os, pl->fifo +
+					(size_t)pl->fifo_start * pl->in_stride);
+				pl->fifo_start++;
+				pl->fifo_len--;
+				pl->fifo_pos++;
+			}
+			oil_scale_out(&pl->os, row);
+			pl->out_pos++;
+
+			/* Pad the right edge to a whole block. */
+			memset(row + pl->out_width, row[pl->out_width - 1],
+				pl->out_stride - pl->out_width);
+		}
+	}
+
+	jpeg_write_raw_data(op->cinfo, op->out_ptrs, op->out_lines);
+	return 0;
+}
+
+size_t oil_libjpeg_planar_mem_size(struct oil_libjpeg_planar *op)
+{
+	struct oil_libjpeg_plane *pl;
+	size_t size;
+	int i;
+
+	size = 0;
+	for (i=0; i<op->num_ready; i++) {
+		pl = op->planes + i;
+		size += oil_scale_mem_size(&pl->os);
+		size += (size_t)pl->fifo_cap * pl->in_stride;
+		size += (size_t)pl->out_stride * pl->out_rows_imcu;
+	}
+	if (op->linear) {
+		size += oil_scale_mem_size(&op->os);
+		for (i=0; i<3; i++) {
+			pl = op->planes + i;
+			size += (size_t)pl->fifo_cap * pl->in_stride;
+			size += (size_t)pl->out_stride * pl->out_rows_imcu;
+		}
+		pl = op->planes + 1;
+		size += 2 * (size_t)pl->in_width * sizeof(float);
+		size += 2 * (size_t)op->os.out_width;
+		size += 2 * (size_t)pl->out_width * sizeof(int);
+	}
+	return size;
+}
+
+void oil_libjpeg_planar_free(struct oil_libjpeg_planar *op)
+{
+	struct oil_libjpeg_plane *pl;
+	int i;
+
+	for (i=0; i<3; i++) {
+		pl = op->planes + i;
+		if (i < op->num_ready) {
+			oil_scale_free(&pl->os);
+		}
+		free(pl->fifo);
+		free(pl->out);
+		free(pl->out_rows);
+	}
+	for (i=0; i<2; i++) {
+		free(op->chroma_in[i]);
+		free(op->chroma_out[i]);
+		free(op->chroma_sum[i]);
+	}
+	oil_scale_free(&op->os);
+	free(op->scratch);
+	free(op->in_row_ptrs);
+	memset(op, 0, sizeof(*op));
+}
+
+int oil_libjpeg_planar_supported(struct jpeg_decompress_struct *dinfo,
+	int linear)
+{
+	if (dinfo->jpeg_color_space != JCS_YCbCr || dinfo->num_components != 3) {
+		return 0;
+	}
+	return !linear || linear_supported(dinfo->comp_info);
+}
@@ -23,13 +23,19 @@
 #define OIL_LIBJPEG_H
 
 #include <stdio.h>
+#include <pthread.h>
 #include <jpeglib.h>
 #include "oil_resample.h"
 
+struct oil_libjpeg_parallel;
+struct oil_libjpeg_worker;
+
 struct oil_libjpeg {
 	struct oil_scale os;
 	struct jpeg_decompress_struct *dinfo;
 	unsigned char *inbuf;
+	struct oil_libjpeg_parallel *par; // parallel decoder, or NULL.
+	char warning[JMSG_LENGTH_MAX]; // last warning of the workers, or empty.
 };
 
 /**
@@ -46,9 +52,410 @@ struct oil_libjpeg {
 int oil_libjpeg_init(struct oil_libjpeg *ol,
 	struct jpeg_decompress_struct *dinfo, int out_width, int out_height);
 
+/**
+ * Free the scaler and stop the worker threads of oil_libjpeg_start_parallel().
+ * The last warning the workers had from libjpeg is left in ol->warning, for
+ * the caller to report.
+ */
 void oil_libjpeg_free(struct oil_libjpeg *ol);
 
-void oil_libjpeg_read_scanline(struct oil_libjpeg *ol, unsigned char *outbuf);
+/**
+ * Set up DCT scaling so that libjpeg decodes the image at the smallest size
+ * that is at least min_ratio times the desired output size. The remaining
+ * reduction is left to oil_scale. This must be called before oil_libjpeg_init().
+ * @dinfo: Pointer to a libjpeg decompress struct, with header already read.
+ * @out_width: Desired width, in pixels, of the output image.
+ * @out_height: Desired height, in pixels, of the output image.
+ * @min_ratio: Smallest acceptable ratio of decoded size to output size. Values
+ *   below 1 are treated as 1. Larger values trade speed for quality.
+ *
+ * Images are never scaled up by the decoder. A reduction to 1/8 or less uses
+ * libjpeg's DC-only IDCT.
+ */
+void oil_libjpeg_prescale(struct jpeg_decompress_struct *dinfo, int out_width,
+	int out_height, double min_ratio);
+
+/**
+ * Speed profiles, trading fidelity for throughput.
+ */
+enum oil_libjpeg_speed {
+	OIL_SPEED_BALANCED = 0, // libjpeg defaults.
+	OIL_SPEED_FAST, // fast integer DCT, no fancy upsampling or smoothing.
+	OIL_SPEED_QUALITY, // libjpeg defaults plus optimized Huffman tables.
+};
+
+/**
+ * Set the decoder's DCT method, upsampling and block smoothing for a speed
+ * profile. Must be called before oil_libjpeg_start_decompress().
+ * @dinfo: Pointer to a libjpeg decompress struct, with header already read.
+ * @speed: The speed profile.
+ */
+void oil_libjpeg_decompress_speed(struct jpeg_decompress_struct *dinfo,
+	enum oil_libjpeg_speed speed);
+
+/**
+ * Set the encoder's DCT method and Huffman table optimization for a speed
+ * profile. Must be called after jpeg_set_defaults() and before
+ * jpeg_start_compress().
+ * @cinfo: Pointer to a libjpeg compress struct.
+ * @speed: The speed profile.
+ */
+void oil_libjpeg_compress_speed(struct jpeg_compress_struct *cinfo,
+	enum oil_libjpeg_speed speed);
+
+enum oil_libjpeg_subsampling {
+	OIL_SUBSAMPLE_DEFAULT = 0, // whatever jpeg_set_defaults() chose.
+	OIL_SUBSAMPLE_444, // chroma at full resolution.
+	OIL_SUBSAMPLE_422, // chroma at half the columns.
+	OIL_SUBSAMPLE_420, // chroma at half the columns and half the rows.
+};
+
+/**
+ * Encoder settings that spend CPU time to make the output smaller.
+ */
+struct oil_libjpeg_encode {
+	int progressive; // write a progressive JPEG.
+	int optimize; // build optimal Huffman tables.
+	enum oil_libjpeg_subsampling subsampling; // chroma subsampling of YCbCr.
+	int arithmetic; // arithmetic instead of Huffman coding.
+	int trellis; // trellis quantization, if libjpeg is mozjpeg.
+	int restart_rows; // MCU rows between restart markers, 0 for none.
+};
+
+/**
+ * Check that the linked libjpeg supports the requested encoder settings.
+ * @enc: Pointer to the encoder settings.
+ *
+ * Returns 0 if they are supported.
+ * Returns -1 if arithmetic coding was requested but is not compiled in.
+ * Returns -2 if trellis quantization was requested but libjpeg is not mozjpeg.
+ */
+int oil_libjpeg_encode_check(struct oil_libjpeg_encode *enc);
+
+/**
+ * Apply encoder settings. Must be called after jpeg_set_defaults() and
+ * jpeg_set_quality(), and before oil_libjpeg_planar_init() since that sizes
+ * the output planes by the sampling factors. Settings that
+ * oil_libjpeg_encode_check() rejects are ignored.
+ * @cinfo: Pointer to a libjpeg compress struct.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libjpeg_compress_encode(struct jpeg_compress_struct *cinfo,
+	struct oil_libjpeg_encode *enc);
+
+/**
+ * Use instead of jpeg_start_decompress(). Progressive images are decoded in
+ * buffered-image mode, and input is consumed only until every coefficient that
+ * can affect the output at the current DCT scale has been read. At 1/8 scale
+ * this skips the final refinement scans of most progressive images, and the
+ * input that holds them is never read.
+ * @dinfo: Pointer to a libjpeg decompress struct, with header already read.
+ *
+ * Returns 1 once decompression has started.
+ * Returns 0 if a suspending data source ran out of input. Call again once it
+ *   has more.
+ */
+int oil_libjpeg_start_decompress(struct jpeg_decompress_struct *dinfo);
+
+/**
+ * A band of MCU rows, decoded or encoded on a worker thread as a JPEG of its
+ * own.
+ */
+struct oil_libjpeg_band {
+	int band; // index of the band in the image.
+	unsigned char *data; // the band as a JPEG.
+	size_t data_cap; // size of data.
+	size_t data_start; // offset of the band's entropy-coded data in data.
+	size_t data_len; // length of the band's entropy-coded data.
+	unsigned char *rows; // pixel rows of the band.
+	int num_rows; // rows of the band.
+	int pos; // rows taken by the scaler, or given by the caller, so far.
+	int state; // OIL_BAND_* below.
+	int ret; // 0, or -1 if libjpeg failed and err holds the message.
+	struct jpeg_error_mgr err; // the worker's error state on failure.
+};
+
+enum oil_libjpeg_band_state {
+	OIL_BAND_FREE = 0,
+	OIL_BAND_QUEUED,
+	OIL_BAND_RUNNING,
+	OIL_BAND_DONE,
+};
+
+/**
+ * Decodes a baseline JPEG with restart markers on several threads. The
+ * entropy-coded data between restart markers can be decoded on its own, so
+ * the image is cut into bands of MCU rows that start at a restart marker.
+ * Each band is copied into a JPEG of its own, with the header of the image,
+ * a height patched into the SOF marker and the restart markers renumbered, and
+ * decoded by a worker with a decompressor of its own. Bands are handed to the
+ * scaler in order.
+ *
+ * Fancy upsampling of subsampled chroma looks at the rows above and below, so
+ * in that case the rows around a band are decoded with it and thrown away.
+ * The output is the same as decoding the image in one piece.
+ */
+struct oil_libjpeg_parallel {
+	struct jpeg_decompress_struct *dinfo; // decompressor the settings are from.
+	const unsigned char *data; // the whole JPEG.
+	size_t header_len; // bytes up to the end of the SOS marker.
+	size_t sof_height; // offset of the image height in the SOF marker.
+	size_t *starts; // offset of each restart interval.
+	size_t *ends; // offset just past the data of each restart interval.
+	int num_intervals; // number of restart intervals.
+	int mcus_per_row; // MCUs in an MCU row.
+	int mcu_rows; // MCU rows in the image.
+	int mcu_height; // image rows in an MCU row.
+	int out_rows; // output rows in an MCU row.
+	int band_mcu_rows; // MCU rows in each band but the last.
+	int overlap; // MCU rows decoded above and below a band for context.
+	int num_bands; // number of bands in the image.
+	size_t stride; // length in bytes of an output row.
+	struct oil_libjpeg_band *slots; // ring of bands, taken in order.
+	int num_slots; // size of the ring.
+	int take; // slot the scaler reads from.
+	int next; // next slot to hand to a worker. Protected by lock.
+	struct oil_libjpeg_worker *workers; // worker threads.
+	int num_threads; // number of worker threads started.
+	int closed; // set to make the workers exit.
+	pthread_mutex_t lock; // protects closed, next and the band states.
+	pthread_cond_t queued; // signalled when a band is queued.
+	pthread_cond_t done; // broadcast when a band is decoded.
+};
+
+/**
+ * Use instead of oil_libjpeg_start_decompress() to decode on several threads.
+ * oil_libjpeg_read_scanline() then takes rows from the worker threads, and
+ * oil_libjpeg_free() stops them.
+ * @ol: Pointer to an initialized oil_libjpeg struct. Its decompressor must have
+ *   read the header from data, and must not be started.
+ * @data: The whole JPEG, as given to jpeg_mem_src(). It must outlive ol.
+ * @len: Length in bytes of data.
+ * @threads: Number of worker threads.
+ *
+ * Only single-scan Huffman-coded images with restart markers at the start of
+ * MCU rows can be decoded this way. Errors found by the workers are raised
+ * through the error handler of ol's decompressor, from
+ * oil_libjpeg_read_scanline().
+ *
+ * Returns 0 on success.
+ * Returns -1 if the image can't be split into bands. Nothing has changed, and
+ *   oil_libjpeg_start_decompress() should be used instead.
+ * Returns -2 if unable to allocate memory or start the threads.
+ */
+int oil_libjpeg_start_parallel(struct oil_libjpeg *ol,
+	const unsigned char *data, size_t len, int threads);
+
+/**
+ * Encodes a baseline JPEG on several threads. Rows are collected into bands of
+ * MCU rows, and each band is encoded by a worker as a JPEG of its own, with
+ * the settings of the caller's compressor. Bands start at a restart marker, so
+ * the entropy-coded data of a band doesn't depend on the bands before it.
+ * The caller's compressor writes the header of the image, and the data of the
+ * bands follows in order, with their restart markers renumbered and a marker
+ * in between. The result is the image that the compressor would have written
+ * with the same restart interval.
+ *
+ * Huffman tables are fixed before any band is encoded, so optimized tables,
+ * progressive and arithmetic coding can't be used.
+ */
+struct oil_libjpeg_writer {
+	struct jpeg_compress_struct *cinfo; // compressor of the image.
+	size_t stride; // length in bytes of an input row.
+	int mcu_height; // image rows in an MCU row.
+	int band_rows; // image rows in each band but the last.
+	int band_intervals; // restart intervals in each band but the last.
+	int num_bands; // number of bands in the image.
+	int started; // 1 once the header has been written.
+	struct oil_libjpeg_band *slots; // ring of bands, filled in order.
+	int num_slots; // size of the ring.
+	int fill; // slot being filled.
+	int filling; // 1 if the slot at fill has been given rows.
+	int flush; // oldest slot not yet written out.
+	int next; // next slot to hand to a worker. Protected by lock.
+	int queued_bands; // bands handed to the workers so far.
+	struct oil_libjpeg_worker *workers; // worker threads.
+	int num_threads; // number of worker threads started.
+	int closed; // set to make the workers exit.
+	pthread_mutex_t lock; // protects closed, next and the band states.
+	pthread_cond_t queued; // signalled when a band is queued.
+	pthread_cond_t done; // broadcast when a band is encoded.
+	char warning[JMSG_LENGTH_MAX]; // last warning of the workers, or empty.
+};
+
+/**
+ * Initialize a parallel writer and start its threads. Rows are then given to
+ * oil_libjpeg_writer_write_row() instead of jpeg_write_scanlines(), and
+ * oil_libjpeg_writer_finish() is used instead of jpeg_finish_compress().
+ * oil_libjpeg_writer_free() must be called even if this fails.
+ * @jw: Pointer to the struct to be initialized.
+ * @cinfo: Pointer to a libjpeg compress struct with its parameters set, that
+ *   has not been started. A restart marker is set for every MCU row, unless
+ *   restart_in_rows is already set.
+ * @threads: Number of worker threads.
+ *
+ * Errors found by the workers are raised through cinfo's error handler.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the settings of cinfo don't allow the image to be split into
+ *   bands. Nothing has changed, and the image should be written as usual.
+ * Returns -2 if unable to allocate memory or start the threads.
+ */
+int oil_libjpeg_writer_init(struct oil_libjpeg_writer *jw,
+	struct jpeg_compress_struct *cinfo, int threads);
+
+/**
+ * Queue a row for encoding. May write bands out to the destination of the
+ * compressor. Call jpeg_start_compress(), and write any markers, first.
+ * @jw: Pointer to an initialized writer.
+ * @row: The row, in the compressor's input color space.
+ */
+void oil_libjpeg_writer_write_row(struct oil_libjpeg_writer *jw,
+	unsigned char *row);
+
+/**
+ * Write out the remaining bands and the EOI marker, and terminate the
+ * destination. The compressor is left as jpeg_abort_compress() leaves it.
+ * @jw: Pointer to a writer that has been given every row.
+ */
+void oil_libjpeg_writer_finish(struct oil_libjpeg_writer *jw);
+
+/**
+ * Stop the worker threads and free the writer's buffers. The last warning the
+ * workers had from libjpeg is left in jw->warning, for the caller to report.
+ */
+void oil_libjpeg_writer_free(struct oil_libjpeg_writer *jw);
+
+/**
+ * Estimate the number of bytes libjpeg allocates when decompression starts. For
+ * multi-scan images this includes the coefficients of the whole image, which
+ * are held until the decompressor is aborted or destroyed.
+ * @dinfo: Pointer to a decompressor that has read the image header.
+ */
+size_t oil_libjpeg_decoder_mem_size(struct jpeg_decompress_struct *dinfo);
+
+/**
+ * Estimate the number of bytes allocated on the heap for decoding and scaling.
+ * @ol: Pointer to an initialized oil_libjpeg struct.
+ */
+size_t oil_libjpeg_mem_size(struct oil_libjpeg *ol);
+
+/**
+ * Read and scale the next output scanline.
+ * @ol: Pointer to an oil_libjpeg struct whose decompressor has started.
+ * @outbuf: Buffer to hold the scanline.
+ *
+ * Returns 1 once the scanline has been written to outbuf.
+ * Returns 0 if a suspending data source ran out of input. The rows read so far
+ *   have been kept, so call again once it has more.
+ */
+int oil_libjpeg_read_scanline(struct oil_libjpeg *ol, unsigned char *outbuf);
+
+/**
+ * A plane of a YCbCr image, scaled at its own resolution.
+ */
+struct oil_libjpeg_plane {
+	struct oil_scale os;
+	unsigned char *fifo; // decoded rows not yet taken by the scaler.
+	int fifo_start; // first row in fifo.
+	int fifo_pos; // row of the plane held at fifo_start.
+	int fifo_len; // number of rows in fifo.
+	int fifo_cap; // number of rows fifo can hold.
+	int in_stride; // length in bytes of a decoded row.
+	int in_rows; // rows decoded per iMCU row.
+	int in_left; // rows of the plane not yet decoded.
+	int in_width; // width of the decoded plane.
+	int in_height; // height of the decoded plane.
+	unsigned char *out; // one iMCU row of output for the compressor.
+	JSAMPROW *out_rows; // pointers to the rows of out.
+	int out_stride; // length in bytes of an output row, padded to a block.
+	int out_rows_imcu; // output rows per iMCU row.
+	int out_width; // width of the output plane.
+	int out_height; // height of the output plane.
+	int out_pos; // output rows produced so far.
+};
+
+/**
+ * Scale a YCbCr JPEG into a YCbCr JPEG through libjpeg's raw data interface,
+ * one plane at a time and at each plane's native resolution. This skips color
+ * conversion and chroma upsampling on decode and the reverse on encode.
+ * Samples are resampled as they are stored, without conversion to linear light.
+ *
+ * In linear mode the planes are instead converted to linear RGB as they enter
+ * the horizontal scaler, with chroma upsampling folded in, and the scaled
+ * pixels go straight back to YCbCr. The result is close to scaling libjpeg's
+ * RGB output, but skips the 8-bit sRGB image in between.
+ */
+struct oil_libjpeg_planar {
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfo;
+	struct oil_libjpeg_plane planes[3];
+	int num_ready; // number of planes with an initialized scaler.
+	JSAMPARRAY in_ptrs[3]; // row pointers given to jpeg_read_raw_data().
+	JSAMPROW *in_row_ptrs; // storage for in_ptrs.
+	unsigned char *scratch; // receives decoded rows below the image.
+	JSAMPARRAY out_ptrs[3]; // row pointers given to jpeg_write_raw_data().
+	int in_lines; // image rows per iMCU row of the decompressor.
+	int out_lines; // image rows per iMCU row of the compressor.
+	int linear; // scale in linear RGB with os instead of plane by plane.
+	struct oil_scale os; // scaler for all three planes in linear mode.
+	int in_h_shift; // 1 if input chroma has half the columns of luma.
+	int in_v_ratio; // luma rows per input chroma row.
+	int out_h_ratio; // luma columns per output chroma column.
+	int out_v_ratio; // luma rows per output chroma row.
+	float *chroma_in[2]; // Cb and Cr upsampled to the current luma row.
+	unsigned char *chroma_out[2]; // Cb and Cr of the last output row.
+	int *chroma_sum[2]; // Cb and Cr summed for downsampling.
+	int sum_rows; // number of output rows summed in chroma_sum.
+};
+
+/**
+ * Returns 1 if the image can be scaled with oil_libjpeg_planar.
+ * @dinfo: Pointer to a libjpeg decompress struct, with header already read.
+ * @linear: Whether linear mode will be used. It needs luma at full resolution
+ *   and chroma subsampled by at most two in each direction.
+ */
+int oil_libjpeg_planar_supported(struct jpeg_decompress_struct *dinfo,
+	int linear);
+
+/**
+ * Initialize an oil_libjpeg_planar struct and switch both libjpeg structs to
+ * raw data. Must be called before jpeg_start_compress() and
+ * oil_libjpeg_start_decompress(). oil_libjpeg_planar_free() must be called
+ * even if this fails.
+ * @op: Pointer to the struct to be initialized.
+ * @dinfo: Pointer to a libjpeg decompress struct, with header already read.
+ * @cinfo: Pointer to a YCbCr libjpeg compress struct, with parameters set. The
+ *   output planes are sized by its sampling factors.
+ * @out_width: Desired width, in pixels, of the output image.
+ * @out_height: Desired height, in pixels, of the output image.
+ * @linear: 1 to scale in linear RGB, 0 to scale each plane as stored.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad or the image is not supported.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libjpeg_planar_init(struct oil_libjpeg_planar *op,
+	struct jpeg_decompress_struct *dinfo, struct jpeg_compress_struct *cinfo,
+	int out_width, int out_height, int linear);
+
+/**
+ * Scale and write the next iMCU row, which is out_lines rows of the output
+ * image. Call this until the compressor has received the whole image.
+ * @op: Pointer to an initialized oil_libjpeg_planar struct.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libjpeg_planar_write(struct oil_libjpeg_planar *op);
+
+/**
+ * Get the number of bytes allocated on the heap for scaling.
+ * @op: Pointer to an initialized oil_libjpeg_planar struct.
+ */
+size_t oil_libjpeg_planar_mem_size(struct oil_libjpeg_planar *op);
+
+void oil_libjpeg_planar_free(struct oil_libjpeg_planar *op);
 
 enum oil_colorspace jpeg_cs_to_oil(J_COLOR_SPACE cs);
 
@@ -20,52 +20,272 @@
  */
 
 #include "oil_libpng.h"
+#include <limits.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <string.h>
+#ifdef HAVE_LIBDEFLATE
+#include <libdeflate.h>
+#endif
 
-static unsigned char **alloc_full_image_buf(int height, int rowbytes)
+/* Smallest amount of filtered data deflated on its own by a parallel writer. */
+#define GROUP_BYTES (128 * 1024)
+
+/* Size of the deflate window. Each group is primed with this much history. */
+#define DICT_BYTES 32768
+
+/* Largest IDAT chunk written from a libdeflate stream. */
+#define IDAT_BYTES (1024 * 1024)
+
+/* First column, column step, first row and row step of each Adam7 pass. */
+static const int adam7_x0[7] = { 0, 4, 0, 2, 0, 1, 0 };
+static const int adam7_dx[7] = { 8, 8, 4, 4, 2, 2, 1 };
+static const int adam7_y0[7] = { 0, 0, 4, 0, 2, 0, 1 };
+static const int adam7_dy[7] = { 8, 8, 8, 4, 4, 2, 2 };
+
+/* Number of rows or columns of an image that fall in an Adam7 pass. */
+static int adam7_len(int len, int start, int step)
 {
-	int i, j;
-	unsigned char **imgbuf;
+	return len > start ? (len - start + step - 1) / step : 0;
+}
 
-	imgbuf = malloc(height * sizeof(unsigned char *));
-	if (!imgbuf) {
-		return NULL;
+/* Give the scaler a row as libpng returns it, looking up indexed rows. */
+static void scale_in(struct oil_libpng *ol, unsigned char *row)
+{
+	if (ol->pal) {
+		oil_scale_in_palette(&ol->os, row, ol->pal);
+	} else if (ol->in16) {
+		oil_scale_in16(&ol->os, row);
+	} else {
+		oil_scale_in(&ol->os, row);
 	}
-	for (i=0; i<height; i++) {
-		imgbuf[i] = malloc(rowbytes);
-		if (!imgbuf[i]) {
-			for (j=0; j<i-1; j++) {
-				free(imgbuf[j]);
-			}
-			free(imgbuf);
-			return NULL;
+}
+
+static void scale_x(struct oil_libpng *ol, unsigned char *row, float *out)
+{
+	if (ol->pal) {
+		oil_scale_x_palette(&ol->os, row, ol->pal, out);
+	} else if (ol->in16) {
+		oil_scale_x16(&ol->os, row, out);
+	} else {
+		oil_scale_x(&ol->os, row, out);
+	}
+}
+
+static void scale_out(struct oil_libpng *ol, unsigned char *outbuf)
+{
+	if (ol->out_depth == 16) {
+		oil_scale_out16(&ol->os, outbuf);
+	} else if (ol->bg) {
+		oil_scale_out_flat(&ol->os, outbuf, ol->bg);
+	} else {
+		oil_scale_out(&ol->os, outbuf);
+	}
+}
+
+/* Copy row i of one of the first six Adam7 passes into the even rows. When
+ * they are kept scaled, the first five passes go to ol->quarter, which holds
+ * their even columns, and each row of the sixth pass fills in the odd columns
+ * of a row, which is then scaled. inbuf has room for the pass row and the row
+ * it completes.
+ */
+static void store_pass_row(struct oil_libpng *ol, int pass, int i,
+	unsigned char *row)
+{
+	int j, y, width, bpp;
+	size_t rowbytes, quarter_len;
+	unsigned char *dst, *full;
+
+	rowbytes = png_get_rowbytes(ol->rpng, ol->rinfo);
+	bpp = rowbytes / ol->os.in_width;
+	y = (adam7_y0[pass] + i * adam7_dy[pass]) / 2;
+	width = adam7_len(ol->os.in_width, adam7_x0[pass], adam7_dx[pass]);
+	quarter_len = (size_t)(ol->os.in_width + 1) / 2 * bpp;
+
+	if (!ol->even_scaled) {
+		dst = ol->even + y * ol->even_len;
+		for (j=0; j<width; j++) {
+			memcpy(dst + (adam7_x0[pass] + j * adam7_dx[pass]) * bpp,
+				row + j * bpp, bpp);
+		}
+	} else if (pass < 5) {
+		dst = ol->quarter + y * quarter_len;
+		for (j=0; j<width; j++) {
+			memcpy(dst + ((adam7_x0[pass] + j * adam7_dx[pass]) >> 1) *
+				bpp, row + j * bpp, bpp);
+		}
+	} else {
+		dst = ol->quarter + y * quarter_len;
+		full = ol->inbuf + rowbytes;
+		for (j=0; j<ol->os.in_width; j++) {
+			memcpy(full + j * bpp, (j & 1 ? row : dst) + (j >> 1) * bpp,
+				bpp);
 		}
+		scale_x(ol, full, (float *)(ol->even + y * ol->even_len));
+	}
+
+	if (!--ol->pass_rows) {
+		free(ol->quarter);
+		ol->quarter = NULL;
 	}
-	return imgbuf;
 }
 
-static void free_full_image_buf(unsigned char **imgbuf, int height)
+/* Set up the even rows of an interlaced image. They are kept scaled when that
+ * takes less memory, which the scaled mode can only do when there is a sixth
+ * pass to fill in the odd columns.
+ */
+static int init_even_rows(struct oil_libpng *ol, size_t rowbytes)
 {
-	int i;
-	for (i=0; i<height; i++) {
-		free(imgbuf[i]);
+	int pass, bpp, even_height;
+	size_t quarter_len;
+
+	bpp = rowbytes / ol->os.in_width;
+	even_height = (ol->os.in_height + 1) / 2;
+	quarter_len = (size_t)(ol->os.in_width + 1) / 2 * bpp;
+	ol->even_scaled = quarter_len + ol->os.sl_len * sizeof(float) < rowbytes;
+	ol->even_len = ol->even_scaled ? ol->os.sl_len * sizeof(float) : rowbytes;
+
+	/* libpng skips passes that are empty. */
+	ol->pass_rows = 0;
+	for (pass=0; pass<6; pass++) {
+		if (adam7_len(ol->os.in_width, adam7_x0[pass], adam7_dx[pass])) {
+			ol->pass_rows += adam7_len(ol->os.in_height,
+				adam7_y0[pass], adam7_dy[pass]);
+		}
+	}
+
+	ol->even = malloc(ol->even_len * even_height);
+	if (!ol->even) {
+		return -2;
+	}
+	if (ol->even_scaled) {
+		ol->quarter = malloc(quarter_len * even_height);
+		if (!ol->quarter) {
+			return -2;
+		}
 	}
-	free(imgbuf);
+	return 0;
 }
 
-int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
+/* Read the first six Adam7 passes into ol->even. */
+static void read_even_rows(struct oil_libpng *ol)
+{
+	int i, pass, height;
+
+	for (pass=0; pass<6; pass++) {
+		if (!adam7_len(ol->os.in_width, adam7_x0[pass], adam7_dx[pass])) {
+			continue;
+		}
+		height = adam7_len(ol->os.in_height, adam7_y0[pass],
+			adam7_dy[pass]);
+		for (i=0; i<height; i++) {
+			png_read_row(ol->rpng, ol->inbuf, NULL);
+			store_pass_row(ol, pass, i, ol->inbuf);
+		}
+	}
+}
+
+/* Returns 1 if rows are left as indices and looked up in ol->pal. Interlaced
+ * palette images are unpacked to a byte per index by libpng, but interlaced
+ * gray ones are expanded, which leaves nothing to look up.
+ */
+static int indexed(png_structp rpng, png_infop rinfo)
+{
+	if (png_get_color_type(rpng, rinfo) == PNG_COLOR_TYPE_PALETTE) {
+		return 1;
+	}
+	return png_get_bit_depth(rpng, rinfo) < 8 &&
+		png_get_interlace_type(rpng, rinfo) != PNG_INTERLACE_ADAM7;
+}
+
+void oil_libpng_set_transforms(png_structp rpng, png_infop rinfo)
+{
+	if (!indexed(rpng, rinfo)) {
+		png_set_expand(rpng);
+	} else if (png_get_interlace_type(rpng, rinfo) == PNG_INTERLACE_ADAM7) {
+		png_set_packing(rpng);
+	}
+	png_read_update_info(rpng, rinfo);
+}
+
+png_byte oil_libpng_color_type(png_structp rpng, png_infop rinfo)
+{
+	int trns;
+
+	trns = png_get_valid(rpng, rinfo, PNG_INFO_tRNS) != 0;
+	if (png_get_color_type(rpng, rinfo) == PNG_COLOR_TYPE_PALETTE) {
+		return trns ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB;
+	}
+	if (png_get_bit_depth(rpng, rinfo) < 8) {
+		return trns ? PNG_COLOR_TYPE_GA : PNG_COLOR_TYPE_GRAY;
+	}
+	return png_get_color_type(rpng, rinfo);
+}
+
+/* Build the lookup table for palette images and gray images with fewer than 8
+ * bits per sample. Palette entries missing from PLTE or tRNS are opaque black.
+ */
+static int init_palette(struct oil_libpng *ol)
+{
+	png_colorp plte;
+	png_bytep trans;
+	png_color_16p trans_color;
+	int i, num_plte, num_trans, depth, max;
+	unsigned char samples[4];
+
+	ol->pal = malloc(sizeof(struct oil_palette));
+	if (!ol->pal) {
+		return -2;
+	}
+	depth = png_get_bit_depth(ol->rpng, ol->rinfo);
+	ol->pal->depth = depth;
+
+	num_plte = num_trans = 0;
+	plte = NULL;
+	trans = NULL;
+	trans_color = NULL;
+	if (png_get_valid(ol->rpng, ol->rinfo, PNG_INFO_PLTE)) {
+		png_get_PLTE(ol->rpng, ol->rinfo, &plte, &num_plte);
+	}
+	if (png_get_valid(ol->rpng, ol->rinfo, PNG_INFO_tRNS)) {
+		png_get_tRNS(ol->rpng, ol->rinfo, &trans, &num_trans, &trans_color);
+	}
+
+	max = (1 << depth) - 1;
+	for (i=0; i<=max; i++) {
+		if (png_get_color_type(ol->rpng, ol->rinfo) == PNG_COLOR_TYPE_PALETTE) {
+			samples[0] = i < num_plte ? plte[i].red : 0;
+			samples[1] = i < num_plte ? plte[i].green : 0;
+			samples[2] = i < num_plte ? plte[i].blue : 0;
+			samples[3] = i < num_trans ? trans[i] : 255;
+		} else {
+			samples[0] = i * 255 / max;
+			samples[1] = trans_color && trans_color->gray == i ? 0 : 255;
+		}
+		oil_palette_set(ol->pal, ol->os.cs, i, samples);
+	}
+	return 0;
+}
+
+/* Set up the scaler and buffers without reading any rows. */
+static int init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
 	int out_width, int out_height)
 {
-	int ret, in_width, in_height, buf_len;
+	int ret, in_width, in_height, buf_len, interlaced;
 	enum oil_colorspace cs;
 
 	ol->rpng = rpng;
 	ol->rinfo = rinfo;
 	ol->in_vpos = 0;
 	ol->inbuf = NULL;
-	ol->inimage = NULL;
+	ol->even = NULL;
+	ol->quarter = NULL;
+	ol->pal = NULL;
+	ol->in16 = png_get_bit_depth(rpng, rinfo) == 16;
+	ol->out_depth = 8;
+	ol->bg = NULL;
 
-	cs = png_cs_to_oil(png_get_color_type(rpng, rinfo));
+	cs = png_cs_to_oil(oil_libpng_color_type(rpng, rinfo));
 	if (cs == OIL_CS_UNKNOWN) {
 		return -1;
 	}
@@ -80,44 +300,95 @@ int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
 	}
 
 	buf_len = png_get_rowbytes(rpng, rinfo);
-	switch (png_get_interlace_type(rpng, rinfo)) {
-	case PNG_INTERLACE_NONE:
-		ol->inbuf = malloc(buf_len);
-		if (!ol->inbuf) {
-			oil_scale_free(&ol->os);
-			return -2;
-		}
-		break;
-	case PNG_INTERLACE_ADAM7:
-		ol->inimage = alloc_full_image_buf(in_height, buf_len);
-		if (!ol->inimage) {
-			oil_scale_free(&ol->os);
-			return -2;
-		}
-		png_read_image(rpng, ol->inimage);
-		break;
+	interlaced = png_get_interlace_type(rpng, rinfo) == PNG_INTERLACE_ADAM7;
+	ol->inbuf = malloc(interlaced ? 2 * buf_len : buf_len);
+	if (!ol->inbuf) {
+		oil_scale_free(&ol->os);
+		return -2;
+	}
+	if ((interlaced && init_even_rows(ol, buf_len)) ||
+		(indexed(rpng, rinfo) && init_palette(ol))) {
+		oil_libpng_free(ol);
+		return -2;
 	}
 
 	return 0;
 }
 
+int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
+	int out_width, int out_height)
+{
+	int ret;
+
+	ret = init(ol, rpng, rinfo, out_width, out_height);
+	if (!ret && ol->even) {
+		read_even_rows(ol);
+	}
+	return ret;
+}
+
+int oil_libpng_push_init(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, int out_width, int out_height)
+{
+	return init(ol, rpng, rinfo, out_width, out_height);
+}
+
 void oil_libpng_free(struct oil_libpng *ol)
 {
 	if (ol->inbuf) {
 		free(ol->inbuf);
 	}
-	if (ol->inimage) {
-		free_full_image_buf(ol->inimage, ol->os.in_height);
-	}
+	free(ol->even);
+	free(ol->quarter);
+	free(ol->pal);
+	ol->inbuf = ol->even = ol->quarter = NULL;
+	ol->pal = NULL;
 	oil_scale_free(&ol->os);
 }
 
+size_t oil_libpng_mem_size(struct oil_libpng *ol)
+{
+	size_t size, rowbytes;
+
+	size = oil_scale_mem_size(&ol->os);
+	rowbytes = png_get_rowbytes(ol->rpng, ol->rinfo);
+	if (ol->even) {
+		size += 2 * rowbytes + ol->even_len * ((ol->os.in_height + 1) / 2);
+	} else if (ol->inbuf) {
+		size += rowbytes;
+	}
+	if (ol->pal) {
+		size += sizeof(struct oil_palette);
+	}
+	return size;
+}
+
+/* Give the scaler the next even row of an interlaced image. */
+static void scale_in_even(struct oil_libpng *ol)
+{
+	unsigned char *row;
+
+	row = ol->even + (ol->in_vpos++ >> 1) * ol->even_len;
+	if (ol->even_scaled) {
+		oil_scale_in_x(&ol->os, (float *)row);
+	} else {
+		scale_in(ol, row);
+	}
+}
+
+/* Odd rows come from the last Adam7 pass, which holds them in full. */
 static void read_scanline_interlaced(struct oil_libpng *ol, unsigned char *outbuf)
 {
 	int i;
 
 	for (i=oil_scale_slots(&ol->os); i>0; i--) {
-		oil_scale_in(&ol->os, ol->inimage[ol->in_vpos++]);
+		if (ol->in_vpos & 1) {
+			png_read_row(ol->rpng, ol->inbuf, NULL);
+			scale_in(ol, ol->inbuf);
+			ol->in_vpos++;
+		} else {
+			scale_in_even(ol);
+		}
 	}
 }
 
@@ -127,7 +398,7 @@ static void read_scanline(struct oil_libpng *ol, unsigned char *outbuf)
 
 	for (i=oil_scale_slots(&ol->os); i>0; i--) {
 		png_read_row(ol->rpng, ol->inbuf, NULL);
-		oil_scale_in(&ol->os, ol->inbuf);
+		scale_in(ol, ol->inbuf);
 	}
 }
 
@@ -141,7 +412,33 @@ void oil_libpng_read_scanline(struct oil_libpng *ol, unsigned char *outbuf)
 		read_scanline_interlaced(ol, outbuf);
 		break;
 	}
-	oil_scale_out(&ol->os, outbuf);
+	scale_out(ol, outbuf);
+}
+
+void oil_libpng_push_row(struct oil_libpng *ol, unsigned char *row,
+	png_uint_32 row_num, int pass)
+{
+	if (ol->even && pass < 6) {
+		store_pass_row(ol, pass, row_num, row);
+		return;
+	}
+	scale_in(ol, row);
+	ol->in_vpos++;
+}
+
+int oil_libpng_push_scanline(struct oil_libpng *ol, unsigned char *outbuf)
+{
+	if (ol->os.out_pos >= ol->os.out_height) {
+		return 0;
+	}
+	while (oil_scale_slots(&ol->os) > 0) {
+		if (!ol->even || ol->pass_rows || ol->in_vpos & 1) {
+			return 0;
+		}
+		scale_in_even(ol);
+	}
+	scale_out(ol, outbuf);
+	return 1;
 }
 
 enum oil_colorspace png_cs_to_oil(png_byte cs)
@@ -159,3 +456,1239 @@ enum oil_colorspace png_cs_to_oil(png_byte cs)
 		return OIL_CS_UNKNOWN;
 	}
 }
+
+static void read_mem(png_structp rpng, png_bytep data, png_size_t length)
+{
+	struct oil_mem *mem;
+
+	mem = (struct oil_mem *)png_get_io_ptr(rpng);
+	if (length > mem->len - mem->pos) {
+		png_error(rpng, "Unexpected end of image data.");
+		return;
+	}
+	memcpy(data, mem->data + mem->pos, length);
+	mem->pos += length;
+}
+
+void oil_libpng_encode_defaults(struct oil_libpng_encode *enc)
+{
+	enc->level = -1;
+	enc->filters = 0;
+	enc->strategy = -1;
+	enc->threads = 1;
+	enc->libdeflate = 0;
+	enc->depth = 8;
+	enc->reduce = 0;
+	enc->colors = 0;
+	enc->dither = 0;
+}
+
+void oil_libpng_encode_fast(struct oil_libpng_encode *enc)
+{
+	enc->level = 1;
+	enc->filters = PNG_FILTER_UP;
+	enc->strategy = Z_RLE;
+}
+
+int oil_libpng_writer_needed(struct oil_libpng_encode *enc)
+{
+	return enc->threads > 1 || enc->libdeflate;
+}
+
+void oil_libpng_compress_encode(png_structp wpng, struct oil_libpng_encode *enc)
+{
+	if (enc->level >= 0) {
+		png_set_compression_level(wpng, enc->level);
+	}
+	if (enc->filters) {
+		png_set_filter(wpng, PNG_FILTER_TYPE_BASE, enc->filters);
+	}
+	if (enc->strategy >= 0) {
+		png_set_compression_strategy(wpng, enc->strategy);
+	}
+}
+
+void oil_libpng_mem_src(png_structp rpng, struct oil_mem *mem)
+{
+	mem->pos = 0;
+	png_set_read_fn(rpng, mem, read_mem);
+}
+
+/* Output color reduction */
+
+/* Bytes of output held to decide on the color type. */
+#define REDUCE_BYTES (4 * 1024 * 1024)
+
+/* Slots in the table of colors looked up in the palette. A power of two with
+ * room for every color of an exact palette.
+ */
+#define REDUCE_SLOTS 4096
+
+/* Sample i of a color packed by reduce_rgba(), red first. */
+#define RGBA_SAMPLE(color, i) ((color) >> (24 - 8 * (i)) & 255)
+
+struct oil_reduce_slot {
+	unsigned int color; // RGBA, red in the top byte.
+	int index; // palette entry, or -1 if the slot is empty.
+};
+
+/* Pack pixel x of a scanline into an unsigned int, red in the top byte. */
+static unsigned int reduce_rgba(unsigned char *in, int cmp, int x)
+{
+	unsigned char *p;
+
+	p = in + x * cmp;
+	switch (cmp) {
+	case 1:
+		return (unsigned int)p[0] << 24 | p[0] << 16 | p[0] << 8 | 255;
+	case 2:
+		return (unsigned int)p[0] << 24 | p[0] << 16 | p[0] << 8 | p[1];
+	case 3:
+		return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | 255;
+	}
+	return (unsigned int)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static unsigned int reduce_hash(unsigned int color)
+{
+	return (color * 2654435761u) >> 20 & (REDUCE_SLOTS - 1);
+}
+
+static void reduce_clear(struct oil_reduce_slot *slots)
+{
+	int i;
+
+	for (i=0; i<REDUCE_SLOTS; i++) {
+		slots[i].index = -1;
+	}
+}
+
+/* Find the slot of a color in an exact palette, or the empty slot where it
+ * belongs.
+ */
+static struct oil_reduce_slot *reduce_slot(struct oil_reduce_slot *slots,
+	unsigned int color)
+{
+	unsigned int i;
+
+	i = reduce_hash(color);
+	while (slots[i].index != -1 && slots[i].color != color) {
+		i = (i + 1) & (REDUCE_SLOTS - 1);
+	}
+	return slots + i;
+}
+
+/* Distance from a color to palette entry i, or best if it is no nearer. */
+static int reduce_distance(struct oil_libpng_reduce *r, int *s, int i, int best)
+{
+	unsigned char *p;
+	int c, d, e;
+
+	p = r->pal + i * 4;
+	d = 0;
+	for (c=0; c<4 && d<best; c++) {
+		e = s[c] - p[c];
+		d += e * e;
+	}
+	return d < best ? d : best;
+}
+
+/* Search the entries outward from the one nearest in green, in each direction
+ * until green alone is further away than the best match so far.
+ */
+static int reduce_nearest(struct oil_libpng_reduce *r, int *s)
+{
+	int lo, hi, mid, i, d, e, best, best_d;
+
+	lo = 0;
+	hi = r->num_pal;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (r->pal[r->order[mid] * 4 + 1] < s[1]) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	hi = lo;
+	lo--;
+
+	best = r->order[hi < r->num_pal ? hi : lo];
+	best_d = INT_MAX;
+	while (lo >= 0 || hi < r->num_pal) {
+		if (hi < r->num_pal) {
+			i = r->order[hi++];
+			e = r->pal[i * 4 + 1] - s[1];
+			if (e * e >= best_d) {
+				hi = r->num_pal;
+			} else if ((d = reduce_distance(r, s, i, best_d)) < best_d) {
+				best = i;
+				best_d = d;
+			}
+		}
+		if (lo >= 0) {
+			i = r->order[lo--];
+			e = r->pal[i * 4 + 1] - s[1];
+			if (e * e >= best_d) {
+				lo = -1;
+			} else if ((d = reduce_distance(r, s, i, best_d)) < best_d) {
+				best = i;
+				best_d = d;
+			}
+		}
+	}
+	return best;
+}
+
+/* Nearest palette entry to a color. Each slot caches the last color that
+ * hashed to it.
+ */
+static int reduce_lookup(struct oil_libpng_reduce *r, unsigned int color)
+{
+	struct oil_reduce_slot *slot;
+	int c, s[4];
+
+	slot = r->slots + reduce_hash(color);
+	if (slot->index == -1 || slot->color != color) {
+		for (c=0; c<4; c++) {
+			s[c] = RGBA_SAMPLE(color, c);
+		}
+		slot->color = color;
+		slot->index = reduce_nearest(r, s);
+	}
+	return slot->index;
+}
+
+/* Widest channel of n pixels, and its range. */
+static int box_widest(unsigned int *px, size_t n, int *channel)
+{
+	int lo[4] = { 255, 255, 255, 255 }, hi[4] = { 0, 0, 0, 0 };
+	int c, v, best;
+	size_t i;
+
+	for (i=0; i<n; i++) {
+		for (c=0; c<4; c++) {
+			v = RGBA_SAMPLE(px[i], c);
+			lo[c] = v < lo[c] ? v : lo[c];
+			hi[c] = v > hi[c] ? v : hi[c];
+		}
+	}
+	best = 0;
+	for (c=1; c<4; c++) {
+		if (hi[c] - lo[c] > hi[best] - lo[best]) {
+			best = c;
+		}
+	}
+	*channel = best;
+	return hi[best] - lo[best];
+}
+
+/* Move the pixels at or below the median of a channel first, and return how
+ * many there are. The channel must not be flat, so that neither part is empty.
+ */
+static size_t box_split(unsigned int *px, size_t n, int channel)
+{
+	size_t hist[256], sum, i, j;
+	unsigned int tmp;
+	int m;
+
+	memset(hist, 0, sizeof(hist));
+	for (i=0; i<n; i++) {
+		hist[RGBA_SAMPLE(px[i], channel)]++;
+	}
+	sum = 0;
+	for (m=0; m<255; m++) {
+		sum += hist[m];
+		if (sum >= n / 2) {
+			break;
+		}
+	}
+	if (m == 255 || sum == n) {
+		for (m--; !hist[m]; m--);
+	}
+
+	i = 0;
+	j = n;
+	while (i < j) {
+		if ((int)RGBA_SAMPLE(px[i], channel) <= m) {
+			i++;
+		} else {
+			tmp = px[--j];
+			px[j] = px[i];
+			px[i] = tmp;
+		}
+	}
+	return i;
+}
+
+/* Build a palette of up to r->colors entries from the scanlines held, by
+ * splitting the box with the most pixels times range at its median until
+ * there are enough boxes. Each entry is the mean of its box.
+ */
+static int reduce_median_cut(struct oil_libpng_reduce *r)
+{
+	size_t start[256], end[256], n, i, k, sum[4];
+	int range[256], channel[256], b, best, c, num;
+	unsigned int *px;
+
+	n = (size_t)r->held_rows * r->width;
+	px = malloc(n * sizeof(unsigned int));
+	if (!px) {
+		return -2;
+	}
+	for (i=0; i<n; i++) {
+		px[i] = reduce_rgba(r->held, r->cmp, i);
+		if (!(px[i] & 255)) {
+			px[i] = 0;
+		}
+	}
+
+	num = 1;
+	start[0] = 0;
+	end[0] = n;
+	range[0] = box_widest(px, n, channel);
+	while (num < r->colors) {
+		best = -1;
+		for (b=0; b<num; b++) {
+			if (range[b] && (best == -1 ||
+				(double)range[b] * (end[b] - start[b]) >
+				(double)range[best] * (end[best] - start[best]))) {
+				best = b;
+			}
+		}
+		if (best == -1) {
+			break;
+		}
+		k = box_split(px + start[best], end[best] - start[best],
+			channel[best]);
+		start[num] = start[best] + k;
+		end[num] = end[best];
+		end[best] = start[num];
+		range[best] = box_widest(px + start[best], k, channel + best);
+		range[num] = box_widest(px + start[num], end[num] - start[num],
+			channel + num);
+		num++;
+	}
+
+	for (b=0; b<num; b++) {
+		memset(sum, 0, sizeof(sum));
+		for (i=start[b]; i<end[b]; i++) {
+			for (c=0; c<4; c++) {
+				sum[c] += RGBA_SAMPLE(px[i], c);
+			}
+		}
+		k = end[b] - start[b];
+		for (c=0; c<4; c++) {
+			r->pal[b * 4 + c] = (sum[c] + k / 2) / k;
+		}
+	}
+	r->num_pal = num;
+	free(px);
+	return 0;
+}
+
+/* Move the translucent entries of the palette first, so that tRNS can leave
+ * out the opaque ones. Slots of an exact palette are updated to match.
+ */
+static void reduce_sort_palette(struct oil_libpng_reduce *r)
+{
+	unsigned char sorted[256 * 4];
+	int map[256], i, n, opaque;
+
+	n = 0;
+	for (opaque=0; opaque<2; opaque++) {
+		for (i=0; i<r->num_pal; i++) {
+			if ((r->pal[i * 4 + 3] == 255) == opaque) {
+				map[i] = n;
+				memcpy(sorted + n * 4, r->pal + i * 4, 4);
+				n++;
+			}
+		}
+	}
+	memcpy(r->pal, sorted, n * 4);
+	for (i=0; i<REDUCE_SLOTS; i++) {
+		if (r->slots[i].index != -1) {
+			r->slots[i].index = map[r->slots[i].index];
+		}
+	}
+}
+
+static int palette_depth(int num)
+{
+	return num <= 2 ? 1 : num <= 4 ? 2 : num <= 16 ? 4 : 8;
+}
+
+static void reduce_use_palette(struct oil_libpng_reduce *r)
+{
+	int i;
+
+	r->color_type = PNG_COLOR_TYPE_PALETTE;
+	r->depth = palette_depth(r->num_pal);
+	r->channels = 1;
+	r->num_trans = 0;
+	for (i=0; i<r->num_pal; i++) {
+		if (r->pal[i * 4 + 3] != 255) {
+			r->num_trans = i + 1;
+		}
+	}
+}
+
+/* Quantize to the palette of the source if it is small enough, or else to
+ * one built from the scanlines held.
+ */
+static int reduce_quantize(struct oil_libpng_reduce *r)
+{
+	int i, j, green, ret;
+
+	reduce_clear(r->slots);
+	if (r->src_num && r->src_num <= r->colors) {
+		memcpy(r->pal, r->src_pal, r->src_num * 4);
+		r->num_pal = r->src_num;
+	} else {
+		ret = reduce_median_cut(r);
+		if (ret) {
+			return ret;
+		}
+		reduce_sort_palette(r);
+	}
+	r->quantize = 1;
+	reduce_use_palette(r);
+
+	/* Order the entries by green for reduce_nearest(). */
+	for (i=0; i<r->num_pal; i++) {
+		green = r->pal[i * 4 + 1];
+		for (j=i; j>0 && r->pal[r->order[j - 1] * 4 + 1] > green; j--) {
+			r->order[j] = r->order[j - 1];
+		}
+		r->order[j] = i;
+	}
+	return 0;
+}
+
+/* Decide on the color type from the scanlines held, and from what the source
+ * guarantees about the scanlines to come.
+ */
+static int reduce_decide(struct oil_libpng_reduce *r)
+{
+	struct oil_reduce_slot *slot;
+	unsigned int color, v;
+	int i, x, y, gray, opaque, num, gray_depth, ok1, ok2, ok4;
+
+	r->decided = 1;
+	gray = opaque = ok1 = ok2 = ok4 = 1;
+	num = 0;
+	reduce_clear(r->slots);
+	for (y=0; y<r->held_rows; y++) {
+		for (x=0; x<r->width; x++) {
+			color = reduce_rgba(r->held, r->cmp, y * r->width + x);
+			v = RGBA_SAMPLE(color, 0);
+			gray = gray && v == RGBA_SAMPLE(color, 1) &&
+				v == RGBA_SAMPLE(color, 2);
+			opaque = opaque && (color & 255) == 255;
+			ok1 = ok1 && v % 255 == 0;
+			ok2 = ok2 && v % 85 == 0;
+			ok4 = ok4 && v % 17 == 0;
+			if (num > 256) {
+				continue;
+			}
+			slot = reduce_slot(r->slots, color);
+			if (slot->index == -1 && num++ < 256) {
+				slot->color = color;
+				slot->index = num - 1;
+				for (i=0; i<4; i++) {
+					r->pal[slot->index * 4 + i] =
+						RGBA_SAMPLE(color, i);
+				}
+			}
+		}
+	}
+	gray_depth = ok1 ? 1 : ok2 ? 2 : ok4 ? 4 : 8;
+	if (r->held_rows < r->height) {
+		gray = gray && (r->cmp < 3 || r->src_gray);
+		opaque = opaque && (r->cmp % 2 || r->src_opaque);
+		num = 257;
+		/* Scaled rows may have any gray level, whatever the source depth. */
+		gray_depth = 8;
+	}
+
+	if (r->colors && num > r->colors) {
+		return reduce_quantize(r);
+	}
+
+	if (gray && opaque && gray_depth <= palette_depth(num)) {
+		r->color_type = PNG_COLOR_TYPE_GRAY;
+		r->depth = gray_depth;
+		r->channels = 1;
+	} else if (num <= 256) {
+		r->num_pal = num;
+		reduce_sort_palette(r);
+		reduce_use_palette(r);
+	} else {
+		r->color_type = gray ? PNG_COLOR_TYPE_GRAY : PNG_COLOR_TYPE_RGB;
+		if (!opaque) {
+			r->color_type |= PNG_COLOR_MASK_ALPHA;
+		}
+		r->depth = 8;
+		r->channels = (gray ? 1 : 3) + !opaque;
+	}
+	return 0;
+}
+
+int oil_libpng_reduce_init(struct oil_libpng_reduce *r, png_structp rpng,
+	png_infop rinfo, int width, int height, int cmp,
+	struct oil_libpng_encode *enc)
+{
+	png_colorp plte;
+	png_bytep trans;
+	png_color_16p trans_color;
+	int i, num_plte, num_trans;
+	unsigned char *p;
+	size_t rowbytes;
+
+	memset(r, 0, sizeof(struct oil_libpng_reduce));
+	if (width < 1 || height < 1 || cmp < 1 || cmp > 4 || enc->colors < 0 ||
+		enc->colors == 1 || enc->colors > 256) {
+		return -1;
+	}
+	r->width = width;
+	r->height = height;
+	r->cmp = cmp;
+	r->colors = enc->colors;
+	r->dither = enc->colors && enc->dither;
+
+	if (png_get_color_type(rpng, rinfo) == PNG_COLOR_TYPE_PALETTE) {
+		num_plte = num_trans = 0;
+		plte = NULL;
+		trans = NULL;
+		if (png_get_valid(rpng, rinfo, PNG_INFO_PLTE)) {
+			png_get_PLTE(rpng, rinfo, &plte, &num_plte);
+		}
+		if (png_get_valid(rpng, rinfo, PNG_INFO_tRNS)) {
+			png_get_tRNS(rpng, rinfo, &trans, &num_trans,
+				&trans_color);
+		}
+		r->src_gray = r->src_opaque = 1;
+		for (i=0; i<num_plte; i++) {
+			p = r->src_pal + i * 4;
+			p[0] = plte[i].red;
+			p[1] = plte[i].green;
+			p[2] = plte[i].blue;
+			p[3] = i < num_trans ? trans[i] : 255;
+			r->src_gray = r->src_gray && p[0] == p[1] && p[1] == p[2];
+			r->src_opaque = r->src_opaque && p[3] == 255;
+		}
+		r->src_num = num_plte;
+	}
+
+	/* Only a palette needs more than the first scanline when the whole
+	 * output can't be held.
+	 */
+	rowbytes = (size_t)width * cmp;
+	r->max_rows = REDUCE_BYTES / rowbytes;
+	if (r->max_rows >= height) {
+		r->max_rows = height;
+	} else if (!r->colors || r->max_rows < 1) {
+		r->max_rows = 1;
+	}
+
+	r->held = malloc(r->max_rows * rowbytes);
+	r->slots = malloc(REDUCE_SLOTS * sizeof(struct oil_reduce_slot));
+	r->row = malloc(rowbytes);
+	if (r->dither) {
+		r->err = calloc(2 * ((size_t)width + 2) * 4, sizeof(int));
+	}
+	if (!r->held || !r->slots || !r->row || (r->dither && !r->err)) {
+		return -2;
+	}
+	return 0;
+}
+
+int oil_libpng_reduce_push(struct oil_libpng_reduce *r, unsigned char *in)
+{
+	size_t rowbytes;
+
+	rowbytes = (size_t)r->width * r->cmp;
+	if (r->decided && r->out_rows == r->held_rows) {
+		r->held_rows = r->out_rows = 0;
+	}
+	memcpy(r->held + r->held_rows * rowbytes, in, rowbytes);
+	r->held_rows++;
+	r->in_rows++;
+	if (!r->decided &&
+		(r->held_rows == r->max_rows || r->in_rows == r->height)) {
+		return reduce_decide(r);
+	}
+	return 0;
+}
+
+/* Pack a row of one byte per pixel to depth bits per pixel, in place. */
+static void reduce_pack(unsigned char *row, int width, int depth)
+{
+	int x, per, shift;
+	unsigned char b;
+
+	per = 8 / depth;
+	b = 0;
+	for (x=0; x<width; x++) {
+		shift = 8 - depth * (x % per + 1);
+		b = (x % per ? b : 0) | row[x] << shift;
+		if (!shift || x == width - 1) {
+			row[x / per] = b;
+		}
+	}
+}
+
+/* Map a row to the palette, spreading the error of each pixel to the right
+ * and to the row below. Transparent pixels neither take nor give error.
+ */
+static void reduce_dither_row(struct oil_libpng_reduce *r, unsigned char *in)
+{
+	int *cur, *next, x, c, e, idx, s[4];
+	unsigned int color;
+	unsigned char *p;
+	size_t len;
+
+	len = ((size_t)r->width + 2) * 4;
+	cur = r->err;
+	next = r->err + len;
+	for (x=0; x<r->width; x++) {
+		color = reduce_rgba(in, r->cmp, x);
+		if (!(color & 255)) {
+			r->row[x] = reduce_lookup(r, 0);
+			continue;
+		}
+		for (c=0; c<4; c++) {
+			s[c] = RGBA_SAMPLE(color, c) + cur[(x + 1) * 4 + c] / 16;
+			s[c] = s[c] < 0 ? 0 : s[c] > 255 ? 255 : s[c];
+		}
+		idx = reduce_lookup(r, (unsigned int)s[0] << 24 | s[1] << 16 |
+			s[2] << 8 | s[3]);
+		r->row[x] = idx;
+		p = r->pal + idx * 4;
+		for (c=0; c<4; c++) {
+			e = s[c] - p[c];
+			cur[(x + 2) * 4 + c] += e * 7;
+			next[x * 4 + c] += e * 3;
+			next[(x + 1) * 4 + c] += e * 5;
+			next[(x + 2) * 4 + c] += e;
+		}
+	}
+	memcpy(cur, next, len * sizeof(int));
+	memset(next, 0, len * sizeof(int));
+}
+
+unsigned char *oil_libpng_reduce_pop(struct oil_libpng_reduce *r)
+{
+	unsigned char *in, *p;
+	unsigned int color;
+	int x, max;
+
+	if (!r->decided || r->out_rows == r->held_rows) {
+		return NULL;
+	}
+	in = r->held + (size_t)r->out_rows * r->width * r->cmp;
+	r->out_rows++;
+
+	if (r->color_type == PNG_COLOR_TYPE_PALETTE) {
+		if (r->dither) {
+			reduce_dither_row(r, in);
+		} else {
+			for (x=0; x<r->width; x++) {
+				color = reduce_rgba(in, r->cmp, x);
+				if (!r->quantize) {
+					r->row[x] = reduce_slot(r->slots, color)->index;
+				} else {
+					r->row[x] = reduce_lookup(r,
+						color & 255 ? color : 0);
+				}
+			}
+		}
+	} else if (r->channels == r->cmp && r->depth == 8) {
+		return in;
+	} else {
+		max = (1 << r->depth) - 1;
+		for (x=0; x<r->width; x++) {
+			p = in + x * r->cmp;
+			switch (r->color_type) {
+			case PNG_COLOR_TYPE_GRAY:
+				r->row[x] = p[0] * max / 255;
+				break;
+			case PNG_COLOR_TYPE_GA:
+				r->row[x * 2] = p[0];
+				r->row[x * 2 + 1] = p[r->cmp - 1];
+				break;
+			case PNG_COLOR_TYPE_RGB:
+				memcpy(r->row + x * 3, p, 3);
+				break;
+			}
+		}
+	}
+
+	if (r->depth < 8) {
+		reduce_pack(r->row, r->width, r->depth);
+	}
+	return r->row;
+}
+
+void oil_libpng_reduce_header(struct oil_libpng_reduce *r, png_structp wpng,
+	png_infop winfo, struct oil_libpng_encode *enc)
+{
+	png_color plte[256];
+	png_byte trans[256];
+	int i;
+
+	png_set_IHDR(wpng, winfo, r->width, r->height, r->depth,
+		r->color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+		PNG_FILTER_TYPE_DEFAULT);
+	if (r->color_type == PNG_COLOR_TYPE_PALETTE) {
+		for (i=0; i<r->num_pal; i++) {
+			plte[i].red = r->pal[i * 4];
+			plte[i].green = r->pal[i * 4 + 1];
+			plte[i].blue = r->pal[i * 4 + 2];
+			trans[i] = r->pal[i * 4 + 3];
+		}
+		png_set_PLTE(wpng, winfo, plte, r->num_pal);
+		if (r->num_trans) {
+			png_set_tRNS(wpng, winfo, trans, r->num_trans, NULL);
+		}
+	}
+
+	enc->depth = r->depth;
+	if (!enc->filters && (r->color_type == PNG_COLOR_TYPE_PALETTE ||
+		r->depth < 8)) {
+		enc->filters = PNG_FILTER_NONE;
+	}
+}
+
+size_t oil_libpng_reduce_mem_size(struct oil_libpng_reduce *r)
+{
+	size_t rowbytes;
+
+	rowbytes = (size_t)r->width * r->cmp;
+	return r->max_rows * rowbytes + rowbytes +
+		REDUCE_SLOTS * sizeof(struct oil_reduce_slot) +
+		(r->err ? 2 * ((size_t)r->width + 2) * 4 * sizeof(int) : 0);
+}
+
+void oil_libpng_reduce_free(struct oil_libpng_reduce *r)
+{
+	free(r->held);
+	free(r->slots);
+	free(r->row);
+	free(r->err);
+}
+
+/* Parallel writer */
+
+static int paeth_predictor(int a, int b, int c)
+{
+	int p, pa, pb, pc;
+
+	p = a + b - c;
+	pa = abs(p - a);
+	pb = abs(p - b);
+	pc = abs(p - c);
+	if (pa <= pb && pa <= pc) {
+		return a;
+	}
+	return pb <= pc ? b : c;
+}
+
+/* Sum of the filtered bytes taken as signed values, which is how libpng picks
+ * between filters.
+ */
+static unsigned long filter_sum(unsigned char *out, int len)
+{
+	unsigned long sum;
+	int i;
+
+	sum = 0;
+	for (i=0; i<len; i++) {
+		sum += out[i] < 128 ? out[i] : 256 - out[i];
+	}
+	return sum;
+}
+
+/* Apply filter type to row, writing the filter byte and the filtered row to
+ * out.
+ */
+static void filter_row(int type, unsigned char *out, unsigned char *row,
+	unsigned char *prev, int len, int bpp)
+{
+	int i;
+
+	*out++ = type;
+	switch (type) {
+	case PNG_FILTER_VALUE_NONE:
+		memcpy(out, row, len);
+		break;
+	case PNG_FILTER_VALUE_SUB:
+		memcpy(out, row, bpp);
+		for (i=bpp; i<len; i++) {
+			out[i] = row[i] - row[i - bpp];
+		}
+		break;
+	case PNG_FILTER_VALUE_UP:
+		for (i=0; i<len; i++) {
+			out[i] = row[i] - prev[i];
+		}
+		break;
+	case PNG_FILTER_VALUE_AVG:
+		for (i=0; i<bpp; i++) {
+			out[i] = row[i] - (prev[i] >> 1);
+		}
+		for (i=bpp; i<len; i++) {
+			out[i] = row[i] - ((row[i - bpp] + prev[i]) >> 1);
+		}
+		break;
+	case PNG_FILTER_VALUE_PAETH:
+		for (i=0; i<bpp; i++) {
+			out[i] = row[i] - prev[i];
+		}
+		for (i=bpp; i<len; i++) {
+			out[i] = row[i] - paeth_predictor(row[i - bpp], prev[i],
+				prev[i - bpp]);
+		}
+		break;
+	}
+}
+
+/* Deflate a group as raw deflate data, ending in a sync flush unless it is the
+ * last group. Runs on a worker thread.
+ */
+static int deflate_group(struct oil_libpng_writer *pw,
+	struct oil_libpng_group *g)
+{
+	z_stream zs;
+	unsigned char *out;
+	size_t cap;
+	int ret, flush;
+
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, pw->level, Z_DEFLATED, -15, 8, pw->strategy)) {
+		return -2;
+	}
+	if (g->dict_len) {
+		deflateSetDictionary(&zs, g->dict, g->dict_len);
+	}
+
+	/* Leave room for the zlib header before and the Adler-32 after. */
+	cap = deflateBound(&zs, g->in_len) + 16;
+	if (cap > g->out_cap) {
+		out = realloc(g->out, cap);
+		if (!out) {
+			deflateEnd(&zs);
+			return -2;
+		}
+		g->out = out;
+		g->out_cap = cap;
+	}
+
+	flush = g->last ? Z_FINISH : Z_SYNC_FLUSH;
+	zs.next_in = g->in;
+	zs.avail_in = g->in_len;
+	zs.next_out = g->out + 2;
+	zs.avail_out = g->out_cap - 6;
+	for (;;) {
+		ret = deflate(&zs, flush);
+		if (ret == Z_STREAM_END || (!g->last && zs.avail_out)) {
+			break;
+		}
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			deflateEnd(&zs);
+			return -2;
+		}
+		cap = g->out_cap * 2;
+		out = realloc(g->out, cap);
+		if (!out) {
+			deflateEnd(&zs);
+			return -2;
+		}
+		zs.next_out = out + 2 + zs.total_out;
+		zs.avail_out = cap - 6 - zs.total_out;
+		g->out = out;
+		g->out_cap = cap;
+	}
+	g->out_len = zs.total_out;
+	deflateEnd(&zs);
+
+	g->adler = adler32(adler32(0, NULL, 0), g->in, g->in_len);
+	return 0;
+}
+
+static void *writer_worker(void *data)
+{
+	struct oil_libpng_writer *pw;
+	struct oil_libpng_group *g;
+	int ret;
+
+	pw = (struct oil_libpng_writer *)data;
+
+	pthread_mutex_lock(&pw->lock);
+	for (;;) {
+		g = pw->groups + pw->next;
+		if (g->state == OIL_GROUP_QUEUED) {
+			g->state = OIL_GROUP_RUNNING;
+			pw->next = (pw->next + 1) % pw->num_groups;
+			pthread_mutex_unlock(&pw->lock);
+
+			ret = deflate_group(pw, g);
+
+			pthread_mutex_lock(&pw->lock);
+			g->ret = ret;
+			g->state = OIL_GROUP_DONE;
+			pthread_cond_broadcast(&pw->done);
+		} else if (pw->closed) {
+			break;
+		} else {
+			pthread_cond_wait(&pw->queued, &pw->lock);
+		}
+	}
+	pthread_mutex_unlock(&pw->lock);
+	return NULL;
+}
+
+/* Read the state of a group, which the workers change under the lock. */
+static int group_state(struct oil_libpng_writer *pw, int i)
+{
+	int state;
+
+	pthread_mutex_lock(&pw->lock);
+	state = pw->groups[i].state;
+	pthread_mutex_unlock(&pw->lock);
+	return state;
+}
+
+/* Wait for the oldest group to be deflated and write it as an IDAT chunk. The
+ * first chunk starts with the zlib header and the last one ends with the
+ * Adler-32 of the whole stream.
+ */
+static int flush_group(struct oil_libpng_writer *pw)
+{
+	struct oil_libpng_group *g;
+	unsigned char *data;
+	size_t len;
+	int cmf, flg;
+
+	g = pw->groups + pw->flush;
+	pthread_mutex_lock(&pw->lock);
+	while (g->state != OIL_GROUP_DONE) {
+		pthread_cond_wait(&pw->done, &pw->lock);
+	}
+	pthread_mutex_unlock(&pw->lock);
+	if (g->ret) {
+		return g->ret;
+	}
+
+	data = g->out + 2;
+	len = g->out_len;
+	if (pw->first) {
+		cmf = 0x78;
+		flg = (pw->level == Z_DEFAULT_COMPRESSION ? 2 :
+			pw->level < 2 ? 0 : pw->level < 6 ? 1 : pw->level == 6 ?
+			2 : 3) << 6;
+		flg += 31 - (cmf * 256 + flg) % 31;
+		g->out[0] = cmf;
+		g->out[1] = flg;
+		data = g->out;
+		len += 2;
+		pw->first = 0;
+	}
+	pw->adler = adler32_combine(pw->adler, g->adler, g->in_len);
+	if (g->last) {
+		data[len++] = pw->adler >> 24;
+		data[len++] = pw->adler >> 16;
+		data[len++] = pw->adler >> 8;
+		data[len++] = pw->adler;
+	}
+
+	pthread_mutex_lock(&pw->lock);
+	g->state = OIL_GROUP_FILLING;
+	g->in_len = 0;
+	pthread_mutex_unlock(&pw->lock);
+	pw->flush = (pw->flush + 1) % pw->num_groups;
+
+	png_write_chunk(pw->wpng, (png_const_bytep)"IDAT", data, len);
+	return 0;
+}
+
+/* Queue the group being filled and move on to the next one, writing out
+ * older groups until it is free.
+ */
+static int dispatch_group(struct oil_libpng_writer *pw, int last)
+{
+	struct oil_libpng_group *g, *prev;
+	int ret;
+
+	g = pw->groups + pw->fill;
+	g->last = last;
+	g->dict_len = 0;
+	if (pw->dispatched) {
+		prev = pw->groups + (pw->fill + pw->num_groups - 1) %
+			pw->num_groups;
+		g->dict_len = prev->in_len < DICT_BYTES ? prev->in_len : DICT_BYTES;
+		memcpy(g->dict, prev->in + prev->in_len - g->dict_len,
+			g->dict_len);
+	}
+
+	pthread_mutex_lock(&pw->lock);
+	g->state = OIL_GROUP_QUEUED;
+	pthread_cond_signal(&pw->queued);
+	pthread_mutex_unlock(&pw->lock);
+
+	pw->dispatched++;
+	pw->fill = (pw->fill + 1) % pw->num_groups;
+	pw->rows_in_group = 0;
+
+	if (last) {
+		return 0;
+	}
+	while (group_state(pw, pw->fill) != OIL_GROUP_FILLING) {
+		ret = flush_group(pw);
+		if (ret) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+int oil_libpng_writer_init(struct oil_libpng_writer *pw, png_structp wpng,
+	int width, int channels, struct oil_libpng_encode *enc)
+{
+	struct oil_libpng_group *g;
+	sigset_t all, old;
+	size_t group_len;
+	int i, threads;
+
+	memset(pw, 0, sizeof(struct oil_libpng_writer));
+	pthread_mutex_init(&pw->lock, NULL);
+	pthread_cond_init(&pw->queued, NULL);
+	pthread_cond_init(&pw->done, NULL);
+
+	threads = enc->threads;
+	if (threads < 1 || width < 1 || channels < 1 || channels > 4 ||
+		(enc->depth != 1 && enc->depth != 2 && enc->depth != 4 &&
+		enc->depth != 8 && enc->depth != 16)) {
+		return -1;
+	}
+#ifndef HAVE_LIBDEFLATE
+	if (enc->libdeflate) {
+		return -1;
+	}
+#endif
+
+	pw->wpng = wpng;
+	/* Filters work on whole bytes, even for packed samples. */
+	pw->bpp = enc->depth < 8 ? 1 : channels * enc->depth / 8;
+	pw->rowbytes = ((size_t)width * channels * enc->depth + 7) / 8;
+	pw->filters = enc->filters ? enc->filters : PNG_ALL_FILTERS;
+	pw->level = enc->level >= 0 ? enc->level : Z_DEFAULT_COMPRESSION;
+	if (enc->strategy >= 0) {
+		pw->strategy = enc->strategy;
+	} else {
+		/* Same default as libpng. */
+		pw->strategy = pw->filters == PNG_FILTER_NONE ?
+			Z_DEFAULT_STRATEGY : Z_FILTERED;
+	}
+	pw->rows_per_group = (GROUP_BYTES + pw->rowbytes) / (pw->rowbytes + 1);
+	pw->num_groups = threads * 2;
+	pw->libdeflate = enc->libdeflate;
+	if (pw->libdeflate) {
+		pw->rows_per_group = INT_MAX;
+		pw->num_groups = 1;
+		threads = 0;
+	}
+	pw->first = 1;
+	pw->adler = adler32(0, NULL, 0);
+
+	pw->prev = calloc(pw->rowbytes, 1);
+	pw->trial = malloc(2 * (size_t)(pw->rowbytes + 1));
+	pw->groups = calloc(pw->num_groups, sizeof(struct oil_libpng_group));
+	if (!pw->prev || !pw->trial || !pw->groups) {
+		return -2;
+	}
+	group_len = (size_t)(GROUP_BYTES + pw->rowbytes) / (pw->rowbytes + 1) *
+		(pw->rowbytes + 1);
+	for (i=0; i<pw->num_groups; i++) {
+		g = pw->groups + i;
+		g->in = malloc(group_len);
+		g->in_cap = group_len;
+		g->dict = malloc(DICT_BYTES);
+		if (!g->in || !g->dict) {
+			return -2;
+		}
+	}
+
+	if (!threads) {
+		return 0;
+	}
+	pw->threads = malloc(threads * sizeof(pthread_t));
+	if (!pw->threads) {
+		return -2;
+	}
+	/* Let signals go to the threads that called us. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i=0; i<threads; i++) {
+		if (pthread_create(pw->threads + i, NULL, writer_worker, pw)) {
+			break;
+		}
+		pw->num_threads++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return pw->num_threads == threads ? 0 : -2;
+}
+
+int oil_libpng_writer_write_row(struct oil_libpng_writer *pw,
+	unsigned char *row)
+{
+	struct oil_libpng_group *g;
+	unsigned char *dst, *cand, *best, *tmp;
+	unsigned long sum, best_sum;
+	size_t cap;
+	int type, len;
+
+	g = pw->groups + pw->fill;
+	len = pw->rowbytes;
+	if (g->in_len + len + 1 > g->in_cap) {
+		/* Only the single libdeflate group grows. */
+		cap = g->in_cap * 2;
+		tmp = realloc(g->in, cap);
+		if (!tmp) {
+			return -2;
+		}
+		g->in = tmp;
+		g->in_cap = cap;
+	}
+	dst = g->in + g->in_len;
+
+	if (!(pw->filters & (pw->filters - 1))) {
+		/* A single filter, its bit is 0x08 << type. */
+		for (type=0; !(pw->filters & (PNG_FILTER_NONE << type)); type++);
+		filter_row(type, dst, row, pw->prev, len, pw->bpp);
+	} else {
+		cand = pw->trial;
+		best = pw->trial + len + 1;
+		best_sum = ULONG_MAX;
+		for (type=0; type<PNG_FILTER_VALUE_LAST; type++) {
+			if (!(pw->filters & (PNG_FILTER_NONE << type))) {
+				continue;
+			}
+			filter_row(type, cand, row, pw->prev, len, pw->bpp);
+			sum = filter_sum(cand + 1, len);
+			if (sum < best_sum) {
+				best_sum = sum;
+				tmp = best;
+				best = cand;
+				cand = tmp;
+			}
+		}
+		memcpy(dst, best, len + 1);
+	}
+
+	memcpy(pw->prev, row, len);
+	g->in_len += len + 1;
+	if (++pw->rows_in_group == pw->rows_per_group) {
+		return dispatch_group(pw, 0);
+	}
+	return 0;
+}
+
+#ifdef HAVE_LIBDEFLATE
+/* Compress every filtered row with libdeflate, as a zlib stream split into
+ * IDAT chunks.
+ */
+static int finish_libdeflate(struct oil_libpng_writer *pw)
+{
+	struct libdeflate_compressor *c;
+	struct oil_libpng_group *g;
+	size_t pos, len;
+
+	g = pw->groups;
+	c = libdeflate_alloc_compressor(pw->level < 0 ? 6 : pw->level);
+	if (!c) {
+		return -2;
+	}
+	g->out_cap = libdeflate_zlib_compress_bound(c, g->in_len);
+	g->out = malloc(g->out_cap);
+	if (!g->out) {
+		libdeflate_free_compressor(c);
+		return -2;
+	}
+	g->out_len = libdeflate_zlib_compress(c, g->in, g->in_len, g->out,
+		g->out_cap);
+	libdeflate_free_compressor(c);
+	if (!g->out_len) {
+		return -2;
+	}
+
+	for (pos=0; pos<g->out_len; pos+=len) {
+		len = g->out_len - pos < IDAT_BYTES ? g->out_len - pos : IDAT_BYTES;
+		png_write_chunk(pw->wpng, (png_const_bytep)"IDAT", g->out + pos,
+			len);
+	}
+	png_write_chunk(pw->wpng, (png_const_bytep)"IEND", NULL, 0);
+	return 0;
+}
+#endif
+
+int oil_libpng_writer_finish(struct oil_libpng_writer *pw)
+{
+	int ret;
+
+#ifdef HAVE_LIBDEFLATE
+	if (pw->libdeflate) {
+		return finish_libdeflate(pw);
+	}
+#endif
+	ret = dispatch_group(pw, 1);
+	while (!ret && group_state(pw, pw->flush) != OIL_GROUP_FILLING) {
+		ret = flush_group(pw);
+	}
+	if (ret) {
+		return ret;
+	}
+	png_write_chunk(pw->wpng, (png_const_bytep)"IEND", NULL, 0);
+	return 0;
+}
+
+size_t oil_libpng_writer_mem_size(struct oil_libpng_writer *pw)
+{
+	size_t size;
+	int i;
+
+	size = pw->rowbytes * 3 + 2 + pw->num_groups * DICT_BYTES;
+	for (i=0; i<pw->num_groups; i++) {
+		size += pw->groups[i].in_cap + pw->groups[i].out_cap;
+	}
+	return size;
+}
+
+void oil_libpng_writer_free(struct oil_libpng_writer *pw)
+{
+	int i;
+
+	pthread_mutex_lock(&pw->lock);
+	pw->closed = 1;
+	pthread_cond_broadcast(&pw->queued);
+	pthread_mutex_unlock(&pw->lock);
+	for (i=0; i<pw->num_threads; i++) {
+		pthread_join(pw->threads[i], NULL);
+	}
+
+	if (pw->groups) {
+		for (i=0; i<pw->num_groups; i++) {
+			free(pw->groups[i].in);
+			free(pw->groups[i].dict);
+			free(pw->groups[i].out);
+		}
+	}
+	free(pw->groups);
+	free(pw->threads);
+	free(pw->trial);
+	free(pw->prev);
+	pthread_cond_destroy(&pw->done);
+	pthread_cond_destroy(&pw->queued);
+	pthread_mutex_destroy(&pw->lock);
+}
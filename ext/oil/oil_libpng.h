@@ -23,18 +23,75 @@
 #define OIL_LIBPNG_H
 
 #include <stdio.h>
+#include <pthread.h>
 #include <png.h>
+#include <zlib.h>
 #include "oil_resample.h"
+#include "oil_mem.h"
 
+/**
+ * Interlaced images are read one Adam7 pass at a time. The first six passes
+ * only hold even rows, and the seventh holds every odd row in full, so only
+ * the even rows are kept before scaling starts. The odd rows go straight from
+ * libpng to the scaler. When the output is much narrower than the input, the
+ * even rows are kept scaled horizontally, and until the sixth pass completes
+ * them only their even columns are kept.
+ *
+ * With libpng's progressive reader, rows are given to oil_libpng_push_row() as
+ * they are decoded and output scanlines are taken with
+ * oil_libpng_push_scanline() as soon as the rows given allow.
+ *
+ * Palette images and gray images with fewer than 8 bits per sample are not
+ * expanded by libpng. Their rows are scaled straight from the indices through
+ * a lookup table, which saves expanding each row to RGBA before scaling it.
+ * 16-bit images are scaled from their 16-bit samples, and can be given out
+ * with 16-bit samples as well by setting out_depth to 16. Output samples are
+ * then most significant byte first, as PNG stores them. Setting bg instead
+ * flattens alpha against it in the vertical pass, so that gray and alpha
+ * images give gray scanlines and RGBA images give RGB, for encoders that have
+ * no alpha channel.
+ *
+ * Interlaced palette images still have libpng unpack each index to a byte,
+ * since every pass scatters single pixels, and interlaced gray images are
+ * expanded by libpng as before.
+ */
 struct oil_libpng {
 	struct oil_scale os;
 	png_structp rpng;
 	png_infop rinfo;
 	int in_vpos;
 	unsigned char *inbuf;
-	unsigned char **inimage;
+	unsigned char *even; // even rows of an interlaced image.
+	size_t even_len; // bytes in each row of even.
+	int even_scaled; // 1 if even holds rows scaled by oil_scale_x().
+	unsigned char *quarter; // even columns of the even rows, when scaled.
+	int pass_rows; // rows of the first six passes not yet read.
+	struct oil_palette *pal; // lookup table for indexed rows, or NULL.
+	int in16; // 1 if rows hold 16-bit samples.
+	int out_depth; // bits per output sample. 8, or set to 16 after init.
+	unsigned char *bg; // sRGB color to flatten alpha against, set after init.
 };
 
+/**
+ * Set up the libpng transformations oil expects on a read struct whose header
+ * has been read with png_read_info(): tRNS data is expanded to alpha and
+ * 16-bit samples are kept. Palette rows, and low bit depth gray rows that
+ * are not interlaced, are left as indices, which oil_libpng looks up itself.
+ * @rpng: Pointer to a libpng read struct.
+ * @rinfo: Pointer to the libpng info struct of rpng.
+ */
+void oil_libpng_set_transforms(png_structp rpng, png_infop rinfo);
+
+/**
+ * Get the color type of the scanlines oil_libpng gives for an image. Palette
+ * images give RGB, or RGBA if they have a tRNS chunk, and gray images with
+ * fewer than 8 bits per sample give gray, or gray and alpha if they have one.
+ * @rpng: Pointer to a libpng read struct set up with
+ *   oil_libpng_set_transforms().
+ * @rinfo: Pointer to the libpng info struct of rpng.
+ */
+png_byte oil_libpng_color_type(png_structp rpng, png_infop rinfo);
+
 /**
  * Initialize an oil_libpng struct.
  * @ol: Pointer to the struct to be initialized.
@@ -49,10 +106,333 @@ struct oil_libpng {
 int oil_libpng_init(struct oil_libpng *ol, png_structp rpng, png_infop rinfo,
 	int out_width, int out_height);
 
+/**
+ * Initialize an oil_libpng struct for libpng's progressive reader. No rows are
+ * read: they are given to oil_libpng_push_row() by the row callback instead.
+ * Interlaced images must be read without png_set_interlace_handling().
+ * Arguments and return values are those of oil_libpng_init().
+ */
+int oil_libpng_push_init(struct oil_libpng *ol, png_structp rpng,
+	png_infop rinfo, int out_width, int out_height);
+
+/**
+ * Take a row from the progressive reader's row callback. Take every scanline
+ * that oil_libpng_push_scanline() has ready before giving the next row.
+ * @ol: Pointer to a struct initialized with oil_libpng_push_init().
+ * @row: The new_row given to the callback.
+ * @row_num: The row_num given to the callback.
+ * @pass: The pass given to the callback.
+ */
+void oil_libpng_push_row(struct oil_libpng *ol, unsigned char *row,
+	png_uint_32 row_num, int pass);
+
+/**
+ * Scale the next output scanline if the rows given so far allow it.
+ * @ol: Pointer to a struct initialized with oil_libpng_push_init().
+ * @outbuf: Buffer to hold the scanline.
+ *
+ * Returns 1 if a scanline was written to outbuf.
+ * Returns 0 if more rows are needed, or every scanline has been taken.
+ */
+int oil_libpng_push_scanline(struct oil_libpng *ol, unsigned char *outbuf);
+
 void oil_libpng_free(struct oil_libpng *ol);
 
+/**
+ * Get the number of bytes allocated on the heap for decoding and scaling. For
+ * interlaced images this includes the buffer holding the even rows.
+ * @ol: Pointer to an initialized oil_libpng struct.
+ */
+size_t oil_libpng_mem_size(struct oil_libpng *ol);
+
 void oil_libpng_read_scanline(struct oil_libpng *ol, unsigned char *outbuf);
 
 enum oil_colorspace png_cs_to_oil(png_byte cs);
 
+/**
+ * Encoder settings. Fields left at their defaults keep libpng's choice, which
+ * is zlib level 6 with adaptive filtering.
+ */
+struct oil_libpng_encode {
+	int level; // zlib compression level, 0 to 9. -1 for the default.
+	int filters; // mask of PNG_FILTER_* values. 0 for the default.
+	int strategy; // zlib strategy, such as Z_RLE. -1 for the default.
+	int threads; // threads deflating the output. 1 lets libpng do it.
+	int libdeflate; // compress with libdeflate instead of zlib.
+	int depth; // bits per sample of the output image, 8 or 16.
+	int reduce; // 1 to write the smallest color type that holds the output.
+	int colors; // palette size to quantize the output to, or 0.
+	int dither; // 1 to diffuse the error of quantizing.
+};
+
+/**
+ * Returns 1 if the settings need oil_libpng_writer instead of libpng's own
+ * row writer.
+ * @enc: Pointer to the encoder settings.
+ */
+int oil_libpng_writer_needed(struct oil_libpng_encode *enc);
+
+/**
+ * Reset encoder settings to libpng's defaults.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libpng_encode_defaults(struct oil_libpng_encode *enc);
+
+/**
+ * Use settings that encode several times faster than libpng's defaults, for
+ * a few percent larger output: zlib level 1, the Up filter and run-length
+ * encoding.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libpng_encode_fast(struct oil_libpng_encode *enc);
+
+/**
+ * Apply encoder settings. Must be called before png_write_info().
+ * @wpng: Pointer to a libpng write struct.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libpng_compress_encode(png_structp wpng, struct oil_libpng_encode *enc);
+
+/**
+ * Picks the smallest color type for the output of an 8-bit image and converts
+ * its scanlines to it. The header of a PNG comes before its rows, so scanlines
+ * are held until the color type is decided:
+ *
+ * - When the whole output fits in 4 MiB it is held, and alpha is dropped if
+ *   every pixel is opaque, color is dropped if every pixel is gray, and a
+ *   palette is used if there are 256 colors or fewer. Gray images and
+ *   palettes with few entries get fewer bits per sample.
+ * - Larger output is decided from the first scanline, so only what the source
+ *   guarantees is dropped: alpha when every tRNS entry of a palette image is
+ *   opaque, and color when every PLTE entry is gray.
+ *
+ * With colors set, output with more colors than that is quantized to a
+ * palette instead. Palette images with no more entries than that keep their
+ * own palette. Other images get one built by median cut from the scanlines
+ * held, which are the first 4 MiB of output, and pixels are mapped to the
+ * nearest entry. Floyd-Steinberg dithering spreads the error of each pixel
+ * over its neighbours, which only needs the error of the next row.
+ */
+struct oil_libpng_reduce {
+	int width;
+	int height;
+	int cmp; // samples per pixel of the scanlines given.
+	int colors; // palette size to quantize to, or 0 to keep every color.
+	int dither; // 1 to diffuse the error of quantizing.
+	int src_gray; // 1 if the source guarantees gray pixels.
+	int src_opaque; // 1 if the source guarantees opaque pixels.
+	unsigned char src_pal[256 * 4]; // RGBA entries of a palette source.
+	int src_num; // entries in src_pal, or 0 if the source has no palette.
+	unsigned char *held; // scanlines held until decided.
+	int max_rows; // scanlines held before deciding.
+	int held_rows; // scanlines in held.
+	int out_rows; // scanlines of held given out by oil_libpng_reduce_pop().
+	int in_rows; // scanlines given so far.
+	int decided; // 1 once the fields below are set.
+	png_byte color_type; // color type of the output.
+	int depth; // bits per sample of the output, 1 to 8.
+	int channels; // samples per pixel of the output.
+	unsigned char pal[256 * 4]; // RGBA palette entries, translucent first.
+	int num_pal; // entries in pal.
+	int num_trans; // entries in pal that are not opaque.
+	int quantize; // 1 if pixels are mapped to the nearest entry of pal.
+	int order[256]; // entries of pal by green, when quantizing.
+	struct oil_reduce_slot *slots; // colors looked up in pal.
+	int *err; // dithering error of this row and the next, per sample.
+	unsigned char *row; // the converted row.
+};
+
+/**
+ * Initialize an oil_libpng_reduce struct.
+ * @r: Pointer to the struct to be initialized.
+ * @rpng: Pointer to the libpng read struct of the source.
+ * @rinfo: Pointer to the libpng info struct of rpng.
+ * @width: Width of the output, in pixels.
+ * @height: Height of the output, in pixels.
+ * @cmp: Samples per pixel of the 8-bit scanlines that will be given.
+ * @enc: Encoder settings, for colors and dither.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libpng_reduce_init(struct oil_libpng_reduce *r, png_structp rpng,
+	png_infop rinfo, int width, int height, int cmp,
+	struct oil_libpng_encode *enc);
+
+/**
+ * Give the next scanline. The color type is decided once enough have been
+ * given, after which every scanline held must be taken with
+ * oil_libpng_reduce_pop() before giving the next one.
+ * @r: Pointer to an initialized struct.
+ * @in: The scanline.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libpng_reduce_push(struct oil_libpng_reduce *r, unsigned char *in);
+
+/**
+ * Take the next row, converted to the color type decided. The row is valid
+ * until the next call.
+ * @r: Pointer to an initialized struct.
+ *
+ * Returns NULL until the color type is decided, or once every row given has
+ * been taken.
+ */
+unsigned char *oil_libpng_reduce_pop(struct oil_libpng_reduce *r);
+
+/**
+ * Set the IHDR, PLTE and tRNS chunks of the output once decided, and the bit
+ * depth and filters of enc to match it, for oil_libpng_writer_init(). Palette
+ * and low bit depth images default to no filtering, as in libpng.
+ * @r: Pointer to a struct that has decided on the color type.
+ * @wpng: Pointer to a libpng write struct.
+ * @winfo: Pointer to the libpng info struct of wpng.
+ * @enc: Encoder settings to update.
+ */
+void oil_libpng_reduce_header(struct oil_libpng_reduce *r, png_structp wpng,
+	png_infop winfo, struct oil_libpng_encode *enc);
+
+/**
+ * Get the number of bytes allocated on the heap, including held scanlines.
+ * @r: Pointer to an initialized struct.
+ */
+size_t oil_libpng_reduce_mem_size(struct oil_libpng_reduce *r);
+
+void oil_libpng_reduce_free(struct oil_libpng_reduce *r);
+
+/**
+ * A run of filtered rows of a parallel writer, deflated on its own.
+ */
+struct oil_libpng_group {
+	unsigned char *in; // filtered rows, each starting with its filter byte.
+	size_t in_len; // bytes held in in.
+	size_t in_cap; // size of in.
+	unsigned char *dict; // last 32 KiB of the rows before this group.
+	size_t dict_len; // bytes held in dict.
+	unsigned char *out; // deflated rows, with room for the zlib header.
+	size_t out_len; // bytes of deflated data, after the header room.
+	size_t out_cap; // size of out.
+	uLong adler; // Adler-32 of in.
+	int last; // 1 if this group ends the zlib stream.
+	int state; // OIL_GROUP_* below.
+	int ret; // 0, or -2 if deflate ran out of memory.
+};
+
+enum oil_libpng_group_state {
+	OIL_GROUP_FILLING = 0,
+	OIL_GROUP_QUEUED,
+	OIL_GROUP_RUNNING,
+	OIL_GROUP_DONE,
+};
+
+/**
+ * Writes the image data of a PNG with several threads. Rows are filtered on
+ * the calling thread and collected into groups of at least 128 KiB, and each
+ * group is deflated on a worker thread, like pigz does. Groups end with a
+ * sync flush, so their output can be joined into a single zlib stream, and
+ * each group is primed with the 32 KiB of rows before it so that little
+ * compression is lost. The Adler-32 of the stream is combined from those of
+ * the groups. Each group is written as one IDAT chunk, in order.
+ *
+ * With libdeflate the writer runs on the calling thread instead. libdeflate
+ * only compresses whole buffers, and its streams can't be joined, so all of
+ * the filtered rows are held in a single group and compressed at the end.
+ * The group doubles as rows come in and the compressed stream is about as
+ * large as the rows, so the writer holds up to three times the filtered image
+ * at the end. That memory buys compression several times faster than zlib at
+ * a similar ratio.
+ */
+struct oil_libpng_writer {
+	png_structp wpng;
+	int rowbytes; // bytes in a row, without the filter byte.
+	int bpp; // bytes per pixel.
+	int filters; // mask of PNG_FILTER_* values to pick from.
+	int level; // zlib compression level.
+	int strategy; // zlib strategy.
+	int libdeflate; // 1 to compress every row at the end with libdeflate.
+	unsigned char *prev; // the previous row, unfiltered.
+	unsigned char *trial; // scratch space for picking a filter.
+	struct oil_libpng_group *groups; // ring of groups, filled in order.
+	int num_groups; // size of the ring.
+	int fill; // group being filled.
+	int flush; // oldest group not yet written out.
+	int next; // next group to hand to a worker. Protected by lock.
+	int dispatched; // groups handed to the workers so far.
+	int rows_per_group; // rows in each group but the last.
+	int rows_in_group; // rows filled into the current group.
+	int first; // 1 until the first IDAT chunk has been written.
+	uLong adler; // Adler-32 of the groups written out so far.
+	pthread_t *threads; // worker threads.
+	int num_threads; // number of worker threads started.
+	int closed; // set to make the workers exit.
+	pthread_mutex_t lock; // protects closed, next and the group states.
+	pthread_cond_t queued; // signalled when a group is queued.
+	pthread_cond_t done; // broadcast when a group is deflated.
+};
+
+/**
+ * Initialize a parallel writer and start its threads. Write the header with
+ * png_write_info() before the first row, then write rows with
+ * oil_libpng_writer_write_row() instead of png_write_row().
+ * oil_libpng_writer_free() must be called even if this fails.
+ * @pw: Pointer to the struct to be initialized.
+ * @wpng: Pointer to a libpng write struct that has written its header. Its
+ *   rows must have enc->depth bits per sample, without interlacing. Rows
+ *   with fewer than 8 bits per sample are given packed.
+ * @width: Width of the image, in pixels.
+ * @channels: Samples per pixel.
+ * @enc: Encoder settings, including the number of threads and bit depth.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad, or libdeflate was asked for but oil was
+ *   built without it.
+ * Returns -2 if unable to allocate memory or start the threads.
+ */
+int oil_libpng_writer_init(struct oil_libpng_writer *pw, png_structp wpng,
+	int width, int channels, struct oil_libpng_encode *enc);
+
+/**
+ * Filter a row and queue it for deflating. May write IDAT chunks.
+ * @pw: Pointer to an initialized writer.
+ * @row: The row, unfiltered.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libpng_writer_write_row(struct oil_libpng_writer *pw,
+	unsigned char *row);
+
+/**
+ * Deflate the remaining rows and write the last IDAT chunks and the IEND
+ * chunk. Use instead of png_write_end().
+ * @pw: Pointer to a writer that has been given every row.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libpng_writer_finish(struct oil_libpng_writer *pw);
+
+/**
+ * Get the number of bytes allocated on the heap by the writer.
+ * @pw: Pointer to an initialized writer.
+ */
+size_t oil_libpng_writer_mem_size(struct oil_libpng_writer *pw);
+
+/**
+ * Stop the worker threads and free the writer's buffers.
+ */
+void oil_libpng_writer_free(struct oil_libpng_writer *pw);
+
+/**
+ * Read PNG data straight out of memory instead of through a callback.
+ * @rpng: Pointer to a libpng read struct.
+ * @mem: Memory holding the compressed PNG. It must outlive the read struct.
+ *
+ * The only copy made is into libpng's own buffers, and no locks or
+ * interpreter state are touched, so reading may happen on any thread.
+ */
+void oil_libpng_mem_src(png_structp rpng, struct oil_mem *mem);
+
 #endif
@@ -0,0 +1,155 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifdef HAVE_LIBWEBP
+
+#include "oil_libwebp.h"
+#include <string.h>
+
+void oil_libwebp_encode_defaults(struct oil_libwebp_encode *enc)
+{
+	enc->quality = 75;
+	enc->method = 4;
+	enc->lossless = 0;
+	enc->threads = 1;
+}
+
+void oil_libwebp_encode_fast(struct oil_libwebp_encode *enc)
+{
+	enc->method = 0;
+}
+
+void oil_libwebp_encode_best(struct oil_libwebp_encode *enc)
+{
+	enc->method = 6;
+}
+
+int oil_libwebp_init(struct oil_libwebp *ow, int width, int height,
+	struct oil_libwebp_encode *enc)
+{
+	memset(ow, 0, sizeof(struct oil_libwebp));
+	WebPMemoryWriterInit(&ow->wr);
+	if (!WebPPictureInit(&ow->pic) || !WebPConfigInit(&ow->config)) {
+		return -1;
+	}
+	if (width < 1 || height < 1 || width > WEBP_MAX_DIMENSION ||
+		height > WEBP_MAX_DIMENSION) {
+		return -1;
+	}
+
+	ow->config.quality = enc->quality;
+	ow->config.method = enc->method;
+	ow->config.lossless = enc->lossless;
+	ow->config.thread_level = enc->threads > 1;
+	if (!WebPValidateConfig(&ow->config)) {
+		return -1;
+	}
+
+	ow->pic.use_argb = 1;
+	ow->pic.width = width;
+	ow->pic.height = height;
+	if (!WebPPictureAlloc(&ow->pic)) {
+		return -2;
+	}
+	ow->pic.writer = WebPMemoryWrite;
+	ow->pic.custom_ptr = &ow->wr;
+	return 0;
+}
+
+void oil_libwebp_write_row(struct oil_libwebp *ow, unsigned char *row,
+	enum oil_colorspace cs)
+{
+	uint32_t *out;
+	unsigned char *p;
+	int x, width;
+
+	out = ow->pic.argb + (size_t)ow->row * ow->pic.argb_stride;
+	width = ow->pic.width;
+	ow->row++;
+
+	switch (cs) {
+	case OIL_CS_G:
+		for (x=0; x<width; x++) {
+			out[x] = 0xFF000000u | row[x] * 0x010101u;
+		}
+		break;
+	case OIL_CS_GA:
+		for (x=0; x<width; x++) {
+			p = row + x * 2;
+			out[x] = (uint32_t)p[1] << 24 | p[0] * 0x010101u;
+		}
+		break;
+	case OIL_CS_RGB:
+		for (x=0; x<width; x++) {
+			p = row + x * 3;
+			out[x] = 0xFF000000u | p[0] << 16 | p[1] << 8 | p[2];
+		}
+		break;
+	case OIL_CS_RGBX:
+	case OIL_CS_RGBA:
+		for (x=0; x<width; x++) {
+			p = row + x * 4;
+			out[x] = (cs == OIL_CS_RGBA ? (uint32_t)p[3] << 24 :
+				0xFF000000u) | p[0] << 16 | p[1] << 8 | p[2];
+		}
+		break;
+	case OIL_CS_CMYK:
+		/* Inverted samples hold how much of each ink is left out. */
+		for (x=0; x<width; x++) {
+			p = row + x * 4;
+			out[x] = 0xFF000000u | p[0] * p[3] / 255 << 16 |
+				p[1] * p[3] / 255 << 8 | p[2] * p[3] / 255;
+		}
+		break;
+	case OIL_CS_UNKNOWN:
+		break;
+	}
+}
+
+int oil_libwebp_finish(struct oil_libwebp *ow)
+{
+	if (WebPEncode(&ow->config, &ow->pic)) {
+		return 0;
+	}
+	switch (ow->pic.error_code) {
+	case VP8_ENC_ERROR_OUT_OF_MEMORY:
+	case VP8_ENC_ERROR_BITSTREAM_OUT_OF_MEMORY:
+	case VP8_ENC_ERROR_BAD_WRITE:
+		return -2;
+	default:
+		return -1;
+	}
+}
+
+size_t oil_libwebp_mem_size(struct oil_libwebp *ow)
+{
+	return (size_t)ow->pic.argb_stride * ow->pic.height * 4 +
+		ow->wr.max_size;
+}
+
+void oil_libwebp_free(struct oil_libwebp *ow)
+{
+	WebPPictureFree(&ow->pic);
+	WebPMemoryWriterClear(&ow->wr);
+}
+
+#endif
@@ -0,0 +1,120 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+
+#ifndef OIL_LIBWEBP_H
+#define OIL_LIBWEBP_H
+
+#ifdef HAVE_LIBWEBP
+
+#include <webp/encode.h>
+#include "oil_resample.h"
+
+/**
+ * Encoder settings. Fields left at their defaults keep libwebp's choice.
+ */
+struct oil_libwebp_encode {
+	float quality; // 0 to 100. For lossless output, the effort spent.
+	int method; // 0, the fastest, to 6, the smallest output.
+	int lossless; // 1 for lossless output.
+	int threads; // more than 1 lets libwebp use a second thread.
+};
+
+/**
+ * Reset encoder settings to libwebp's defaults: quality 75 and method 4.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libwebp_encode_defaults(struct oil_libwebp_encode *enc);
+
+/**
+ * Use method 0, which encodes several times faster than the default for
+ * somewhat larger output.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libwebp_encode_fast(struct oil_libwebp_encode *enc);
+
+/**
+ * Use method 6, which gives the smallest output and is the slowest.
+ * @enc: Pointer to the encoder settings.
+ */
+void oil_libwebp_encode_best(struct oil_libwebp_encode *enc);
+
+/**
+ * Encodes a WebP image from scanlines. libwebp only encodes whole pictures, so
+ * each scanline is converted straight into the ARGB buffer of the picture, and
+ * libwebp encodes that buffer once the last one is in. No other copy of the
+ * image is made. The output is collected in memory.
+ */
+struct oil_libwebp {
+	WebPConfig config;
+	WebPPicture pic;
+	WebPMemoryWriter wr; // the output, once finished.
+	int row; // next row of pic to fill.
+};
+
+/**
+ * Initialize an oil_libwebp struct. oil_libwebp_free() must be called even if
+ * this fails.
+ * @ow: Pointer to the struct to be initialized.
+ * @width: Width of the image, in pixels.
+ * @height: Height of the image, in pixels.
+ * @enc: Encoder settings.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad, including images over 16383 pixels wide
+ *   or high, which WebP can't hold.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libwebp_init(struct oil_libwebp *ow, int width, int height,
+	struct oil_libwebp_encode *enc);
+
+/**
+ * Give the next scanline.
+ * @ow: Pointer to an initialized struct.
+ * @row: The scanline, as given by oil_libjpeg or oil_libpng with 8 bits per
+ *   sample. CMYK scanlines are taken to be inverted, as Adobe writes them.
+ * @cs: Color space of the scanline.
+ */
+void oil_libwebp_write_row(struct oil_libwebp *ow, unsigned char *row,
+	enum oil_colorspace cs);
+
+/**
+ * Encode the image once every scanline has been given. The output is then in
+ * ow->wr.mem and is ow->wr.size bytes long.
+ * @ow: Pointer to an initialized struct.
+ *
+ * Returns 0 on success.
+ * Returns -1 if libwebp fails to encode the image.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_libwebp_finish(struct oil_libwebp *ow);
+
+/**
+ * Get the number of bytes allocated on the heap for the picture and output.
+ * @ow: Pointer to an initialized struct.
+ */
+size_t oil_libwebp_mem_size(struct oil_libwebp *ow);
+
+void oil_libwebp_free(struct oil_libwebp *ow);
+
+#endif
+
+#endif
@@ -0,0 +1,149 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "oil_mem.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+void oil_mem_init(struct oil_mem *mem, const unsigned char *data, size_t len)
+{
+	mem->data = data;
+	mem->len = len;
+	mem->pos = 0;
+	mem->map = NULL;
+	mem->map_len = 0;
+}
+
+int oil_mem_map(struct oil_mem *mem, int fd, long offset)
+{
+#ifdef HAVE_MMAP
+	struct stat st;
+	void *addr;
+
+	oil_mem_init(mem, NULL, 0);
+
+	if (fstat(fd, &st) != 0) {
+		return -1;
+	}
+	if (offset < 0 || offset > st.st_size) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	/* mmap() refuses empty mappings. Leave the buffer empty so that the
+	 * decoder reports a truncated image.
+	 */
+	if (st.st_size == 0) {
+		return 0;
+	}
+
+	addr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+#ifdef HAVE_MADVISE
+	madvise(addr, st.st_size, MADV_SEQUENTIAL);
+#endif
+
+	mem->map = addr;
+	mem->map_len = st.st_size;
+	mem->data = (unsigned char *)addr + offset;
+	mem->len = st.st_size - offset;
+	return 0;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+int oil_mem_map_path(struct oil_mem *mem, const char *path)
+{
+	int fd, ret, err;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+	ret = oil_mem_map(mem, fd, 0);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ret;
+}
+
+void oil_mem_free(struct oil_mem *mem)
+{
+#ifdef HAVE_MMAP
+	if (mem->map) {
+		munmap(mem->map, mem->map_len);
+	}
+#endif
+	oil_mem_init(mem, NULL, 0);
+}
+
+int oil_push_append(struct oil_push *push, const unsigned char *data,
+	size_t len)
+{
+	size_t skip, cap;
+	unsigned char *tmp;
+
+	skip = push->skip < len ? push->skip : len;
+	push->skip -= skip;
+	data += skip;
+	len -= skip;
+
+	if (push->pos) {
+		memmove(push->data, push->data + push->pos,
+			push->len - push->pos);
+		push->len -= push->pos;
+		push->pos = 0;
+	}
+
+	if (len > push->cap - push->len) {
+		cap = push->cap ? push->cap : 4096;
+		while (cap - push->len < len) {
+			cap *= 2;
+		}
+		tmp = realloc(push->data, cap);
+		if (!tmp) {
+			return -2;
+		}
+		push->data = tmp;
+		push->cap = cap;
+	}
+	memcpy(push->data + push->len, data, len);
+	push->len += len;
+	return 0;
+}
+
+void oil_push_free(struct oil_push *push)
+{
+	free(push->data);
+	memset(push, 0, sizeof(*push));
+}
@@ -0,0 +1,107 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OIL_MEM_H
+#define OIL_MEM_H
+
+#include <stddef.h>
+
+/**
+ * A compressed image held in memory. The bytes are either borrowed from the
+ * caller or are a read-only mapping of a file that we own.
+ */
+struct oil_mem {
+	const unsigned char *data; // start of the image data.
+	size_t len; // length in bytes of the image data.
+	size_t pos; // read position, used by readers that copy out of data.
+	void *map; // start of our file mapping, or NULL if data is borrowed.
+	size_t map_len; // length in bytes of our file mapping.
+};
+
+/**
+ * Point an oil_mem struct at a caller-owned buffer. No data is copied, so the
+ * buffer must outlive any reader using it.
+ * @mem: Pointer to the struct to be initialized.
+ * @data: Pointer to the image data.
+ * @len: Length in bytes of the image data.
+ */
+void oil_mem_init(struct oil_mem *mem, const unsigned char *data, size_t len);
+
+/**
+ * Map a file into memory for sequential reading.
+ * @mem: Pointer to the struct to be initialized.
+ * @fd: File descriptor open for reading. It may be closed once this returns.
+ * @offset: Byte offset in the file where the image data starts.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, with errno set.
+ */
+int oil_mem_map(struct oil_mem *mem, int fd, long offset);
+
+/**
+ * Open and map the file at path for sequential reading.
+ * @mem: Pointer to the struct to be initialized.
+ * @path: Path of the file to map.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure, with errno set.
+ */
+int oil_mem_map_path(struct oil_mem *mem, const char *path);
+
+/**
+ * Release a file mapping, if any, and reset the struct.
+ * @mem: Pointer to the struct to be freed.
+ */
+void oil_mem_free(struct oil_mem *mem);
+
+/**
+ * A compressed image given to a reader a chunk at a time. Chunks are appended
+ * after the bytes the decoder has yet to read, and the bytes it has read are
+ * dropped when the next chunk comes in.
+ */
+struct oil_push {
+	unsigned char *data; // bytes pushed and not yet dropped.
+	size_t len; // length in bytes of data.
+	size_t pos; // bytes of data the decoder has read.
+	size_t cap; // size of data.
+	size_t skip; // bytes to drop from the next chunks before keeping any.
+	int closed; // 1 once the last chunk has been pushed.
+};
+
+/**
+ * Drop the bytes that have been read and append a chunk.
+ * @push: Pointer to a zeroed or previously used struct.
+ * @data: Pointer to the chunk.
+ * @len: Length in bytes of the chunk.
+ *
+ * Returns 0 on success.
+ * Returns -2 if unable to allocate memory.
+ */
+int oil_push_append(struct oil_push *push, const unsigned char *data,
+	size_t len);
+
+/**
+ * Free the pushed bytes and reset the struct.
+ * @push: Pointer to the struct to be freed.
+ */
+void oil_push_free(struct oil_push *push);
+
+#endif
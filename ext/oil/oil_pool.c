@@ -0,0 +1,342 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include "oil_pool.h"
+#include <errno.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+#include <sched.h>
+#endif
+
+struct oil_job *oil_job_new()
+{
+	struct oil_job *job;
+
+	job = calloc(1, sizeof(struct oil_job));
+	if (job) {
+		job->refs = 1;
+	}
+	return job;
+}
+
+void oil_job_release(struct oil_job *job)
+{
+	if (__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL)) {
+		return;
+	}
+	oil_mem_free(&job->in);
+	free(job->in_buf);
+	free(job->in_path);
+	free(job->out_path);
+	free(job->out_buf);
+	free(job);
+}
+
+/**
+ * Run a job on the calling thread.
+ */
+static void job_run(struct oil_job *job)
+{
+	struct oil_mem in;
+	FILE *out;
+	const char *out_name;
+
+	if (job->in_path) {
+		if (oil_mem_map_path(&in, job->in_path)) {
+			snprintf(job->err, OIL_ERR_LEN, "%s: %s", job->in_path,
+				strerror(errno));
+			job->ret = -1;
+			return;
+		}
+	} else {
+		in = job->in;
+	}
+
+	if (job->out_path) {
+		out_name = job->out_path;
+		out = fopen(job->out_path, "wb");
+	} else {
+		out_name = "open_memstream";
+		out = open_memstream(&job->out_buf, &job->out_len);
+	}
+
+	if (!out) {
+		snprintf(job->err, OIL_ERR_LEN, "%s: %s", out_name,
+			strerror(errno));
+		job->ret = -1;
+	} else {
+		job->ret = oil_resize(&in, out, job->box_width,
+			job->box_height, &job->opts, job->err);
+		if (fclose(out) && !job->ret) {
+			snprintf(job->err, OIL_ERR_LEN, "%s: %s", out_name,
+				strerror(errno));
+			job->ret = -1;
+		}
+		if (job->ret && job->out_path) {
+			unlink(job->out_path);
+		}
+	}
+
+	if (job->in_path) {
+		oil_mem_free(&in);
+	}
+}
+
+static void pool_destroy(struct oil_pool *pool)
+{
+	pthread_cond_destroy(&pool->job_done);
+	pthread_cond_destroy(&pool->not_full);
+	pthread_cond_destroy(&pool->not_empty);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool->queue);
+	pool->threads = NULL;
+	pool->queue = NULL;
+}
+
+static void *worker(void *data)
+{
+	struct oil_pool *pool;
+	struct oil_job *job;
+	int last;
+
+	pool = (struct oil_pool *)data;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->count && !pool->closed) {
+			pthread_cond_wait(&pool->not_empty, &pool->lock);
+		}
+		if (!pool->count) {
+			pool->running--;
+			last = pool->abandoned && !pool->running;
+			pthread_mutex_unlock(&pool->lock);
+			if (last) {
+				pool_destroy(pool);
+				free(pool);
+			}
+			return NULL;
+		}
+		job = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->queue_size;
+		pool->count--;
+		pthread_cond_signal(&pool->not_full);
+		pthread_mutex_unlock(&pool->lock);
+
+		job_run(job);
+
+		pthread_mutex_lock(&pool->lock);
+		job->done = 1;
+		pthread_cond_broadcast(&pool->job_done);
+		pthread_mutex_unlock(&pool->lock);
+
+		oil_job_release(job);
+	}
+}
+
+static void pin_thread(pthread_t thread, int n)
+{
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	long num_cpus;
+
+	num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (num_cpus < 1) {
+		return;
+	}
+	CPU_ZERO(&set);
+	CPU_SET(n % num_cpus, &set);
+	pthread_setaffinity_np(thread, sizeof(set), &set);
+#endif
+}
+
+int oil_pool_init(struct oil_pool *pool, int num_threads, int queue_size,
+	int pin)
+{
+	sigset_t all, old;
+	int i;
+
+	if (num_threads < 1 || queue_size < 1) {
+		return -1;
+	}
+
+	memset(pool, 0, sizeof(struct oil_pool));
+	pool->queue_size = queue_size;
+	pool->queue = malloc(queue_size * sizeof(struct oil_job *));
+	pool->threads = malloc(num_threads * sizeof(pthread_t));
+	if (!pool->queue || !pool->threads) {
+		free(pool->queue);
+		free(pool->threads);
+		pool->queue = NULL;
+		pool->threads = NULL;
+		return -2;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->not_empty, NULL);
+	pthread_cond_init(&pool->not_full, NULL);
+	pthread_cond_init(&pool->job_done, NULL);
+
+	/* New threads inherit the signal mask of the thread that creates them. */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	for (i=0; i<num_threads; i++) {
+		if (pthread_create(pool->threads + i, NULL, worker, pool)) {
+			break;
+		}
+		if (pin) {
+			pin_thread(pool->threads[i], i);
+		}
+		pool->num_threads++;
+		pool->running++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (pool->num_threads < num_threads) {
+		oil_pool_free(pool);
+		return -2;
+	}
+	return 0;
+}
+
+static void enqueue(struct oil_pool *pool, struct oil_job *job)
+{
+	__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+	pool->queue[(pool->head + pool->count) % pool->queue_size] = job;
+	pool->count++;
+	pthread_cond_signal(&pool->not_empty);
+}
+
+int oil_pool_submit(struct oil_pool *pool, struct oil_job *job)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == pool->queue_size && !pool->closed) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	if (pool->closed) {
+		pthread_mutex_unlock(&pool->lock);
+		return -1;
+	}
+	enqueue(pool, job);
+	pthread_mutex_unlock(&pool->lock);
+	return 0;
+}
+
+int oil_pool_try_submit(struct oil_pool *pool, struct oil_job *job)
+{
+	int ret;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->closed) {
+		ret = -1;
+	} else if (pool->count == pool->queue_size) {
+		ret = -2;
+	} else {
+		enqueue(pool, job);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return ret;
+}
+
+void oil_pool_close(struct oil_pool *pool)
+{
+	int i, num_threads;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->closed = 1;
+	num_threads = pool->num_threads;
+	pool->num_threads = 0;
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_cond_broadcast(&pool->not_full);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i=0; i<num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+}
+
+/* Close the pool and discard queued jobs rather than running them. Called
+ * with the lock held.
+ */
+static void discard_jobs(struct oil_pool *pool)
+{
+	struct oil_job *job;
+
+	pool->closed = 1;
+	while (pool->count) {
+		job = pool->queue[pool->head];
+		pool->head = (pool->head + 1) % pool->queue_size;
+		pool->count--;
+		snprintf(job->err, OIL_ERR_LEN, "Pool was freed before the job ran.");
+		job->ret = -1;
+		job->done = 1;
+		oil_job_release(job);
+	}
+	pthread_cond_broadcast(&pool->job_done);
+	pthread_cond_broadcast(&pool->not_empty);
+	pthread_cond_broadcast(&pool->not_full);
+}
+
+void oil_pool_free(struct oil_pool *pool)
+{
+	if (!pool->queue) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	discard_jobs(pool);
+	pthread_mutex_unlock(&pool->lock);
+
+	oil_pool_close(pool);
+	pool_destroy(pool);
+}
+
+void oil_pool_abandon(struct oil_pool *pool)
+{
+	int i, running;
+
+	if (!pool->queue) {
+		free(pool);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	discard_jobs(pool);
+	for (i=0; i<pool->num_threads; i++) {
+		pthread_detach(pool->threads[i]);
+	}
+	pool->num_threads = 0;
+	pool->abandoned = 1;
+	running = pool->running;
+	pthread_mutex_unlock(&pool->lock);
+
+	if (!running) {
+		pool_destroy(pool);
+		free(pool);
+	}
+}
@@ -0,0 +1,134 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OIL_POOL_H
+#define OIL_POOL_H
+
+#include <pthread.h>
+#include "oil_mem.h"
+#include "oil_resize.h"
+
+/**
+ * A resize job. The input is either held in memory or read from in_path, and
+ * the output is either written to out_path or collected in out_buf.
+ */
+struct oil_job {
+	struct oil_mem in; // input image, used when in_path is NULL.
+	unsigned char *in_buf; // our copy of the input image, freed with the job.
+	char *in_path; // path of the input image, or NULL.
+	char *out_path; // path of the output image, or NULL.
+	int box_width; // width of the box the output has to fit in.
+	int box_height; // height of the box the output has to fit in.
+	struct oil_resize_opts opts; // encoder options.
+	char *out_buf; // encoded output when out_path is NULL.
+	size_t out_len; // length in bytes of out_buf.
+	int ret; // result of the resize, valid once done is set.
+	char err[OIL_ERR_LEN]; // error message when ret is non-zero.
+	int done; // set by the worker once the job has run.
+	int refs; // number of owners, the job is freed when this drops to 0.
+};
+
+/**
+ * A fixed set of worker threads fed from a bounded queue of jobs.
+ */
+struct oil_pool {
+	pthread_t *threads; // worker threads.
+	int num_threads; // number of worker threads that were started.
+	struct oil_job **queue; // ring buffer of pending jobs.
+	int queue_size; // capacity of the ring buffer.
+	int head; // position of the next job to run.
+	int count; // number of pending jobs.
+	int closed; // no more jobs are accepted once this is set.
+	int running; // worker threads that have not exited.
+	int abandoned; // set by oil_pool_abandon(), the last worker frees us.
+	pthread_mutex_t lock; // protects everything above and job->done.
+	pthread_cond_t not_empty; // signalled when a job is queued.
+	pthread_cond_t not_full; // signalled when a job is dequeued.
+	pthread_cond_t job_done; // broadcast when any job finishes.
+};
+
+/**
+ * Allocate a job with a single reference.
+ *
+ * Returns NULL if unable to allocate memory.
+ */
+struct oil_job *oil_job_new();
+
+/**
+ * Drop a reference to a job, freeing it when no references remain. Safe to
+ * call from any thread.
+ */
+void oil_job_release(struct oil_job *job);
+
+/**
+ * Start a pool of worker threads.
+ * @pool: Pointer to the pool struct to be initialized.
+ * @num_threads: Number of worker threads.
+ * @queue_size: Maximum number of jobs waiting to run.
+ * @pin: If non-zero, pin worker n to CPU n, modulo the number of CPUs.
+ *
+ * Workers block all signals so that they are delivered to other threads.
+ *
+ * Returns 0 on success.
+ * Returns -1 if an argument is bad.
+ * Returns -2 if unable to allocate memory or start the threads.
+ */
+int oil_pool_init(struct oil_pool *pool, int num_threads, int queue_size,
+	int pin);
+
+/**
+ * Queue a job, taking a reference to it. Blocks while the queue is full.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the pool has been closed.
+ */
+int oil_pool_submit(struct oil_pool *pool, struct oil_job *job);
+
+/**
+ * Queue a job without blocking.
+ *
+ * Returns 0 on success.
+ * Returns -1 if the pool has been closed.
+ * Returns -2 if the queue is full.
+ */
+int oil_pool_try_submit(struct oil_pool *pool, struct oil_job *job);
+
+/**
+ * Stop accepting jobs, run the jobs that are still queued, and wait for the
+ * worker threads to exit. Safe to call more than once.
+ */
+void oil_pool_close(struct oil_pool *pool);
+
+/**
+ * Close the pool and free its resources. Jobs that are still queued are
+ * discarded and marked as failed, running jobs are waited for.
+ */
+void oil_pool_free(struct oil_pool *pool);
+
+/**
+ * Like oil_pool_free(), but returns without waiting for running jobs. The
+ * worker threads are detached, and the last one to exit frees the pool
+ * itself, so it must have been allocated with malloc(). A pool that has no
+ * workers left is freed right away.
+ */
+void oil_pool_abandon(struct oil_pool *pool);
+
+#endif
@@ -23,6 +23,7 @@
 #include <math.h>
 #include <stdlib.h>
 #include <limits.h>
+#include <string.h>
 
 /**
  * When shrinking a 10 million pixel wide scanline down to a single pixel, we
@@ -57,6 +58,14 @@ static int clamp8(float x)
 	return round(clampf(x) * 255.0f);
 }
 
+/**
+ * Truncate a float between 0 and 256 to an 8-bit integer.
+ */
+static unsigned char clamp_u8(float x)
+{
+	return x < 255.0f ? x : 255;
+}
+
 /**
  * Map from the discreet dest coordinate pos to a continuous source coordinate.
  * The resulting coordinate can range from -0.5 to the maximum of the
@@ -180,6 +189,22 @@ static int linear_sample_to_srgb(float in)
 	return in > l2s_rights[offs] ? offs + 1 : offs;
 }
 
+/**
+ * Maps a linear RGB float to a 16-bit sRGB integer.
+ */
+static int linear_sample_to_srgb16(float in)
+{
+	double x;
+
+	x = clampf(in);
+	if (x <= 0.0031308) {
+		x *= 12.92;
+	} else {
+		x = 1.055 * pow(x, 1 / 2.4) - 0.055;
+	}
+	return round(x * 65535.0);
+}
+
 /**
  * Resizes a strip of RGBX scanlines to a single scanline.
  */
@@ -301,6 +326,54 @@ static void strip_scale_rgba(float **in, int strip_height, int len,
 	}
 }
 
+/**
+ * Resizes a strip of greyscale-alpha scanlines to a single greyscale scanline,
+ * composited over an opaque background. Samples are still premultiplied, so
+ * the background only needs to be added where coverage is missing.
+ */
+static void strip_scale_ga_flat(float **in, int strip_height, int len,
+	unsigned char *out, float *coeffs, float bg)
+{
+	int i, j;
+	double sum[2];
+
+	for (i=0; i<len; i+=2) {
+		sum[0] = sum[1] = 0;
+		for (j=0; j<strip_height; j++) {
+			sum[0] += coeffs[j] * in[j][i];
+			sum[1] += coeffs[j] * in[j][i + 1];
+		}
+		out[0] = clamp8(sum[0] + (1 - clampf(sum[1])) * bg);
+		out++;
+	}
+}
+
+/**
+ * Resizes a strip of RGB-alpha scanlines to a single RGB scanline, composited
+ * over an opaque background given in linear RGB.
+ */
+static void strip_scale_rgba_flat(float **in, int strip_height, int len,
+	unsigned char *out, float *coeffs, float *bg)
+{
+	int i, j;
+	double sum[4], rest;
+
+	for (i=0; i<len; i+=4) {
+		sum[0] = sum[1] = sum[2] = sum[3] = 0;
+		for (j=0; j<strip_height; j++) {
+			sum[0] += coeffs[j] * in[j][i];
+			sum[1] += coeffs[j] * in[j][i + 1];
+			sum[2] += coeffs[j] * in[j][i + 2];
+			sum[3] += coeffs[j] * in[j][i + 3];
+		}
+		rest = 1 - clampf(sum[3]);
+		out[0] = linear_sample_to_srgb(sum[0] + rest * bg[0]);
+		out[1] = linear_sample_to_srgb(sum[1] + rest * bg[1]);
+		out[2] = linear_sample_to_srgb(sum[2] + rest * bg[2]);
+		out += 3;
+	}
+}
+
 /**
  * Resizes a strip of CMYK scanlines to a single scanline.
  */
@@ -326,6 +399,35 @@ static void strip_scale_cmyk(float **in, int strip_height, int len,
 	}
 }
 
+/**
+ * Resizes a strip of RGB or RGBX scanlines to a single scanline of JFIF YCbCr,
+ * written as three separate rows.
+ */
+static void strip_scale_ycbcr(float **in, int strip_height, int len, int cmp,
+	unsigned char *y, unsigned char *cb, unsigned char *cr, float *coeffs)
+{
+	int i, j, r, g, b;
+	double sum[3];
+
+	for (i=0; i<len; i+=cmp) {
+		sum[0] = sum[1] = sum[2] = 0;
+		for (j=0; j<strip_height; j++) {
+			sum[0] += coeffs[j] * in[j][i];
+			sum[1] += coeffs[j] * in[j][i + 1];
+			sum[2] += coeffs[j] * in[j][i + 2];
+		}
+		r = linear_sample_to_srgb(sum[0]);
+		g = linear_sample_to_srgb(sum[1]);
+		b = linear_sample_to_srgb(sum[2]);
+		y[0] = 0.299f * r + 0.587f * g + 0.114f * b + 0.5f;
+		cb[0] = clamp_u8(-0.168736f * r - 0.331264f * g + 0.5f * b + 128.5f);
+		cr[0] = clamp_u8(0.5f * r - 0.418688f * g - 0.081312f * b + 128.5f);
+		y++;
+		cb++;
+		cr++;
+	}
+}
+
 /**
  * Scale a strip of scanlines. Branches to the correct interpolator using the
  * given colorspace.
@@ -359,6 +461,49 @@ static void strip_scale(float **in, int strip_height, int len,
 	}
 }
 
+/**
+ * Resizes a strip of G, GA, RGB or RGBA scanlines to a single scanline of
+ * 16-bit samples, most significant byte first.
+ */
+static void strip_scale16(float **in, int strip_height, int len,
+	unsigned char *out, float *coeffs, enum oil_colorspace cs)
+{
+	int i, j, k, cmp, colors, v;
+	double sum[4], alpha;
+
+	cmp = OIL_CMP(cs);
+	colors = cs == OIL_CS_GA || cs == OIL_CS_RGBA ? cmp - 1 : cmp;
+	for (i=0; i<len; i+=cmp) {
+		for (k=0; k<cmp; k++) {
+			sum[k] = 0;
+			for (j=0; j<strip_height; j++) {
+				sum[k] += coeffs[j] * in[j][i + k];
+			}
+		}
+		if (colors < cmp) {
+			alpha = clampf(sum[colors]);
+			if (alpha != 0) {
+				for (k=0; k<colors; k++) {
+					sum[k] /= alpha;
+				}
+			}
+			v = round(alpha * 65535.0f);
+			out[2 * colors] = v >> 8;
+			out[2 * colors + 1] = v;
+		}
+		for (k=0; k<colors; k++) {
+			if (colors > 2) {
+				v = linear_sample_to_srgb16(sum[k]);
+			} else {
+				v = round(clampf(sum[k]) * 65535.0f);
+			}
+			out[2 * k] = v >> 8;
+			out[2 * k + 1] = v;
+		}
+		out += 2 * cmp;
+	}
+}
+
 /* horizontal scaling */
 
 /**
@@ -368,12 +513,27 @@ static void strip_scale(float **in, int strip_height, int len,
 static float s2l_map_f[256];
 
 /**
- * Populates s2l_map_f.
+ * Maps sRGB values in steps of 1/S2L_FINE_STEPS to linear RGB. Used where
+ * samples are computed from YCbCr and were never rounded to 8 bits.
+ */
+#define S2L_FINE_STEPS 16
+#define S2L_FINE_LEN (255 * S2L_FINE_STEPS + 1)
+static float s2l_fine[S2L_FINE_LEN];
+
+/**
+ * Maps 16-bit sRGB values to linear RGB.
+ */
+static float s2l_map16[65536];
+
+/**
+ * Populates s2l_map_f, s2l_fine and s2l_map16. s2l_map16 is interpolated from
+ * s2l_fine, whose entries are close enough that the error is far below what
+ * a float holds.
  */
 static void build_s2l()
 {
-	int input;
-	double in_f, tmp, val;
+	int input, i;
+	double in_f, tmp, val, pos;
 
 	for (input=0; input<=255; input++) {
 		in_f = input / 255.0;
@@ -385,6 +545,134 @@ static void build_s2l()
 		}
 		s2l_map_f[input] = val;
 	}
+
+	for (input=0; input<S2L_FINE_LEN; input++) {
+		in_f = input / (255.0 * S2L_FINE_STEPS);
+		if (in_f <= 0.040448236277) {
+			val = in_f / 12.92;
+		} else {
+			tmp = ((in_f + 0.055)/1.055);
+			val = pow(tmp, 2.4);
+		}
+		s2l_fine[input] = val;
+	}
+
+	for (input=0; input<65535; input++) {
+		pos = input * ((S2L_FINE_LEN - 1) / 65535.0);
+		i = pos;
+		s2l_map16[input] = s2l_fine[i] + (s2l_fine[i + 1] - s2l_fine[i]) *
+			(pos - i);
+	}
+	s2l_map16[65535] = s2l_fine[S2L_FINE_LEN - 1];
+}
+
+/**
+ * Number of 16-bit pixels converted to floats at a time.
+ */
+#define WIDE_CHUNK 256
+
+/**
+ * Convert len pixels of 16-bit samples, most significant byte first, to the
+ * floats the scaler keeps: linear light for RGB, and premultiplied by alpha.
+ */
+static void wide_to_linear(unsigned char *in, enum oil_colorspace cs, int len,
+	float *out)
+{
+	int i, k;
+	float alpha;
+
+	switch (cs) {
+	case OIL_CS_G:
+		for (i=0; i<len; i++) {
+			out[i] = (in[2 * i] << 8 | in[2 * i + 1]) / 65535.0f;
+		}
+		break;
+	case OIL_CS_GA:
+		for (i=0; i<len; i++) {
+			alpha = (in[2] << 8 | in[3]) / 65535.0f;
+			out[0] = alpha * (in[0] << 8 | in[1]) / 65535.0f;
+			out[1] = alpha;
+			in += 4;
+			out += 2;
+		}
+		break;
+	case OIL_CS_RGB:
+		for (i=0; i<len * 3; i++) {
+			out[i] = s2l_map16[in[2 * i] << 8 | in[2 * i + 1]];
+		}
+		break;
+	case OIL_CS_RGBA:
+		for (i=0; i<len; i++) {
+			alpha = (in[6] << 8 | in[7]) / 65535.0f;
+			for (k=0; k<3; k++) {
+				out[k] = s2l_map16[in[2 * k] << 8 | in[2 * k + 1]] * alpha;
+			}
+			out[3] = alpha;
+			in += 8;
+			out += 4;
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/**
+ * Number of pixels converted from YCbCr at a time, small enough that the
+ * converted samples stay in the L1 cache until the scaler reads them.
+ */
+#define YCBCR_CHUNK 256
+
+/**
+ * Convert len YCbCr pixels starting at luma column pos to interleaved linear
+ * RGB. When chroma_shift is 1, chroma has half as many samples as luma and is
+ * upsampled with a triangle filter like libjpeg's fancy upsampling. The
+ * arithmetic is done in loops that the compiler can vectorize, leaving only
+ * the table lookup for a last pass.
+ */
+static void ycbcr_to_linear(unsigned char *y, float *cb, float *cr,
+	int chroma_shift, int width, int pos, int len, float *out, int *idx)
+{
+	int i, k, lo, hi, c_max;
+	float c_cb[YCBCR_CHUNK + 2], c_cr[YCBCR_CHUNK + 2], r, g, b, max;
+
+	/* Upsample chroma a pair of pixels at a time, starting from the chroma
+	 * sample under pos. An odd pos takes the second pixel of its pair.
+	 */
+	if (chroma_shift) {
+		c_max = (width - 1) >> 1;
+		for (i=0, k=pos>>1; i<len+(pos&1); i+=2, k++) {
+			lo = k ? k - 1 : 0;
+			hi = k < c_max ? k + 1 : c_max;
+			c_cb[i] = 0.75f * cb[k] + 0.25f * cb[lo];
+			c_cb[i + 1] = 0.75f * cb[k] + 0.25f * cb[hi];
+			c_cr[i] = 0.75f * cr[k] + 0.25f * cr[lo];
+			c_cr[i + 1] = 0.75f * cr[k] + 0.25f * cr[hi];
+		}
+		k = pos & 1;
+	} else {
+		for (i=0; i<len; i++) {
+			c_cb[i] = cb[pos + i];
+			c_cr[i] = cr[pos + i];
+		}
+		k = 0;
+	}
+
+	y += pos;
+	max = S2L_FINE_LEN - 1;
+	for (i=0; i<len; i++) {
+		r = (y[i] + 1.402f * c_cr[i + k]) * S2L_FINE_STEPS + 0.5f;
+		g = (y[i] - 0.344136f * c_cb[i + k] - 0.714136f * c_cr[i + k]) *
+			S2L_FINE_STEPS + 0.5f;
+		b = (y[i] + 1.772f * c_cb[i + k]) * S2L_FINE_STEPS + 0.5f;
+		idx[i * 3] = r < 0 ? 0 : (r > max ? max : r);
+		idx[i * 3 + 1] = g < 0 ? 0 : (g > max ? max : g);
+		idx[i * 3 + 2] = b < 0 ? 0 : (b > max ? max : b);
+	}
+
+	for (i=0; i<len * 3; i++) {
+		out[i] = s2l_fine[idx[i]];
+	}
 }
 
 /**
@@ -602,7 +890,7 @@ static void xscale_down_ga(unsigned char *in, int in_width, float *out,
 	for (i=0; i<out_width; i++) {
 		for (j=border_buf[0]; j>0; j--) {
 			alpha = in[1] / 255.0f;
-			add_sample_to_sum_f(in[0] * alpha, coeff_buf, sum[0]);
+			add_sample_to_sum_f(alpha * in[0] / 255.0f, coeff_buf, sum[0]);
 			add_sample_to_sum_f(alpha, coeff_buf, sum[1]);
 			in += 2;
 			coeff_buf += 4;
@@ -613,6 +901,129 @@ static void xscale_down_ga(unsigned char *in, int in_width, float *out,
 	}
 }
 
+static void xscale_down_ycbcr(unsigned char *y, float *cb, float *cr,
+	int chroma_shift, int in_width, float *out, int out_width, int cmp,
+	float *coeff_buf, int *border_buf)
+{
+	int i, j, k, pos, left, idx[YCBCR_CHUNK * 3];
+	float *in, lin[YCBCR_CHUNK * 3], sum[3][4] = {{ 0.0f }};
+
+	pos = 0;
+	left = 0;
+	in = lin;
+	for (i=0; i<out_width; i++) {
+		for (j=border_buf[0]; j>0; j--) {
+			if (!left) {
+				left = in_width - pos;
+				left = left < YCBCR_CHUNK ? left : YCBCR_CHUNK;
+				ycbcr_to_linear(y, cb, cr, chroma_shift, in_width, pos,
+					left, lin, idx);
+				pos += left;
+				in = lin;
+			}
+			for (k=0; k<3; k++) {
+				add_sample_to_sum_f(in[k], coeff_buf, sum[k]);
+			}
+			in += 3;
+			left--;
+			coeff_buf += 4;
+		}
+		dump_out(out, sum, 3);
+		if (cmp == 4) {
+			out[3] = 0;
+		}
+		out += cmp;
+		border_buf++;
+	}
+}
+
+/**
+ * Get index i from a scanline of indices that are depth bits each.
+ */
+static int palette_index(unsigned char *in, int i, int depth)
+{
+	int pos;
+
+	if (depth == 8) {
+		return in[i];
+	}
+	pos = i * depth;
+	return in[pos >> 3] >> (8 - depth - (pos & 7)) & ((1 << depth) - 1);
+}
+
+/**
+ * Indices are read in order, a byte at a time, so that sub-byte indices cost a
+ * shift and a mask each. cmp is a constant at each call site, which lets the
+ * compiler unroll the loops over samples.
+ */
+static void xscale_down_palette(unsigned char *in, struct oil_palette *pal,
+	float *out, int out_width, int cmp, float *coeff_buf, int *border_buf)
+{
+	int i, j, k, depth, mask, shift, byte;
+	float *px, sum[4][4] = {{ 0.0f }};
+
+	depth = pal->depth;
+	mask = (1 << depth) - 1;
+	shift = byte = 0;
+	for (i=0; i<out_width; i++) {
+		for (j=border_buf[0]; j>0; j--) {
+			if (depth == 8) {
+				px = pal->table + *in++ * 4;
+			} else {
+				if (!shift) {
+					byte = *in++;
+					shift = 8;
+				}
+				shift -= depth;
+				px = pal->table + (byte >> shift & mask) * 4;
+			}
+			for (k=0; k<cmp; k++) {
+				add_sample_to_sum_f(px[k], coeff_buf, sum[k]);
+			}
+			coeff_buf += 4;
+		}
+		dump_out(out, sum, cmp);
+		out += cmp;
+		border_buf++;
+	}
+}
+
+/**
+ * cmp must be OIL_CMP(cs). It is a constant at each call site, which lets the
+ * compiler unroll the loops over samples.
+ */
+static void xscale_down16(unsigned char *in, int in_width, float *out,
+	int out_width, enum oil_colorspace cs, int cmp, float *coeff_buf,
+	int *border_buf)
+{
+	int i, j, k, pos, left;
+	float *lin, buf[WIDE_CHUNK * 4], sum[4][4] = {{ 0.0f }};
+
+	pos = 0;
+	left = 0;
+	lin = buf;
+	for (i=0; i<out_width; i++) {
+		for (j=border_buf[0]; j>0; j--) {
+			if (!left) {
+				left = in_width - pos;
+				left = left < WIDE_CHUNK ? left : WIDE_CHUNK;
+				wide_to_linear(in + pos * 2 * cmp, cs, left, buf);
+				pos += left;
+				lin = buf;
+			}
+			for (k=0; k<cmp; k++) {
+				add_sample_to_sum_f(lin[k], coeff_buf, sum[k]);
+			}
+			lin += cmp;
+			left--;
+			coeff_buf += 4;
+		}
+		dump_out(out, sum, cmp);
+		out += cmp;
+		border_buf++;
+	}
+}
+
 static void oil_xscale_down(unsigned char *in, int width_in, float *out,
 	int width_out, enum oil_colorspace cs_in, float *coeff_buf,
 	int *border_buf)
@@ -795,6 +1206,82 @@ static void xscale_up_g(unsigned char *in, int width_in, float *out,
 	}
 }
 
+static void xscale_up_ycbcr(unsigned char *y, float *cb, float *cr,
+	int chroma_shift, int width_in, float *out, int width_out, int cmp)
+{
+	int i, j, k, smp_i, idx[3];
+	float coeffs[4], tx, sum[3], rgb[3];
+
+	for (i=0; i<width_out; i++) {
+		smp_i = split_map(width_in, width_out, i, &tx) - 1;
+		calc_coeffs(coeffs, tx, 4);
+		sum[0] = sum[1] = sum[2] = 0.0f;
+		for (j=0; j<4; j++) {
+			ycbcr_to_linear(y, cb, cr, chroma_shift, width_in,
+				dim_safe(smp_i + j, width_in - 1), 1, rgb, idx);
+			for (k=0; k<3; k++) {
+				sum[k] += rgb[k] * coeffs[j];
+			}
+		}
+		for (k=0; k<3; k++) {
+			out[k] = sum[k];
+		}
+		if (cmp == 4) {
+			out[3] = 0.0f;
+		}
+		out += cmp;
+	}
+}
+
+static void xscale_up_palette(unsigned char *in, struct oil_palette *pal,
+	int width_in, float *out, int width_out, int cmp)
+{
+	int i, j, k, smp_i;
+	float coeffs[4], tx, sum[4], *px;
+
+	for (i=0; i<width_out; i++) {
+		smp_i = split_map(width_in, width_out, i, &tx) - 1;
+		calc_coeffs(coeffs, tx, 4);
+		sum[0] = sum[1] = sum[2] = sum[3] = 0.0f;
+		for (j=0; j<4; j++) {
+			px = pal->table + palette_index(in,
+				dim_safe(smp_i + j, width_in - 1), pal->depth) * 4;
+			for (k=0; k<cmp; k++) {
+				sum[k] += px[k] * coeffs[j];
+			}
+		}
+		for (k=0; k<cmp; k++) {
+			out[k] = sum[k];
+		}
+		out += cmp;
+	}
+}
+
+static void xscale_up16(unsigned char *in, int width_in, float *out,
+	int width_out, enum oil_colorspace cs)
+{
+	int i, j, k, cmp, smp_i;
+	float coeffs[4], tx, sum[4], px[4];
+
+	cmp = OIL_CMP(cs);
+	for (i=0; i<width_out; i++) {
+		smp_i = split_map(width_in, width_out, i, &tx) - 1;
+		calc_coeffs(coeffs, tx, 4);
+		sum[0] = sum[1] = sum[2] = sum[3] = 0.0f;
+		for (j=0; j<4; j++) {
+			wide_to_linear(in + dim_safe(smp_i + j, width_in - 1) * 2 * cmp,
+				cs, 1, px);
+			for (k=0; k<cmp; k++) {
+				sum[k] += px[k] * coeffs[j];
+			}
+		}
+		for (k=0; k<cmp; k++) {
+			out[k] = sum[k];
+		}
+		out += cmp;
+	}
+}
+
 static void oil_xscale_up(unsigned char *in, int width_in, float *out,
 	int width_out, enum oil_colorspace cs_in)
 {
@@ -870,11 +1357,6 @@ int oil_scale_init(struct oil_scale *os, int in_height, int out_height,
 		return -1;
 	}
 
-	/* Lazy perform global init */
-	if (!s2l_map_f[128]) {
-		oil_global_init();
-	}
-
 	os->in_height = in_height;
 	os->out_height = out_height;
 	os->in_width = in_width;
@@ -953,18 +1435,32 @@ int oil_scale_slots(struct oil_scale *ys)
 	return safe_target - ys->in_pos;
 }
 
+void oil_scale_x(struct oil_scale *os, unsigned char *in, float *out)
+{
+	if (os->coeffs_x) {
+		oil_xscale_down(in, os->in_width, out, os->out_width, os->cs,
+			os->coeffs_x, os->borders);
+	} else {
+		oil_xscale_up(in, os->in_width, out, os->out_width, os->cs);
+	}
+}
+
 void oil_scale_in(struct oil_scale *os, unsigned char *in)
 {
 	float *tmp;
 
 	tmp = os->rb + (os->in_pos % os->taps) * os->sl_len;
 	os->in_pos++;
-	if (os->coeffs_x) {
-		oil_xscale_down(in, os->in_width, tmp, os->out_width, os->cs,
-			os->coeffs_x, os->borders);
-	} else {
-		oil_xscale_up(in, os->in_width, tmp, os->out_width, os->cs);
-	}
+	oil_scale_x(os, in, tmp);
+}
+
+void oil_scale_in_x(struct oil_scale *os, float *in)
+{
+	float *tmp;
+
+	tmp = os->rb + (os->in_pos % os->taps) * os->sl_len;
+	os->in_pos++;
+	memcpy(tmp, in, os->sl_len * sizeof(float));
 }
 
 void oil_scale_out(struct oil_scale *ys, unsigned char *out)
@@ -985,6 +1481,215 @@ void oil_scale_out(struct oil_scale *ys, unsigned char *out)
 	ys->target = yscaler_map_pos(ys, &ys->ty);
 }
 
+void oil_scale_out_flat(struct oil_scale *ys, unsigned char *out,
+	unsigned char *bg)
+{
+	int i, idx;
+	float bg_lin[3];
+
+	if (ys->cs != OIL_CS_GA && ys->cs != OIL_CS_RGBA) {
+		oil_scale_out(ys, out);
+		return;
+	}
+
+	for (i=0; i<ys->taps; i++) {
+		idx = oil_yscaler_safe_idx(ys, i);
+		ys->virt[i] = ys->rb + (idx % ys->taps) * ys->sl_len;
+	}
+	calc_coeffs(ys->coeffs_y, ys->ty, ys->taps);
+	if (ys->cs == OIL_CS_GA) {
+		bg_lin[0] = (0.299f * bg[0] + 0.587f * bg[1] + 0.114f * bg[2]) /
+			255.0f;
+		strip_scale_ga_flat(ys->virt, ys->taps, ys->sl_len, out,
+			ys->coeffs_y, bg_lin[0]);
+	} else {
+		for (i=0; i<3; i++) {
+			bg_lin[i] = s2l_map_f[bg[i]];
+		}
+		strip_scale_rgba_flat(ys->virt, ys->taps, ys->sl_len, out,
+			ys->coeffs_y, bg_lin);
+	}
+	ys->out_pos++;
+	ys->target = yscaler_map_pos(ys, &ys->ty);
+}
+
+void oil_scale_in_ycbcr(struct oil_scale *os, unsigned char *y, float *cb,
+	float *cr, int chroma_shift)
+{
+	float *tmp;
+
+	tmp = os->rb + (os->in_pos % os->taps) * os->sl_len;
+	os->in_pos++;
+	if (os->coeffs_x) {
+		xscale_down_ycbcr(y, cb, cr, chroma_shift, os->in_width, tmp,
+			os->out_width, OIL_CMP(os->cs), os->coeffs_x, os->borders);
+	} else {
+		xscale_up_ycbcr(y, cb, cr, chroma_shift, os->in_width, tmp,
+			os->out_width, OIL_CMP(os->cs));
+	}
+}
+
+void oil_scale_out_ycbcr(struct oil_scale *ys, unsigned char *y,
+	unsigned char *cb, unsigned char *cr)
+{
+	int i, idx;
+
+	for (i=0; i<ys->taps; i++) {
+		idx = oil_yscaler_safe_idx(ys, i);
+		ys->virt[i] = ys->rb + (idx % ys->taps) * ys->sl_len;
+	}
+	calc_coeffs(ys->coeffs_y, ys->ty, ys->taps);
+	strip_scale_ycbcr(ys->virt, ys->taps, ys->sl_len, OIL_CMP(ys->cs), y, cb,
+		cr, ys->coeffs_y);
+	ys->out_pos++;
+	ys->target = yscaler_map_pos(ys, &ys->ty);
+}
+
+void oil_scale_x16(struct oil_scale *os, unsigned char *in, float *out)
+{
+	float *c;
+	int *b;
+
+	c = os->coeffs_x;
+	b = os->borders;
+	if (c) {
+		switch (os->cs) {
+		case OIL_CS_G:
+			xscale_down16(in, os->in_width, out, os->out_width,
+				OIL_CS_G, 1, c, b);
+			break;
+		case OIL_CS_GA:
+			xscale_down16(in, os->in_width, out, os->out_width,
+				OIL_CS_GA, 2, c, b);
+			break;
+		case OIL_CS_RGB:
+			xscale_down16(in, os->in_width, out, os->out_width,
+				OIL_CS_RGB, 3, c, b);
+			break;
+		case OIL_CS_RGBA:
+			xscale_down16(in, os->in_width, out, os->out_width,
+				OIL_CS_RGBA, 4, c, b);
+			break;
+		default:
+			break;
+		}
+	} else {
+		xscale_up16(in, os->in_width, out, os->out_width, os->cs);
+	}
+}
+
+void oil_scale_in16(struct oil_scale *os, unsigned char *in)
+{
+	float *tmp;
+
+	tmp = os->rb + (os->in_pos % os->taps) * os->sl_len;
+	os->in_pos++;
+	oil_scale_x16(os, in, tmp);
+}
+
+void oil_scale_out16(struct oil_scale *ys, unsigned char *out)
+{
+	int i, idx;
+
+	for (i=0; i<ys->taps; i++) {
+		idx = oil_yscaler_safe_idx(ys, i);
+		ys->virt[i] = ys->rb + (idx % ys->taps) * ys->sl_len;
+	}
+	calc_coeffs(ys->coeffs_y, ys->ty, ys->taps);
+	strip_scale16(ys->virt, ys->taps, ys->sl_len, out, ys->coeffs_y, ys->cs);
+	ys->out_pos++;
+	ys->target = yscaler_map_pos(ys, &ys->ty);
+}
+
+/* Entries hold what the per-color-space scalers above compute for a sample,
+ * in the same order of operations, so that indexed images scale exactly like
+ * their expanded equivalents.
+ */
+void oil_palette_set(struct oil_palette *pal, enum oil_colorspace cs,
+	int index, unsigned char *samples)
+{
+	float *px, alpha;
+	int k;
+
+	px = pal->table + index * 4;
+	switch (cs) {
+	case OIL_CS_G:
+		px[0] = samples[0] / 255.0f;
+		break;
+	case OIL_CS_GA:
+		alpha = samples[1] / 255.0f;
+		px[0] = alpha * samples[0] / 255.0f;
+		px[1] = alpha;
+		break;
+	case OIL_CS_RGB:
+		for (k=0; k<3; k++) {
+			px[k] = s2l_map_f[samples[k]];
+		}
+		break;
+	case OIL_CS_RGBA:
+		alpha = samples[3] / 255.0f;
+		for (k=0; k<3; k++) {
+			px[k] = s2l_map_f[samples[k]] * alpha;
+		}
+		px[3] = alpha;
+		break;
+	default:
+		break;
+	}
+}
+
+void oil_scale_x_palette(struct oil_scale *os, unsigned char *in,
+	struct oil_palette *pal, float *out)
+{
+	float *c;
+	int *b;
+
+	c = os->coeffs_x;
+	b = os->borders;
+	if (c) {
+		switch (OIL_CMP(os->cs)) {
+		case 1:
+			xscale_down_palette(in, pal, out, os->out_width, 1, c, b);
+			break;
+		case 2:
+			xscale_down_palette(in, pal, out, os->out_width, 2, c, b);
+			break;
+		case 3:
+			xscale_down_palette(in, pal, out, os->out_width, 3, c, b);
+			break;
+		case 4:
+			xscale_down_palette(in, pal, out, os->out_width, 4, c, b);
+			break;
+		}
+	} else {
+		xscale_up_palette(in, pal, os->in_width, out, os->out_width,
+			OIL_CMP(os->cs));
+	}
+}
+
+void oil_scale_in_palette(struct oil_scale *os, unsigned char *in,
+	struct oil_palette *pal)
+{
+	float *tmp;
+
+	tmp = os->rb + (os->in_pos % os->taps) * os->sl_len;
+	os->in_pos++;
+	oil_scale_x_palette(os, in, pal, tmp);
+}
+
+size_t oil_scale_mem_size(struct oil_scale *os)
+{
+	size_t size;
+
+	size = (size_t)os->sl_len * os->taps * sizeof(float);
+	size += os->taps * (sizeof(float *) + sizeof(float));
+	if (os->coeffs_x) {
+		size += 128 * (size_t)os->in_width;
+		size += sizeof(int) * (size_t)os->out_width;
+	}
+	return size;
+}
+
 int oil_fix_ratio(int src_width, int src_height, int *out_width,
 	int *out_height)
 {
@@ -22,6 +22,8 @@
 #ifndef OIL_RESAMPLE_H
 #define OIL_RESAMPLE_H
 
+#include <stddef.h>
+
 /**
  * Color spaces currently supported by oil.
  */
@@ -76,10 +78,8 @@ struct oil_scale {
 };
 
 /**
- * Initialize static, pre-calculated tables. This only needs to be called once.
- * A call to oil_scale_init() will initialize these tables if not already done,
- * so explicityly calling oil_global_init() is only needed if there are
- * concurrency concerns.
+ * Initialize static, pre-calculated tables. This must be called once, before
+ * any scaler is initialized and before any threads that scale are started.
  */
 void oil_global_init();
 
@@ -121,6 +121,22 @@ int oil_scale_slots(struct oil_scale *ys);
  */
 void oil_scale_in(struct oil_scale *os, unsigned char *in);
 
+/**
+ * Scale an input scanline horizontally, without buffering it, so that it can
+ * be ingested later with oil_scale_in_x(). Input is unsigned chars.
+ * @os: Pointer to the scaler struct.
+ * @in: Pointer to the input buffer containing a scanline.
+ * @out: Pointer to a buffer of os->sl_len floats.
+ */
+void oil_scale_x(struct oil_scale *os, unsigned char *in, float *out);
+
+/**
+ * Ingest & buffer an input scanline that was scaled by oil_scale_x().
+ * @os: Pointer to the scaler struct.
+ * @in: Pointer to the os->sl_len floats of the scaled scanline.
+ */
+void oil_scale_in_x(struct oil_scale *os, float *in);
+
 /**
  * Scale previously ingested & buffered contents to produce the next scaled output
  * scanline.
@@ -129,6 +145,121 @@ void oil_scale_in(struct oil_scale *os, unsigned char *in);
  */
 void oil_scale_out(struct oil_scale *ys, unsigned char *out);
 
+/**
+ * Same as oil_scale_out(), but flattens alpha against an opaque background
+ * while scaling, giving OIL_CS_G scanlines for OIL_CS_GA and OIL_CS_RGB
+ * scanlines for OIL_CS_RGBA. Other color spaces are scaled as by
+ * oil_scale_out().
+ * @ys: Pointer to the scaler struct.
+ * @out: Pointer to the buffer where the output scanline will be written.
+ * @bg: The background as 8-bit sRGB red, green and blue. Gray images are
+ *   flattened against its luma.
+ */
+void oil_scale_out_flat(struct oil_scale *ys, unsigned char *out,
+	unsigned char *bg);
+
+/**
+ * Ingest & buffer an input scanline given as JFIF YCbCr planes. Samples are
+ * upsampled and converted straight to linear RGB, without rounding to 8-bit
+ * sRGB first. The scaler must use OIL_CS_RGB or OIL_CS_RGBX.
+ * @os: Pointer to the scaler struct.
+ * @y: Pointer to a row of luma samples.
+ * @cb: Pointer to a row of blue-difference chroma, centered on 0.
+ * @cr: Pointer to a row of red-difference chroma, centered on 0.
+ * @chroma_shift: 1 if there is one chroma sample for every two luma samples,
+ *   0 if there is one for each.
+ */
+void oil_scale_in_ycbcr(struct oil_scale *os, unsigned char *y, float *cb,
+	float *cr, int chroma_shift);
+
+/**
+ * Same as oil_scale_out(), but writes the scanline as JFIF YCbCr planes at
+ * full resolution. The scaler must use OIL_CS_RGB or OIL_CS_RGBX.
+ * @ys: Pointer to the scaler struct.
+ * @y: Pointer to the buffer where luma samples will be written.
+ * @cb: Pointer to the buffer where blue-difference chroma will be written.
+ * @cr: Pointer to the buffer where red-difference chroma will be written.
+ */
+void oil_scale_out_ycbcr(struct oil_scale *ys, unsigned char *y,
+	unsigned char *cb, unsigned char *cr);
+
+/**
+ * Same as oil_scale_in(), but for a scanline of 16-bit samples, most
+ * significant byte first, as PNG stores them. Only for OIL_CS_G, OIL_CS_GA,
+ * OIL_CS_RGB and OIL_CS_RGBA.
+ * @os: Pointer to the scaler struct.
+ * @in: Pointer to the input buffer containing a scanline.
+ */
+void oil_scale_in16(struct oil_scale *os, unsigned char *in);
+
+/**
+ * Same as oil_scale_x(), but for a scanline of 16-bit samples.
+ * @os: Pointer to the scaler struct.
+ * @in: Pointer to the input buffer containing a scanline.
+ * @out: Pointer to a buffer of os->sl_len floats.
+ */
+void oil_scale_x16(struct oil_scale *os, unsigned char *in, float *out);
+
+/**
+ * Same as oil_scale_out(), but writes 16-bit samples, most significant byte
+ * first. Works with scanlines given by any of the oil_scale_in functions.
+ * Only for OIL_CS_G, OIL_CS_GA, OIL_CS_RGB and OIL_CS_RGBA.
+ * @ys: Pointer to the scaler struct.
+ * @out: Pointer to the buffer that will hold the output scanline, of
+ *   2 * ys->sl_len bytes.
+ */
+void oil_scale_out16(struct oil_scale *ys, unsigned char *out);
+
+/**
+ * Lookup table for scanlines of indices, such as those of PNG palette images
+ * and of gray images with fewer than 8 bits per sample. Entries hold the
+ * samples the way the scaler keeps them, converted to linear light and
+ * premultiplied by alpha, so each input pixel costs one lookup.
+ */
+struct oil_palette {
+	float table[256 * 4]; // OIL_CMP(cs) samples of each entry, 4 apart.
+	int depth; // bits per index: 1, 2, 4 or 8, packed from the high bit.
+};
+
+/**
+ * Set a palette entry from 8-bit samples. oil_scale_init() or
+ * oil_global_init() must have been called first.
+ * @pal: Pointer to the palette.
+ * @cs: Color space of the scaler the palette will be used with. One of
+ *   OIL_CS_G, OIL_CS_GA, OIL_CS_RGB or OIL_CS_RGBA.
+ * @index: Index of the entry.
+ * @samples: OIL_CMP(cs) samples, in the order of the color space.
+ */
+void oil_palette_set(struct oil_palette *pal, enum oil_colorspace cs,
+	int index, unsigned char *samples);
+
+/**
+ * Same as oil_scale_in(), but for a scanline of indices into pal. The scaler
+ * must use the color space the palette was set up with.
+ * @os: Pointer to the scaler struct.
+ * @in: Pointer to the input buffer containing a scanline of indices.
+ * @pal: Pointer to the palette.
+ */
+void oil_scale_in_palette(struct oil_scale *os, unsigned char *in,
+	struct oil_palette *pal);
+
+/**
+ * Same as oil_scale_x(), but for a scanline of indices into pal.
+ * @os: Pointer to the scaler struct.
+ * @in: Pointer to the input buffer containing a scanline of indices.
+ * @pal: Pointer to the palette.
+ * @out: Pointer to a buffer of os->sl_len floats.
+ */
+void oil_scale_x_palette(struct oil_scale *os, unsigned char *in,
+	struct oil_palette *pal, float *out);
+
+/**
+ * Get the number of bytes allocated on the heap by a scaler struct. The ring
+ * buffer dominates this for large reductions in height.
+ * @os: Pointer to an initialized scaler struct.
+ */
+size_t oil_scale_mem_size(struct oil_scale *os);
+
 /**
  * Calculate an output ratio that preserves the input aspect ratio.
  * @src_width: Width, in pixels, of the input image.
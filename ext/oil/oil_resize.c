@@ -0,0 +1,513 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "oil_resize.h"
+#include "oil_libjpeg.h"
+#include "oil_libpng.h"
+#include <errno.h>
+#include <setjmp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+enum oil_format oil_sniff_signature(const unsigned char *data, size_t len)
+{
+	if (len < 2) {
+		return OIL_FMT_UNKNOWN;
+	}
+	if (data[0] == 0xFF && data[1] == 0xD8) {
+		return OIL_FMT_JPEG;
+	}
+	if (data[0] == 0x89 && data[1] == 'P') {
+		return OIL_FMT_PNG;
+	}
+	return OIL_FMT_UNKNOWN;
+}
+
+/* Error handling -- copy the message and longjmp back to the caller. */
+
+struct resize_err {
+	struct jpeg_error_mgr jerr;
+	jmp_buf jmp;
+	char *msg;
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	char buffer[JMSG_LENGTH_MAX];
+	struct resize_err *err;
+
+	err = (struct resize_err *)cinfo->err;
+	(*cinfo->err->format_message) (cinfo, buffer);
+	snprintf(err->msg, OIL_ERR_LEN, "jpeglib: %s", buffer);
+	longjmp(err->jmp, 1);
+}
+
+static void jpeg_output_message(j_common_ptr cinfo) {}
+
+static void png_error_fn(png_structp png_ptr, png_const_charp message)
+{
+	struct resize_err *err;
+
+	err = (struct resize_err *)png_get_error_ptr(png_ptr);
+	snprintf(err->msg, OIL_ERR_LEN, "libpng: %s", message);
+	longjmp(err->jmp, 1);
+}
+
+static void png_warning_fn(png_structp png_ptr, png_const_charp message) {}
+
+/* JPEG */
+
+struct jpeg_state {
+	struct resize_err err;
+	struct jpeg_decompress_struct dinfo;
+	struct jpeg_compress_struct cinfo;
+	struct oil_libjpeg ol;
+	int ol_ready;
+	struct oil_libjpeg_planar op;
+	struct oil_libjpeg_writer jw;
+	unsigned char *outbuf;
+};
+
+static void write_markers(struct jpeg_state *st)
+{
+	jpeg_saved_marker_ptr marker;
+
+	for (marker=st->dinfo.marker_list; marker; marker=marker->next) {
+		jpeg_write_marker(&st->cinfo, marker->marker, marker->data,
+			marker->data_length);
+	}
+}
+
+static void set_compress(struct jpeg_state *st, FILE *out, int out_width,
+	int out_height, struct oil_resize_opts *opts)
+{
+	struct jpeg_compress_struct *cinfo;
+
+	cinfo = &st->cinfo;
+	jpeg_stdio_dest(cinfo, out);
+	cinfo->image_width = out_width;
+	cinfo->image_height = out_height;
+	cinfo->in_color_space = st->dinfo.out_color_space;
+	cinfo->input_components = st->dinfo.output_components;
+	jpeg_set_defaults(cinfo);
+	if (opts->quality) {
+		jpeg_set_quality(cinfo, opts->quality, FALSE);
+	}
+	oil_libjpeg_compress_speed(cinfo, opts->speed);
+	oil_libjpeg_compress_encode(cinfo, &opts->encode);
+}
+
+static int resize_jpeg_planar(struct jpeg_state *st, FILE *out,
+	int out_width, int out_height, struct oil_resize_opts *opts)
+{
+	int i, ret;
+
+	st->dinfo.out_color_space = JCS_YCbCr;
+	jpeg_calc_output_dimensions(&st->dinfo);
+	set_compress(st, out, out_width, out_height, opts);
+
+	ret = oil_libjpeg_planar_init(&st->op, &st->dinfo, &st->cinfo,
+		out_width, out_height, opts->ycbcr == OIL_YCBCR_LINEAR);
+	if (ret) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+		return -1;
+	}
+
+	jpeg_start_compress(&st->cinfo, TRUE);
+	oil_libjpeg_start_decompress(&st->dinfo);
+	write_markers(st);
+
+	for (i=0; i<out_height; i+=st->op.out_lines) {
+		if (oil_libjpeg_planar_write(&st->op)) {
+			snprintf(st->err.msg, OIL_ERR_LEN,
+				"Unable to allocate memory.");
+			return -1;
+		}
+	}
+
+	jpeg_finish_compress(&st->cinfo);
+	return 0;
+}
+
+static int resize_jpeg2(struct jpeg_state *st, struct oil_mem *in, FILE *out,
+	int out_width, int out_height, struct oil_resize_opts *opts)
+{
+	struct jpeg_decompress_struct *dinfo;
+	struct jpeg_compress_struct *cinfo;
+	int i, ret, parallel;
+
+	dinfo = &st->dinfo;
+	cinfo = &st->cinfo;
+
+	if (setjmp(st->err.jmp)) {
+		return -1;
+	}
+
+	jpeg_mem_src(dinfo, in->data, in->len);
+	jpeg_save_markers(dinfo, JPEG_COM, 0xFFFF);
+	jpeg_save_markers(dinfo, JPEG_APP0 + 1, 0xFFFF);
+	jpeg_save_markers(dinfo, JPEG_APP0 + 2, 0xFFFF);
+	jpeg_read_header(dinfo, TRUE);
+	oil_libjpeg_decompress_speed(dinfo, opts->speed);
+
+#ifdef JCS_EXTENSIONS
+	if (dinfo->out_color_space == JCS_RGB) {
+		dinfo->out_color_space = JCS_EXT_RGBX;
+	}
+#endif
+	jpeg_calc_output_dimensions(dinfo);
+
+	if (oil_fix_ratio(dinfo->output_width, dinfo->output_height,
+		&out_width, &out_height)) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Invalid dimensions.");
+		return -1;
+	}
+
+	if (opts->prescale) {
+		oil_libjpeg_prescale(dinfo, out_width, out_height,
+			opts->prescale);
+	}
+
+	if (opts->ycbcr && oil_libjpeg_planar_supported(dinfo,
+		opts->ycbcr == OIL_YCBCR_LINEAR)) {
+		return resize_jpeg_planar(st, out, out_width, out_height, opts);
+	}
+
+	ret = oil_libjpeg_init(&st->ol, dinfo, out_width, out_height);
+	if (ret == -1) {
+		snprintf(st->err.msg, OIL_ERR_LEN,
+			"Unsupported image dimensions or color space.");
+		return -1;
+	} else if (ret) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+		return -1;
+	}
+	st->ol_ready = 1;
+
+	st->outbuf = malloc(out_width * OIL_CMP(st->ol.os.cs));
+	if (!st->outbuf) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+		return -1;
+	}
+
+	set_compress(st, out, out_width, out_height, opts);
+
+	parallel = 0;
+	if (opts->threads > 1) {
+		ret = oil_libjpeg_writer_init(&st->jw, cinfo, opts->threads);
+		if (ret == -2) {
+			snprintf(st->err.msg, OIL_ERR_LEN,
+				"Unable to allocate memory.");
+			return -1;
+		}
+		parallel = !ret;
+	}
+
+	jpeg_start_compress(cinfo, TRUE);
+	ret = -1;
+	if (opts->threads > 1) {
+		ret = oil_libjpeg_start_parallel(&st->ol, in->data, in->len,
+			opts->threads);
+	}
+	if (ret == -2) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+		return -1;
+	} else if (ret) {
+		oil_libjpeg_start_decompress(dinfo);
+	}
+	write_markers(st);
+
+	for (i=0; i<out_height; i++) {
+		oil_libjpeg_read_scanline(&st->ol, st->outbuf);
+		if (parallel) {
+			oil_libjpeg_writer_write_row(&st->jw, st->outbuf);
+		} else {
+			jpeg_write_scanlines(cinfo, (JSAMPARRAY)&st->outbuf, 1);
+		}
+	}
+
+	if (parallel) {
+		oil_libjpeg_writer_finish(&st->jw);
+	} else {
+		jpeg_finish_compress(cinfo);
+	}
+	return 0;
+}
+
+static int resize_jpeg(struct oil_mem *in, FILE *out, int box_width,
+	int box_height, struct oil_resize_opts *opts, char *err)
+{
+	struct jpeg_state st;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	st.err.msg = err;
+	st.dinfo.err = jpeg_std_error(&st.err.jerr);
+	st.cinfo.err = &st.err.jerr;
+	st.err.jerr.error_exit = jpeg_error_exit;
+	st.err.jerr.output_message = jpeg_output_message;
+	jpeg_create_decompress(&st.dinfo);
+	jpeg_create_compress(&st.cinfo);
+
+	ret = resize_jpeg2(&st, in, out, box_width, box_height, opts);
+
+	if (st.ol_ready) {
+		oil_libjpeg_free(&st.ol);
+	}
+	oil_libjpeg_planar_free(&st.op);
+	oil_libjpeg_writer_free(&st.jw);
+	free(st.outbuf);
+	jpeg_destroy_compress(&st.cinfo);
+	jpeg_destroy_decompress(&st.dinfo);
+	return ret;
+}
+
+/* PNG */
+
+struct png_state {
+	struct resize_err err;
+	png_structp rpng;
+	png_infop rinfo;
+	png_structp wpng;
+	png_infop winfo;
+	struct oil_libpng ol;
+	int ol_ready;
+	struct oil_libpng_encode enc;
+	struct oil_libpng_reduce r;
+	int r_ready;
+	struct oil_libpng_writer pw;
+	int pw_ready;
+	int started;
+	unsigned char *outbuf;
+};
+
+/* Write the header, and start oil_libpng_writer if the settings need it. With
+ * reduce this waits until the color type of the output has been decided.
+ */
+static int resize_png_start(struct png_state *st, int out_width)
+{
+	int channels;
+
+	channels = OIL_CMP(st->ol.os.cs);
+	if (st->enc.reduce) {
+		oil_libpng_reduce_header(&st->r, st->wpng, st->winfo, &st->enc);
+		channels = st->r.channels;
+	}
+	png_write_info(st->wpng, st->winfo);
+	st->started = 1;
+
+	if (!oil_libpng_writer_needed(&st->enc)) {
+		return 0;
+	}
+	st->pw_ready = 1;
+	return oil_libpng_writer_init(&st->pw, st->wpng, out_width, channels,
+		&st->enc);
+}
+
+static int resize_png_row(struct png_state *st, unsigned char *row)
+{
+	if (st->pw_ready) {
+		return oil_libpng_writer_write_row(&st->pw, row);
+	}
+	png_write_row(st->wpng, row);
+	return 0;
+}
+
+static int resize_png2(struct png_state *st, struct oil_mem *in, FILE *out,
+	int out_width, int out_height, struct oil_resize_opts *opts)
+{
+	int i, ret;
+	unsigned char *row;
+
+	if (setjmp(st->err.jmp)) {
+		return -1;
+	}
+
+	oil_libpng_mem_src(st->rpng, in);
+	png_read_info(st->rpng, st->rinfo);
+	oil_libpng_set_transforms(st->rpng, st->rinfo);
+
+	if (oil_fix_ratio(png_get_image_width(st->rpng, st->rinfo),
+		png_get_image_height(st->rpng, st->rinfo), &out_width,
+		&out_height)) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Invalid dimensions.");
+		return -1;
+	}
+
+	ret = oil_libpng_init(&st->ol, st->rpng, st->rinfo, out_width,
+		out_height);
+	if (ret == -1) {
+		snprintf(st->err.msg, OIL_ERR_LEN,
+			"Unsupported image dimensions or color space.");
+		return -1;
+	} else if (ret) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+		return -1;
+	}
+	st->ol_ready = 1;
+	st->enc = opts->png;
+	st->ol.out_depth = st->enc.depth;
+
+	st->outbuf = malloc((size_t)out_width * OIL_CMP(st->ol.os.cs) *
+		st->enc.depth / 8);
+	if (!st->outbuf) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+		return -1;
+	}
+
+	if (st->enc.reduce) {
+		st->r_ready = 1;
+		ret = oil_libpng_reduce_init(&st->r, st->rpng, st->rinfo,
+			out_width, out_height, OIL_CMP(st->ol.os.cs), &st->enc);
+		if (ret) {
+			snprintf(st->err.msg, OIL_ERR_LEN,
+				"Unable to allocate memory.");
+			return -1;
+		}
+	}
+
+	png_init_io(st->wpng, out);
+	if (!st->enc.reduce) {
+		png_set_IHDR(st->wpng, st->winfo, out_width, out_height,
+			st->enc.depth, oil_libpng_color_type(st->rpng, st->rinfo),
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+	}
+	oil_libpng_compress_encode(st->wpng, &st->enc);
+
+	ret = st->enc.reduce ? 0 : resize_png_start(st, out_width);
+	for (i=0; !ret && i<out_height; i++) {
+		oil_libpng_read_scanline(&st->ol, st->outbuf);
+		if (!st->enc.reduce) {
+			ret = resize_png_row(st, st->outbuf);
+			continue;
+		}
+		ret = oil_libpng_reduce_push(&st->r, st->outbuf);
+		if (!ret && st->r.decided && !st->started) {
+			ret = resize_png_start(st, out_width);
+		}
+		while (!ret && (row = oil_libpng_reduce_pop(&st->r))) {
+			ret = resize_png_row(st, row);
+		}
+	}
+
+	if (!ret && st->pw_ready) {
+		ret = oil_libpng_writer_finish(&st->pw);
+	} else if (!ret) {
+		png_write_end(st->wpng, st->winfo);
+	}
+	if (ret == -1) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Invalid number of threads.");
+	} else if (ret) {
+		snprintf(st->err.msg, OIL_ERR_LEN, "Unable to allocate memory.");
+	}
+	return ret ? -1 : 0;
+}
+
+static int resize_png(struct oil_mem *in, FILE *out, int box_width,
+	int box_height, struct oil_resize_opts *opts, char *err)
+{
+	struct png_state st;
+	int ret;
+
+	memset(&st, 0, sizeof(st));
+	st.err.msg = err;
+	st.rpng = png_create_read_struct(PNG_LIBPNG_VER_STRING, &st.err,
+		png_error_fn, png_warning_fn);
+	st.wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, &st.err,
+		png_error_fn, png_warning_fn);
+	if (st.rpng) {
+		st.rinfo = png_create_info_struct(st.rpng);
+	}
+	if (st.wpng) {
+		st.winfo = png_create_info_struct(st.wpng);
+	}
+
+	if (st.rinfo && st.winfo) {
+		ret = resize_png2(&st, in, out, box_width, box_height, opts);
+	} else {
+		snprintf(err, OIL_ERR_LEN, "Unable to allocate memory.");
+		ret = -1;
+	}
+
+	if (st.ol_ready) {
+		oil_libpng_free(&st.ol);
+	}
+	if (st.r_ready) {
+		oil_libpng_reduce_free(&st.r);
+	}
+	if (st.pw_ready) {
+		oil_libpng_writer_free(&st.pw);
+	}
+	free(st.outbuf);
+	png_destroy_write_struct(&st.wpng, &st.winfo);
+	png_destroy_read_struct(&st.rpng, &st.rinfo, NULL);
+	return ret;
+}
+
+/* Public entry points */
+
+int oil_resize(struct oil_mem *in, FILE *out, int box_width, int box_height,
+	struct oil_resize_opts *opts, char *err)
+{
+	switch (oil_sniff_signature(in->data, in->len)) {
+	case OIL_FMT_JPEG:
+		return resize_jpeg(in, out, box_width, box_height, opts, err);
+	case OIL_FMT_PNG:
+		return resize_png(in, out, box_width, box_height, opts, err);
+	default:
+		snprintf(err, OIL_ERR_LEN, "Unknown image file format.");
+		return -1;
+	}
+}
+
+int oil_resize_file(const char *in_path, const char *out_path, int box_width,
+	int box_height, struct oil_resize_opts *opts, char *err)
+{
+	struct oil_mem in;
+	FILE *out;
+	int ret;
+
+	if (oil_mem_map_path(&in, in_path)) {
+		snprintf(err, OIL_ERR_LEN, "%s: %s", in_path, strerror(errno));
+		return -1;
+	}
+
+	out = fopen(out_path, "wb");
+	if (!out) {
+		snprintf(err, OIL_ERR_LEN, "%s: %s", out_path, strerror(errno));
+		oil_mem_free(&in);
+		return -1;
+	}
+
+	ret = oil_resize(&in, out, box_width, box_height, opts, err);
+	if (fclose(out) && !ret) {
+		snprintf(err, OIL_ERR_LEN, "%s: %s", out_path, strerror(errno));
+		ret = -1;
+	}
+	if (ret) {
+		unlink(out_path);
+	}
+
+	oil_mem_free(&in);
+	return ret;
+}
@@ -0,0 +1,102 @@
+/**
+ * Copyright (c) 2014-2019 Timothy Elliott
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef OIL_RESIZE_H
+#define OIL_RESIZE_H
+
+#include <stdio.h>
+#include "oil_mem.h"
+#include "oil_libjpeg.h"
+#include "oil_libpng.h"
+
+/**
+ * Size of the buffer that receives error messages.
+ */
+#define OIL_ERR_LEN 256
+
+/**
+ * Image formats understood by oil.
+ */
+enum oil_format {
+	OIL_FMT_UNKNOWN = 0,
+	OIL_FMT_JPEG,
+	OIL_FMT_PNG,
+	OIL_FMT_WEBP, // output only, with libwebp.
+};
+
+/**
+ * Ways to scale YCbCr JPEGs.
+ */
+enum oil_ycbcr {
+	OIL_YCBCR_RGB = 0, // let libjpeg convert to and from RGB.
+	OIL_YCBCR_PLANAR, // scale each plane as stored, see oil_libjpeg_planar.
+	OIL_YCBCR_LINEAR, // convert planes to linear RGB while scaling.
+};
+
+/**
+ * Options for oil_resize().
+ */
+struct oil_resize_opts {
+	int quality; // JPEG quality, 1 to 100. 0 uses the libjpeg default.
+	double prescale; // see oil_libjpeg_prescale(). 0 disables DCT scaling.
+	enum oil_ycbcr ycbcr; // how to scale YCbCr JPEGs.
+	int speed; // JPEG speed profile, an enum oil_libjpeg_speed.
+	int threads; // threads to decode and encode JPEGs with.
+	struct oil_libjpeg_encode encode; // JPEG encoder settings.
+	struct oil_libpng_encode png; // PNG encoder settings.
+};
+
+/**
+ * Identify an image format from the first bytes of an image.
+ * @data: Pointer to the start of the image.
+ * @len: Number of bytes available at data.
+ */
+enum oil_format oil_sniff_signature(const unsigned char *data, size_t len);
+
+/**
+ * Decode an image held in memory, fit it into a box while preserving its
+ * aspect ratio, and encode it to a stream in the same format.
+ * @in: Memory holding the compressed source image.
+ * @out: Stream to which the resized image is written.
+ * @box_width: Width, in pixels, of the bounding box.
+ * @box_height: Height, in pixels, of the bounding box.
+ * @opts: Encoder options.
+ * @err: Buffer of OIL_ERR_LEN bytes that receives a message on failure.
+ *
+ * JPEG COM, APP1 and APP2 markers are carried over to the output. Nothing in
+ * here calls into Ruby, so it is safe to run without the GVL.
+ *
+ * Returns 0 on success.
+ * Returns -1 on failure.
+ */
+int oil_resize(struct oil_mem *in, FILE *out, int box_width, int box_height,
+	struct oil_resize_opts *opts, char *err);
+
+/**
+ * Same as oil_resize(), but reads from and writes to files. The input file is
+ * memory-mapped. A partially written output file is removed on failure.
+ * @in_path: Path of the source image.
+ * @out_path: Path of the output image.
+ */
+int oil_resize_file(const char *in_path, const char *out_path, int box_width,
+	int box_height, struct oil_resize_opts *opts, char *err);
+
+#endif
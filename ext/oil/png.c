@@ -1,13 +1,47 @@
 #include <ruby.h>
 #include <png.h>
+#include <jpeglib.h>
 #include "oil_libpng.h"
+#include "oil_libwebp.h"
+#include "oil_mem.h"
+#include "oil_resize.h"
+
+/* Most pushed data a job step gives libpng at once. Steps check their limits
+ * between calls, since libpng decodes every row it can from what it is given.
+ */
+#define PUSH_SIZE 4096
+
+/* Size of the strings JPEG output is yielded in. */
+#define WRITE_SIZE 1024
 
 static ID id_read;
+static VALUE cJob;
+static VALUE sym_quality;
+
+VALUE oil_mem_from_value(VALUE src, struct oil_mem *mem);
+void oil_mem_map_value(VALUE file, struct oil_mem *mem);
+void oil_step_limit(VALUE limit, long *max_rows, double *deadline);
+void oil_png_encode_opts(VALUE opts, struct oil_libpng_encode *enc);
+enum oil_format oil_format_opt(VALUE opts, enum oil_format own);
+void oil_encode_opts(VALUE opts, struct oil_libjpeg_encode *enc);
+void oil_background_opt(VALUE opts, unsigned char *bg);
+int oil_speed_opt(VALUE opts);
+void output_message(j_common_ptr cinfo);
+#ifdef HAVE_LIBWEBP
+void oil_webp_encode_opts(VALUE opts, struct oil_libwebp_encode *enc);
+#endif
+int oil_step_expired(double deadline);
 
 struct readerdata {
 	png_structp png;
 	png_infop info;
 	VALUE source_io;
+	struct oil_mem mem;
+	struct oil_push push; // data given with <<, by readers made with push.
+	int pushed; // 1 if the reader was made with push.
+	int header_read; // 1 once the header has been read.
+	size_t unread; // bytes libpng left when it paused after the header.
+	size_t mem_size;
 	int scale_width;
 	int scale_height;
 	int locked;
@@ -50,19 +84,45 @@ static void write_data_fn(png_structp png_ptr, png_bytep data, png_size_t length
 
 /* Ruby GC */
 
-static void deallocate(struct readerdata *reader)
+/* Tell the GC about native memory held by the reader while it decodes. */
+static void set_mem_size(struct readerdata *reader, size_t mem_size)
+{
+	rb_gc_adjust_memory_usage((ssize_t)mem_size - (ssize_t)reader->mem_size);
+	reader->mem_size = mem_size;
+}
+
+static void deallocate(void *ptr)
 {
+	struct readerdata *reader = ptr;
+
 	png_destroy_read_struct(&reader->png, &reader->info, NULL);
-	free(reader);
+	oil_mem_free(&reader->mem);
+	rb_gc_adjust_memory_usage(-(ssize_t)reader->push.cap);
+	oil_push_free(&reader->push);
+	xfree(reader);
 }
 
-static void mark(struct readerdata *reader)
+static void mark(void *ptr)
 {
+	struct readerdata *reader = ptr;
+
 	if (!NIL_P(reader->source_io)) {
 		rb_gc_mark(reader->source_io);
 	}
 }
 
+static size_t memsize(const void *ptr)
+{
+	const struct readerdata *reader = ptr;
+	return sizeof(struct readerdata) + reader->mem_size + reader->push.cap;
+}
+
+static const rb_data_type_t png_reader_type = {
+	"Oil::PNGReader",
+	{ mark, deallocate, memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
 static void allocate2(struct readerdata *reader)
 {
 	reader->png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, (png_error_ptr)error, (png_error_ptr)warning);
@@ -74,7 +134,8 @@ static VALUE allocate(VALUE klass)
 	struct readerdata *reader;
 	VALUE self;
 
-	self = Data_Make_Struct(klass, struct readerdata, mark, deallocate, reader);
+	self = TypedData_Make_Struct(klass, struct readerdata, &png_reader_type,
+		reader);
 	allocate2(reader);
 	return self;
 }
@@ -88,32 +149,233 @@ static void raise_if_locked(struct readerdata *reader)
 	}
 }
 
-static VALUE initialize(VALUE self, VALUE io)
-{
-	struct readerdata *reader;
-
-	Data_Get_Struct(self, struct readerdata, reader);
+/* Helpers shared by Reader.new and Reader.open. */
 
+static void reset_read_struct(struct readerdata *reader)
+{
 	if (reader->info) {
 		png_destroy_read_struct(&reader->png, &reader->info, NULL);
 		allocate2(reader);
 		reader->locked = 0;
 	}
+	oil_mem_free(&reader->mem);
+	rb_gc_adjust_memory_usage(-(ssize_t)reader->push.cap);
+	oil_push_free(&reader->push);
+	reader->pushed = 0;
+	reader->header_read = 0;
+}
 
-	reader->source_io = io;
-	png_set_read_fn(reader->png, (void*)io, read_data);
-	png_read_info(reader->png, reader->info);
-
-	png_set_packing(reader->png);
-	png_set_strip_16(reader->png);
-	png_set_expand(reader->png);
-	png_read_update_info(reader->png, reader->info);
+static void header_read(struct readerdata *reader)
+{
+	oil_libpng_set_transforms(reader->png, reader->info);
 
 	reader->scale_width = png_get_image_width(reader->png, reader->info);
 	reader->scale_height = png_get_image_height(reader->png, reader->info);
+	reader->header_read = 1;
+}
+
+static void read_header(struct readerdata *reader)
+{
+	png_read_info(reader->png, reader->info);
+	header_read(reader);
+}
+
+/* Helper that raises an exception if the header hasn't been read yet, or if
+ * the reader was made with push and the caller can't wait for data.
+ */
+static void raise_if_not_ready(struct readerdata *reader, int wait)
+{
+	if (!reader->header_read) {
+		rb_raise(rb_eRuntimeError, "Header not read yet.");
+	}
+	if (reader->pushed && !wait) {
+		rb_raise(rb_eRuntimeError, "Pushed data can only be decoded with start.");
+	}
+}
+
+/*
+ *  call-seq:
+ *     Reader.new(io_in) -> reader
+ *
+ *  Creates a new PNG Reader. +io_in+ must be an IO-like object that responds
+ *  to read(size), a String or an IO::Buffer.
+ *
+ *  Strings are decoded in place, without calling back into Ruby. IO::Buffers
+ *  are copied once, so they may be freed or resized while the reader is in
+ *  use.
+ */
+
+static VALUE initialize(VALUE self, VALUE io)
+{
+	struct readerdata *reader;
+	VALUE mem_src;
+
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	reset_read_struct(reader);
+
+	mem_src = oil_mem_from_value(io, &reader->mem);
+	if (NIL_P(mem_src)) {
+		reader->source_io = io;
+		png_set_read_fn(reader->png, (void*)io, read_data);
+	} else {
+		reader->source_io = mem_src;
+		oil_libpng_mem_src(reader->png, &reader->mem);
+	}
+
+	read_header(reader);
 	return self;
 }
 
+/*
+ *  call-seq:
+ *     Reader.open(path) -> reader
+ *     Reader.open(file) -> reader
+ *
+ *  Creates a new PNG Reader that decodes a memory-mapped file. When given an
+ *  open File, the image is read from the file's current position.
+ *
+ *     reader = Oil::PNGReader.open("image.png")
+ */
+
+static VALUE open_file(VALUE klass, VALUE file)
+{
+	struct readerdata *reader;
+	VALUE self;
+
+	self = rb_obj_alloc(klass);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	reader->source_io = file;
+
+	oil_mem_map_value(file, &reader->mem);
+	oil_libpng_mem_src(reader->png, &reader->mem);
+
+	read_header(reader);
+	return self;
+}
+
+/* Info callback of the progressive reader. Pause once the header is in, so
+ * that no rows are decoded until a job is there to take them.
+ */
+static void push_info(png_structp png, png_infop info)
+{
+	struct readerdata *reader;
+
+	reader = png_get_progressive_ptr(png);
+	header_read(reader);
+	reader->unread = png_process_data_pause(png, 0);
+}
+
+/*
+ *  call-seq:
+ *     Reader.push -> reader
+ *
+ *  Creates a new PNG Reader that is given the image a chunk at a time with
+ *  <<, using libpng's progressive reader. The header is read as soon as enough
+ *  of it has been pushed, and ready? tells when it has been.
+ *
+ *  Pushed images are decoded with start. Each step of the job decodes and
+ *  scales the rows that the data pushed so far holds, and returns an empty
+ *  string when it needs more. Steps may go a few rows past their limit, since
+ *  libpng decodes every row it can from each piece of data it is given. See
+ *  Oil::JPEGReader.push.
+ */
+
+static VALUE push_reader(VALUE klass)
+{
+	struct readerdata *reader;
+	VALUE self;
+
+	self = rb_obj_alloc(klass);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	reader->source_io = Qnil;
+	reader->pushed = 1;
+	png_set_progressive_read_fn(reader->png, reader, push_info, NULL, NULL);
+	return self;
+}
+
+/*
+ *  call-seq:
+ *     reader << string -> reader
+ *
+ *  Append a chunk of the image to a reader made with Reader.push, and read the
+ *  header if it hasn't been read yet and the chunk completes it.
+ */
+
+static VALUE push_data(VALUE self, VALUE string)
+{
+	struct readerdata *reader;
+	struct oil_push *push;
+	size_t cap, len;
+
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	StringValue(string);
+	push = &reader->push;
+	if (!reader->pushed) {
+		rb_raise(rb_eRuntimeError, "Reader was not made with push.");
+	}
+	if (push->closed) {
+		rb_raise(rb_eRuntimeError, "Reader is closed.");
+	}
+
+	cap = push->cap;
+	if (oil_push_append(push, (unsigned char *)RSTRING_PTR(string),
+		RSTRING_LEN(string))) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	rb_gc_adjust_memory_usage((ssize_t)push->cap - (ssize_t)cap);
+
+	/* libpng keeps what it needs of incomplete chunks, so everything given
+	 * to it is used up unless it pauses after the header.
+	 */
+	if (!reader->header_read) {
+		len = push->len - push->pos;
+		reader->unread = 0;
+		png_process_data(reader->png, reader->info, push->data + push->pos,
+			len);
+		push->pos += len - reader->unread;
+	}
+	return self;
+}
+
+/*
+ *  call-seq:
+ *     reader.close -> reader
+ *
+ *  Tell a reader made with Reader.push that the whole image has been pushed.
+ *  Raises RuntimeError if the header is incomplete, or from the job's step if
+ *  the image data is.
+ */
+
+static VALUE push_close(VALUE self)
+{
+	struct readerdata *reader;
+
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	if (!reader->pushed) {
+		rb_raise(rb_eRuntimeError, "Reader was not made with push.");
+	}
+	reader->push.closed = 1;
+	if (!reader->header_read) {
+		png_error(reader->png, "Unexpected end of image data.");
+	}
+	return self;
+}
+
+/*
+ *  call-seq:
+ *     reader.ready? -> true or false
+ *
+ *  Returns true once the header has been read. Readers not made with
+ *  Reader.push are always ready.
+ */
+
+static VALUE ready_p(VALUE self)
+{
+	struct readerdata *reader;
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	return reader->header_read ? Qtrue : Qfalse;
+}
+
 /*
 *  call-seq:
 *     reader.width -> number
@@ -124,7 +386,7 @@ static VALUE initialize(VALUE self, VALUE io)
 static VALUE width(VALUE self)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 	return INT2FIX(png_get_image_width(reader->png, reader->info));
 }
 
@@ -138,7 +400,7 @@ static VALUE width(VALUE self)
 static VALUE height(VALUE self)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 	return INT2FIX(png_get_image_height(reader->png, reader->info));
 }
 
@@ -153,7 +415,7 @@ static VALUE height(VALUE self)
 static VALUE scale_width(VALUE self)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 	return INT2FIX(reader->scale_width);
 }
 
@@ -168,7 +430,7 @@ static VALUE scale_width(VALUE self)
 static VALUE set_scale_width(VALUE self, VALUE scale_width)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 	raise_if_locked(reader);
 	reader->scale_width = NUM2INT(scale_width);
 	return scale_width;
@@ -185,7 +447,7 @@ static VALUE set_scale_width(VALUE self, VALUE scale_width)
 static VALUE scale_height(VALUE self)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 	return INT2FIX(reader->scale_height);
 }
 
@@ -200,7 +462,7 @@ static VALUE scale_height(VALUE self)
 static VALUE set_scale_height(VALUE self, VALUE scale_height)
 {
 	struct readerdata *reader;
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 	raise_if_locked(reader);
 	reader->scale_height = NUM2INT(scale_height);
 	return scale_height;
@@ -212,43 +474,387 @@ struct each_args {
 	png_infop winfo;
 	unsigned char *outwidthbuf;
 	struct oil_libpng ol;
+	struct oil_libpng_encode enc;
+	struct oil_libpng_reduce r;
+	struct oil_libpng_writer pw;
+	size_t pw_mem; // writer memory counted in the reader's mem_size.
+	int cmp;
+	int parallel;
+	int started;
 };
 
+static void raise_writer_error(int ret)
+{
+	if (ret == -1) {
+		rb_raise(rb_eArgError, "Invalid number of threads.");
+	}
+	rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+}
+
+/* Count the writer's memory in the reader's mem_size. The libdeflate writer
+ * grows as rows come in, so this is called again after every row.
+ */
+static void each_writer_mem(struct each_args *args)
+{
+	size_t size;
+
+	size = oil_libpng_writer_mem_size(&args->pw);
+	if (size != args->pw_mem) {
+		set_mem_size(args->reader,
+			args->reader->mem_size - args->pw_mem + size);
+		args->pw_mem = size;
+	}
+}
+
+/* Write the header and start the parallel writer if one is needed. With
+ * reduce this waits until the color type of the output has been decided.
+ */
+static void each_start(struct each_args *args)
+{
+	int channels, ret;
+
+	channels = args->cmp;
+	if (args->enc.reduce) {
+		oil_libpng_reduce_header(&args->r, args->wpng, args->winfo,
+			&args->enc);
+		channels = args->r.channels;
+	}
+	png_write_info(args->wpng, args->winfo);
+	args->started = 1;
+
+	if (!oil_libpng_writer_needed(&args->enc)) {
+		return;
+	}
+	args->parallel = 1;
+	ret = oil_libpng_writer_init(&args->pw, args->wpng,
+		args->reader->scale_width, channels, &args->enc);
+	if (ret!=0) {
+		raise_writer_error(ret);
+	}
+	each_writer_mem(args);
+}
+
+static void each_write_row(struct each_args *args, unsigned char *row)
+{
+	if (!args->parallel) {
+		png_write_row(args->wpng, row);
+	} else if (oil_libpng_writer_write_row(&args->pw, row)) {
+		raise_writer_error(-2);
+	} else {
+		each_writer_mem(args);
+	}
+}
+
 static VALUE each2(struct each_args *args)
 {
-	struct readerdata *reader;
-	unsigned char *outwidthbuf;
+	unsigned char *outwidthbuf, *row;
 	struct oil_libpng *ol;
 	int i, scaley;
 
-	reader = args->reader;
 	outwidthbuf = args->outwidthbuf;
 	ol = &args->ol;
-	scaley = reader->scale_height;
+	scaley = args->reader->scale_height;
 
-	png_write_info(args->wpng, args->winfo);
+	if (!args->enc.reduce) {
+		each_start(args);
+	}
 
 	for(i=0; i<scaley; i++) {
 		oil_libpng_read_scanline(ol, outwidthbuf);
-		png_write_row(args->wpng, outwidthbuf);
+		if (!args->enc.reduce) {
+			each_write_row(args, outwidthbuf);
+			continue;
+		}
+		if (oil_libpng_reduce_push(&args->r, outwidthbuf)) {
+			raise_writer_error(-2);
+		}
+		if (args->r.decided && !args->started) {
+			each_start(args);
+		}
+		while ((row = oil_libpng_reduce_pop(&args->r))) {
+			each_write_row(args, row);
+		}
+	}
+
+	if (!args->parallel) {
+		png_write_end(args->wpng, args->winfo);
+	} else if (oil_libpng_writer_finish(&args->pw)) {
+		raise_writer_error(-2);
+	} else {
+		each_writer_mem(args);
+	}
+	return Qnil;
+}
+
+#ifdef HAVE_LIBWEBP
+struct webp_args {
+	struct readerdata *reader;
+	struct oil_libpng ol;
+	struct oil_libwebp ow;
+	unsigned char *outwidthbuf;
+};
+
+static VALUE each_webp2(struct webp_args *args)
+{
+	int i, ret;
+
+	for (i=0; i<args->reader->scale_height; i++) {
+		oil_libpng_read_scanline(&args->ol, args->outwidthbuf);
+		oil_libwebp_write_row(&args->ow, args->outwidthbuf,
+			args->ol.os.cs);
+	}
+	ret = oil_libwebp_finish(&args->ow);
+	if (ret == -1) {
+		rb_raise(rb_eRuntimeError, "Unable to encode the WebP image.");
+	} else if (ret) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	rb_yield(rb_str_new((char *)args->ow.wr.mem, args->ow.wr.size));
+	return Qnil;
+}
+
+/* Scale the image into a WebP picture and yield the output in one string. */
+static void each_webp(struct readerdata *reader, VALUE opts)
+{
+	struct webp_args args;
+	struct oil_libwebp_encode enc;
+	size_t rowbytes;
+	int ret, state;
+
+	oil_webp_encode_opts(opts, &enc);
+	reader->locked = 1;
+
+	ret = oil_libpng_init(&args.ol, reader->png, reader->info,
+		reader->scale_width, reader->scale_height);
+	if (ret!=0) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	rowbytes = (size_t)reader->scale_width * OIL_CMP(args.ol.os.cs);
+	args.reader = reader;
+	args.outwidthbuf = malloc(rowbytes);
+	ret = oil_libwebp_init(&args.ow, reader->scale_width,
+		reader->scale_height, &enc);
+	if (ret!=0 || !args.outwidthbuf) {
+		oil_libwebp_free(&args.ow);
+		oil_libpng_free(&args.ol);
+		free(args.outwidthbuf);
+		if (ret == -1) {
+			rb_raise(rb_eArgError, "Invalid dimensions for WebP.");
+		}
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	set_mem_size(reader, oil_libpng_mem_size(&args.ol) + rowbytes +
+		oil_libwebp_mem_size(&args.ow));
+
+	rb_protect((VALUE(*)(VALUE))each_webp2, (VALUE)&args, &state);
+
+	oil_libwebp_free(&args.ow);
+	oil_libpng_free(&args.ol);
+	free(args.outwidthbuf);
+	set_mem_size(reader, 0);
+
+	if (state) {
+		rb_jump_tag(state);
+	}
+}
+#endif
+
+/* JPEG output. The compressor comes first so that libjpeg's callbacks can
+ * find the rest.
+ */
+struct jpeg_args {
+	struct jpeg_compress_struct cinfo;
+	struct jpeg_destination_mgr mgr;
+	struct jpeg_error_mgr jerr;
+	VALUE buffer;
+	VALUE opts;
+	struct oil_libjpeg_encode enc;
+	struct readerdata *reader;
+	struct oil_libpng ol;
+	unsigned char *outwidthbuf;
+	unsigned char bg[3];
+};
+
+static void jpeg_error_exit(j_common_ptr cinfo)
+{
+	char buffer[JMSG_LENGTH_MAX];
+	(*cinfo->err->format_message) (cinfo, buffer);
+	rb_raise(rb_eRuntimeError, "jpeglib: %s", buffer);
+}
+
+static void init_destination(j_compress_ptr cinfo)
+{
+	struct jpeg_args *args;
+
+	args = (struct jpeg_args *)cinfo;
+	args->buffer = rb_str_new(NULL, WRITE_SIZE);
+	args->mgr.next_output_byte = (JOCTET *)RSTRING_PTR(args->buffer);
+	args->mgr.free_in_buffer = WRITE_SIZE;
+}
+
+static boolean empty_output_buffer(j_compress_ptr cinfo)
+{
+	rb_yield(((struct jpeg_args *)cinfo)->buffer);
+	init_destination(cinfo);
+	return TRUE;
+}
+
+static void term_destination(j_compress_ptr cinfo)
+{
+	struct jpeg_args *args;
+	size_t datacount;
+
+	args = (struct jpeg_args *)cinfo;
+	datacount = WRITE_SIZE - args->mgr.free_in_buffer;
+	if (datacount > 0) {
+		rb_str_set_len(args->buffer, datacount);
+		rb_yield(args->buffer);
+	}
+}
+
+static VALUE each_jpeg2(struct jpeg_args *args)
+{
+	struct jpeg_compress_struct *cinfo;
+	VALUE quality;
+	int i;
+
+	cinfo = &args->cinfo;
+
+	cinfo->image_width = args->reader->scale_width;
+	cinfo->image_height = args->reader->scale_height;
+	if (OIL_CMP(args->ol.os.cs) < 3) {
+		cinfo->in_color_space = JCS_GRAYSCALE;
+		cinfo->input_components = 1;
+	} else {
+		cinfo->in_color_space = JCS_RGB;
+		cinfo->input_components = 3;
+	}
+	jpeg_set_defaults(cinfo);
+
+	if (!NIL_P(args->opts)) {
+		quality = rb_hash_aref(args->opts, sym_quality);
+		if (!NIL_P(quality)) {
+			jpeg_set_quality(cinfo, NUM2INT(quality), FALSE);
+		}
 	}
+	oil_libjpeg_compress_speed(cinfo, oil_speed_opt(args->opts));
+	oil_libjpeg_compress_encode(cinfo, &args->enc);
 
-	png_write_end(args->wpng, args->winfo);
+	args->mgr.init_destination = init_destination;
+	args->mgr.empty_output_buffer = empty_output_buffer;
+	args->mgr.term_destination = term_destination;
+	cinfo->dest = &args->mgr;
+
+	jpeg_start_compress(cinfo, TRUE);
+	for (i=0; i<args->reader->scale_height; i++) {
+		oil_libpng_read_scanline(&args->ol, args->outwidthbuf);
+		jpeg_write_scanlines(cinfo, &args->outwidthbuf, 1);
+	}
+	jpeg_finish_compress(cinfo);
 	return Qnil;
 }
 
+/* Scale the image straight into a JPEG compressor. Alpha is flattened against
+ * the background by the scaler, which gives gray or RGB scanlines.
+ */
+static void each_jpeg(struct readerdata *reader, VALUE opts)
+{
+	struct jpeg_args args;
+	size_t rowbytes;
+	int ret, state;
+
+	oil_encode_opts(opts, &args.enc);
+	oil_background_opt(opts, args.bg);
+	reader->locked = 1;
+
+	ret = oil_libpng_init(&args.ol, reader->png, reader->info,
+		reader->scale_width, reader->scale_height);
+	if (ret!=0) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	args.ol.bg = args.bg;
+	rowbytes = (size_t)reader->scale_width * OIL_CMP(args.ol.os.cs);
+	args.outwidthbuf = malloc(rowbytes);
+	if (!args.outwidthbuf) {
+		oil_libpng_free(&args.ol);
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	args.reader = reader;
+	args.opts = opts;
+	args.buffer = Qnil;
+
+	args.cinfo.err = jpeg_std_error(&args.jerr);
+	args.jerr.error_exit = jpeg_error_exit;
+	args.jerr.output_message = output_message;
+	jpeg_create_compress(&args.cinfo);
+	set_mem_size(reader, oil_libpng_mem_size(&args.ol) + rowbytes);
+
+	rb_protect((VALUE(*)(VALUE))each_jpeg2, (VALUE)&args, &state);
+
+	jpeg_destroy_compress(&args.cinfo);
+	oil_libpng_free(&args.ol);
+	free(args.outwidthbuf);
+	set_mem_size(reader, 0);
+
+	if (state) {
+		rb_jump_tag(state);
+	}
+}
+
 /*
  * call-seq:
  *    reader.each(opts, &block) -> self
  *
- * Yields a series of binary strings that make up the output JPEG image.
+ * Yields a series of binary strings that make up the output PNG image.
  *
  * Options is a hash which may have the following symbols:
  *
- * :quality - JPEG quality setting. Betweein 0 and 100.
- * :markers - Custom markers to include in the output JPEG. Must be a hash where
- *   the keys are :APP[0-15] or :COM and the values are arrays of strings that
- *   will be inserted into the markers.
+ * :compression_level - zlib compression level, between 0 and 9, or 0 and
+ *   12 with deflate: :libdeflate. Defaults to 6.
+ * :filter - Row filter, one of :none, :sub, :up, :average, :paeth or :all, or
+ *   an array of them to let libpng pick the best for each row. Defaults to
+ *   :all.
+ * :strategy - zlib strategy, one of :default, :filtered, :huffman_only, :rle
+ *   or :fixed.
+ * :speed - Pass :fast for level 1, the :up filter and the :rle strategy. This
+ *   encodes several times faster than the defaults, for slightly larger
+ *   output. The options above override it.
+ * :threads - Number of threads deflating the output. With more than one, rows
+ *   are split into groups of at least 128 KiB that are compressed in
+ *   parallel and joined into a single zlib stream. The output is a little
+ *   larger than with one thread. Defaults to 1.
+ * :deflate - :zlib, the default, or :libdeflate to filter rows in oil and
+ *   compress them with libdeflate, which is several times faster than zlib
+ *   at a similar ratio. libdeflate compresses the whole image at once, so
+ *   rows aren't written out as they are scaled. The filtered rows, in a
+ *   buffer that doubles as it fills, and then the compressed stream are
+ *   held in memory: up to three times the size of the uncompressed output,
+ *   or 72 MB for a 4000x2000 RGB image, where zlib needs a few hundred KB.
+ *   Raises ArgumentError if oil was built without libdeflate, or with
+ *   :threads.
+ * :bit_depth - Bits per sample of the output, 8 or 16. Defaults to 8. Images
+ *   with 16 bits per sample are scaled from their full samples either way.
+ * :reduce - Write the output with the smallest color type that holds it:
+ *   without alpha if every pixel is opaque, gray if every pixel is gray, and
+ *   with a palette of fewer bits per pixel if it has 256 colors or fewer.
+ *   Output over 4 MiB can't be held to look at before the header is written,
+ *   so it is only reduced as far as a palette source guarantees. Requires a
+ *   :bit_depth of 8.
+ * :colors - Quantize output with more colors than this to a palette, between
+ *   2 and 256. Palette images with no more entries keep their own palette,
+ *   others get one made from the first 4 MiB of output. Implies :reduce.
+ * :dither - Diffuse the error of quantizing over neighbouring pixels with
+ *   Floyd-Steinberg dithering. Only used with :colors.
+ * :format - :png, the default, :jpeg or :webp to write a JPEG or WebP image
+ *   instead. JPEG output takes the :quality, :speed, :progressive,
+ *   :optimize, :subsampling, :arithmetic, :trellis and :restart_rows options
+ *   described in Oil::JPEGReader#each. WebP output is yielded as a single
+ *   string once the whole image is encoded, and takes :quality, :method,
+ *   :lossless, :speed and :threads. Raises ArgumentError for :webp if oil was
+ *   built without libwebp.
+ * :background - For JPEG output, the color that transparent pixels are
+ *   flattened against, as [red, green, blue]. Defaults to white. Gray images
+ *   use its luma.
  */
 
 static VALUE each(int argc, VALUE *argv, VALUE self)
@@ -258,33 +864,64 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 	png_structp wpng;
 	VALUE opts;
 	int cmp, state, ret;
+	size_t rowbytes;
 	struct each_args args;
+	struct oil_libpng_encode enc;
+	enum oil_format format;
 	png_byte ctype;
 
 	rb_scan_args(argc, argv, "01", &opts);
 
-	Data_Get_Struct(self, struct readerdata, reader);
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
 
 	raise_if_locked(reader);
+	raise_if_not_ready(reader, 0);
+	format = oil_format_opt(opts, OIL_FMT_PNG);
+	if (format == OIL_FMT_JPEG) {
+		each_jpeg(reader, opts);
+		return self;
+	}
+#ifdef HAVE_LIBWEBP
+	if (format == OIL_FMT_WEBP) {
+		each_webp(reader, opts);
+		return self;
+	}
+#endif
+	if (format != OIL_FMT_PNG) {
+		rb_raise(rb_eArgError,
+			"PNG images can't be written in that format.");
+	}
+	oil_png_encode_opts(opts, &enc);
 	reader->locked = 1;
 
-	cmp = png_get_channels(reader->png, reader->info);
-	ctype = png_get_color_type(reader->png, reader->info);
+	ctype = oil_libpng_color_type(reader->png, reader->info);
+	cmp = OIL_CMP(png_cs_to_oil(ctype));
+	rowbytes = (size_t)reader->scale_width * cmp * enc.depth / 8;
 
 	wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
 		(png_error_ptr)error, (png_error_ptr)warning);
 	winfo = png_create_info_struct(wpng);
 	png_set_write_fn(wpng, 0, write_data_fn, flush_data_fn);
 
-	png_set_IHDR(wpng, winfo, reader->scale_width, reader->scale_height, 8,
-		ctype, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
-		PNG_FILTER_TYPE_DEFAULT);
+	if (!enc.reduce) {
+		png_set_IHDR(wpng, winfo, reader->scale_width,
+			reader->scale_height, enc.depth, ctype,
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+	}
+	oil_libpng_compress_encode(wpng, &enc);
 
 	args.reader = reader;
 	args.wpng = wpng;
 	args.winfo = winfo;
-	args.outwidthbuf = malloc(reader->scale_width * cmp);
+	args.enc = enc;
+	args.cmp = cmp;
+	args.parallel = 0;
+	args.started = 0;
+	args.pw_mem = 0;
+	args.outwidthbuf = malloc(rowbytes);
 	if (!args.outwidthbuf) {
+		png_destroy_write_struct(&wpng, &winfo);
 		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
 	}
 
@@ -292,13 +929,36 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 		reader->scale_width, reader->scale_height);
 	if (ret!=0) {
 		free(args.outwidthbuf);
+		png_destroy_write_struct(&wpng, &winfo);
 		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
 	}
+	args.ol.out_depth = enc.depth;
+
+	if (enc.reduce) {
+		ret = oil_libpng_reduce_init(&args.r, reader->png, reader->info,
+			reader->scale_width, reader->scale_height, cmp, &enc);
+		if (ret!=0) {
+			oil_libpng_reduce_free(&args.r);
+			oil_libpng_free(&args.ol);
+			free(args.outwidthbuf);
+			png_destroy_write_struct(&wpng, &winfo);
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+	}
+	set_mem_size(reader, oil_libpng_mem_size(&args.ol) + rowbytes +
+		(enc.reduce ? oil_libpng_reduce_mem_size(&args.r) : 0));
 
 	rb_protect((VALUE(*)(VALUE))each2, (VALUE)&args, &state);
 
+	if (args.parallel) {
+		oil_libpng_writer_free(&args.pw);
+	}
+	if (enc.reduce) {
+		oil_libpng_reduce_free(&args.r);
+	}
 	oil_libpng_free(&args.ol);
 	free(args.outwidthbuf);
+	set_mem_size(reader, 0);
 	png_destroy_write_struct(&wpng, &winfo);
 
 	if (state) {
@@ -308,13 +968,416 @@ static VALUE each(int argc, VALUE *argv, VALUE self)
 	return self;
 }
 
+/* Time-sliced Jobs */
+
+struct jobdata {
+	VALUE reader;
+	VALUE out;
+	png_structp wpng;
+	png_infop winfo;
+	struct oil_libpng ol;
+	unsigned char *outwidthbuf;
+	struct oil_libpng_encode enc;
+	struct oil_libpng_reduce r;
+	struct oil_libpng_writer pw;
+	size_t pw_mem; // writer memory counted in mem_size.
+	int cmp;
+	int parallel;
+	int rows_left;
+	long step_rows; // rows written by the current step.
+	int started;
+	int done;
+	size_t mem_size;
+};
+
+static void job_write_data_fn(png_structp png_ptr, png_bytep data, png_size_t length)
+{
+	struct jobdata *job;
+
+	job = png_get_io_ptr(png_ptr);
+	rb_str_cat(job->out, (char *)data, length);
+}
+
+/* Count the writer's memory in mem_size, as each_writer_mem() does. */
+static void job_writer_mem(struct jobdata *job)
+{
+	size_t size;
+
+	size = oil_libpng_writer_mem_size(&job->pw);
+	if (size != job->pw_mem) {
+		rb_gc_adjust_memory_usage((ssize_t)size - (ssize_t)job->pw_mem);
+		job->mem_size = job->mem_size - job->pw_mem + size;
+		job->pw_mem = size;
+	}
+}
+
+/* Write the header and start the parallel writer, as each_start() does. */
+static void job_start(struct jobdata *job)
+{
+	int channels, ret;
+
+	channels = job->cmp;
+	if (job->enc.reduce) {
+		oil_libpng_reduce_header(&job->r, job->wpng, job->winfo,
+			&job->enc);
+		channels = job->r.channels;
+	}
+	png_write_info(job->wpng, job->winfo);
+	job->started = 1;
+
+	if (!oil_libpng_writer_needed(&job->enc)) {
+		return;
+	}
+	job->parallel = 1;
+	ret = oil_libpng_writer_init(&job->pw, job->wpng,
+		job->ol.os.out_width, channels, &job->enc);
+	if (ret!=0) {
+		raise_writer_error(ret);
+	}
+	job_writer_mem(job);
+}
+
+/* Write a row with the parallel writer or libpng. */
+static void job_write(struct jobdata *job, unsigned char *row)
+{
+	if (!job->parallel) {
+		png_write_row(job->wpng, row);
+	} else if (oil_libpng_writer_write_row(&job->pw, row)) {
+		raise_writer_error(-2);
+	} else {
+		job_writer_mem(job);
+	}
+}
+
+/* Write a scaled row, or hold it until the reduced color type is decided. */
+static void job_write_row(struct jobdata *job)
+{
+	unsigned char *row;
+
+	if (!job->enc.reduce) {
+		job_write(job, job->outwidthbuf);
+	} else {
+		if (oil_libpng_reduce_push(&job->r, job->outwidthbuf)) {
+			raise_writer_error(-2);
+		}
+		if (job->r.decided && !job->started) {
+			job_start(job);
+		}
+		while ((row = oil_libpng_reduce_pop(&job->r))) {
+			job_write(job, row);
+		}
+	}
+	job->rows_left--;
+	job->step_rows++;
+}
+
+/* Row callback of the progressive reader, for readers made with push. Rows may
+ * still come in after the last scanline has been written.
+ */
+static void job_push_row(png_structp png, png_bytep row, png_uint_32 row_num,
+	int pass)
+{
+	struct jobdata *job;
+
+	job = png_get_progressive_ptr(png);
+	if (!job->rows_left) {
+		return;
+	}
+	oil_libpng_push_row(&job->ol, row, row_num, pass);
+	while (oil_libpng_push_scanline(&job->ol, job->outwidthbuf)) {
+		job_write_row(job);
+	}
+}
+
+/* Free the scaler and compressor once the job has finished or failed. The
+ * reader may already be gone when this is called from the GC, so leave it be.
+ */
+static void job_release(struct jobdata *job)
+{
+	if (job->parallel) {
+		oil_libpng_writer_free(&job->pw);
+		job->parallel = 0;
+	}
+	if (job->outwidthbuf) {
+		oil_libpng_reduce_free(&job->r);
+		oil_libpng_free(&job->ol);
+		free(job->outwidthbuf);
+		job->outwidthbuf = NULL;
+	}
+	if (job->wpng) {
+		png_destroy_write_struct(&job->wpng, &job->winfo);
+	}
+	rb_gc_adjust_memory_usage(-(ssize_t)job->mem_size);
+	job->mem_size = 0;
+	job->pw_mem = 0;
+	job->done = 1;
+}
+
+static void job_free(void *ptr)
+{
+	job_release(ptr);
+	xfree(ptr);
+}
+
+static void job_mark(void *ptr)
+{
+	struct jobdata *job = ptr;
+
+	rb_gc_mark(job->reader);
+	rb_gc_mark(job->out);
+}
+
+static size_t job_memsize(const void *ptr)
+{
+	const struct jobdata *job = ptr;
+	return sizeof(struct jobdata) + job->mem_size;
+}
+
+static const rb_data_type_t job_type = {
+	"Oil::PNGReader::Job",
+	{ job_mark, job_free, job_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+/*
+ * call-seq:
+ *    reader.start(opts) -> job
+ *
+ * Returns a Job that produces the same output as reader.each(opts), a few rows
+ * at a time. See Oil::JPEGReader::Job#step.
+ */
+
+static VALUE start(int argc, VALUE *argv, VALUE self)
+{
+	struct readerdata *reader;
+	struct jobdata *job;
+	struct oil_libpng_encode enc;
+	int cmp, ret;
+	size_t rowbytes;
+	VALUE opts, job_obj;
+
+	rb_scan_args(argc, argv, "01", &opts);
+
+	TypedData_Get_Struct(self, struct readerdata, &png_reader_type, reader);
+	raise_if_locked(reader);
+	raise_if_not_ready(reader, 1);
+	if (oil_format_opt(opts, OIL_FMT_PNG) != OIL_FMT_PNG) {
+		rb_raise(rb_eArgError, "Jobs can only write PNG images.");
+	}
+	oil_png_encode_opts(opts, &enc);
+
+	job_obj = TypedData_Make_Struct(cJob, struct jobdata, &job_type, job);
+	job->reader = self;
+	job->out = Qnil;
+
+	job->wpng = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL,
+		(png_error_ptr)error, (png_error_ptr)warning);
+	job->winfo = png_create_info_struct(job->wpng);
+	png_set_write_fn(job->wpng, job, job_write_data_fn, flush_data_fn);
+
+	if (!enc.reduce) {
+		png_set_IHDR(job->wpng, job->winfo, reader->scale_width,
+			reader->scale_height, enc.depth,
+			oil_libpng_color_type(reader->png, reader->info),
+			PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT,
+			PNG_FILTER_TYPE_DEFAULT);
+	}
+	oil_libpng_compress_encode(job->wpng, &enc);
+	job->enc = enc;
+
+	reader->locked = 1;
+	if (reader->pushed) {
+		ret = oil_libpng_push_init(&job->ol, reader->png, reader->info,
+			reader->scale_width, reader->scale_height);
+		png_set_progressive_read_fn(reader->png, job, NULL, job_push_row,
+			NULL);
+	} else {
+		ret = oil_libpng_init(&job->ol, reader->png, reader->info,
+			reader->scale_width, reader->scale_height);
+	}
+	if (ret!=0) {
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+	job->ol.out_depth = enc.depth;
+	cmp = OIL_CMP(job->ol.os.cs);
+	rowbytes = (size_t)reader->scale_width * cmp * enc.depth / 8;
+	job->outwidthbuf = malloc(rowbytes);
+	if (!job->outwidthbuf) {
+		oil_libpng_free(&job->ol);
+		rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+	}
+
+	job->cmp = cmp;
+
+	if (enc.reduce) {
+		ret = oil_libpng_reduce_init(&job->r, reader->png, reader->info,
+			reader->scale_width, reader->scale_height, cmp, &enc);
+		if (ret!=0) {
+			rb_raise(rb_eRuntimeError, "Unable to allocate memory.");
+		}
+	}
+
+	job->mem_size = oil_libpng_mem_size(&job->ol) + rowbytes +
+		(enc.reduce ? oil_libpng_reduce_mem_size(&job->r) : 0);
+	rb_gc_adjust_memory_usage(job->mem_size);
+	job->rows_left = reader->scale_height;
+	return job_obj;
+}
+
+struct job_step_args {
+	struct jobdata *job;
+	struct readerdata *reader;
+	long max_rows;
+	double deadline;
+};
+
+/* Give libpng the data pushed so far, a piece at a time, until the step's
+ * limits are reached. The row callback writes the rows as they come.
+ */
+static void job_step_push(struct job_step_args *args)
+{
+	struct jobdata *job;
+	struct readerdata *reader;
+	struct oil_push *push;
+	size_t len;
+
+	job = args->job;
+	reader = args->reader;
+	push = &reader->push;
+
+	while (job->step_rows < args->max_rows && job->rows_left &&
+		push->pos < push->len) {
+		len = push->len - push->pos;
+		len = len < PUSH_SIZE ? len : PUSH_SIZE;
+		push->pos += len;
+		png_process_data(reader->png, reader->info,
+			push->data + push->pos - len, len);
+		if (oil_step_expired(args->deadline)) {
+			return;
+		}
+	}
+
+	if (job->rows_left && push->closed && push->pos == push->len) {
+		png_error(reader->png, "Unexpected end of image data.");
+	}
+}
+
+static VALUE job_step2(struct job_step_args *args)
+{
+	struct jobdata *job;
+
+	job = args->job;
+	job->step_rows = 0;
+
+	if (!job->started && !job->enc.reduce) {
+		job_start(job);
+	}
+
+	if (args->reader->pushed) {
+		job_step_push(args);
+	}
+
+	while (!args->reader->pushed && job->step_rows < args->max_rows &&
+		job->rows_left) {
+		oil_libpng_read_scanline(&job->ol, job->outwidthbuf);
+		job_write_row(job);
+		if (oil_step_expired(args->deadline)) {
+			break;
+		}
+	}
+
+	if (!job->rows_left) {
+		if (!job->parallel) {
+			png_write_end(job->wpng, job->winfo);
+		} else if (oil_libpng_writer_finish(&job->pw)) {
+			raise_writer_error(-2);
+		} else {
+			job_writer_mem(job);
+		}
+	}
+
+	return Qnil;
+}
+
+/*
+ * call-seq:
+ *    job.step(max_rows) -> string or nil
+ *    job.step(seconds) -> string or nil
+ *    job.step -> string or nil
+ *
+ * Scales and compresses up to +max_rows+ rows of output, or as many rows as
+ * fit in a time budget of +seconds+. Returns the bytes produced by this step,
+ * or nil once the job is done. See Oil::JPEGReader::Job#step.
+ *
+ * For a reader made with Reader.push, the step also ends when the data pushed
+ * so far runs out, and the next step picks up from there.
+ */
+
+static VALUE job_step(int argc, VALUE *argv, VALUE self)
+{
+	struct jobdata *job;
+	struct job_step_args args;
+	int state;
+	VALUE limit, out;
+
+	rb_scan_args(argc, argv, "01", &limit);
+
+	TypedData_Get_Struct(self, struct jobdata, &job_type, job);
+	if (job->done) {
+		return Qnil;
+	}
+	if (!NIL_P(job->out)) {
+		rb_raise(rb_eRuntimeError, "Job is already running.");
+	}
+
+	oil_step_limit(limit, &args.max_rows, &args.deadline);
+	TypedData_Get_Struct(job->reader, struct readerdata, &png_reader_type,
+		args.reader);
+	args.job = job;
+
+	job->out = rb_str_buf_new(0);
+	rb_protect((VALUE(*)(VALUE))job_step2, (VALUE)&args, &state);
+	out = job->out;
+	job->out = Qnil;
+
+	if (state) {
+		job_release(job);
+		rb_jump_tag(state);
+	}
+
+	if (!job->rows_left) {
+		job_release(job);
+	}
+
+	return out;
+}
+
+/*
+ * call-seq:
+ *    job.done? -> true or false
+ *
+ * Returns true once all output has been returned by step, or step has raised.
+ */
+
+static VALUE job_done_p(VALUE self)
+{
+	struct jobdata *job;
+	TypedData_Get_Struct(self, struct jobdata, &job_type, job);
+	return job->done ? Qtrue : Qfalse;
+}
+
 void Init_png()
 {
 	VALUE mOil, cPNGReader;
 	mOil = rb_const_get(rb_cObject, rb_intern("Oil"));
 	cPNGReader = rb_define_class_under(mOil, "PNGReader", rb_cObject);
 	rb_define_alloc_func(cPNGReader, allocate);
+	rb_define_singleton_method(cPNGReader, "open", open_file, 1);
+	rb_define_singleton_method(cPNGReader, "push", push_reader, 0);
 	rb_define_method(cPNGReader, "initialize", initialize, 1);
+	rb_define_method(cPNGReader, "<<", push_data, 1);
+	rb_define_method(cPNGReader, "close", push_close, 0);
+	rb_define_method(cPNGReader, "ready?", ready_p, 0);
 	rb_define_method(cPNGReader, "width", width, 0);
 	rb_define_method(cPNGReader, "height", height, 0);
 	rb_define_method(cPNGReader, "scale_width", scale_width, 0);
@@ -322,5 +1385,13 @@ void Init_png()
 	rb_define_method(cPNGReader, "scale_height", scale_height, 0);
 	rb_define_method(cPNGReader, "scale_height=", set_scale_height, 1);
 	rb_define_method(cPNGReader, "each", each, -1);
+	rb_define_method(cPNGReader, "start", start, -1);
+
+	cJob = rb_define_class_under(cPNGReader, "Job", rb_cObject);
+	rb_undef_alloc_func(cJob);
+	rb_define_method(cJob, "step", job_step, -1);
+	rb_define_method(cJob, "done?", job_done_p, 0);
+
 	id_read = rb_intern("read");
+	sym_quality = ID2SYM(rb_intern("quality"));
 }
@@ -0,0 +1,423 @@
+#include <ruby.h>
+#include <ruby/thread.h>
+#include <string.h>
+#include <unistd.h>
+#include "oil_pool.h"
+
+static VALUE cJob;
+static VALUE sym_out, sym_queue_size, sym_pin;
+
+VALUE oil_mem_from_value(VALUE src, struct oil_mem *mem);
+void oil_resize_opts_from_hash(VALUE opts, struct oil_resize_opts *ropts);
+
+/* Ruby GC */
+
+/* Running jobs may take a while, so the sweep doesn't wait for them. The
+ * workers free the pool once they are done.
+ */
+static void pool_free(void *ptr)
+{
+	oil_pool_abandon((struct oil_pool *)ptr);
+}
+
+static size_t pool_memsize(const void *ptr)
+{
+	const struct oil_pool *pool = ptr;
+	return sizeof(struct oil_pool) +
+		pool->queue_size * sizeof(struct oil_job *) +
+		pool->num_threads * sizeof(pthread_t);
+}
+
+static const rb_data_type_t pool_type = {
+	"Oil::Pool",
+	{ NULL, pool_free, pool_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+struct jobdata {
+	struct oil_job *job;
+	VALUE pool;
+	VALUE result;
+};
+
+static void job_mark(void *ptr)
+{
+	struct jobdata *jd = ptr;
+	rb_gc_mark(jd->pool);
+	rb_gc_mark(jd->result);
+}
+
+static void job_free(void *ptr)
+{
+	struct jobdata *jd = ptr;
+	if (jd->job) {
+		oil_job_release(jd->job);
+	}
+	xfree(jd);
+}
+
+static size_t job_memsize(const void *ptr)
+{
+	const struct jobdata *jd = ptr;
+	size_t size;
+
+	size = sizeof(struct jobdata);
+	if (jd->job) {
+		size += sizeof(struct oil_job) + jd->job->in.len +
+			jd->job->out_len;
+	}
+	return size;
+}
+
+static const rb_data_type_t job_type = {
+	"Oil::Pool::Job",
+	{ job_mark, job_free, job_memsize, },
+	0, 0, RUBY_TYPED_FREE_IMMEDIATELY,
+};
+
+static VALUE pool_allocate(VALUE klass)
+{
+	VALUE self;
+
+	/* Not xmalloc, since the worker threads may free it. */
+	self = TypedData_Wrap_Struct(klass, &pool_type, NULL);
+	DATA_PTR(self) = calloc(1, sizeof(struct oil_pool));
+	if (!DATA_PTR(self)) {
+		rb_raise(rb_eNoMemError, "Unable to allocate memory.");
+	}
+	return self;
+}
+
+/* Waiting without the GVL */
+
+struct wait_args {
+	struct oil_pool *pool;
+	struct oil_job *job;
+	int interrupted;
+};
+
+static void *wait_not_full(void *data)
+{
+	struct wait_args *args = data;
+	struct oil_pool *pool = args->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (pool->count == pool->queue_size && !pool->closed &&
+		!args->interrupted) {
+		pthread_cond_wait(&pool->not_full, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void *wait_job_done(void *data)
+{
+	struct wait_args *args = data;
+	struct oil_pool *pool = args->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	while (!args->job->done && !args->interrupted) {
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+static void wait_ubf(void *data)
+{
+	struct wait_args *args = data;
+	struct oil_pool *pool = args->pool;
+
+	pthread_mutex_lock(&pool->lock);
+	args->interrupted = 1;
+	pthread_cond_broadcast(&pool->not_full);
+	pthread_cond_broadcast(&pool->job_done);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+static void *close_nogvl(void *data)
+{
+	oil_pool_close((struct oil_pool *)data);
+	return NULL;
+}
+
+static int job_is_done(struct oil_pool *pool, struct oil_job *job)
+{
+	int done;
+
+	pthread_mutex_lock(&pool->lock);
+	done = job->done;
+	pthread_mutex_unlock(&pool->lock);
+	return done;
+}
+
+/*
+ *  call-seq:
+ *     Pool.new([threads [, opts]]) -> pool
+ *
+ *  Starts +threads+ native worker threads, one per online CPU by default.
+ *
+ *  Options is a hash which may have the following symbols:
+ *
+ *  :queue_size - Number of jobs that may wait for a worker before #submit
+ *    blocks. Defaults to four times the number of threads.
+ *  :pin - When true, pin each worker thread to its own CPU.
+ */
+
+static VALUE pool_initialize(int argc, VALUE *argv, VALUE self)
+{
+	struct oil_pool *pool;
+	VALUE threads, opts, queue_size, pin;
+	int num_threads, qsize, ret;
+
+	rb_scan_args(argc, argv, "02", &threads, &opts);
+	TypedData_Get_Struct(self, struct oil_pool, &pool_type, pool);
+
+	if (pool->queue) {
+		rb_raise(rb_eRuntimeError, "Pool already initialized.");
+	}
+
+	num_threads = NIL_P(threads) ? sysconf(_SC_NPROCESSORS_ONLN) :
+		NUM2INT(threads);
+	qsize = num_threads * 4;
+	pin = Qfalse;
+
+	if (!NIL_P(opts)) {
+		Check_Type(opts, T_HASH);
+		queue_size = rb_hash_aref(opts, sym_queue_size);
+		if (!NIL_P(queue_size)) {
+			qsize = NUM2INT(queue_size);
+		}
+		pin = rb_hash_aref(opts, sym_pin);
+	}
+
+	ret = oil_pool_init(pool, num_threads, qsize, RTEST(pin));
+	if (ret == -1) {
+		rb_raise(rb_eArgError, "Thread count and queue size must be positive.");
+	} else if (ret) {
+		rb_raise(rb_eRuntimeError, "Unable to start worker threads.");
+	}
+
+	return self;
+}
+
+static char *strdup_value(VALUE str)
+{
+	char *ret;
+
+	ret = strdup(StringValueCStr(str));
+	if (!ret) {
+		rb_raise(rb_eNoMemError, "Unable to allocate memory.");
+	}
+	return ret;
+}
+
+/*
+ *  call-seq:
+ *     pool.submit(input, box_width, box_height [, opts]) -> job
+ *
+ *  Queue a resize of +input+ to fit in the given box and return an
+ *  Oil::Pool::Job for its result. Blocks, without holding the GVL, while the
+ *  queue is full.
+ *
+ *  +input+ is either a String or IO::Buffer holding a JPEG or PNG image, which
+ *  is copied so that the caller may reuse it, or a File or Pathname that will
+ *  be memory-mapped by the worker.
+ *
+ *  Options is a hash which may have the following symbols:
+ *
+ *  :quality - JPEG quality setting, between 1 and 100. Defaults to 95.
+ *  :prescale - As for Oil.resize_file.
+ *  :ycbcr - As for Oil.resize_file.
+ *  :speed - As for Oil.resize_file.
+ *  :progressive, :optimize, :subsampling, :arithmetic, :trellis,
+ *    :restart_rows - As for Oil.resize_file.
+ *  :threads - As for Oil.resize_file. These threads are started by the job,
+ *    on top of the pool's own.
+ *  :compression_level, :filter, :strategy, :deflate - As for
+ *    Oil.resize_file.
+ *  :out - Path to write the output image to. When not given, the encoded
+ *    image is returned by Job#value.
+ */
+
+static VALUE pool_submit(int argc, VALUE *argv, VALUE self)
+{
+	struct oil_pool *pool;
+	struct oil_job *job;
+	struct jobdata *jd;
+	struct oil_mem mem;
+	struct wait_args wargs;
+	VALUE input, box_width, box_height, opts, out, src, ret;
+	int status;
+
+	rb_scan_args(argc, argv, "31", &input, &box_width, &box_height, &opts);
+	TypedData_Get_Struct(self, struct oil_pool, &pool_type, pool);
+	if (!pool->queue) {
+		rb_raise(rb_eRuntimeError, "Pool not initialized.");
+	}
+
+	ret = TypedData_Make_Struct(cJob, struct jobdata, &job_type, jd);
+	jd->pool = self;
+	jd->result = Qnil;
+	jd->job = job = oil_job_new();
+	if (!job) {
+		rb_raise(rb_eNoMemError, "Unable to allocate memory.");
+	}
+
+	job->box_width = NUM2INT(box_width);
+	job->box_height = NUM2INT(box_height);
+	oil_resize_opts_from_hash(opts, &job->opts);
+
+	if (!NIL_P(opts)) {
+		out = rb_hash_aref(opts, sym_out);
+		if (!NIL_P(out)) {
+			job->out_path = strdup_value(rb_get_path(out));
+		}
+	}
+
+	src = oil_mem_from_value(input, &mem);
+	if (NIL_P(src)) {
+		job->in_path = strdup_value(rb_get_path(input));
+	} else {
+		/* The worker may outlive input, so it gets its own copy. */
+		job->in_buf = malloc(mem.len ? mem.len : 1);
+		if (!job->in_buf) {
+			rb_raise(rb_eNoMemError, "Unable to allocate memory.");
+		}
+		memcpy(job->in_buf, mem.data, mem.len);
+		oil_mem_init(&job->in, job->in_buf, mem.len);
+		RB_GC_GUARD(src);
+	}
+
+	wargs.pool = pool;
+	wargs.job = job;
+	for (;;) {
+		status = oil_pool_try_submit(pool, job);
+		if (status == -1) {
+			rb_raise(rb_eRuntimeError, "Pool is closed.");
+		} else if (status == 0) {
+			break;
+		}
+		wargs.interrupted = 0;
+		rb_thread_call_without_gvl(wait_not_full, &wargs, wait_ubf,
+			&wargs);
+		rb_thread_check_ints();
+	}
+
+	return ret;
+}
+
+/*
+ *  call-seq:
+ *     pool.close -> nil
+ *
+ *  Stop accepting jobs and wait for the queued ones to finish. Worker threads
+ *  exit once the queue is empty.
+ */
+
+static VALUE pool_close(VALUE self)
+{
+	struct oil_pool *pool;
+
+	TypedData_Get_Struct(self, struct oil_pool, &pool_type, pool);
+	if (!pool->queue) {
+		rb_raise(rb_eRuntimeError, "Pool not initialized.");
+	}
+	rb_thread_call_without_gvl(close_nogvl, pool, NULL, NULL);
+	return Qnil;
+}
+
+/*
+ *  call-seq:
+ *     job.done? -> true or false
+ *
+ *  Returns true once the job has run, successfully or not.
+ */
+
+static VALUE job_done_p(VALUE self)
+{
+	struct jobdata *jd;
+	struct oil_pool *pool;
+
+	TypedData_Get_Struct(self, struct jobdata, &job_type, jd);
+	TypedData_Get_Struct(jd->pool, struct oil_pool, &pool_type, pool);
+	return job_is_done(pool, jd->job) ? Qtrue : Qfalse;
+}
+
+/*
+ *  call-seq:
+ *     job.value -> string
+ *
+ *  Wait for the job to run, without holding the GVL, and return the encoded
+ *  image, or the output path if one was given with :out. Raises a
+ *  RuntimeError if the resize failed.
+ */
+
+static VALUE job_value(VALUE self)
+{
+	struct jobdata *jd;
+	struct oil_pool *pool;
+	struct oil_job *job;
+	struct wait_args wargs;
+
+	TypedData_Get_Struct(self, struct jobdata, &job_type, jd);
+	TypedData_Get_Struct(jd->pool, struct oil_pool, &pool_type, pool);
+	job = jd->job;
+
+	wargs.pool = pool;
+	wargs.job = job;
+	while (!job_is_done(pool, job)) {
+		wargs.interrupted = 0;
+		rb_thread_call_without_gvl(wait_job_done, &wargs, wait_ubf,
+			&wargs);
+		rb_thread_check_ints();
+	}
+
+	if (job->ret) {
+		rb_raise(rb_eRuntimeError, "%s", job->err);
+	}
+
+	if (NIL_P(jd->result)) {
+		if (job->out_path) {
+			jd->result = rb_str_new_cstr(job->out_path);
+		} else {
+			jd->result = rb_str_new(job->out_buf, job->out_len);
+			free(job->out_buf);
+			job->out_buf = NULL;
+			job->out_len = 0;
+		}
+	}
+	return jd->result;
+}
+
+/*
+ * Document-class: Oil::Pool
+ *
+ * A fixed set of native threads that resize images in the background, so
+ * that one process can use every core.
+ *
+ *    pool = Oil::Pool.new(4)
+ *    jobs = uploads.map { |data| pool.submit(data, 200, 200) }
+ *    thumbnails = jobs.map(&:value)
+ */
+
+void Init_pool()
+{
+	VALUE mOil, cPool;
+
+	mOil = rb_const_get(rb_cObject, rb_intern("Oil"));
+	cPool = rb_define_class_under(mOil, "Pool", rb_cObject);
+	rb_define_alloc_func(cPool, pool_allocate);
+	rb_define_method(cPool, "initialize", pool_initialize, -1);
+	rb_define_method(cPool, "submit", pool_submit, -1);
+	rb_define_method(cPool, "close", pool_close, 0);
+
+	cJob = rb_define_class_under(cPool, "Job", rb_cObject);
+	rb_undef_alloc_func(cJob);
+	rb_define_method(cJob, "value", job_value, 0);
+	rb_define_method(cJob, "done?", job_done_p, 0);
+
+	sym_out = ID2SYM(rb_intern("out"));
+	sym_queue_size = ID2SYM(rb_intern("queue_size"));
+	sym_pin = ID2SYM(rb_intern("pin"));
+}
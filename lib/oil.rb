@@ -2,10 +2,16 @@ module Oil
   VERSION = "0.2.1"
 
   def self.sniff_signature(io)
-    a = io.getc
-    b = io.getc
-    io.ungetc(b)
-    io.ungetc(a)
+    if io.is_a?(String)
+      a, b = io.byteslice(0, 2).b.chars
+    elsif defined?(IO::Buffer) && io.is_a?(IO::Buffer)
+      a, b = io.get_string(0, [io.size, 2].min).chars
+    else
+      a = io.getc
+      b = io.getc
+      io.ungetc(b)
+      io.ungetc(a)
+    end
 
     if (a == "\xFF".b && b == "\xD8".b)
       return :JPEG
@@ -14,12 +20,54 @@ module Oil
     end
   end
 
-  def self.new(io, box_width, box_height)
+  # +io+ may be an IO, a String or an IO::Buffer holding the image.
+  #
+  # Options is a hash which may have the following symbols:
+  #
+  # :prescale - Let libjpeg decode JPEGs at a reduced size that is at least
+  #   this many times the output size, see JPEGReader#prescale. Defaults to 2.
+  #   Pass false to decode at full size.
+  # :ycbcr - Pass :planar or :linear to read and write YCbCr JPEGs as raw
+  #   planes, see JPEGReader#each.
+  # :speed - JPEG speed profile, :fast, :balanced or :quality, see
+  #   JPEGReader#each.
+  # :progressive, :optimize, :subsampling, :arithmetic, :trellis,
+  #   :restart_rows - JPEG encoder settings, see JPEGReader#each.
+  # :max_bytes - Encode JPEGs at the highest quality that fits in this many
+  #   bytes, see JPEGReader#each.
+  # :threads - Number of threads to decode JPEGs with restart markers, to
+  #   encode baseline JPEGs and to deflate PNGs with, see JPEGReader#each and
+  #   PNGReader#each.
+  # :compression_level, :filter, :strategy, :deflate, :bit_depth, :reduce,
+  #   :colors, :dither - PNG encoder settings, see PNGReader#each.
+  #   speed: :fast also applies to PNGs.
+  # :format - :webp to write a WebP image from either format, see
+  #   JPEGReader#each. :quality, :method, :lossless, :speed and :threads
+  #   apply to it, and :quality defaults to 95 as for JPEGs. :jpeg writes PNGs
+  #   as JPEGs with :quality and the JPEG encoder settings above, see
+  #   PNGReader#each.
+  # :background - The [red, green, blue] color that transparent PNGs are
+  #   flattened against when written as JPEGs. Defaults to white.
+  def self.new(io, box_width, box_height, opts = {})
     case sniff_signature(io)
     when :JPEG
-      return new_jpeg_reader(io, box_width, box_height)
+      return new_jpeg_reader(JPEGReader.new(io, JPEG_MARKERS), box_width, box_height, opts)
     when :PNG
-      return new_png_reader(io, box_width, box_height)
+      return new_png_reader(PNGReader.new(io), box_width, box_height, opts)
+    else
+      raise "Unknown image file format."
+    end
+  end
+
+  # Like Oil.new, but memory-maps the file at +path+ instead of reading it
+  # through Ruby IO.
+  def self.open(path, box_width, box_height, opts = {})
+    signature = File.open(path, 'rb') { |f| sniff_signature(f) }
+    case signature
+    when :JPEG
+      return new_jpeg_reader(JPEGReader.open(path, JPEG_MARKERS), box_width, box_height, opts)
+    when :PNG
+      return new_png_reader(PNGReader.open(path), box_width, box_height, opts)
     else
       raise "Unknown image file format."
     end
@@ -27,32 +75,58 @@ module Oil
 
   private
 
-  def self.new_jpeg_reader(io, box_width, box_height)
-    o = JPEGReader.new(io, [:COM, :APP1, :APP2])
+  JPEG_MARKERS = [:COM, :APP1, :APP2]
+  JPEG_OPTS = [:ycbcr, :speed, :progressive, :optimize, :subsampling,
+               :arithmetic, :trellis, :restart_rows, :max_bytes, :threads]
+  PNG_OPTS = [:speed, :compression_level, :filter, :strategy, :threads,
+              :deflate, :bit_depth, :reduce, :colors, :dither]
+  WEBP_OPTS = [:format, :quality, :method, :lossless, :speed, :threads]
+  PNG_JPEG_OPTS = [:format, :quality, :background, :speed, :progressive,
+                   :optimize, :subsampling, :arithmetic, :trellis,
+                   :restart_rows]
+
+  def self.new_jpeg_reader(o, box_width, box_height, opts)
 
     # bump RGB images to RGBX
     if (o.out_color_space == :RGB)
       o.out_color_space = :RGBX
     end
 
-    # JPEG Pre-scaling is equivalent to a box filter at an integer scale factor.
     destw, desth = Oil.fix_ratio(o.output_width, o.output_height, box_width, box_height)
+
+    # JPEG Pre-scaling is equivalent to a box filter at an integer scale factor.
+    # Leave enough pixels for the resampler to do the rest of the job well.
+    prescale = opts.fetch(:prescale, 2)
+    o.prescale(destw, desth, prescale) if prescale
+
     o.scale_width = destw
     o.scale_height = desth
+    return new_webp_writer(o, opts) if opts[:format] == :webp
 
-    return JPEGReaderWrapper.new(o, { markers: o.markers, quality: 95 })
+    wopts = { markers: o.markers, quality: 95 }
+    JPEG_OPTS.each { |k| wopts[k] = opts[k] if opts.key?(k) }
+    return ReaderWrapper.new(o, wopts)
   end
 
-  def self.new_png_reader(io, box_width, box_height)
-    o = PNGReader.new(io)
+  def self.new_png_reader(o, box_width, box_height, opts)
     destw, desth = self.fix_ratio(o.width, o.height, box_width, box_height)
     o.scale_width = destw
     o.scale_height = desth
-    return o
+    return new_webp_writer(o, opts) if opts[:format] == :webp
+    if opts[:format] == :jpeg
+      return ReaderWrapper.new(o, { quality: 95 }.merge(opts.slice(*PNG_JPEG_OPTS)))
+    end
+
+    wopts = opts.slice(*PNG_OPTS)
+    return wopts.empty? ? o : ReaderWrapper.new(o, wopts)
+  end
+
+  def self.new_webp_writer(o, opts)
+    ReaderWrapper.new(o, { quality: 95 }.merge(opts.slice(*WEBP_OPTS)))
   end
 end
 
-class JPEGReaderWrapper
+class ReaderWrapper
   def initialize(reader, opts)
     @reader = reader
     @opts = opts
@@ -61,6 +135,12 @@ class JPEGReaderWrapper
   def each(&block)
     @reader.each(@opts, &block)
   end
+
+  def start
+    @reader.start(@opts)
+  end
 end
 
+JPEGReaderWrapper = ReaderWrapper
+
 require 'oil/oil.so'
@@ -1,4 +1,5 @@
 require 'stringio'
+require 'fiddle'
 
 class CustomError < RuntimeError; end
 
@@ -72,3 +73,189 @@ class NotStringIO < CustomIO
     return 78887
   end
 end
+
+# Decodes the DC coefficients of a baseline JPEG, giving the average color of
+# each 8x8 block of luma as [r, g, b], row by row. Enough to check colors
+# without a JPEG decoder.
+module JPEGBlocks
+  def self.decode(data)
+    data = data.b
+    qt = {}
+    dht = {}
+    pos = 2
+    loop do
+      marker = data.getbyte(pos + 1)
+      len = data.byteslice(pos + 2, 2).unpack1("n")
+      seg = data.byteslice(pos + 4, len - 2)
+      pos += 2 + len
+      case marker
+      when 0xDB
+        i = 0
+        while i < seg.bytesize
+          pq, tq = seg.getbyte(i).divmod(16)
+          qt[tq] = pq == 0 ? seg.getbyte(i + 1) : seg.byteslice(i + 1, 2).unpack1("n")
+          i += 1 + 64 * (pq + 1)
+        end
+      when 0xC4
+        i = 0
+        while i < seg.bytesize
+          tc, th = seg.getbyte(i).divmod(16)
+          counts = seg.byteslice(i + 1, 16).bytes
+          syms = seg.byteslice(i + 17, counts.sum).bytes
+          codes = {}
+          code = 0
+          counts.each_with_index do |n, l|
+            n.times { codes[[l + 1, code]] = syms.shift; code += 1 }
+            code <<= 1
+          end
+          dht[[tc, th]] = codes
+          i += 17 + counts.sum
+        end
+      when 0xC0, 0xC1
+        @h, @w = seg.byteslice(1, 4).unpack("nn")
+        @comps = (0...seg.getbyte(5)).map do |c|
+          id, hv, tq = seg.byteslice(6 + 3 * c, 3).bytes
+          { id: id, h: hv >> 4, v: hv & 15, q: tq }
+        end
+      when 0xDD
+        raise "restart markers are not supported" if seg.unpack1("n") > 0
+      when 0xDA
+        seg.getbyte(0).times do |c|
+          id, t = seg.byteslice(1 + 2 * c, 2).bytes
+          comp = @comps.find { |x| x[:id] == id }
+          comp[:dc] = dht[[0, t >> 4]]
+          comp[:ac] = dht[[1, t & 15]]
+        end
+        return blocks(data.byteslice(pos..).gsub("\xFF\x00".b, "\xFF".b), qt)
+      when 0xC2
+        raise "progressive JPEGs are not supported"
+      end
+    end
+  end
+
+  def self.blocks(scan, qt)
+    @bits = scan.unpack1("B*")
+    @bit = 0
+    hmax = @comps.map { |c| c[:h] }.max
+    vmax = @comps.map { |c| c[:v] }.max
+    mcux = (@w + 8 * hmax - 1) / (8 * hmax)
+    mcuy = (@h + 8 * vmax - 1) / (8 * vmax)
+    @comps.each { |c| c[:pred] = 0; c[:out] = {} }
+    mcuy.times do |my|
+      mcux.times do |mx|
+        @comps.each do |c|
+          c[:v].times do |by|
+            c[:h].times do |bx|
+              c[:out][[my * c[:v] + by, mx * c[:h] + bx]] = block(c) * qt[c[:q]] / 8.0 + 128
+            end
+          end
+        end
+      end
+    end
+    (0...(@h + 7) / 8).map do |y|
+      (0...(@w + 7) / 8).map do |x|
+        s = @comps.map { |c| c[:out][[y * c[:v] / vmax, x * c[:h] / hmax]] }
+        next [s[0].round] * 3 if s.size == 1
+        yy, cb, cr = s[0], s[1] - 128, s[2] - 128
+        [yy + 1.402 * cr, yy - 0.344136 * cb - 0.714136 * cr, yy + 1.772 * cb].map { |v| v.round.clamp(0, 255) }
+      end
+    end
+  end
+
+  def self.block(c)
+    t = huff(c[:dc])
+    c[:pred] += extend_bits(t)
+    k = 1
+    while k < 64
+      r, s = huff(c[:ac]).divmod(16)
+      if s == 0
+        break unless r == 15
+        k += 16
+      else
+        extend_bits(s)
+        k += r + 1
+      end
+    end
+    c[:pred]
+  end
+
+  def self.huff(codes)
+    code = len = 0
+    loop do
+      code = code << 1 | @bits.getbyte(@bit) - 48
+      @bit += 1
+      len += 1
+      sym = codes[[len, code]]
+      return sym if sym
+      raise "bad huffman code" if len > 16
+    end
+  end
+
+  def self.extend_bits(s)
+    return 0 if s == 0
+    v = @bits[@bit, s].to_i(2)
+    @bit += s
+    v < 1 << (s - 1) ? v - (1 << s) + 1 : v
+  end
+end
+
+# Reads WebP images written by oil. The header is parsed here, the pixels are
+# decoded by libwebp through Fiddle when it can be loaded.
+module WebP
+  # Returns [width, height, alpha] from the first chunk of the image.
+  def self.info(data)
+    raise "not a WebP image" unless data[0, 4] == "RIFF" && data[8, 4] == "WEBP"
+    body = data.byteslice(20, 10)
+    case data[12, 4]
+    when "VP8X"
+      w, h = [body.byteslice(4, 3), body.byteslice(7, 3)].map { |s| (s + "\0").unpack1("V") + 1 }
+      [w, h, body.getbyte(0) & 0x10 != 0]
+    when "VP8L"
+      bits = body.byteslice(1, 4).unpack1("V")
+      [(bits & 0x3FFF) + 1, (bits >> 14 & 0x3FFF) + 1, bits[28] == 1]
+    when "VP8 "
+      w, h = body.byteslice(6, 4).unpack("vv")
+      [w & 0x3FFF, h & 0x3FFF, false]
+    end
+  end
+
+  def self.chunks(data)
+    pos = 12
+    types = []
+    while pos < data.bytesize
+      type, len = data.byteslice(pos, 8).unpack("a4V")
+      types << type
+      pos += 8 + len + len % 2
+    end
+    types
+  end
+
+  def self.lib
+    return @lib if defined?(@lib)
+    @lib = nil
+    %w[libwebp.so libwebp.so.7 libwebp.dylib].each do |name|
+      @lib = Fiddle.dlopen(name)
+      break
+    rescue Fiddle::DLError
+    end
+    @lib
+  end
+
+  # Returns [width, height, RGBA samples], or nil if libwebp isn't found.
+  def self.decode(data)
+    return unless lib
+    decode = Fiddle::Function.new(lib["WebPDecodeRGBA"],
+      [Fiddle::TYPE_VOIDP, Fiddle::TYPE_SIZE_T, Fiddle::TYPE_VOIDP,
+       Fiddle::TYPE_VOIDP], Fiddle::TYPE_VOIDP)
+    free = Fiddle::Function.new(lib["WebPFree"], [Fiddle::TYPE_VOIDP],
+      Fiddle::TYPE_VOID)
+    w = Fiddle::Pointer.malloc(4, Fiddle::RUBY_FREE)
+    h = Fiddle::Pointer.malloc(4, Fiddle::RUBY_FREE)
+    pixels = decode.call(data, data.bytesize, w, h)
+    raise "libwebp could not decode the image" if pixels.null?
+    w, h = w[0, 4].unpack1("l"), h[0, 4].unpack1("l")
+    [w, h, pixels[0, w * h * 4]]
+  ensure
+    free.call(pixels) if pixels && !pixels.null?
+  end
+end
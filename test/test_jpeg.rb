@@ -2,6 +2,8 @@ require 'minitest'
 require 'minitest/autorun'
 require 'oil'
 require 'stringio'
+require 'tempfile'
+require 'objspace'
 require 'helper'
 
 class TestJPEG < MiniTest::Test
@@ -15,6 +17,68 @@ class TestJPEG < MiniTest::Test
 \x01\x00\x01\x01\x01\x11\x00\xff\xcc\x00\x06\x00\x10\x10\x05\xff\xda\x00\x08\
 \x01\x01\x00\x00\x3f\x00\xd2\xcf\x20\xff\xd9".b
 
+  # 16x16 4:2:0 image written with libjpeg's jpeg_simple_progression().
+  PROGRESSIVE_JPEG = "\
+\xff\xd8\xff\xdb\x00\x43\x00\x03\x02\x02\x03\x02\x02\x03\x03\x03\x03\x04\x03\
+\x03\x04\x05\x08\x05\x05\x04\x04\x05\x0a\x07\x07\x06\x08\x0c\x0a\x0c\x0c\x0b\
+\x0a\x0b\x0b\x0d\x0e\x12\x10\x0d\x0e\x11\x0e\x0b\x0b\x10\x16\x10\x11\x13\x14\
+\x15\x15\x15\x0c\x0f\x17\x18\x16\x14\x18\x12\x14\x15\x14\xff\xdb\x00\x43\x01\
+\x03\x04\x04\x05\x04\x05\x09\x05\x05\x09\x14\x0d\x0b\x0d\x14\x14\x14\x14\x14\
+\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\
+\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\x14\
+\x14\x14\x14\x14\x14\x14\x14\xff\xc2\x00\x11\x08\x00\x10\x00\x10\x03\x01\x22\
+\x00\x02\x11\x01\x03\x11\x01\xff\xc4\x00\x15\x00\x01\x01\x00\x00\x00\x00\x00\
+\x00\x00\x00\x00\x00\x00\x00\x00\x00\x06\x07\xff\xc4\x00\x15\x01\x01\x01\x00\
+\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x04\x06\xff\xda\x00\x0c\
+\x03\x01\x00\x02\x10\x03\x10\x00\x00\x01\x8e\xbd\x5f\x41\x90\x47\xff\xc4\x00\
+\x1b\x10\x00\x02\x01\x05\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x04\
+\x05\x11\x00\x01\x02\x12\x21\xff\xda\x00\x08\x01\x01\x00\x01\x05\x02\x1d\x6e\
+\xd6\x19\x5f\x43\x5d\x39\x0a\xb6\x6b\xff\xc4\x00\x1b\x11\x00\x00\x07\x01\x00\
+\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x05\x06\x21\x51\x61\xf0\
+\xff\xda\x00\x08\x01\x03\x01\x01\x3f\x01\x6f\xaf\xd9\xf4\xe0\xff\xc4\x00\x18\
+\x11\x00\x02\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x03\
+\x14\xe1\xf0\xff\xda\x00\x08\x01\x02\x01\x01\x3f\x01\x53\xa5\xea\x3f\xff\xc4\
+\x00\x21\x10\x00\x00\x05\x02\x07\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\
+\x00\x01\x02\x11\x21\x03\x22\x23\x31\x42\x71\x81\xa1\xe1\xff\xda\x00\x08\x01\
+\x01\x00\x06\x3f\x02\x56\x2c\x16\x96\xc8\x29\xea\x4e\xd0\x0e\xee\x82\xae\xe1\
+\xbd\x1f\xff\xc4\x00\x1d\x10\x00\x02\x03\x00\x02\x03\x00\x00\x00\x00\x00\x00\
+\x00\x00\x00\x00\x01\x31\x00\x11\x21\x61\x81\x51\xc1\xf0\xff\xda\x00\x08\x01\
+\x01\x00\x01\x3f\x21\x09\x86\xdc\x83\x72\x61\xe8\x6c\x1a\x63\xad\xbe\xe3\xc4\
+\x60\x2c\xfb\x3e\x7d\xcc\x3b\x02\x5f\xcb\x67\xff\xda\x00\x0c\x03\x01\x00\x02\
+\x00\x03\x00\x00\x00\x10\x83\xff\xc4\x00\x18\x11\x01\x00\x03\x01\x00\x00\x00\
+\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x00\x11\xf0\x91\xff\xda\x00\x08\x01\
+\x03\x01\x01\x3f\x10\x31\x0a\x12\xf7\x8d\x4c\xff\xc4\x00\x19\x11\x00\x02\x03\
+\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x11\x00\x31\x61\x71\
+\xff\xda\x00\x08\x01\x02\x01\x01\x3f\x10\x22\x0b\x79\xc8\xff\xc4\x00\x1c\x10\
+\x01\x01\x01\x00\x03\x00\x03\x00\x00\x00\x00\x00\x00\x00\x00\x00\x01\x11\x21\
+\x00\x31\x51\x41\x71\x81\xff\xda\x00\x08\x01\x01\x00\x01\x3f\x10\x79\x1b\x16\
+\xea\x20\x3c\x55\x6e\x0b\x3e\x8e\x2b\x0f\x69\xc8\x82\x88\xcb\xd3\xe5\x9e\x95\
+\x4c\xa3\x60\x10\x6a\x98\x92\x09\xfa\x67\x1d\x90\x48\x6d\xb8\xf6\x38\xd0\x67\
+\xbb\x19\xcf\xff\xd9".b
+
+  # 32x32 4:2:0 image of four blocks of blue, green, yellow and red, one MCU
+  # each.
+  QUADRANT_JPEG = "\
+\xff\xd8\xff\xe0\x00\x10\x4a\x46\x49\x46\x00\x01\x01\x00\x00\x01\x00\x01\x00\
+\x00\xff\xdb\x00\x43\x00\x08\x06\x06\x07\x06\x05\x08\x07\x07\x07\x09\x09\x08\
+\x0a\x0c\x14\x0d\x0c\x0b\x0b\x0c\x19\x12\x13\x0f\x14\x1d\x1a\x1f\x1e\x1d\x1a\
+\x1c\x1c\x20\x24\x2e\x27\x20\x22\x2c\x23\x1c\x1c\x28\x37\x29\x2c\x30\x31\x34\
+\x34\x34\x1f\x27\x39\x3d\x38\x32\x3c\x2e\x33\x34\x32\xff\xdb\x00\x43\x01\x09\
+\x09\x09\x0c\x0b\x0c\x18\x0d\x0d\x18\x32\x21\x1c\x21\x32\x32\x32\x32\x32\x32\
+\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\
+\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\x32\
+\x32\x32\x32\x32\x32\x32\xff\xc0\x00\x11\x08\x00\x20\x00\x20\x03\x01\x22\x00\
+\x02\x11\x01\x03\x11\x01\xff\xc4\x00\x16\x00\x01\x01\x01\x00\x00\x00\x00\x00\
+\x00\x00\x00\x00\x00\x00\x00\x00\x00\x07\x08\xff\xc4\x00\x14\x10\x01\x00\x00\
+\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\xff\xc4\x00\x17\x01\
+\x01\x01\x01\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x07\x06\x05\
+\x08\xff\xc4\x00\x14\x11\x01\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\x00\
+\x00\x00\x00\x00\xff\xda\x00\x0c\x03\x01\x00\x02\x11\x03\x11\x00\x3f\x00\x8e\
+\x00\x71\x66\x2b\x00\x39\x4d\x0e\xb1\x80\x8e\x30\xb3\xb8\x04\xe2\x1b\xff\xd9".b
+
+  # Offset of the last scan, which refines luma AC coefficients.
+  PROGRESSIVE_LAST_SCAN = 584
+
   BIG_JPEG = begin
     s = ""
     r = Oil::JPEGReader.new(StringIO.new(JPEG_DATA))
@@ -58,6 +122,670 @@ class TestJPEG < MiniTest::Test
     assert_equal 1, o.out_color_components
   end
 
+  # Memory sources
+
+  def test_string_source
+    o = Oil::JPEGReader.new(BIG_JPEG)
+    assert_equal 2000, o.image_width
+    assert_equal drain_io(StringIO.new(BIG_JPEG)), drain(o)
+  end
+
+  def test_string_source_truncated
+    assert_raises(RuntimeError) { Oil::JPEGReader.new(BIG_JPEG[0, 10]) }
+  end
+
+  def test_string_source_modified_after_initialize
+    str = BIG_JPEG.dup
+    o = Oil::JPEGReader.new(str)
+    str.replace("foobar")
+    assert_equal drain_io(StringIO.new(BIG_JPEG)), drain(o)
+  end
+
+  def test_io_buffer_source
+    skip unless defined?(IO::Buffer)
+    o = Oil::JPEGReader.new(IO::Buffer.for(BIG_JPEG))
+    assert_equal drain_io(StringIO.new(BIG_JPEG)), drain(o)
+
+    buf = IO::Buffer.new(BIG_JPEG.bytesize)
+    buf.set_string(BIG_JPEG)
+    o = Oil::JPEGReader.new(buf)
+    buf.free
+    assert_equal drain_io(StringIO.new(BIG_JPEG)), drain(o)
+  end
+
+  def test_open_path
+    with_tempfile(BIG_JPEG) do |f|
+      o = Oil::JPEGReader.open(f.path)
+      assert_equal 2000, o.image_width
+      assert_equal drain_io(StringIO.new(BIG_JPEG)), drain(o)
+    end
+  end
+
+  def test_open_file_at_offset
+    with_tempfile("junk" + BIG_JPEG) do |f|
+      f.read(4)
+      assert_equal 2000, Oil::JPEGReader.open(f).image_width
+    end
+  end
+
+  def test_open_missing_file
+    assert_raises(Errno::ENOENT) { Oil::JPEGReader.open("/nonexistent.jpg") }
+  end
+
+  def test_oil_new_string
+    s = ""
+    Oil.new(BIG_JPEG, 100, 100).each { |d| s << d }
+    assert_equal 100, Oil::JPEGReader.new(s).image_width
+  end
+
+  # Native path-to-path resizing
+
+  def test_resize_file
+    with_tempfile(BIG_JPEG) do |f|
+      out = Tempfile.new('oil_out')
+      Oil.resize_file(f.path, out.path, 100, 200, quality: 50)
+      o = Oil::JPEGReader.open(out.path)
+      assert_equal 100, o.image_width
+      assert_equal 100, o.image_height
+      out.close!
+    end
+  end
+
+  def test_resize_file_keeps_markers
+    str = ""
+    opts = { markers: { COM: ["hello world"] } }
+    Oil::JPEGReader.new(jpeg_io).each(opts) { |s| str << s }
+    with_tempfile(str) do |f|
+      out = Tempfile.new('oil_out')
+      Oil.resize_file(f.path, out.path, 10, 10)
+      assert_equal(opts[:markers], Oil::JPEGReader.open(out.path, [:COM]).markers)
+      out.close!
+    end
+  end
+
+  def test_resize_file_corrupt
+    with_tempfile(BIG_JPEG[0, 10]) do |f|
+      path = f.path + ".out"
+      assert_raises(RuntimeError) { Oil.resize_file(f.path, path, 10, 10) }
+      refute File.exist?(path)
+    end
+  end
+
+  def test_resize_file_unknown_format
+    with_tempfile("foobar") do |f|
+      assert_raises(RuntimeError) { Oil.resize_file(f.path, f.path + ".out", 10, 10) }
+    end
+  end
+
+  def test_resize_file_missing_input
+    assert_raises(RuntimeError) do
+      Oil.resize_file("/nonexistent.jpg", "/nonexistent.out.jpg", 10, 10)
+    end
+  end
+
+  def test_prescale
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    r.prescale(100, 100)
+    assert_equal [1, 8], [r.scale_num, r.scale_denom]
+    assert_equal 250, r.output_width
+
+    r.prescale(100, 100, 4)
+    assert_equal 500, r.output_width
+
+    r.prescale(100, 100, 0.5)
+    assert_equal 250, r.output_width
+  end
+
+  def test_prescale_never_enlarges
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    r.prescale(3000, 3000)
+    assert_equal 2000, r.output_width
+    assert_equal 2000, r.output_height
+  end
+
+  def test_prescale_thumbnail_decodes_dc_only
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    r.prescale(64, 64)
+    assert_equal [1, 8], [r.scale_num, r.scale_denom]
+    assert_equal 250, r.output_width
+
+    r.prescale(250, 250, 1)
+    assert_equal [1, 8], [r.scale_num, r.scale_denom]
+
+    r.prescale(251, 251, 1)
+    assert_equal [2, 8], [r.scale_num, r.scale_denom]
+  end
+
+  def test_prescale_locked
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    r.start
+    assert_raises(RuntimeError) { r.prescale(100, 100) }
+  end
+
+  def test_oil_new_prescale
+    [{}, { prescale: 8 }, { prescale: false }].each do |opts|
+      out = ""
+      Oil.new(BIG_JPEG, 90, 90, opts).each { |d| out << d }
+      r = Oil::JPEGReader.new(out)
+      assert_equal [90, 90], [r.image_width, r.image_height]
+    end
+  end
+
+  def test_resize_file_prescale
+    with_tempfile(BIG_JPEG) do |f|
+      out = Tempfile.new('oil_out')
+      Oil.resize_file(f.path, out.path, 90, 90, prescale: false)
+      o = Oil::JPEGReader.open(out.path)
+      assert_equal [90, 90], [o.image_width, o.image_height]
+      out.close!
+    end
+  end
+
+  def test_progressive_skips_unused_scans
+    expected = drain_eighth(PROGRESSIVE_JPEG)
+
+    # The decoder must stop before reaching a bogus marker in the last scan.
+    str = PROGRESSIVE_JPEG.dup
+    str[PROGRESSIVE_LAST_SCAN + 1] = "\x10"
+    assert_equal expected, drain_eighth(str)
+    assert_raises(RuntimeError) { Oil::JPEGReader.new(str).each { |d| } }
+  end
+
+  def test_progressive_reads_all_scans_at_full_size
+    truncated = PROGRESSIVE_JPEG[0, PROGRESSIVE_LAST_SCAN] + "\xFF\xD9".b
+    full, partial = [PROGRESSIVE_JPEG, truncated].map do |data|
+      s = ""
+      Oil::JPEGReader.new(data).each { |d| s << d }
+      s
+    end
+    refute_equal full, partial
+  end
+
+  def test_planar
+    [:planar, :linear].product([[7, 5], [16, 16], [100, 60], [1, 1]]).each do |mode, (w, h)|
+      r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+      r.scale_width = w
+      r.scale_height = h
+      s = ""
+      r.each(ycbcr: mode) { |d| s << d }
+      o = Oil::JPEGReader.new(s)
+      assert_equal [w, h], [o.image_width, o.image_height]
+      assert_equal :YCbCr, o.jpeg_color_space
+    end
+  end
+
+  def test_planar_falls_back_for_grayscale
+    expected = drain_io(jpeg_io)
+    [:planar, :linear].each do |mode|
+      r = Oil::JPEGReader.new(jpeg_io)
+      r.scale_width = 10
+      r.scale_height = 20
+      s = ""
+      r.each(ycbcr: mode) { |d| s << d }
+      assert_equal expected, s
+    end
+  end
+
+  def test_planar_unknown_mode
+    r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+    assert_raises(ArgumentError) { r.each(ycbcr: :bogus) { |d| } }
+  end
+
+  def test_planar_job
+    [:planar, :linear].each do |mode|
+      expected = ""
+      r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+      r.scale_width = 100
+      r.scale_height = 60
+      r.each(ycbcr: mode) { |d| expected << d }
+
+      r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+      r.scale_width = 100
+      r.scale_height = 60
+      job = r.start(ycbcr: mode)
+      out = "".b
+      steps = 0
+      while chunk = job.step(1)
+        out << chunk
+        steps += 1
+      end
+      assert_equal 4, steps
+      assert_equal expected, out
+    end
+  end
+
+  def test_linear_differs_from_planar
+    out = [:planar, :linear].map do |mode|
+      r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+      r.scale_width = 7
+      r.scale_height = 5
+      s = ""
+      r.each(ycbcr: mode) { |d| s << d }
+      s
+    end
+    refute_equal out[0], out[1]
+  end
+
+  def test_linear_prescaled
+    jpeg = quadrant_jpeg
+    expected = JPEGBlocks.decode(oil_new(jpeg, 64, 64))
+    [:planar, :linear].each do |mode|
+      assert_blocks_close expected, JPEGBlocks.decode(oil_new(jpeg, 64, 64, ycbcr: mode))
+      with_tempfile(jpeg) do |f|
+        out = Tempfile.new('oil_out')
+        Oil.resize_file(f.path, out.path, 64, 64, ycbcr: mode)
+        assert_blocks_close expected, JPEGBlocks.decode(File.binread(out.path))
+        out.close!
+      end
+    end
+  end
+
+  # A 4:2:0 JPEG of four blocks of blue, green, yellow and red.
+  def quadrant_jpeg
+    r = Oil::JPEGReader.new(QUADRANT_JPEG)
+    r.scale_width = 256
+    r.scale_height = 256
+    s = ""
+    r.each { |d| s << d }
+    s
+  end
+
+  def oil_new(data, w, h, opts = {})
+    s = ""
+    Oil.new(StringIO.new(data), w, h, opts).each { |d| s << d }
+    s
+  end
+
+  def assert_blocks_close(expected, actual)
+    assert_equal expected.size, actual.size
+    assert_operator expected.flatten.zip(actual.flatten).map { |a, b| (a - b).abs }.max, :<=, 12
+  end
+
+  def test_resize_file_planar
+    [:planar, :linear].each do |mode|
+      with_tempfile(PROGRESSIVE_JPEG) do |f|
+        out = Tempfile.new('oil_out')
+        Oil.resize_file(f.path, out.path, 9, 9, ycbcr: mode)
+        o = Oil::JPEGReader.open(out.path)
+        assert_equal [9, 9], [o.image_width, o.image_height]
+        out.close!
+      end
+    end
+  end
+
+  def test_speed
+    sizes = [nil, :fast, :balanced, :quality].map do |speed|
+      r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+      r.scale_width = 100
+      r.scale_height = 60
+      out = ""
+      opts = speed ? { speed: speed } : {}
+      r.each(opts) { |d| out << d }
+      o = Oil::JPEGReader.new(out)
+      assert_equal [100, 60], [o.image_width, o.image_height]
+      out
+    end
+    assert_equal sizes[0], sizes[2]
+    refute_equal sizes[0], sizes[1]
+    assert_operator sizes[3].bytesize, :<, sizes[2].bytesize
+  end
+
+  def test_speed_unknown
+    r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+    assert_raises(ArgumentError) { r.each(speed: :bogus) { |d| } }
+    with_tempfile(PROGRESSIVE_JPEG) do |f|
+      assert_raises(ArgumentError) do
+        Oil.resize_file(f.path, f.path + '.out', 9, 9, speed: :bogus)
+      end
+    end
+  end
+
+  def test_resize_file_speed
+    [:fast, :quality].each do |speed|
+      with_tempfile(PROGRESSIVE_JPEG) do |f|
+        out = Tempfile.new('oil_out')
+        Oil.resize_file(f.path, out.path, 9, 9, speed: speed)
+        o = Oil::JPEGReader.open(out.path)
+        assert_equal [9, 9], [o.image_width, o.image_height]
+        out.close!
+      end
+    end
+  end
+
+  def encode(opts)
+    r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+    r.scale_width = 64
+    r.scale_height = 64
+    out = ""
+    r.each(opts) { |d| out << d }
+    out
+  end
+
+  def test_encode_progressive
+    out = encode(progressive: true, ycbcr: nil)
+    o = Oil::JPEGReader.new(out)
+    assert_equal [64, 64], [o.image_width, o.image_height]
+    assert_includes out, "\xff\xc2".b
+    assert_operator out.bytesize, :<, encode({}).bytesize
+  end
+
+  def test_encode_optimize
+    assert_operator encode(optimize: true).bytesize, :<, encode({}).bytesize
+  end
+
+  def test_encode_subsampling
+    sizes = ["4:4:4", "4:2:2", "4:2:0"].map do |sub|
+      [nil, :planar, :linear].map do |mode|
+        out = encode(subsampling: sub, ycbcr: mode)
+        o = Oil::JPEGReader.new(out)
+        assert_equal [64, 64], [o.image_width, o.image_height]
+        drain_string(out)
+        out.bytesize
+      end
+    end
+    assert_operator sizes[0][0], :>, sizes[1][0]
+    assert_operator sizes[1][0], :>, sizes[2][0]
+    assert_raises(ArgumentError) { encode(subsampling: "4:1:1") }
+  end
+
+  def test_encode_arithmetic
+    out = encode(arithmetic: true)
+    assert_includes out, "\xff\xc9".b
+    drain_string(out)
+  rescue ArgumentError
+    skip "libjpeg was built without arithmetic coding"
+  end
+
+  def test_encode_trellis
+    drain_string(encode(trellis: true))
+  rescue ArgumentError
+    skip "libjpeg is not mozjpeg"
+  end
+
+  def test_resize_file_encode
+    with_tempfile(PROGRESSIVE_JPEG) do |f|
+      out = Tempfile.new('oil_out')
+      Oil.resize_file(f.path, out.path, 9, 9, progressive: true,
+        subsampling: "4:4:4")
+      o = Oil::JPEGReader.open(out.path)
+      assert_equal [9, 9], [o.image_width, o.image_height]
+      out.close!
+    end
+  end
+
+  def test_max_bytes
+    outputs = (50..95).map { |q| encode(quality: q) }
+    out = encode(quality: 95, max_bytes: outputs[0].bytesize)
+    assert_operator out.bytesize, :<=, outputs[0].bytesize
+    assert_includes outputs, out
+  end
+
+  def test_max_bytes_fits_at_quality
+    assert_equal encode(quality: 80), encode(quality: 80, max_bytes: 1 << 20)
+    assert_equal encode(quality: 100), encode(max_bytes: 1 << 20)
+  end
+
+  def test_max_bytes_too_small
+    assert_raises(RuntimeError) { encode(max_bytes: 10) }
+  end
+
+  def test_max_bytes_bad_args
+    assert_raises(ArgumentError) { encode(max_bytes: 0) }
+    assert_raises(ArgumentError) { encode(max_bytes: 1000, ycbcr: :planar) }
+  end
+
+  def restart_jpeg(opts = {})
+    r = Oil::JPEGReader.new(PROGRESSIVE_JPEG)
+    r.scale_width = 600
+    r.scale_height = 400
+    out = ""
+    r.each({ restart_rows: 1 }.merge(opts)) { |d| out << d }
+    out
+  end
+
+  def resize_threads(data, opts, scale_denom = 1)
+    r = Oil::JPEGReader.new(data)
+    r.scale_denom = scale_denom
+    r.scale_width = 250
+    r.scale_height = 150
+    out = ""
+    r.each(opts) { |d| out << d }
+    out
+  end
+
+  def test_encode_restart_rows
+    out = restart_jpeg
+    assert_includes out, "\xff\xdd".b
+    assert_includes out, "\xff\xd0".b
+    refute_includes encode({}), "\xff\xdd".b
+    assert_raises(ArgumentError) { encode(restart_rows: -1) }
+  end
+
+  def test_threads
+    [{}, { subsampling: "4:2:2" }, { subsampling: "4:4:4" }].each do |eo|
+      data = restart_jpeg(eo)
+      [{}, { speed: :fast }].each do |o|
+        [1, 2].each do |denom|
+          assert_equal resize_threads(data, o.merge(restart_rows: 1), denom),
+            resize_threads(data, o.merge(threads: 3), denom)
+        end
+      end
+    end
+  end
+
+  def test_threads_fall_back
+    data = restart_jpeg
+    expected = resize_threads(data, restart_rows: 1)
+    assert_equal expected, resize_threads(StringIO.new(data), threads: 3)
+    assert_equal encode(restart_rows: 1), encode(threads: 3)
+    truncated = data[0, data.bytesize / 2]
+    assert_equal resize_threads(truncated, restart_rows: 1),
+      resize_threads(truncated, threads: 3)
+    assert_raises(ArgumentError) { resize_threads(data, threads: 0) }
+  end
+
+  def test_threads_encode
+    data = restart_jpeg(subsampling: "4:4:4")
+    out = resize_threads(data, threads: 2)
+    assert_includes out, "\xff\xdd".b
+    assert_equal resize_threads(data, restart_rows: 2),
+      resize_threads(data, restart_rows: 2, threads: 2)
+    [{ progressive: true }, { optimize: true }, { speed: :quality }].each do |o|
+      assert_equal resize_threads(data, o), resize_threads(data, o.merge(threads: 2))
+    end
+    r = Oil::JPEGReader.new(out)
+    assert_equal [250, 150], [r.image_width, r.image_height]
+    r.each { |d| }
+  end
+
+  def test_threads_job
+    data = restart_jpeg
+    r = Oil::JPEGReader.new(data)
+    r.scale_width = 250
+    r.scale_height = 150
+    job = r.start(threads: 2)
+    out = ""
+    while chunk = job.step(7)
+      out << chunk
+    end
+    assert_equal resize_threads(data, restart_rows: 1), out
+  end
+
+  def test_threads_warning
+    data = restart_jpeg
+    i = data.index("\xff\xd5".b)
+    corrupt = data[0, i - 20] + data[i..-1]
+    verbose, $VERBOSE = $VERBOSE, true
+    [{ restart_rows: 1 }, { threads: 3 }].each do |o|
+      assert_output(nil, /jpeglib: Corrupt JPEG data/) do
+        resize_threads(corrupt, o)
+      end
+    end
+    assert_output(nil, /jpeglib: Corrupt JPEG data/) do
+      job = Oil::JPEGReader.new(corrupt).start(threads: 3)
+      while job.step; end
+    end
+  ensure
+    $VERBOSE = verbose
+  end
+
+  def test_resize_file_threads
+    with_tempfile(restart_jpeg) do |f|
+      out1 = Tempfile.new('oil_out')
+      out2 = Tempfile.new('oil_out')
+      Oil.resize_file(f.path, out1.path, 250, 150, restart_rows: 1)
+      Oil.resize_file(f.path, out2.path, 250, 150, threads: 4)
+      assert_equal File.binread(out1.path), File.binread(out2.path)
+      out1.close!
+      out2.close!
+    end
+  end
+
+  def test_job_steps
+    expected = ""
+    Oil::JPEGReader.new(BIG_JPEG).each { |d| expected << d }
+    job = Oil::JPEGReader.new(BIG_JPEG).start
+    out = "".b
+    steps = 0
+    while chunk = job.step(100)
+      out << chunk
+      steps += 1
+    end
+    assert job.done?
+    assert_equal 20, steps
+    assert_equal expected, out
+  end
+
+  def test_job_time_budget
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    r.scale_width = 100
+    r.scale_height = 100
+    job = r.start(quality: 50)
+    out = "".b
+    while chunk = job.step(0.0)
+      out << chunk
+    end
+    expected = ""
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    r.scale_width = 100
+    r.scale_height = 100
+    r.each(quality: 50) { |d| expected << d }
+    assert_equal expected, out
+  end
+
+  def test_job_runs_to_completion
+    job = Oil.new(jpeg_io, 10, 10).start
+    refute job.done?
+    assert_match(/\A\xFF\xD8.*\xFF\xD9\z/mn, job.step)
+    assert job.done?
+    assert_nil job.step
+  end
+
+  def test_job_locks_reader
+    r = Oil::JPEGReader.new(jpeg_io)
+    r.start
+    assert_raises(RuntimeError) { r.scale_width = 10 }
+    assert_raises(RuntimeError) { r.start }
+  end
+
+  def test_job_raises
+    job = Oil::JPEGReader.new(RaiseIO.new(BIG_JPEG, read_count: 1)).start
+    assert_raises(CustomError) { job.step }
+    assert job.done?
+    assert_nil job.step
+  end
+
+  def test_job_negative_rows
+    job = Oil::JPEGReader.new(jpeg_io).start
+    assert_raises(ArgumentError) { job.step(-1) }
+  end
+
+  def test_webp
+    s = ""
+    begin
+      Oil::JPEGReader.new(BIG_JPEG).each(format: :webp) { |d| s << d }
+    rescue ArgumentError => e
+      skip e.message if e.message =~ /without libwebp/
+      raise
+    end
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    assert_equal [r.image_width, r.image_height, false], WebP.info(s)
+
+    r = Oil::JPEGReader.new(quadrant_jpeg)
+    r.scale_width = 64
+    r.scale_height = 64
+    s = ""
+    r.each(format: :webp, lossless: true) { |d| s << d }
+    assert_equal [64, 64, false], WebP.info(s)
+    w, h, pixels = WebP.decode(s)
+    skip "libwebp can't be loaded to decode the output" unless pixels
+    assert_equal [64, 64], [w, h]
+    colors = [[0, 0, 254], [0, 200, 0], [250, 240, 0], [220, 20, 20]]
+    [[16, 16], [48, 16], [16, 48], [48, 48]].each_with_index do |(x, y), i|
+      pixel = pixels.byteslice((y * 64 + x) * 4, 4).bytes
+      assert_equal 255, pixel[3]
+      assert_blocks_close [colors[i]], [pixel[0, 3]]
+    end
+  end
+
+  def test_webp_bad_args
+    r = Oil::JPEGReader.new(BIG_JPEG)
+    assert_raises(ArgumentError) { r.each(format: :bogus) {} }
+    assert_raises(ArgumentError) { r.start(format: :webp) }
+  end
+
+  def push_jpeg(data, chunk_size, opts = {})
+    chunks = (0...data.bytesize).step(chunk_size).map { |i| data.b[i, chunk_size] }
+    r = Oil::JPEGReader.push
+    r << chunks.shift until r.ready?
+    r.scale_width = 30
+    r.scale_height = 20
+    job = r.start(opts)
+    out = "".b
+    until job.done?
+      out << job.step(3).to_s
+      chunks.empty? ? r.close : r << chunks.shift
+    end
+    out
+  end
+
+  def test_push
+    [BIG_JPEG, PROGRESSIVE_JPEG, restart_jpeg].each do |data|
+      expected = ""
+      r = Oil::JPEGReader.new(data)
+      r.scale_width = 30
+      r.scale_height = 20
+      r.each(quality: 80, threads: 2) { |d| expected << d }
+      [1, 97, data.bytesize].each do |size|
+        assert_equal expected, push_jpeg(data, size, quality: 80, threads: 2)
+      end
+    end
+  end
+
+  def test_push_truncated
+    data = BIG_JPEG[0, BIG_JPEG.bytesize / 2]
+    expected = ""
+    r = Oil::JPEGReader.new(data)
+    r.scale_width = 30
+    r.scale_height = 20
+    r.each { |d| expected << d }
+    assert_equal expected, push_jpeg(data, 1000)
+  end
+
+  def test_push_errors
+    r = Oil::JPEGReader.push
+    r << JPEG_DATA[0, 10]
+    refute r.ready?
+    assert_raises(RuntimeError) { r.start }
+    assert_raises(RuntimeError) { r.close }
+    assert_raises(RuntimeError) { r << JPEG_DATA }
+    r = Oil::JPEGReader.push([:APP1])
+    r << JPEG_DATA
+    assert r.ready?
+    assert_raises(RuntimeError) { r.each { |d| } }
+    assert_raises(RuntimeError) { Oil::JPEGReader.new(jpeg_io) << "" }
+  end
+
   # Allocation tests
 
   def test_multiple_initialize_leak
@@ -68,6 +796,36 @@ class TestJPEG < MiniTest::Test
 
     o.send(:initialize, jpeg_io)
     o.each{ |d| }
+
+    # The memory source shares the reader's source manager with the IO one.
+    outs = 3.times.flat_map do
+      [StringIO.new(BIG_JPEG), BIG_JPEG].map do |src|
+        o.send(:initialize, src)
+        out = ""
+        o.each { |d| out << d }
+        out
+      end
+    end
+    assert_equal [outs[0]], outs.uniq
+  end
+
+  def test_memsize_of_native_buffers
+    o = Oil::JPEGReader.new(BIG_JPEG)
+    o.scale_width = 10
+    o.scale_height = 10
+    header_size = ObjectSpace.memsize_of(o)
+
+    each_size = nil
+    o.each{ |d| each_size ||= ObjectSpace.memsize_of(o) }
+    assert_operator each_size, :>, header_size + 128 * 2000
+
+    # The decompressor keeps its row buffers until the reader is reset.
+    after_size = ObjectSpace.memsize_of(o)
+    assert_operator after_size, :<, each_size
+    assert_operator after_size, :>, header_size
+
+    o.send(:initialize, jpeg_io)
+    assert_operator ObjectSpace.memsize_of(o), :<, after_size
   end
 
   # Test io
@@ -232,4 +990,35 @@ class TestJPEG < MiniTest::Test
   def drain_string(str)
     Oil::JPEGReader.new(StringIO.new(str)).each{ |s| }
   end
+
+  def drain_eighth(data)
+    r = Oil::JPEGReader.new(data)
+    r.scale_num = 1
+    r.scale_denom = 8
+    s = ""
+    r.each { |d| s << d }
+    s
+  end
+
+  def drain(reader)
+    reader.scale_width = 10
+    reader.scale_height = 20
+    s = ""
+    reader.each { |d| s << d }
+    s
+  end
+
+  def drain_io(io)
+    drain(Oil::JPEGReader.new(io))
+  end
+
+  def with_tempfile(data)
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(data)
+    f.rewind
+    yield f
+  ensure
+    f.close!
+  end
 end
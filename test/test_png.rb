@@ -2,6 +2,9 @@ require 'minitest'
 require 'minitest/autorun'
 require 'oil'
 require 'stringio'
+require 'tempfile'
+require 'zlib'
+require 'objspace'
 require 'helper'
 
 class TestPNG < MiniTest::Test
@@ -47,6 +50,685 @@ class TestPNG < MiniTest::Test
     assert_equal 1, o.height
   end
 
+  # Memory sources
+
+  def test_string_source
+    o = Oil::PNGReader.new(BIG_PNG)
+    assert_equal 500, o.width
+    assert_equal drain(Oil::PNGReader.new(StringIO.new(BIG_PNG))), drain(o)
+  end
+
+  def test_string_source_truncated
+    assert_raises(RuntimeError) { drain(Oil::PNGReader.new(BIG_PNG[0, 100])) }
+  end
+
+  def test_io_buffer_source
+    skip unless defined?(IO::Buffer)
+    o = Oil::PNGReader.new(IO::Buffer.for(BIG_PNG))
+    assert_equal drain(Oil::PNGReader.new(StringIO.new(BIG_PNG))), drain(o)
+
+    buf = IO::Buffer.new(BIG_PNG.bytesize)
+    buf.set_string(BIG_PNG)
+    o = Oil::PNGReader.new(buf)
+    buf.resize(16)
+    assert_equal drain(Oil::PNGReader.new(StringIO.new(BIG_PNG))), drain(o)
+  end
+
+  def test_open_path
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(BIG_PNG)
+    f.close
+    o = Oil::PNGReader.open(f.path)
+    assert_equal 1000, o.height
+    assert_equal drain(Oil::PNGReader.new(StringIO.new(BIG_PNG))), drain(o)
+  ensure
+    f.unlink
+  end
+
+  def test_oil_open
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(BIG_PNG)
+    f.close
+    s = ""
+    Oil.open(f.path, 50, 50).each { |d| s << d }
+    assert_equal 25, Oil::PNGReader.new(s).width
+  ensure
+    f.unlink
+  end
+
+  def test_resize_file
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(BIG_PNG)
+    f.close
+    out = Tempfile.new('oil_out')
+    Oil.resize_file(f.path, out.path, 50, 50)
+    o = Oil::PNGReader.open(out.path)
+    assert_equal 25, o.width
+    assert_equal 50, o.height
+  ensure
+    f.unlink
+    out.close! if out
+  end
+
+  def encode(opts)
+    s = ""
+    Oil::PNGReader.new(BIG_PNG).each(opts) { |d| s << d }
+    s
+  end
+
+  def encode_png(png, opts)
+    s = ""
+    Oil::PNGReader.new(png).each(opts.merge(filter: :none)) { |d| s << d }
+    s
+  end
+
+  def test_compression_level
+    stored = encode(compression_level: 0)
+    assert_operator stored.bytesize, :>, 500 * 1000
+    assert_operator encode(compression_level: 9).bytesize, :<, stored.bytesize
+    assert_equal 500, Oil::PNGReader.new(stored).width
+    drain_string(stored)
+  end
+
+  def test_filter_and_strategy
+    [:none, :sub, :up, :average, :paeth, :all, [:sub, :up]].each do |f|
+      [:default, :filtered, :huffman_only, :rle, :fixed].each do |st|
+        drain_string(encode(filter: f, strategy: st))
+      end
+    end
+  end
+
+  def test_speed_fast
+    fast = encode(speed: :fast)
+    refute_equal encode({}), fast
+    assert_equal fast, encode(compression_level: 1, filter: :up, strategy: :rle)
+    assert_equal encode(compression_level: 0, filter: :up, strategy: :rle),
+      encode(speed: :fast, compression_level: 0)
+
+    s = ""
+    Oil.new(BIG_PNG, 500, 1000, speed: :fast).each { |d| s << d }
+    assert_equal fast, s
+  end
+
+  def test_encode_bad_args
+    assert_raises(ArgumentError) { encode(compression_level: 10) }
+    assert_raises(ArgumentError) { encode(filter: :bogus) }
+    assert_raises(ArgumentError) { encode(filter: []) }
+    assert_raises(ArgumentError) { encode(strategy: :bogus) }
+    assert_raises(ArgumentError) { encode(bit_depth: 12) }
+    assert_raises(ArgumentError) { Oil::PNGReader.new(BIG_PNG).start(strategy: :bogus) }
+  end
+
+  def test_resize_file_fast
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(BIG_PNG)
+    f.close
+    out = Tempfile.new('oil_out')
+    Oil.resize_file(f.path, out.path, 50, 50, speed: :fast, filter: :sub)
+    o = Oil::PNGReader.open(out.path)
+    assert_equal [25, 50], [o.width, o.height]
+  ensure
+    f.unlink
+    out.close! if out
+  end
+
+  # Re-encode without compression so that images with the same pixels compare
+  # equal.
+  def pixels(png)
+    s = ""
+    Oil::PNGReader.new(png).each(compression_level: 0) { |d| s << d }
+    s
+  end
+
+  def idat(png)
+    data = "".b
+    pos = 8
+    while pos < png.bytesize
+      len, type = png.byteslice(pos, 8).unpack("Na4")
+      data << png.byteslice(pos + 8, len) if type == "IDAT"
+      pos += len + 12
+    end
+    data
+  end
+
+  def test_threads
+    expected = pixels(BIG_PNG)
+    [2, 3, 8].each do |n|
+      [{}, { speed: :fast }, { filter: :paeth }, { compression_level: 0 }].each do |o|
+        out = encode(o.merge(threads: n))
+        assert_equal expected, pixels(out)
+        assert_equal 1000 * 501, Zlib::Inflate.inflate(idat(out)).bytesize
+      end
+    end
+  end
+
+  def test_threads_job
+    job = Oil::PNGReader.new(BIG_PNG).start(threads: 4)
+    out = "".b
+    while chunk = job.step(64)
+      out << chunk
+    end
+    assert job.done?
+    assert_equal encode(threads: 4), out
+  end
+
+  def test_threads_abandoned_job
+    job = Oil::PNGReader.new(BIG_PNG).start(threads: 4)
+    job.step(300)
+    job = nil
+    GC.start
+  end
+
+  def test_libdeflate
+    [{}, { speed: :fast }, { filter: :paeth }, { compression_level: 12 }].each do |o|
+      out = encode(o.merge(deflate: :libdeflate))
+      assert_equal pixels(BIG_PNG), pixels(out)
+      assert_equal 1000 * 501, Zlib::Inflate.inflate(idat(out)).bytesize
+    end
+  rescue ArgumentError => e
+    raise unless e.message =~ /without libdeflate/
+    skip "oil was built without libdeflate"
+  end
+
+  def test_deflate_bad_args
+    assert_equal encode({}), encode(deflate: :zlib)
+    assert_raises(ArgumentError) { encode(deflate: :bogus) }
+    assert_raises(ArgumentError) { encode(deflate: :libdeflate, threads: 2) }
+    assert_raises(ArgumentError) { encode(compression_level: 12) }
+    assert_raises(ArgumentError) do
+      encode(deflate: :libdeflate, compression_level: 13)
+    end
+  end
+
+  def test_threads_bad_args
+    assert_raises(ArgumentError) { encode(threads: 0) }
+  end
+
+  def test_resize_file_threads
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(BIG_PNG)
+    f.close
+    out = Tempfile.new('oil_out')
+    Oil.resize_file(f.path, out.path, 250, 500, threads: 4)
+    r = Oil::PNGReader.new(BIG_PNG)
+    r.scale_width = 250
+    r.scale_height = 500
+    assert_equal pixels(drain(r)), pixels(File.binread(out.path))
+  ensure
+    f.unlink
+    out.close! if out
+  end
+
+  # First column, first row, column step and row step of each Adam7 pass.
+  ADAM7 = [[0, 0, 8, 8], [4, 0, 8, 8], [0, 4, 4, 8], [2, 0, 4, 4],
+           [0, 2, 2, 4], [1, 0, 2, 2], [0, 1, 1, 2]]
+
+  def png_chunk(type, data)
+    [data.bytesize].pack("N") + type + data + [Zlib.crc32(type + data)].pack("N")
+  end
+
+  COLOR_TYPES = { 1 => 0, 2 => 4, 3 => 2, 4 => 6 }
+
+  # Rows of the pixels at the given columns and rows, each starting with the
+  # None filter byte, in Adam7 pass order if interlaced.
+  def png_rows(width, height, interlace)
+    passes = interlace ? ADAM7 : [[0, 0, 1, 1]]
+    passes.flat_map do |x0, y0, dx, dy|
+      next [] if x0 >= width
+      (y0...height).step(dy).map { |y| "\0".b + yield((x0...width).step(dx), y) }
+    end
+  end
+
+  def png_file(ihdr, data, chunks = "")
+    "\x89PNG\r\n\x1A\n".b + png_chunk("IHDR", ihdr) + chunks +
+      png_chunk("IDAT", Zlib::Deflate.deflate(data)) + png_chunk("IEND", "")
+  end
+
+  # A PNG of the given pixels, unfiltered, with or without Adam7. The color
+  # type comes from the samples per pixel, RGBA by default.
+  def raw_png(width, height, pixels, interlace, cmp = 4, depth = 8)
+    bpp = cmp * depth / 8
+    rows = png_rows(width, height, interlace) do |xs, y|
+      xs.map { |x| pixels.byteslice((y * width + x) * bpp, bpp) }.join
+    end
+    ihdr = [width, height, depth, COLOR_TYPES[cmp], 0, 0, interlace ? 1 : 0].pack("NNC5")
+    png_file(ihdr, rows.join)
+  end
+
+  # A palette or gray PNG of indices packed depth bits at a time.
+  def indexed_png(width, height, indices, depth, interlace, color_type, chunks)
+    rows = png_rows(width, height, interlace) do |xs, y|
+      [xs.map { |x| indices[y * width + x].to_s(2).rjust(depth, "0") }.join].pack("B*")
+    end
+    ihdr = [width, height, depth, color_type, 0, 0, interlace ? 1 : 0].pack("NNC5")
+    png_file(ihdr, rows.join, chunks)
+  end
+
+  # Output of each PNG at several sizes. Leave out upscaling to compare
+  # images read by different scalers: the compiler may fuse their
+  # multiply-adds differently, which can round a sample apart.
+  def scaled_outputs(pngs, w, h, up = true)
+    sizes = [[w, h], [w / 3, h / 3], [w / 20, h / 20], [w / 9, h]]
+    sizes << [w * 2, h * 2] if up
+    sizes.map do |sw, sh|
+      pngs.map do |png|
+        r = Oil::PNGReader.new(png)
+        r.scale_width = [sw, 1].max
+        r.scale_height = [sh, 1].max
+        drain(r)
+      end
+    end
+  end
+
+  def test_interlaced
+    [[301, 203], [1, 9], [9, 1]].each do |w, h|
+      pixels = Random.new(w).bytes(w * h * 4)
+      plain = raw_png(w, h, pixels, false)
+      interlaced = raw_png(w, h, pixels, true)
+      scaled_outputs([plain, interlaced], w, h).each do |out|
+        assert_equal out[0], out[1]
+      end
+    end
+  end
+
+  def test_palette
+    w, h = 301, 203
+    rand = Random.new(2)
+    [1, 2, 4, 8].each do |depth|
+      colors = [1 << depth, 200].min
+      plte = rand.bytes(colors * 3)
+      indices = Array.new(w * h) { rand.rand(colors) }
+      # Entries past the end of tRNS are opaque.
+      trns = rand.bytes(colors / 2 + 1)
+      rgb = indices.map { |i| plte.byteslice(i * 3, 3) }.join
+      rgba = indices.map { |i| plte.byteslice(i * 3, 3) + (trns[i] || "\xFF".b) }.join
+      [false, true].each do |interlace|
+        png = indexed_png(w, h, indices, depth, interlace, 3, png_chunk("PLTE", plte))
+        scaled_outputs([png, raw_png(w, h, rgb, false, 3)], w, h, false).each do |out|
+          assert_equal out[1], out[0]
+        end
+        png = indexed_png(w, h, indices, depth, interlace, 3,
+          png_chunk("PLTE", plte) + png_chunk("tRNS", trns))
+        scaled_outputs([png, raw_png(w, h, rgba, false)], w, h, false).each do |out|
+          assert_equal out[1], out[0]
+        end
+        assert_equal drain(Oil::PNGReader.new(png)), push_png(png, 500, w, h)
+      end
+    end
+  end
+
+  def test_low_bit_depth_gray
+    w, h = 301, 203
+    rand = Random.new(3)
+    [1, 2, 4].each do |depth|
+      max = (1 << depth) - 1
+      indices = Array.new(w * h) { rand.rand(max + 1) }
+      g = indices.map { |i| i * 255 / max }.pack("C*")
+      ga = indices.map { |i| [i * 255 / max, i == 1 ? 0 : 255] }.flatten.pack("C*")
+      [false, true].each do |interlace|
+        png = indexed_png(w, h, indices, depth, interlace, 0, "")
+        scaled_outputs([png, raw_png(w, h, g, false, 1)], w, h, false).each do |out|
+          assert_equal out[1], out[0]
+        end
+        png = indexed_png(w, h, indices, depth, interlace, 0,
+          png_chunk("tRNS", [1].pack("n")))
+        scaled_outputs([png, raw_png(w, h, ga, false, 2)], w, h, false).each do |out|
+          assert_equal out[1], out[0]
+        end
+      end
+    end
+  end
+
+  # Unfiltered rows of the image data of a PNG, without their filter bytes.
+  def raw_rows(png, width, bpp)
+    Zlib::Inflate.inflate(idat(png)).bytes.each_slice(width * bpp + 1).map { |r| r.drop(1) }.flatten.pack("C*")
+  end
+
+  def test_16_bit
+    w, h = 301, 203
+    (1..4).each do |cmp|
+      px8 = Random.new(cmp).bytes(w * h * cmp)
+      px16 = px8.unpack("C*").map { |v| v * 257 }.pack("n*")
+      [false, true].each do |interlace|
+        png = raw_png(w, h, px16, interlace, cmp, 16)
+        scaled_outputs([png, raw_png(w, h, px8, false, cmp)], w, h, false).each do |out|
+          assert_equal out[1], out[0]
+        end
+      end
+    end
+  end
+
+  def test_16_bit_output
+    w, h = 301, 203
+    [1, 3].each do |cmp|
+      px = Random.new(cmp).bytes(w * h * cmp * 2)
+      [false, true].each do |interlace|
+        png = raw_png(w, h, px, interlace, cmp, 16)
+        out = encode_png(png, bit_depth: 16)
+        assert_equal px, raw_rows(out, w, cmp * 2)
+        assert_equal px, raw_rows(encode_png(png, bit_depth: 16, threads: 2), w, cmp * 2)
+        assert_equal out, push_png(png, 500, w, h, bit_depth: 16, filter: :none)
+      end
+    end
+    out = encode_png(raw_png(2, 1, [10, 20, 30, 40].pack("C*"), false, 2), bit_depth: 16)
+    assert_equal [10 * 257, 20 * 257, 30 * 257, 40 * 257].pack("n*"), raw_rows(out, 2, 4)
+    out = ""
+    Oil.new(StringIO.new(BIG_PNG), 50, 50, bit_depth: 16).each { |d| out << d }
+    assert_equal 16, out.getbyte(24)
+  end
+
+  def chunk(png, type)
+    pos = 8
+    while pos < png.bytesize
+      len, t = png.byteslice(pos, 8).unpack("Na4")
+      return png.byteslice(pos + 8, len) if t == type
+      pos += len + 12
+    end
+  end
+
+  # RGBA samples of an unfiltered PNG of any color type with 8 bits or fewer.
+  def rgba(png)
+    w, _, depth, ctype = chunk(png, "IHDR").unpack("NNCC")
+    cmp = { 0 => 1, 2 => 3, 3 => 1, 4 => 2, 6 => 4 }[ctype]
+    plte = chunk(png, "PLTE").to_s.bytes.each_slice(3).to_a
+    trns = chunk(png, "tRNS").to_s.bytes
+    rows = Zlib::Inflate.inflate(idat(png)).bytes.each_slice((w * cmp * depth + 7) / 8 + 1)
+    rows.flat_map do |row|
+      bits = row.drop(1).pack("C*").unpack1("B*")
+      samples = bits.scan(/.{#{depth}}/).first(w * cmp).map { |b| b.to_i(2) }
+      samples.each_slice(cmp).flat_map do |s|
+        case ctype
+        when 0 then [s[0] * 255 / (2**depth - 1)] * 3 + [255]
+        when 2 then s + [255]
+        when 3 then plte[s[0]] + [trns[s[0]] || 255]
+        when 4 then [s[0]] * 3 + [s[1]]
+        else s
+        end
+      end
+    end.pack("C*")
+  end
+
+  def reduced(png, sw, sh, opts)
+    r = Oil::PNGReader.new(png)
+    r.scale_width = sw
+    r.scale_height = sh
+    out = "".b
+    r.each(opts.merge(filter: :none)) { |d| out << d }
+    out
+  end
+
+  def test_reduce
+    w, h = 101, 67
+    rnd = Random.new(48)
+    plte = png_chunk("PLTE", rnd.bytes(9 * 3)) + png_chunk("tRNS", "\x00\x80".b)
+    palette = indexed_png(w, h, Array.new(w * h) { rnd.rand(9) }, 4, false, 3, plte)
+    opaque = rnd.bytes(w * h * 4).bytes.each_slice(4).flat_map { |p| p[0, 3] + [255] }
+    gray = rnd.bytes(w * h).bytes.flat_map { |v| [v] * 3 }
+    bilevel = Array.new(w * h) { rnd.rand(2) * 255 }
+    {
+      palette => [3, 4, 6],
+      raw_png(w, h, opaque.pack("C*"), false) => [2, 8, 2],
+      raw_png(w, h, gray.pack("C*"), false, 3) => [0, 8, 0],
+      raw_png(w, h, bilevel.pack("C*"), true, 1) => [0, 1, 0],
+      raw_png(w, h, rnd.bytes(w * h * 2), false, 2) => [4, 8, 4],
+    }.each do |png, (ctype, depth, small_ctype)|
+      out = reduced(png, w, h, reduce: true)
+      assert_equal [depth, ctype], [out.getbyte(24), out.getbyte(25)]
+      assert_equal rgba(reduced(png, w, h, {})), rgba(out)
+      assert_equal pixels(out), pixels(reduced(png, w, h, reduce: true, threads: 2))
+      assert_equal out, push_png(png, 1000, w, h, reduce: true, filter: :none)
+
+      out = reduced(png, w / 3, h / 3, reduce: true)
+      assert_equal small_ctype, out.getbyte(25)
+      assert_equal rgba(reduced(png, w / 3, h / 3, {})), rgba(out)
+    end
+  end
+
+  def test_reduce_large_output
+    w, h = 1100, 1000
+    indices = Random.new(4).bytes(w * h)
+    rows = (0...h).map { |y| "\x00".b + indices.byteslice(y * w, w) }.join
+    plte = png_chunk("PLTE", (0..255).map { |i| [i] * 3 }.flatten.pack("C*")) +
+      png_chunk("tRNS", "\xFF".b * 256)
+    png = png_file([w, h, 8, 3, 0, 0, 0].pack("NNC5"), rows, plte)
+    out = reduced(png, w, h, reduce: true)
+    assert_equal 0, out.getbyte(25)
+    assert_equal rows, Zlib::Inflate.inflate(idat(out))
+
+    # Nothing guarantees that later rows of RGBA images stay opaque.
+    png = raw_png(w, h, "\x10\x20\x30\xFF".b * (w * h), false)
+    assert_equal 6, reduced(png, w, h, reduce: true).getbyte(25)
+
+    # A white first row doesn't make the rest of a gray image bilevel.
+    w, h = 3000, 2000
+    gray = "\xFF".b * w + Random.new(5).bytes(w * (h - 1))
+    png = raw_png(w, h, gray, false, 1)
+    out = reduced(png, w, h, reduce: true)
+    assert_equal [8, 0], [out.getbyte(24), out.getbyte(25)]
+    assert_equal Zlib::Inflate.inflate(idat(png)), Zlib::Inflate.inflate(idat(out))
+  end
+
+  def test_colors
+    w, h = 151, 101
+    px = (0...w * h).flat_map { |i| [i % w * 255 / w, i / w * 255 / h, 128] }
+    png = raw_png(w, h, px.pack("C*"), false, 3)
+    outs = [false, true].map do |dither|
+      out = reduced(png, w, h, colors: 16, dither: dither)
+      assert_equal [4, 3], [out.getbyte(24), out.getbyte(25)]
+      assert_equal 16 * 3, chunk(out, "PLTE").bytesize
+      diff = rgba(out).bytes.zip(rgba(reduced(png, w, h, {})).bytes).sum { |a, b| (a - b).abs }
+      assert_operator diff, :<, w * h * 4 * 12
+      assert_equal out, push_png(png, 1000, w, h, colors: 16, dither: dither)
+      out
+    end
+    refute_equal outs[0], outs[1]
+
+    # A palette image that fits keeps its palette.
+    rnd = Random.new(6)
+    plte = png_chunk("PLTE", rnd.bytes(9 * 3)) + png_chunk("tRNS", "\x00\x80".b)
+    palette = indexed_png(w, h, Array.new(w * h) { rnd.rand(9) }, 4, false, 3, plte)
+    out = reduced(palette, w / 3, h / 3, colors: 16)
+    assert_equal chunk(palette, "PLTE"), chunk(out, "PLTE")
+    assert_equal chunk(palette, "tRNS"), chunk(out, "tRNS")
+    assert_equal 4, out.getbyte(24)
+  end
+
+  def test_reduce_bad_args
+    assert_raises(ArgumentError) { encode(colors: 1) }
+    assert_raises(ArgumentError) { encode(colors: 257) }
+    assert_raises(ArgumentError) { encode(reduce: true, bit_depth: 16) }
+  end
+
+  def test_webp
+    webp = begin
+      encode(format: :webp)
+    rescue ArgumentError => e
+      skip e.message if e.message =~ /without libwebp/
+      raise
+    end
+    assert_equal webp.bytesize - 8, webp[4, 4].unpack1("V")
+    assert_equal [500, 1000, false], WebP.info(webp)
+    lossless = encode(format: :webp, lossless: true)
+    assert_equal "VP8L", lossless[12, 4]
+
+    w, h = 37, 23
+    rnd = Random.new(49)
+    (1..4).each do |cmp|
+      samples = rnd.bytes(w * h * cmp).bytes.each_slice(cmp).flat_map do |p|
+        cmp.even? ? p[0..-2] + [p[-1] | 1] : p
+      end
+      png = raw_png(w, h, samples.pack("C*"), false, cmp)
+      webp = reduced(png, w, h, format: :webp)
+      assert_equal [w, h, cmp.even?], WebP.info(webp)
+      assert_equal cmp.even?, WebP.chunks(webp).include?("ALPH")
+
+      webp = reduced(png, w, h, format: :webp, lossless: true)
+      assert_equal [w, h, cmp.even?], WebP.info(webp)
+      decoded = WebP.decode(webp) or next
+      assert_equal [w, h, rgba(reduced(png, w, h, {}))], decoded
+    end
+    skip "libwebp can't be loaded to decode the output" unless WebP.lib
+  end
+
+  def test_jpeg
+    png = raw_png(64, 48, Random.new(1).bytes(64 * 48 * 3), false, 3)
+    jpeg = encode_jpeg(png, quality: 80)
+    r = Oil::JPEGReader.new(StringIO.new(jpeg))
+    assert_equal [20, 15, 3], [r.image_width, r.image_height, r.num_components]
+    assert_operator encode_jpeg(png, quality: 30).bytesize, :<, jpeg.bytesize
+  end
+
+  def test_jpeg_flattens_alpha
+    clear = raw_png(40, 30, "\0\0\0\0" * 1200, false)
+    red = raw_png(40, 30, "\xC8\x1E\x3C".b * 1200, false, 3)
+    assert_equal encode_jpeg(red), encode_jpeg(clear, background: [200, 30, 60])
+    opaque = raw_png(40, 30, "\xC8\x1E\x3C\xFF".b * 1200, true)
+    assert_equal encode_jpeg(red), encode_jpeg(opaque)
+    s = ""
+    Oil.new(clear, 20, 20, format: :jpeg, quality: 75, background: [200, 30, 60]).each { |d| s << d }
+    assert_equal encode_jpeg(red), s
+  end
+
+  def test_jpeg_gray_alpha
+    clear = raw_png(40, 30, "\0\0" * 1200, false, 2)
+    white = raw_png(40, 30, "\xFF".b * 1200, false, 1)
+    jpeg = encode_jpeg(clear)
+    assert_equal 1, Oil::JPEGReader.new(StringIO.new(jpeg)).num_components
+    assert_equal encode_jpeg(white), jpeg
+  end
+
+  def test_jpeg_bad_background
+    assert_raises(ArgumentError) { encode(format: :jpeg, background: [1, 2]) }
+    assert_raises(ArgumentError) { encode(format: :jpeg, background: [0, 0, 256]) }
+    assert_raises(TypeError) { encode(format: :jpeg, background: 0xffffff) }
+  end
+
+  def encode_jpeg(png, opts = {})
+    r = Oil::PNGReader.new(png)
+    r.scale_width = 20
+    r.scale_height = 15
+    drain(r, opts.merge(format: :jpeg))
+  end
+
+  def test_webp_bad_args
+    assert_raises(ArgumentError) { encode(format: :bogus) }
+    assert_raises(ArgumentError) { Oil::PNGReader.new(BIG_PNG).start(format: :webp) }
+  end
+
+  def test_interlaced_truncated
+    png = raw_png(301, 203, Random.new(1).bytes(301 * 203 * 4), true)
+    assert_raises(RuntimeError) { drain(Oil::PNGReader.new(png[0, png.bytesize / 2])) }
+  end
+
+  def test_gray_alpha_downscale
+    r = Oil::PNGReader.new(raw_png(4, 1, [100, 255].pack("C*") * 4, false, 2))
+    r.scale_width = 2
+    r.scale_height = 1
+    out = ""
+    r.each(filter: :none) { |d| out << d }
+    assert_equal "\0".b + [100, 255].pack("C*") * 2, Zlib::Inflate.inflate(idat(out))
+  end
+
+  def push_png(png, chunk_size, sw, sh, opts = {})
+    chunks = (0...png.bytesize).step(chunk_size).map { |i| png.b[i, chunk_size] }
+    r = Oil::PNGReader.push
+    r << chunks.shift until r.ready?
+    r.scale_width = sw
+    r.scale_height = sh
+    job = r.start(opts)
+    out = "".b
+    until job.done?
+      out << job.step(3).to_s
+      chunks.empty? ? r.close : r << chunks.shift
+    end
+    out
+  end
+
+  def test_push
+    [[301, 203], [1, 9], [9, 1]].each do |w, h|
+      pixels = Random.new(w).bytes(w * h * 4)
+      [false, true].each do |interlace|
+        png = raw_png(w, h, pixels, interlace)
+        [[w, h], [w / 20, h / 3], [w * 2, h * 2]].each do |sw, sh|
+          sw, sh = [sw, 1].max, [sh, 1].max
+          r = Oil::PNGReader.new(png)
+          r.scale_width = sw
+          r.scale_height = sh
+          expected = drain(r)
+          [3, 500, png.bytesize].each do |size|
+            assert_equal expected, push_png(png, size, sw, sh)
+          end
+        end
+      end
+    end
+    expected = ""
+    r = Oil::PNGReader.new(BIG_PNG)
+    r.scale_width = 50
+    r.scale_height = 100
+    r.each(threads: 2) { |d| expected << d }
+    assert_equal expected, push_png(BIG_PNG, 1000, 50, 100, threads: 2)
+  end
+
+  def test_push_errors
+    r = Oil::PNGReader.push
+    r << BIG_PNG[0, 20]
+    refute r.ready?
+    assert_raises(RuntimeError) { r.start }
+    assert_raises(RuntimeError) { r.close }
+    assert_raises(RuntimeError) { r << BIG_PNG }
+    r = Oil::PNGReader.push
+    r << BIG_PNG
+    assert r.ready?
+    assert_raises(RuntimeError) { r.each { |d| } }
+    assert_raises(RuntimeError) { Oil::PNGReader.new(png_io) << "" }
+    assert_raises(RuntimeError) do
+      push_png(BIG_PNG[0, BIG_PNG.bytesize / 2], 1000, 50, 100)
+    end
+  end
+
+  def test_job_steps
+    expected = ""
+    Oil::PNGReader.new(BIG_PNG).each { |d| expected << d }
+    job = Oil::PNGReader.new(BIG_PNG).start
+    out = "".b
+    while chunk = job.step(64)
+      out << chunk
+    end
+    assert job.done?
+    assert_equal expected, out
+  end
+
+  def test_job_encode_opts
+    job = Oil::PNGReader.new(BIG_PNG).start(speed: :fast)
+    out = "".b
+    while chunk = job.step(64)
+      out << chunk
+    end
+    assert_equal encode(speed: :fast), out
+  end
+
+  def test_job_time_budget
+    job = Oil.new(StringIO.new(BIG_PNG), 50, 50).start
+    chunks = []
+    while chunk = job.step(0.0)
+      chunks << chunk
+    end
+    assert_equal 50, chunks.size
+    assert_equal [25, 50], Oil::PNGReader.new(chunks.join).then { |r| [r.width, r.height] }
+  end
+
+  def test_job_locks_reader
+    r = Oil::PNGReader.new(png_io)
+    r.start
+    assert_raises(RuntimeError) { r.each { |d| } }
+    assert_raises(RuntimeError) { r.start }
+  end
+
   # Allocation tests
 
   def test_multiple_initialize_leak
@@ -59,6 +741,34 @@ class TestPNG < MiniTest::Test
     o.each{ |d| }
   end
 
+  def test_memsize_of_native_buffers
+    o = Oil::PNGReader.new(BIG_PNG)
+    o.scale_width = 10
+    o.scale_height = 10
+    header_size = ObjectSpace.memsize_of(o)
+
+    each_size = nil
+    o.each{ |d| each_size ||= ObjectSpace.memsize_of(o) }
+    assert_operator each_size, :>, header_size + 128 * 500
+    assert_equal header_size, ObjectSpace.memsize_of(o)
+  end
+
+  def test_memsize_of_libdeflate_rows
+    o = Oil::PNGReader.new(BIG_PNG)
+    header_size = ObjectSpace.memsize_of(o)
+
+    max_size = 0
+    o.each(deflate: :libdeflate) do |d|
+      max_size = [max_size, ObjectSpace.memsize_of(o)].max
+    end
+    # Every filtered row is held until the image is compressed.
+    assert_operator max_size, :>, header_size + 1000 * 501
+    assert_equal header_size, ObjectSpace.memsize_of(o)
+  rescue ArgumentError => e
+    raise unless e.message =~ /without libdeflate/
+    skip "oil was built without libdeflate"
+  end
+
   # Test io
 
   IO_OFFSETS = [0, 10, 20]#, 8191, 8192, 8193, 12000]
@@ -147,4 +857,10 @@ class TestPNG < MiniTest::Test
   def drain_string(str)
     Oil::PNGReader.new(StringIO.new(str)).each{|s|}
   end
+
+  def drain(reader, opts = {})
+    s = ""
+    reader.each(opts) { |d| s << d }
+    s
+  end
 end
@@ -0,0 +1,119 @@
+require 'minitest'
+require 'minitest/autorun'
+require 'oil'
+require 'stringio'
+require 'tempfile'
+require 'helper'
+
+class TestPool < MiniTest::Test
+  # http://garethrees.org/2007/11/14/pngcrush/
+  PNG_DATA = "\
+\x89\x50\x4E\x47\x0D\x0A\x1A\x0A\x00\x00\x00\x0D\x49\x48\x44\x52\x00\x00\x00\
+\x01\x00\x00\x00\x01\x01\x00\x00\x00\x00\x37\x6E\xF9\x24\x00\x00\x00\x10\x49\
+\x44\x41\x54\x78\x9C\x62\x60\x01\x00\x00\x00\xFF\xFF\x03\x00\x00\x06\x00\x05\
+\x57\xBF\xAB\xD4\x00\x00\x00\x00\x49\x45\x4E\x44\xAE\x42\x60\x82".b
+
+  BIG_PNG = begin
+    s = ""
+    r = Oil::PNGReader.new(PNG_DATA)
+    r.scale_width = 500
+    r.scale_height = 1000
+    r.each{ |a| s << a }
+    s
+  end
+
+  def setup
+    @pool = Oil::Pool.new(2, queue_size: 2)
+  end
+
+  def teardown
+    @pool.close
+  end
+
+  def test_submit_string
+    job = @pool.submit(BIG_PNG, 50, 50)
+    o = Oil::PNGReader.new(job.value)
+    assert job.done?
+    assert_equal 25, o.width
+    assert_equal 50, o.height
+  end
+
+  def test_value_is_cached
+    job = @pool.submit(BIG_PNG, 50, 50)
+    assert_same job.value, job.value
+  end
+
+  def test_many_jobs_with_backpressure
+    jobs = 20.times.map { |i| @pool.submit(BIG_PNG, 10 + i, 10 + i) }
+    jobs.each_with_index do |job, i|
+      assert_equal(((10 + i) / 2.0).round, Oil::PNGReader.new(job.value).width)
+    end
+  end
+
+  def test_input_modified_after_submit
+    str = BIG_PNG.dup
+    job = @pool.submit(str, 50, 50)
+    str.replace("foobar")
+    assert_equal 25, Oil::PNGReader.new(job.value).width
+  end
+
+  def test_path_in_path_out
+    f = Tempfile.new('oil')
+    f.binmode
+    f.write(BIG_PNG)
+    f.close
+    out = f.path + ".out.png"
+    job = @pool.submit(File.new(f.path), 50, 50, out: out)
+    assert_equal out, job.value
+    assert_equal 25, Oil::PNGReader.open(out).width
+  ensure
+    File.unlink(out) if out && File.exist?(out)
+    f.unlink
+  end
+
+  def test_bad_input
+    job = @pool.submit("foobar", 50, 50)
+    assert_raises(RuntimeError) { job.value }
+    assert job.done?
+  end
+
+  def test_submit_after_close
+    @pool.close
+    assert_raises(RuntimeError) { @pool.submit(BIG_PNG, 50, 50) }
+  end
+
+  def test_bad_thread_count
+    assert_raises(ArgumentError) { Oil::Pool.new(0) }
+  end
+
+  def test_not_initialized
+    failed = Oil::Pool.allocate
+    assert_raises(ArgumentError) { failed.send(:initialize, 0) }
+    [Oil::Pool.allocate, failed].each do |pool|
+      assert_raises(RuntimeError) { pool.submit(BIG_PNG, 50, 50) }
+      assert_raises(RuntimeError) { pool.close }
+    end
+  end
+
+  def test_pinned
+    pool = Oil::Pool.new(1, pin: true)
+    assert_equal 25, Oil::PNGReader.new(pool.submit(BIG_PNG, 50, 50).value).width
+    pool.close
+  end
+
+  def test_gc_with_pending_jobs
+    pool = Oil::Pool.new(1, queue_size: 8)
+    8.times { pool.submit(BIG_PNG, 50, 50) }
+    pool = nil
+    GC.start
+  end
+
+  def test_gc_with_running_jobs
+    4.times do
+      pool = Oil::Pool.new(2)
+      4.times { pool.submit(BIG_PNG, 500, 1000) }
+    end
+    GC.start
+    assert_equal 25, Oil::PNGReader.new(@pool.submit(BIG_PNG, 50, 50).value).width
+  end
+end